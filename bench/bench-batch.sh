@@ -0,0 +1,75 @@
+#!/bin/bash
+# Compare stat()ing every element with --batch-probe, which reads each parent
+# of several elements once, on a module-style -A cleanup: PKGS packages with
+# bin, lib, lib64 and include elements (lib64 and include mostly missing),
+# plus some packages that were removed altogether.
+#
+# Counts the syscalls each makes with strace(1), if it's installed, and times
+# both. Set TMPDIR to a directory on NFS (or whatever shared filesystem the
+# tree lives on) to measure that instead of the local disk.
+#
+# Usage: bench/bench-batch.sh [path/to/cleanpath] [runs] [pkgs]
+
+CLEANPATH=$(readlink -f "${1:-./bin/cleanpath}")
+RUNS=${2:-100}
+PKGS=${3:-100}
+MIN_CHILDREN=3
+
+export LC_ALL=C
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cleanpath-bench-batch.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+BENCH_PATH=""
+BENCH_LD_PATH=""
+BENCH_CPATH=""
+for ((i = 0; i < PKGS; i++)); do
+  PKG=$WORK/sw/pkg$i/$((i % 7)).$((i % 3))
+  # every tenth package was removed
+  if ((i % 10 != 9)); then
+    mkdir -p "$PKG/bin" "$PKG/lib"
+    ((i % 4 == 0)) && mkdir -p "$PKG/lib64"
+  fi
+  BENCH_PATH="${BENCH_PATH}${BENCH_PATH:+:}$PKG/bin"
+  BENCH_LD_PATH="${BENCH_LD_PATH}${BENCH_LD_PATH:+:}$PKG/lib:$PKG/lib64"
+  BENCH_CPATH="${BENCH_CPATH}${BENCH_CPATH:+:}$PKG/include"
+done
+
+bench() { env -i PATH="$BENCH_PATH" LD_LIBRARY_PATH="$BENCH_LD_PATH" CPATH="$BENCH_CPATH" "$CLEANPATH" -A -n "$@"; }
+
+# make sure they agree
+if [ "$(bench)" != "$(bench --batch-probe=$MIN_CHILDREN)" ]; then
+  echo "cleanpath --batch-probe changed the result" >&2
+  exit 1
+fi
+
+time_runs() {
+  local start end
+  start=$(date +%s%N)
+  for ((r = 0; r < RUNS; r++)); do
+    bench "$@" > /dev/null
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / RUNS / 1000 ))
+}
+
+# stat/open/getdents64/close calls made while cleaning, less the ones a run
+# with nothing to clean makes just to start up
+STRACE_CALLS=stat,newfstatat,statx,lstat,open,openat,getdents64,close
+count_syscalls() {
+  local total base
+  if ! command -v strace > /dev/null; then
+    echo "-"
+    return
+  fi
+  base=$(env -i strace -f -qq -e trace=$STRACE_CALLS "$CLEANPATH" -A -n 2>&1 > /dev/null | wc -l)
+  total=$(env -i PATH="$BENCH_PATH" LD_LIBRARY_PATH="$BENCH_LD_PATH" CPATH="$BENCH_CPATH" \
+    strace -f -qq -e trace=$STRACE_CALLS "$CLEANPATH" -A -n "$@" 2>&1 > /dev/null | wc -l)
+  echo $((total - base))
+}
+
+echo "$((PKGS * 4)) elements under $PKGS packages, $RUNS runs each"
+printf "%-20s %10s %10s\n" "method" "syscalls" "usec/run"
+printf "%-20s %10s %10s\n" "stat each" "$(count_syscalls)" "$(time_runs)"
+printf "%-20s %10s %10s\n" "--batch-probe=$MIN_CHILDREN" "$(count_syscalls --batch-probe=$MIN_CHILDREN)" \
+  "$(time_runs --batch-probe=$MIN_CHILDREN)"
+command -v strace > /dev/null || echo "(install strace to count syscalls)"
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Compare substring (-E) and component trie (-S) exclusion at large rule
+# counts. Existence/usability checks are turned off (-e -u) so that the time
+# measured is the matching itself and not stat().
+#
+# Usage: bench/bench-exclude.sh [path/to/cleanpath] [iterations]
+
+CLEANPATH=${1:-./bin/cleanpath}
+ITERATIONS=${2:-20}
+ELEMENTS=200
+
+export LC_ALL=C
+
+# A 200 element path that looks like a module-inflated one
+BENCH_PATH=""
+for ((i = 0; i < ELEMENTS; i++)); do
+  BENCH_PATH="${BENCH_PATH}${BENCH_PATH:+:}/sw/pkg$i/$((i % 7)).$((i % 3))/bin"
+done
+export BENCH_PATH
+
+time_run() {
+  local start end
+  start=$(date +%s%N)
+  for ((n = 0; n < ITERATIONS; n++)); do
+    "$CLEANPATH" BENCH_PATH -e -u -n "$@" > /dev/null
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / ITERATIONS / 1000 ))
+}
+
+printf "%-8s %14s %14s\n" "rules" "-E usec/run" "-S usec/run"
+for RULES in 50 500 2000 8000; do
+  E_ARGS=()
+  S_ARGS=()
+  # Rules that never match, which is the worst case for -E since every rule
+  # must be scanned for every element
+  for ((r = 0; r < RULES; r++)); do
+    E_ARGS+=(-E "/sw/retired$r/")
+    S_ARGS+=(-S "/sw/retired$r")
+  done
+  printf "%-8s %14s %14s\n" "$RULES" "$(time_run "${E_ARGS[@]}")" "$(time_run "${S_ARGS[@]}")"
+done
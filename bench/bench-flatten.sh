@@ -0,0 +1,60 @@
+#!/bin/bash
+# Compare dynamic loader resolution time with a long LD_LIBRARY_PATH and
+# with the same path flattened into a view by cleanpath --flatten.
+#
+# Builds a program linked against a library that lives in the last of
+# DIRS directories, so every load misses in all the others first (and so
+# does libc, before the loader falls back to its cache).
+#
+# Usage: bench/bench-flatten.sh [path/to/cleanpath] [runs] [dirs]
+
+CLEANPATH=$(readlink -f "${1:-./bin/cleanpath}")
+RUNS=${2:-500}
+DIRS=${3:-80}
+CC=${CC:-gcc}
+
+export LC_ALL=C
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cleanpath-bench-flatten.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/src"
+echo 'int bench_target(void) { return 0; }' > "$WORK/src/target.c"
+echo 'int bench_pad(void) { return 0; }' > "$WORK/src/pad.c"
+printf 'int bench_target(void);\nint main(void) { return bench_target(); }\n' > "$WORK/src/main.c"
+
+LIB_PATH=""
+for ((i = 0; i < DIRS; i++)); do
+  mkdir -p "$WORK/lib$i"
+  # every directory has something in it, like a real module tree
+  $CC -shared -fPIC -o "$WORK/lib$i/libpad$i.so" "$WORK/src/pad.c" || exit 1
+  LIB_PATH="${LIB_PATH}${LIB_PATH:+:}$WORK/lib$i"
+done
+LAST=$WORK/lib$((DIRS - 1))
+$CC -shared -fPIC -o "$LAST/libbenchtarget.so" "$WORK/src/target.c" || exit 1
+$CC -o "$WORK/main" "$WORK/src/main.c" -L"$LAST" -lbenchtarget || exit 1
+
+FLAT_PATH=$(LD_LIBRARY_PATH=$LIB_PATH "$CLEANPATH" -n -I --flatten \
+  --view-dir="$WORK/views" LD_LIBRARY_PATH | sed -n 's/^LD_LIBRARY_PATH=//p')
+if [ -z "$FLAT_PATH" ] || [ "$FLAT_PATH" = "$LIB_PATH" ]; then
+  echo "cleanpath did not flatten the path" >&2
+  exit 1
+fi
+
+time_runs() {
+  local start end
+  start=$(date +%s%N)
+  for ((n = 0; n < RUNS; n++)); do
+    LD_LIBRARY_PATH=$1 "$WORK/main" || exit 1
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / RUNS / 1000 ))
+}
+
+# warm up the page cache for both
+time_runs "$LIB_PATH" > /dev/null
+time_runs "$FLAT_PATH" > /dev/null
+
+echo "LD_LIBRARY_PATH with $DIRS directories, $RUNS runs each"
+printf "%-12s %10s\n" "path" "usec/run"
+printf "%-12s %10s\n" "original" "$(time_runs "$LIB_PATH")"
+printf "%-12s %10s\n" "flattened" "$(time_runs "$FLAT_PATH")"
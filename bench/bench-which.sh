@@ -0,0 +1,76 @@
+#!/bin/bash
+# Compare looking up commands with which(1), bash's command -v and
+# cleanpath --which on a long PATH.
+#
+# Builds a PATH of DIRS directories with a few executables in each and looks
+# up NAMES commands, most of them in the last directories (so every search
+# misses in almost all of the others) and some in none. Set TMPDIR to a
+# directory on NFS (or whatever shared filesystem the PATH lives on) to
+# measure that instead of the local disk.
+#
+# Usage: bench/bench-which.sh [path/to/cleanpath] [runs] [dirs] [names]
+
+CLEANPATH=$(readlink -f "${1:-./bin/cleanpath}")
+RUNS=${2:-100}
+DIRS=${3:-100}
+NAMES=${4:-40}
+
+export LC_ALL=C
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cleanpath-bench-which.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+WHICH=$(command -v which)
+
+BENCH_PATH=""
+for ((i = 0; i < DIRS; i++)); do
+  mkdir -p "$WORK/bin$i"
+  for ((j = 0; j < 20; j++)); do
+    printf '#!/bin/sh\n' > "$WORK/bin$i/pad$i-$j"
+  done
+  chmod +x "$WORK/bin$i"/*
+  BENCH_PATH="${BENCH_PATH}${BENCH_PATH:+:}$WORK/bin$i"
+done
+CMDS=()
+for ((n = 0; n < NAMES; n++)); do
+  if ((n % 4 == 3)); then
+    CMDS+=("missing$n")
+  else
+    CMDS+=("pad$((DIRS - 1 - n % 10))-$((n % 20))")
+  fi
+done
+# so the index is not "racily" new
+touch -d '1 minute ago' "$WORK"/bin*
+export XDG_CACHE_HOME=$WORK/cache
+mkdir -m 700 "$XDG_CACHE_HOME"
+
+time_runs() {
+  local start end
+  start=$(date +%s%N)
+  for ((r = 0; r < RUNS; r++)); do
+    "$@" > /dev/null
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / RUNS / 1000 ))
+}
+
+which_each() {
+  local cmd
+  for cmd in "${CMDS[@]}"; do
+    PATH=$BENCH_PATH "$WHICH" "$cmd"
+  done
+}
+which_all() { PATH=$BENCH_PATH "$WHICH" "${CMDS[@]}"; }
+command_v() { PATH=$BENCH_PATH /bin/bash -c 'command -v "$@"' bash "${CMDS[@]}"; }
+cleanpath_which() { PATH=$BENCH_PATH "$CLEANPATH" --which "${CMDS[@]}"; }
+
+# make sure they agree, and build the index
+if [ "$(which_all)" != "$(cleanpath_which)" ]; then
+  echo "cleanpath --which and which disagree" >&2
+  exit 1
+fi
+
+echo "PATH with $DIRS directories, $NAMES commands ($((NAMES / 4)) missing), $RUNS runs each"
+printf "%-24s %10s\n" "method" "usec/run"
+[ -n "$WHICH" ] && printf "%-24s %10s\n" "which, once per command" "$(time_runs which_each)"
+[ -n "$WHICH" ] && printf "%-24s %10s\n" "which, all at once" "$(time_runs which_all)"
+printf "%-24s %10s\n" "bash command -v" "$(time_runs command_v)"
+printf "%-24s %10s\n" "cleanpath --which" "$(time_runs cleanpath_which)"
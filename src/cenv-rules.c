@@ -0,0 +1,332 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CENV_RULES_LOADED_SEMAPHORE
+#define _CENV_RULES_LOADED_SEMAPHORE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+/**
+ * Site policy for cenv, kept in a file instead of on every command-line.
+ *
+ * A config file is text, one long option per line without its leading "--"
+ * (e.g., "name-starts=BASH_FUNC_" or "pfile-read"), with "#" comments. It
+ * is parsed exactly like the command-line, so it costs as much as the
+ * command-line it replaces. "--compile" turns it into a rule file, which is
+ * mapped instead of parsed:
+ *
+ *   header   magic, version, size, which toggles the options flipped and
+ *            which delimiters they set, and where each list and the class
+ *            table are
+ *   classes  the --pdir, --pfile and --unset names, already in cenv's open
+ *            addressed hash table (hash, name, class)
+ *   lists    for each pattern list (-E, --pfile-exclude, --name-starts,
+ *            ...), the offsets of its strings
+ *   pool     the strings, NUL terminated
+ *
+ * Loading one checks it, then points the pattern lists into the mapping;
+ * variable names are looked up in its class table directly. Toggles are
+ * flipped and delimiters set only where the compiled options did, so a rule
+ * file changes the options given before it exactly as its config file would.
+ * Rule files are in native byte order, for the machines of one site.
+ */
+
+#define CENV_RULES_MAGIC "CENVRULE"
+#define CENV_RULES_VERSION 3
+
+/* The pattern lists in a rule file, in order */
+static args_array_t **cenv_rules_lists[] = {
+  &opt_pdir_exclude, &opt_pdir_include, &opt_pfile_exclude, &opt_pfile_include,
+  &opt_name_match, &opt_name_starts, &opt_name_ends,
+  &opt_value_match, &opt_value_starts, &opt_value_ends,
+  &opt_keep, &opt_keep_prefix,
+  NULL
+};
+#define CENV_RULES_LISTS 12
+
+/* The toggles in a rule file, in order */
+static boolean *cenv_rules_toggles[] = {
+  &opt_pdir_all, &opt_pdir_exists, &opt_pdir_exec, &opt_pdir_nodupes, &opt_pdir_empty,
+  &opt_pfile_all, &opt_pfile_exists, &opt_pfile_exec, &opt_pfile_read, &opt_pfile_nodupes,
+  &opt_clean_common, &opt_abspaths, &opt_logical,
+  NULL
+};
+#define CENV_RULES_TOGGLES 16
+
+/* The toggles before any option was parsed, and whether a delimiter was
+   given, to tell what the options compiled changed */
+static boolean cenv_rules_toggle_defaults[CENV_RULES_TOGGLES];
+static boolean cenv_rules_pdir_delim_set = 0;
+static boolean cenv_rules_pfile_delim_set = 0;
+
+typedef struct cenv_rules_header_t {
+  char magic[8];
+  unsigned int version;
+  unsigned int path_names;        /* how many --pdir and --pfile names */
+  unsigned long long size;
+  unsigned char toggles[CENV_RULES_TOGGLES];
+  char pdir_delim;                /* '\0' if it wasn't set */
+  char pfile_delim;
+  char pad[6];
+  unsigned int lists[CENV_RULES_LISTS][2];   /* offset of the string offsets, count */
+  unsigned int classes;           /* offset of the class table */
+  unsigned int class_mask;
+} cenv_rules_header_t;
+
+typedef struct cenv_rules_class_t {
+  unsigned int hash;
+  unsigned int name;              /* offset, 0 for an empty slot */
+  unsigned int what;
+  unsigned int pad;
+} cenv_rules_class_t;
+
+/* The rule file in use, if any */
+static const char *cenv_rules_data = NULL;
+static const cenv_rules_class_t *cenv_rules_classes = NULL;
+static unsigned int cenv_rules_mask = 0;
+static unsigned int cenv_rules_path_names = 0;
+
+/* The config file line being parsed, for error messages */
+static const char *cenv_config_where = NULL;
+
+/**
+ * Remember the toggles as they are before any option is parsed.
+ */
+static void cenv_rules_save_defaults(void) {
+  unsigned int idx;
+  for(idx = 0; cenv_rules_toggles[idx]; idx++)
+    cenv_rules_toggle_defaults[idx] = *cenv_rules_toggles[idx];
+}
+
+/**
+ * Look a variable up in the rule file's class table.
+ *
+ * @return its class, or CENV_KEEP if the rule file doesn't name it
+ */
+static int cenv_rules_class(const char *env_name, unsigned int hash) {
+  unsigned int idx;
+  if(! cenv_rules_classes)
+    return CENV_KEEP;
+  for(idx = hash & cenv_rules_mask; cenv_rules_classes[idx].name; idx = (idx + 1) & cenv_rules_mask)
+    if(cenv_rules_classes[idx].hash == hash && eq(cenv_rules_data + cenv_rules_classes[idx].name, env_name))
+      return cenv_rules_classes[idx].what;
+  return CENV_KEEP;
+}
+
+/**
+ * Append strings in the mapping to a list, without copying them.
+ */
+static void cenv_rules_append(args_array_t *array, const unsigned int *offsets, unsigned int count) {
+  unsigned int idx;
+  if(array->length + count > array->size) {
+    array->size = array->length + count;
+    array->args = (char **)realloc(array->args, sizeof(char *) * array->size);
+    if(! array->args) fatal("Unable to allocate RAM for rules.\n");
+  }
+  for(idx = 0; idx < count; idx++)
+    array->args[array->length++] = (char *)cenv_rules_data + offsets[idx];
+}
+
+/**
+ * Map a rule file and put its rules in place.
+ */
+static void cenv_rules_map(const char *file_name, int fd, off_t size) {
+  const cenv_rules_header_t *header;
+  const unsigned int *offsets;
+  unsigned int idx, pos, pool;
+  char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(MAP_FAILED == data)
+    fatal("Unable to map rule file \"%s\": %s\n", file_name, strerror(errno));
+  header = (const cenv_rules_header_t *)data;
+  if(header->version != CENV_RULES_VERSION)
+    fatal("Rule file \"%s\" is version %u, this cenv reads version %u. Compile it again.\n",
+          file_name, header->version, CENV_RULES_VERSION);
+  /* the pool is last, and everything points before the end of the file */
+  if(header->size != (unsigned long long)size || '\0' != data[size - 1] ||
+     header->classes < sizeof(cenv_rules_header_t) || header->classes >= size ||
+     (size - header->classes) / sizeof(cenv_rules_class_t) <= header->class_mask ||
+     (header->class_mask & (header->class_mask + 1)))
+    fatal("Rule file \"%s\" is truncated or corrupt\n", file_name);
+  cenv_rules_data = data;
+  cenv_rules_classes = (const cenv_rules_class_t *)(data + header->classes);
+  cenv_rules_mask = header->class_mask;
+  pool = header->classes + sizeof(cenv_rules_class_t) * (header->class_mask + 1);
+  for(idx = 0; idx < CENV_RULES_LISTS; idx++)
+    pool += sizeof(unsigned int) * header->lists[idx][1];
+  if(pool > size)
+    fatal("Rule file \"%s\" is truncated or corrupt\n", file_name);
+  for(idx = 0; idx <= cenv_rules_mask; idx++)
+    if(cenv_rules_classes[idx].name >= size || (cenv_rules_classes[idx].name && cenv_rules_classes[idx].name < pool))
+      fatal("Rule file \"%s\" is truncated or corrupt\n", file_name);
+  for(idx = 0; idx < CENV_RULES_LISTS; idx++) {
+    offsets = (const unsigned int *)(data + header->lists[idx][0]);
+    if(header->lists[idx][0] > pool - sizeof(unsigned int) * header->lists[idx][1])
+      fatal("Rule file \"%s\" is truncated or corrupt\n", file_name);
+    for(pos = 0; pos < header->lists[idx][1]; pos++)
+      if(offsets[pos] < pool || offsets[pos] >= size)
+        fatal("Rule file \"%s\" is truncated or corrupt\n", file_name);
+    cenv_rules_append(*cenv_rules_lists[idx], offsets, header->lists[idx][1]);
+  }
+  opt_purg_env = opt_name_match->length || opt_name_starts->length || opt_name_ends->length ||
+    opt_value_match->length || opt_value_starts->length || opt_value_ends->length;
+  /* the same as the config file's lines would have done */
+  for(idx = 0; cenv_rules_toggles[idx]; idx++)
+    if(header->toggles[idx])
+      toggle(*cenv_rules_toggles[idx]);
+  if(header->pdir_delim) {
+    opt_pdir_delim = header->pdir_delim;
+    cenv_rules_pdir_delim_set = 1;
+  }
+  if(header->pfile_delim) {
+    opt_pfile_delim = header->pfile_delim;
+    cenv_rules_pfile_delim_set = 1;
+  }
+  cenv_rules_path_names = header->path_names;
+  verbose(2,("Using rule file \"%s\"\n", file_name));
+}
+
+/**
+ * Load a config file or a compiled rule file, whichever it is.
+ */
+static void cenv_rules_load(const char *file_name) {
+  char line[PATH_MAX + 64], where[PATH_MAX + 32];
+  struct stat file_stat;
+  unsigned int line_number = 0;
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  FILE *fh;
+  if(fd < 0 || 0 != fstat(fd, &file_stat))
+    fatal("Unable to read config \"%s\": %s\n", file_name, strerror(errno));
+  if(8 == read(fd, line, 8) && 0 == memcmp(line, CENV_RULES_MAGIC, 8)) {
+    if(file_stat.st_size < (off_t)sizeof(cenv_rules_header_t))
+      fatal("Rule file \"%s\" is truncated or corrupt\n", file_name);
+    cenv_rules_map(file_name, fd, file_stat.st_size);
+    close(fd);
+    return;
+  }
+  if(NULL == (fh = fdopen(fd, "r")) || 0 != fseek(fh, 0, SEEK_SET))
+    fatal("Unable to read config \"%s\": %s\n", file_name, strerror(errno));
+  while(fgets(line, sizeof(line), fh)) {
+    char *start = line, *end;
+    size_t name_len;
+    int idx = 0;
+    line_number++;
+    if(NULL != (end = strchr(line, '#'))) *end = '\0';
+    while(isspace((unsigned char)*start)) start++;
+    end = start + strlen(start);
+    while(end > start && isspace((unsigned char)*(end - 1))) end--;
+    *end = '\0';
+    if('\0' == *start)
+      continue;
+    name_len = strcspn(start, "=");
+    if((6 == name_len && 0 == strncmp(start, "config", 6)) ||
+       (7 == name_len && 0 == strncmp(start, "compile", 7)) ||
+       (4 == name_len && 0 == strncmp(start, "save", 4)) ||
+       (4 == name_len && 0 == strncmp(start, "load", 4)))
+      fatal("%s:%u: \"%s\" can only be given on the command-line\n", file_name, line_number, start);
+    snprintf(where, sizeof(where), "%s:%u", file_name, line_number);
+    cenv_config_where = where;
+    cpath_parse_long_arg(&idx, start, 0, NULL);
+    cenv_config_where = NULL;
+  }
+  fclose(fh);
+}
+
+/**
+ * Add a string to the file being compiled.
+ *
+ * @return its offset
+ */
+static unsigned int cenv_rules_put(char **data, size_t *size, size_t *used, const void *bytes, size_t len) {
+  unsigned int offset = *used;
+  while(*used + len > *size) {
+    *size *= 2;
+    *data = (char *)realloc(*data, *size);
+    if(! *data) fatal("Unable to allocate RAM for rules.\n");
+  }
+  memcpy(*data + *used, bytes, len);
+  *used += len;
+  return offset;
+}
+
+/**
+ * Write the rules from the config file(s) and command-line as a rule file.
+ * The class table must already be built, without the defaults.
+ *
+ * @return non-zero on success
+ */
+static int cenv_rules_compile(const char *file_name) {
+  char tmp_name[PATH_MAX + 16];
+  size_t size = 4096, used = 0;
+  char *data = (char *)malloc(size);
+  cenv_rules_header_t header;
+  cenv_rules_class_t *classes;
+  unsigned int idx, pos, slots = cenv_class_mask + 1, pool, list_offsets;
+  FILE *fh;
+  if(! data) fatal("Unable to allocate RAM for rules.\n");
+  if(cenv_rules_data)
+    fatal("--compile needs config files, not a rule file\n");
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CENV_RULES_MAGIC, 8);
+  header.version = CENV_RULES_VERSION;
+  header.path_names = opt_pdir_envs->length + opt_pfile_envs->length;
+  for(idx = 0; cenv_rules_toggles[idx]; idx++)
+    header.toggles[idx] = ! *cenv_rules_toggles[idx] != ! cenv_rules_toggle_defaults[idx];
+  header.pdir_delim = cenv_rules_pdir_delim_set ? opt_pdir_delim : '\0';
+  header.pfile_delim = cenv_rules_pfile_delim_set ? opt_pfile_delim : '\0';
+  header.classes = sizeof(header);
+  header.class_mask = cenv_class_mask;
+  /* room for the header, the class table and the list offsets, filled in
+     once the pool after them is laid out */
+  list_offsets = header.classes + sizeof(cenv_rules_class_t) * slots;
+  pool = list_offsets;
+  for(idx = 0; idx < CENV_RULES_LISTS; idx++)
+    pool += sizeof(unsigned int) * (*cenv_rules_lists[idx])->length;
+  while(size < pool) size *= 2;
+  data = (char *)realloc(data, size);
+  if(! data) fatal("Unable to allocate RAM for rules.\n");
+  memset(data, 0, pool);
+  used = pool;
+  for(idx = 0; idx < slots; idx++) {
+    classes = (cenv_rules_class_t *)(data + header.classes) + idx;
+    if(cenv_classes[idx].name) {
+      unsigned int name = cenv_rules_put(&data, &size, &used, cenv_classes[idx].name,
+                                         strlen(cenv_classes[idx].name) + 1);
+      classes = (cenv_rules_class_t *)(data + header.classes) + idx;
+      classes->name = name;
+      classes->hash = cenv_classes[idx].hash;
+      classes->what = cenv_classes[idx].what;
+    }
+  }
+  for(idx = 0; idx < CENV_RULES_LISTS; idx++) {
+    args_array_t *list = *cenv_rules_lists[idx];
+    header.lists[idx][0] = list_offsets;
+    header.lists[idx][1] = list->length;
+    for(pos = 0; pos < list->length; pos++) {
+      unsigned int offset = cenv_rules_put(&data, &size, &used, list->args[pos], strlen(list->args[pos]) + 1);
+      memcpy(data + list_offsets, &offset, sizeof(offset));
+      list_offsets += sizeof(offset);
+    }
+  }
+  /* an empty pool still has to end in a NUL */
+  if(used == pool)
+    cenv_rules_put(&data, &size, &used, "", 1);
+  header.size = used;
+  memcpy(data, &header, sizeof(header));
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int)getpid());
+  if(NULL == (fh = fopen(tmp_name, "w"))) {
+    verbose(0,("Unable to write rule file \"%s\": %s\n", tmp_name, strerror(errno)));
+    free(data);
+    return 0;
+  }
+  if(1 != fwrite(data, used, 1, fh) || 0 != fclose(fh) || 0 != rename(tmp_name, file_name)) {
+    verbose(0,("Unable to write rule file \"%s\": %s\n", file_name, strerror(errno)));
+    unlink(tmp_name);
+    free(data);
+    return 0;
+  }
+  verbose(1,("Wrote rule file \"%s\" (%u bytes)\n", file_name, (unsigned int)used));
+  free(data);
+  return 1;
+}
+
+#endif /* _CENV_RULES_LOADED_SEMAPHORE */
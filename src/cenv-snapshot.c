@@ -0,0 +1,311 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CENV_SNAPSHOT_LOADED_SEMAPHORE
+#define _CENV_SNAPSHOT_LOADED_SEMAPHORE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/**
+ * Binary snapshots of what cenv did to an environment, so the many ranks of
+ * a parallel job that all start from the same environment can reuse one
+ * cleanup instead of each probing the same (often shared) filesystems.
+ *
+ * A snapshot holds only the changes: for each variable cenv cleaned or
+ * unset, its new "NAME=value" definition (or none, if it was unset) and a
+ * hash of the value it was built from. Everything else (e.g., per-rank
+ * variables) is taken from the environment the snapshot is loaded into.
+ *
+ * Layout (native byte order, the file is only meant for the machines of one
+ * cluster):
+ *
+ *   header   magic, uid, record count, file size, creation time, and a
+ *            hash of the options it was written with
+ *   records  one per variable cleaned or unset, in environment order
+ *   pool     the "NAME=value\0" definitions, which the new envp points
+ *            straight into
+ *
+ * A snapshot is only used with the same options (and, with -a, the same
+ * current directory) and if every variable it was built from still has the
+ * value it had, so a changed environment falls back to a normal cleanup.
+ * Changes to the filesystem itself are not noticed; a snapshot is meant to
+ * live as long as a job.
+ *
+ * Whoever can write a snapshot decides the environment it gives, so one is
+ * only used if the file belongs to the user and nobody else can write it
+ * (the uid in the header is only a hint, anyone can put any there). They are
+ * written 0600, through a temporary file that is created exclusively.
+ */
+
+#define CENV_SNAPSHOT_MAGIC "CENVSNP2"
+/* Marks a record for a variable that was unset */
+#define CENV_SNAPSHOT_UNSET ((unsigned int)-1)
+/* Marks a hash for a variable that was not set at all */
+#define CENV_SNAPSHOT_ABSENT 0ULL
+
+typedef struct cenv_snapshot_header_t {
+  char magic[8];
+  unsigned int uid;
+  unsigned int count;
+  unsigned long long size;
+  long long created;
+  unsigned long long options;     /* see cenv_options_hash() */
+} cenv_snapshot_header_t;
+
+typedef struct cenv_snapshot_record_t {
+  unsigned long long input_hash;  /* of the value it was built from */
+  unsigned int name;              /* offset of the name ("NAME=value") */
+  unsigned int name_len;
+  unsigned int definition;        /* offset of "NAME=value", or CENV_SNAPSHOT_UNSET */
+  unsigned int pad;
+} cenv_snapshot_record_t;
+
+typedef struct cenv_snapshot_t {
+  char *data;                     /* the mapping, or the buffer being built */
+  size_t size;
+  size_t used;
+  cenv_snapshot_header_t *header;
+  cenv_snapshot_record_t *records;
+  unsigned int record_size;       /* while building */
+  const char *pool;
+} cenv_snapshot_t;
+
+/* Where a 64 bit FNV-1a hash starts */
+#define CENV_SNAPSHOT_HASH_START 0xcbf29ce484222325ULL
+
+/**
+ * Add bytes to a 64 bit FNV-1a hash.
+ */
+static unsigned long long cenv_snapshot_hash_bytes(unsigned long long hash, const void *bytes, size_t len) {
+  const unsigned char *cptr = (const unsigned char *)bytes;
+  while(len--) {
+    hash ^= *(cptr++);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * 64 bit FNV-1a of a value, never CENV_SNAPSHOT_ABSENT.
+ */
+static unsigned long long cenv_snapshot_hash(const char *value) {
+  unsigned long long hash;
+  if(! value)
+    return CENV_SNAPSHOT_ABSENT;
+  hash = cenv_snapshot_hash_bytes(CENV_SNAPSHOT_HASH_START, value, strlen(value));
+  return CENV_SNAPSHOT_ABSENT == hash ? 1 : hash;
+}
+
+/**
+ * Start a snapshot to record changes into.
+ *
+ * @param options the hash of the options it's made with
+ */
+static cenv_snapshot_t *cenv_snapshot_new(unsigned long long options) {
+  cenv_snapshot_t *snap = (cenv_snapshot_t *)calloc(1, sizeof(cenv_snapshot_t));
+  if(! snap) fatal("Unable to allocate RAM for the snapshot.\n");
+  snap->size = 4096;
+  snap->data = (char *)malloc(snap->size);
+  snap->header = (cenv_snapshot_header_t *)calloc(1, sizeof(cenv_snapshot_header_t));
+  snap->record_size = 16;
+  snap->records = (cenv_snapshot_record_t *)malloc(sizeof(cenv_snapshot_record_t) * snap->record_size);
+  if(! snap->data || ! snap->header || ! snap->records) fatal("Unable to allocate RAM for the snapshot.\n");
+  snap->header->options = options;
+  return snap;
+}
+
+/**
+ * Add a string to the pool being built.
+ *
+ * @return its offset in the pool
+ */
+static unsigned int cenv_snapshot_add_string(cenv_snapshot_t *snap, const char *name, const char *value) {
+  size_t name_len = strlen(name), len = name_len + (value ? strlen(value) + 1 : 0) + 1;
+  unsigned int offset = snap->used;
+  while(snap->used + len > snap->size) {
+    snap->size *= 2;
+    snap->data = (char *)realloc(snap->data, snap->size);
+    if(! snap->data) fatal("Unable to allocate RAM for the snapshot.\n");
+  }
+  memcpy(snap->data + snap->used, name, name_len);
+  if(value) {
+    snap->data[snap->used + name_len] = '=';
+    strcpy(snap->data + snap->used + name_len + 1, value);
+  } else {
+    snap->data[snap->used + name_len] = '\0';
+  }
+  snap->used += len;
+  return offset;
+}
+
+/**
+ * Record a change.
+ *
+ * @param name the variable
+ * @param old_value what it was built from
+ * @param new_value what it became, or NULL if it was unset
+ */
+static void cenv_snapshot_add(cenv_snapshot_t *snap, const char *name, const char *old_value,
+                              const char *new_value) {
+  cenv_snapshot_record_t *record;
+  if(snap->header->count == snap->record_size) {
+    snap->record_size *= 2;
+    snap->records = (cenv_snapshot_record_t *)realloc(snap->records, sizeof(cenv_snapshot_record_t) *
+                                                      snap->record_size);
+    if(! snap->records) fatal("Unable to allocate RAM for the snapshot.\n");
+  }
+  record = &snap->records[snap->header->count++];
+  record->input_hash = cenv_snapshot_hash(old_value);
+  record->name_len = strlen(name);
+  record->pad = 0;
+  if(new_value) {
+    record->definition = record->name = cenv_snapshot_add_string(snap, name, new_value);
+  } else {
+    record->definition = CENV_SNAPSHOT_UNSET;
+    record->name = cenv_snapshot_add_string(snap, name, NULL);
+  }
+}
+
+/**
+ * Write a snapshot, under a temporary name that is then renamed into place so
+ * readers never see half of one.
+ *
+ * @return non-zero on success
+ */
+static int cenv_snapshot_save(cenv_snapshot_t *snap, const char *file_name) {
+  char tmp_name[PATH_MAX + 16];
+  cenv_snapshot_header_t *header = snap->header;
+  size_t records_size = sizeof(cenv_snapshot_record_t) * header->count;
+  FILE *fh;
+  int fd;
+  memcpy(header->magic, CENV_SNAPSHOT_MAGIC, 8);
+  header->uid = uid;
+  header->size = sizeof(cenv_snapshot_header_t) + records_size + snap->used;
+  header->created = time(NULL);
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int)getpid());
+  /* never follow, or write through, something someone else put there */
+  fd = open(tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if(fd < 0 || NULL == (fh = fdopen(fd, "w"))) {
+    verbose(0,("Unable to write snapshot \"%s\": %s\n", tmp_name, strerror(errno)));
+    if(fd >= 0) {
+      close(fd);
+      unlink(tmp_name);
+    }
+    return 0;
+  }
+  if(1 != fwrite(header, sizeof(cenv_snapshot_header_t), 1, fh) ||
+     (header->count && 1 != fwrite(snap->records, records_size, 1, fh)) ||
+     (snap->used && 1 != fwrite(snap->data, snap->used, 1, fh)) ||
+     0 != fclose(fh) || 0 != rename(tmp_name, file_name)) {
+    verbose(0,("Unable to write snapshot \"%s\": %s\n", file_name, strerror(errno)));
+    unlink(tmp_name);
+    return 0;
+  }
+  verbose(1,("Wrote snapshot \"%s\" with %u changes\n", file_name, header->count));
+  return 1;
+}
+
+/**
+ * Map a snapshot and check that it was built from this environment.
+ *
+ * @param file_name the snapshot
+ * @param envp the environment it would be applied to
+ * @param options the hash of the options it would be applied with
+ *
+ * @return the snapshot, or NULL if it's missing, broken or stale
+ */
+static cenv_snapshot_t *cenv_snapshot_load(const char *file_name, char **envp, unsigned long long options) {
+  cenv_snapshot_t *snap;
+  struct stat file_stat;
+  unsigned int idx, pos;
+  char *data;
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    verbose(1,("Not using snapshot \"%s\": %s\n", file_name, strerror(errno)));
+    return NULL;
+  }
+  if(0 != fstat(fd, &file_stat) || file_stat.st_size < (off_t)sizeof(cenv_snapshot_header_t) ||
+     MAP_FAILED == (data = (char *)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+    verbose(1,("Not using snapshot \"%s\": it's not a snapshot\n", file_name));
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  if(file_stat.st_uid != uid || (file_stat.st_mode & (S_IWGRP | S_IWOTH))) {
+    verbose(1,("Not using snapshot \"%s\": it's not yours, or others can write it\n", file_name));
+    munmap(data, file_stat.st_size);
+    return NULL;
+  }
+  snap = (cenv_snapshot_t *)calloc(1, sizeof(cenv_snapshot_t));
+  if(! snap) fatal("Unable to allocate RAM for the snapshot.\n");
+  snap->data = data;
+  snap->size = file_stat.st_size;
+  snap->header = (cenv_snapshot_header_t *)data;
+  snap->records = (cenv_snapshot_record_t *)(data + sizeof(cenv_snapshot_header_t));
+  if(0 != memcmp(snap->header->magic, CENV_SNAPSHOT_MAGIC, 8) || snap->header->size != snap->size ||
+     snap->header->uid != uid || snap->header->count > (snap->size - sizeof(cenv_snapshot_header_t)) /
+     sizeof(cenv_snapshot_record_t)) {
+    verbose(1,("Not using snapshot \"%s\": it's not one of ours, or it's truncated\n", file_name));
+    munmap(data, snap->size);
+    free(snap);
+    return NULL;
+  }
+  if(snap->header->options != options) {
+    verbose(1,("Not using snapshot \"%s\": it was written with other options\n", file_name));
+    munmap(data, snap->size);
+    free(snap);
+    return NULL;
+  }
+  snap->pool = (const char *)(snap->records + snap->header->count);
+  snap->used = snap->size - (snap->pool - data);
+  if(snap->used && '\0' != snap->pool[snap->used - 1]) {
+    verbose(1,("Not using snapshot \"%s\": it's not one of ours, or it's truncated\n", file_name));
+    munmap(data, snap->size);
+    free(snap);
+    return NULL;
+  }
+  for(idx = 0; idx < snap->header->count; idx++) {
+    cenv_snapshot_record_t *record = &snap->records[idx];
+    const char *name = snap->pool + record->name, *value = NULL;
+    /* a definition is its "NAME=value", an unset variable only has "NAME" */
+    if(record->name >= snap->used || record->name_len >= snap->used - record->name ||
+       (CENV_SNAPSHOT_UNSET == record->definition ? '\0' != name[record->name_len] :
+        record->definition != record->name || '=' != name[record->name_len])) {
+      verbose(1,("Not using snapshot \"%s\": it's corrupt\n", file_name));
+      munmap(data, snap->size);
+      free(snap);
+      return NULL;
+    }
+    for(pos = 0; envp[pos] && ! value; pos++)
+      if(0 == strncmp(envp[pos], name, record->name_len) && '=' == envp[pos][record->name_len])
+        value = envp[pos] + record->name_len + 1;
+    if(cenv_snapshot_hash(value) != record->input_hash) {
+      verbose(1,("Not using snapshot \"%s\": %.*s has changed since it was written\n", file_name,
+                 (int)record->name_len, name));
+      munmap(data, snap->size);
+      free(snap);
+      return NULL;
+    }
+  }
+  verbose(2,("Using snapshot \"%s\" with %u changes\n", file_name, snap->header->count));
+  return snap;
+}
+
+/**
+ * Find the record for an environment definition.
+ *
+ * @return the record, or NULL if the variable wasn't changed
+ */
+static cenv_snapshot_record_t *cenv_snapshot_find(cenv_snapshot_t *snap, const char *definition) {
+  unsigned int idx;
+  for(idx = 0; idx < snap->header->count; idx++) {
+    cenv_snapshot_record_t *record = &snap->records[idx];
+    if(0 == strncmp(definition, snap->pool + record->name, record->name_len) &&
+       '=' == definition[record->name_len])
+      return record;
+  }
+  return NULL;
+}
+
+#endif /* _CENV_SNAPSHOT_LOADED_SEMAPHORE */
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,6 +47,8 @@
 
 #define toggle(x) ( ( x ) = ( x ) ? 0 : 1 )
 
+typedef int boolean;
+
 /**
  * Struct for generic arguments array
  */
@@ -71,11 +74,54 @@ FILE *debug_fh = NULL;
 #define CPATH_SHELL_BASH 1
 #define CPATH_SHELL_CSH  2
 
+/**
+ * How the members of one class of path variable are checked: directory paths
+ * (PATH, MANPATH, ...) or file paths (CLASSPATH, whose members are jars as
+ * well as directories).
+ */
+typedef struct cenv_policy_t {
+  const char *what;          /* "directory" or "file", for messages */
+  args_array_t *exclude;     /* drop members containing any of these */
+  args_array_t *include;     /* keep members containing any of these, unchecked */
+  boolean exists;            /* members must exist */
+  boolean exec;              /* directory members must be usable */
+  boolean read;              /* file members must be readable */
+  boolean files;             /* file members are allowed at all */
+  boolean nodupes;
+  boolean empty;             /* keep empty members */
+  char delim;
+} cenv_policy_t;
+static cenv_policy_t pdir_policy;
+static cenv_policy_t pfile_policy;
+
+/**
+ * The variables named on the command-line (and the common ones with -C), in a
+ * small open addressed hash table so each variable in the environment is
+ * classified with one lookup instead of a scan of every list. A rule file
+ * (see cenv-rules.c) brings its own, already built.
+ */
+typedef struct cenv_class_t {
+  const char *name;
+  unsigned int hash;
+  int what;                  /* CENV_UNSET, CENV_PDIR or CENV_PFILE */
+} cenv_class_t;
+static cenv_class_t *cenv_classes;
+static unsigned int cenv_class_mask;
+
+/**
+ * What to do with a variable, decided once per variable
+ */
+#define CENV_KEEP  0
+#define CENV_UNSET 1
+#define CENV_PDIR  2
+#define CENV_PFILE 3
+
 /**
  * Using one static global struct seemed neater than having a lot of static
  * globals or passing a struct around everywhere.
  */
 typedef struct path_info_t {
+  cenv_policy_t *policy;
   char * env_name;
   unsigned int path_string_length;
   char * old_path_string;
@@ -85,6 +131,8 @@ typedef struct path_info_t {
   unsigned int old_directory_count;
   unsigned int new_directory_count;
   char ** directories;
+  unsigned int kept_count;
+  char * canon_ptr;          /* where the next canonical member goes */
   char delim;
 } path_info_t;
 static path_info_t path_info;
@@ -94,28 +142,43 @@ static path_info_t path_info;
  * ========================================================================== */
 static int     opt_verbosity        = 0;
 static boolean opt_debug_on         = 0;
-static char ** opt_pdir_envs        = NULL;
-static char ** opt_pdir_exclude     = NULL;
-static char ** opt_pdir_include     = NULL;
+static args_array_t *opt_pdir_envs;
+static args_array_t *opt_pdir_exclude;
+static args_array_t *opt_pdir_include;
 static boolean opt_pdir_all         = 0;
 static boolean opt_pdir_exists      = 1;
 static boolean opt_pdir_exec        = 1;
 static boolean opt_pdir_nodupes     = 1;
-static char ** opt_pfile_envs       = NULL;
-static char ** opt_pfile_exclude    = NULL;
-static char ** opt_pfile_include    = NULL;
+static boolean opt_pdir_empty       = 0;
+static args_array_t *opt_pfile_envs;
+static args_array_t *opt_pfile_exclude;
+static args_array_t *opt_pfile_include;
 static boolean opt_pfile_all        = 0;
 static boolean opt_pfile_exists     = 1;
 static boolean opt_pfile_exec       = 1;
 static boolean opt_pfile_read       = 1;
 static boolean opt_pfile_nodupes    = 1;
-static boolean opt_abspaths         = 1;
 static char    opt_pdir_delim       = ':';
 static char    opt_pfile_delim      = ':';
 static int     opt_target_shell     = CPATH_SHELL_BASH;
 static boolean opt_output_unchanged = 0;
+static boolean opt_include_verbose  = 0;
 static boolean opt_clean_common     = 0;
+static boolean opt_abspaths         = 0;
+static boolean opt_logical          = 0;
 static boolean opt_purg_env         = 0;
+static args_array_t *opt_unset;
+static args_array_t *opt_name_match;
+static args_array_t *opt_name_starts;
+static args_array_t *opt_name_ends;
+static args_array_t *opt_value_match;
+static args_array_t *opt_value_starts;
+static args_array_t *opt_value_ends;
+static args_array_t *opt_keep;
+static args_array_t *opt_keep_prefix;
+static char   *opt_save             = NULL;
+static char   *opt_load             = NULL;
+static char   *opt_compile          = NULL;
 
 
 /**
@@ -278,6 +341,7 @@ void init_prog_light(char **argv) {
     fatal("Could not determine program name.");
   if('\0' == *cptr)
     fatal("This program has no name. Should not be possible.");
+  basename_ptr = cptr;
   while('\0' != *cptr) {
     if('/' == *cptr) {
       len = 0;
@@ -326,16 +390,40 @@ static char *common_paths[] = {
 static uid_t uid;
 static gid_t gid;
 
+#include "cenv-snapshot.c"
+static void cpath_parse_long_arg(int *idx, char *this_arg, int argc, char *args[]);
+#include "cenv-rules.c"
+#include "cpath-allow.c"
+#include "cpath-shell.c"
+
+/**
+ * With --keep or --keep-prefix, the variables to keep, and the unsets held
+ * back to be printed as one statement
+ */
+static cpath_allow_t *keep_allow = NULL;
+static args_array_t *unset_pending = NULL;
+
+
+/**
+ * The command to run in exec mode (everything after "--"), or NULL to print
+ * a script instead
+ */
+static char **cenv_command = NULL;
 
 /**
  * Prints out a (hopefully) useful help menssage
  */
 static void usage() {
-  printf("Usage: %s OPTIONS [ENV_NAME1 [ENV_NAME2 [...]]]\n"
+  printf("Usage: %s OPTIONS [ENV_NAME1 [ENV_NAME2 [...]]] [-- COMMAND [ARGS...]]\n"
+         "\n"
+         "Cleans up PATH environment variables and unsets unwanted ones, in one pass over\n"
+         "the environment. By default with no arguments, cleans up only the $PATH\n"
+         "environment variable by outputting text which is suitable for inclusion in the\n"
+         "shell script (e.g., eval `%s` in bash).\n"
          "\n"
-         "Cleans up PATH environment variables. By default with no arguments, cleans up\n"
-         "only the $PATH environment variable by outputting text which is suitable for\n"
-         "inclusion in the shell script (e.g., eval `%s` in bash).\n"
+         "Given \"-- COMMAND [ARGS...]\", nothing is output. Instead COMMAND is run\n"
+         "directly with the cleaned environment (like env(1)), and looked for in the\n"
+         "cleaned PATH, which saves the shell the round trip of evaluating a script.\n"
          "\n"
          "By default keeps only the first occurence of each directory in the path, and\n"
          "keeps only existing directories which the current user may actually use (i.e.,\n"
@@ -345,6 +433,9 @@ static void usage() {
          "--------------------------------------------------------------------------------\n"
          "OPTIONS:\n"
          "  -A    = Work on all environment variables whose name ends in \"PATH\".\n"
+         "  -a    = Toggle on/off making relative path members (and empty ones kept\n"
+         "          with -k) absolute, relative to the current directory (default:\n"
+         "          off).\n"
          "  -D    = Toggle on/off debugging output if avaiable (default: off)\n"
          "  -V    = Toggle on/off to print verbose output to stdout for inclusion into \n"
          "          scripts (default: off)\n"
@@ -355,28 +446,286 @@ static void usage() {
          "              DLN_LIBRARY_PATH, RUBYLIB_PREFIX, CLASSPATH\n"
          "  -c    = Print tcsh/csh set compatible \"setenv FOO=bar;\" definitions.\n"
          "  -d'X' = Set the path delimiter to 'X' (default ':').\n"
+         "  -E st = Exclude path members that contain the string 'st'.\n"
          "  -e    = Toggle on/off to include only existing directories (default: on)\n"
-         "  -h    = Print this help message\n"
+         "  -h    = Print this help message. Also --help.\n"
          "  -?    = Print this help message\n"
          "  -I    = Toggle on/off outputting unchanged variables (default: off)\n"
+         "  -k    = Toggle on/off keeping empty path members (default: off)\n"
+         "  -L    = Toggle on/off removing \"dir/..\" from path members, the way\n"
+         "          \"cd -L\" does, which is wrong if dir is a symbolic link (default:\n"
+         "          off).\n"
          "  -n    = Print non-shell set compatible \"FOO=bar\".\n"
          "  -q    = Decrease verbosity by 1. Can be used multiple times.\n"
          "  -r    = Toggle on/off to remove duplicate directories (default: on)\n"
          "  -u    = Toggle on/off to include only \"usable\" directories (default: on)\n"
-         "  -v    = Increase verbosity by 1. Can be used multiple times.\n",
-         get_progname(), get_progname());
+         "  -v    = Increase verbosity by 1. Can be used multiple times.\n"
+         "\n"
+         "Directory paths (ENV_NAMEs, PATH by default, and the -A/-C ones):\n"
+         "  --pdir=NAMES\n"
+         "        = Also clean the comma separated variables NAMES as directory paths.\n"
+         "  --pdir-include=ST\n"
+         "        = Keep members that contain the string 'ST' without checking them.\n"
+         "  -d, -E, -e, -r and -u above apply to directory paths, -k to both kinds.\n"
+         "\n"
+         "File paths (members may be files such as jars, as well as directories):\n"
+         "  --pfile=NAMES\n"
+         "        = Clean the comma separated variables NAMES as file paths. CLASSPATH\n"
+         "          is one with -C.\n"
+         "  --pfile-all\n"
+         "        = Toggle on/off cleaning all variables whose name ends in\n"
+         "          \"CLASSPATH\" as file paths (default: off).\n"
+         "  --pfile-delim=X\n"
+         "        = Set the file path delimiter to 'X' (default ':').\n"
+         "  --pfile-exclude=ST, --pfile-include=ST\n"
+         "        = Drop, or keep without checking, members containing 'ST'.\n"
+         "  --pfile-exists, --pfile-exec, --pfile-read, --pfile-nodupes\n"
+         "        = Toggle on/off keeping only members that exist, directories that\n"
+         "          are usable, files that are readable, and the first of each\n"
+         "          duplicate (default: all on).\n"
+         "\n"
+         "Unsetting (the same criteria as unsetenvs):\n"
+         "  --unset=NAMES\n"
+         "        = Unset the comma separated variables NAMES.\n"
+         "  --name-match=ST, --name-starts=ST, --name-ends=ST\n"
+         "        = Unset any variable whose name contains, starts with or ends with\n"
+         "          the string 'ST'.\n"
+         "  --value-match=ST, --value-starts=ST, --value-ends=ST\n"
+         "        = Unset any variable whose value contains, starts with or ends with\n"
+         "          the string 'ST'.\n"
+         "\n"
+         "Clean-room (allowlist):\n"
+         "  --keep=NAMES\n"
+         "        = Keep the comma separated variables NAMES, and unset every variable\n"
+         "          not kept by this or --keep-prefix, except the ones being cleaned.\n"
+         "          The unsets are printed as one statement, except for exported bash\n"
+         "          functions, which get an \"unset -f\".\n"
+         "  --keep-prefix=PREFIXES\n"
+         "        = Keep variables whose names start with any of the comma separated\n"
+         "          PREFIXES, as with --keep.\n"
+         "\n"
+         "Site policy:\n"
+         "  --config=FILE\n"
+         "        = Read options from FILE, one long option per line without its\n"
+         "          \"--\", or from a rule file compiled from such files. Options given\n"
+         "          after it override it. Toggles in it flip the setting as it is,\n"
+         "          like they do on the command-line, compiled or not. Without a\n"
+         "          long name elsewhere, -A, -a, -C, -d, -E, -e, -k, -L, -r and -u\n"
+         "          are pdir-all, abspaths, common, pdir-delim, pdir-exclude,\n"
+         "          pdir-exists, keep-empty, logical, pdir-nodupes and pdir-exec.\n"
+         "  --compile=FILE\n"
+         "        = Compile the options given (usually --config files) into the rule\n"
+         "          file FILE, which is mapped instead of parsed, and exit.\n"
+         "\n"
+         "Snapshots (for the many ranks of a parallel job):\n"
+         "  --save=FILE\n"
+         "        = Also write what was changed to the binary snapshot FILE.\n"
+         "  --load=FILE\n"
+         "        = Apply the changes in snapshot FILE instead of cleaning, without\n"
+         "          touching the filesystem. If any variable it was built from has\n"
+         "          changed since, a new path variable has appeared, or the options\n"
+         "          (or, with -a, the current directory) differ from --save's,\n"
+         "          clean as usual instead. FILE must be yours and not writable by\n"
+         "          anyone else.\n"
+         "\n"
+         "Example:\n"
+         "  %s -C --name-starts=BASH_FUNC_ -- mpirun ./a.out\n"
+         "  %s -C --save=env.snap && mpirun %s --load=env.snap -- ./a.out\n"
+         "  %s --config=site.conf --compile=site.rules\n",
+         get_progname(), get_progname(), get_progname(), get_progname(), get_progname(),
+         get_progname());
 }
 
 /**
- * Parse the arguments provided on the command line.
+ * Get the value of a short argument, either from the rest of this argv
+ * ("-Xvalue") or from the next one ("-X value").
+ *
+ * @param idx the index of the current argument, advanced if the next argv is
+ *        used
+ * @param current_arg the current position in the argument, moved to its end
+ *        if the value was taken from it
  */
-static args_array_t *cpath_parseargs(int argc, char *args[]) {
-  int i = 0;
-  args_array_t *args_array = malloc(sizeof(args_array));
+static char *cpath_getval(int *idx, char **current_arg, int argc, char *args[]) {
+  char *value = *(current_arg) + 1;
+  if('\0' != *value) {
+    /* -Xvalue, we're done with this argument */
+    *(current_arg) += strlen(value);
+    return value;
+  }
+  *(idx) += 1;
+  if(*(idx) >= argc)
+    fatal("ERROR: No argument provided for -%c!\n", **(current_arg));
+  return args[*idx];
+}
+
+/**
+ * Get the value of a long argument, either from "--name=value" or from the
+ * next argv.
+ *
+ * @param idx the index of the current argument, advanced if the next argv is
+ *        used
+ * @param name the long argument name, without the "--"
+ * @param value what followed the '=', or NULL if there was no '='
+ */
+static char *cpath_long_getval(int *idx, const char *name, char *value, int argc, char *args[]) {
+  if(NULL == value) {
+    *(idx) += 1;
+    if(*(idx) >= argc)
+      fatal("ERROR: No argument provided for --%s!\n", name);
+    value = args[*idx];
+  }
+  { /* the caller frees name, which value may point into */
+    str_clone(copy, value);
+    return copy;
+  }
+}
+
+/**
+ * Parse one long argument (--name or --name=value).
+ *
+ * @param idx the index of the current argument, advanced if the option's value
+ *        is the next argv
+ * @param this_arg the argument without the leading "--"
+ */
+static void cpath_parse_long_arg(int *idx, char *this_arg, int argc, char *args[]) {
+  str_clone(name, this_arg);
+  char *value = strchr(name, '=');
+  if(NULL != value) {
+    *value = '\0';
+    value++;
+  }
+  debug(3,("cpath_parse_long_arg(\"%s\", \"%s\")\n", name, value ? value : ""));
+  if(eq(name, "help")) {
+    usage();
+    exit(0);
+  } else if(eq(name, "unset")) {
+    char *names = cpath_long_getval(idx, name, value, argc, args), *env_name;
+    for(env_name = strtok(names, ","); env_name; env_name = strtok(NULL, ","))
+      cpath_add_other_arg(env_name, opt_unset);
+  } else if(eq(name, "pdir")) {
+    char *names = cpath_long_getval(idx, name, value, argc, args), *env_name;
+    for(env_name = strtok(names, ","); env_name; env_name = strtok(NULL, ","))
+      cpath_add_other_arg(env_name, opt_pdir_envs);
+  } else if(eq(name, "pdir-include")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_pdir_include);
+  } else if(eq(name, "pfile")) {
+    char *names = cpath_long_getval(idx, name, value, argc, args), *env_name;
+    for(env_name = strtok(names, ","); env_name; env_name = strtok(NULL, ","))
+      cpath_add_other_arg(env_name, opt_pfile_envs);
+  } else if(eq(name, "pfile-all")) {
+    toggle(opt_pfile_all);
+  } else if(eq(name, "pfile-delim")) {
+    opt_pfile_delim = *cpath_long_getval(idx, name, value, argc, args);
+    if(! opt_pfile_delim)
+      fatal("--pfile-delim needs a delimiter\n");
+    cenv_rules_pfile_delim_set = 1;
+  } else if(eq(name, "pfile-exclude")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_pfile_exclude);
+  } else if(eq(name, "pfile-include")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_pfile_include);
+  } else if(eq(name, "pfile-exists")) {
+    toggle(opt_pfile_exists);
+  } else if(eq(name, "pfile-exec")) {
+    toggle(opt_pfile_exec);
+  } else if(eq(name, "pfile-read")) {
+    toggle(opt_pfile_read);
+  } else if(eq(name, "pfile-nodupes")) {
+    toggle(opt_pfile_nodupes);
+  } else if(eq(name, "name-match")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_name_match);
+    opt_purg_env = 1;
+  } else if(eq(name, "name-starts")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_name_starts);
+    opt_purg_env = 1;
+  } else if(eq(name, "name-ends")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_name_ends);
+    opt_purg_env = 1;
+  } else if(eq(name, "value-match")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_value_match);
+    opt_purg_env = 1;
+  } else if(eq(name, "value-starts")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_value_starts);
+    opt_purg_env = 1;
+  } else if(eq(name, "value-ends")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_value_ends);
+    opt_purg_env = 1;
+  } else if(eq(name, "keep") || eq(name, "keep-prefix")) {
+    char *names = cpath_long_getval(idx, name, value, argc, args), *keep_name;
+    for(keep_name = strtok(names, ","); keep_name; keep_name = strtok(NULL, ","))
+      cpath_add_other_arg(keep_name, eq(name, "keep") ? opt_keep : opt_keep_prefix);
+  } else if(eq(name, "save")) {
+    opt_save = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "load")) {
+    opt_load = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "config")) {
+    char *file_name = cpath_long_getval(idx, name, value, argc, args);
+    cenv_rules_load(file_name);
+    free(file_name);
+  } else if(eq(name, "compile")) {
+    opt_compile = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "pdir-all")) {
+    toggle(opt_pdir_all);
+  } else if(eq(name, "pdir-delim")) {
+    opt_pdir_delim = *cpath_long_getval(idx, name, value, argc, args);
+    if(! opt_pdir_delim)
+      fatal("--pdir-delim needs a delimiter\n");
+    cenv_rules_pdir_delim_set = 1;
+  } else if(eq(name, "pdir-exclude")) {
+    cpath_add_other_arg(cpath_long_getval(idx, name, value, argc, args), opt_pdir_exclude);
+  } else if(eq(name, "pdir-exists")) {
+    toggle(opt_pdir_exists);
+  } else if(eq(name, "pdir-exec")) {
+    toggle(opt_pdir_exec);
+  } else if(eq(name, "pdir-nodupes")) {
+    toggle(opt_pdir_nodupes);
+  } else if(eq(name, "keep-empty")) {
+    toggle(opt_pdir_empty);
+  } else if(eq(name, "common")) {
+    toggle(opt_clean_common);
+  } else if(eq(name, "abspaths")) {
+    toggle(opt_abspaths);
+  } else if(eq(name, "logical")) {
+    toggle(opt_logical);
+  } else if(cenv_config_where) {
+    fatal("%s: unknown setting \"%s\"\n", cenv_config_where, name);
+  } else {
+    usage();
+    fatal("Unknown parameter --%s\n", name);
+  }
+  free(name);
+}
+
+static args_array_t *cpath_new_args_array_t(void) {
+  args_array_t *args_array = (args_array_t *)malloc(sizeof(args_array_t));
   if(! args_array) fatal("Out or memory error - could not allocate RAM for args_array.\n");
   args_array->length = 0;
   args_array->size = 0;
-  args_array->length = 0;
+  args_array->args = NULL;
+  return args_array;
+}
+
+/**
+ * Parse the arguments provided on the command line.
+ */
+static args_array_t *cpath_parseargs(int argc, char *args[]) {
+  int i = 0;
+  args_array_t *args_array = cpath_new_args_array_t();
+  cenv_rules_save_defaults();
+  opt_pdir_envs = args_array;
+  opt_pdir_exclude = cpath_new_args_array_t();
+  opt_pdir_include = cpath_new_args_array_t();
+  opt_pfile_envs = cpath_new_args_array_t();
+  opt_pfile_exclude = cpath_new_args_array_t();
+  opt_pfile_include = cpath_new_args_array_t();
+  opt_unset = cpath_new_args_array_t();
+  opt_name_match = cpath_new_args_array_t();
+  opt_name_starts = cpath_new_args_array_t();
+  opt_name_ends = cpath_new_args_array_t();
+  opt_value_match = cpath_new_args_array_t();
+  opt_value_starts = cpath_new_args_array_t();
+  opt_value_ends = cpath_new_args_array_t();
+  opt_keep = cpath_new_args_array_t();
+  opt_keep_prefix = cpath_new_args_array_t();
   for(
       i = 1; /* start at 1, not 0, since args[0] is the string with which
                 this programs was called */
@@ -395,14 +744,25 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
       if('-' == *this_arg) { /* if the argument was a "long" agument as *
                                 specified by using --argname, handle it *
                                 differently */
-        /* Not implemented yet */
-        usage();
-        fatal("Long args are not implemented yet.\n");
+        if('\0' == this_arg[1]) { /* "--", the rest is the command to run */
+          if(i + 1 >= argc)
+            fatal("No command given after \"--\"\n");
+          cenv_command = args + i + 1;
+          break;
+        }
+        cpath_parse_long_arg(&i, this_arg + 1, argc, args);
+        continue;
       }
       while(*this_arg) {
         switch(*this_arg) {
         case 'A':
-          toggle(opt_all_paths);
+          toggle(opt_pdir_all);
+          break;
+        case 'a':
+          toggle(opt_abspaths);
+          break;
+        case 'L':
+          toggle(opt_logical);
           break;
         case 'v':
           opt_verbosity ++;
@@ -416,19 +776,25 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
           opt_verbosity --;
           break;
         case 'e':
-          toggle(opt_check_dir_exists);
+          toggle(opt_pdir_exists);
+          break;
+        case 'E':
+          cpath_add_other_arg(cpath_getval(&i, &this_arg, argc, args), opt_pdir_exclude);
+          break;
+        case 'k':
+          toggle(opt_pdir_empty);
           break;
         case 'u':
-          toggle(opt_only_executable_dirs);
+          toggle(opt_pdir_exec);
           break;
         case 'D':
           toggle(opt_debug_on);
           break;
         case 'C':
-          toggle(opt_common_paths);
+          toggle(opt_clean_common);
           break;
         case 'r':
-          toggle(opt_remove_dupes);
+          toggle(opt_pdir_nodupes);
           break;
         case 'I':
           toggle(opt_output_unchanged);
@@ -444,17 +810,15 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
           break;
         case 'V':
           toggle(opt_include_verbose);
-          if(opt_include_verbose)
-            sh_comments();
-          else
-            no_comments();
           break;
         case 'd':
-          opt_delim = *(this_arg + 1);
-          if(!opt_delim) {
+          opt_pdir_delim = *(this_arg + 1);
+          if(!opt_pdir_delim) {
             usage();
             fatal("-d arg not currently supported use -darg in stead.");
           }
+          cenv_rules_pdir_delim_set = 1;
+          this_arg++;
           break;
         default:
           usage();
@@ -470,6 +834,28 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
   return args_array;
 }
 
+/**
+ * Does a string contain, start with or end with any of the strings in an
+ * array?
+ *
+ * @param how 'm' for contains, 's' for starts with, 'e' for ends with
+ *
+ * @return the string that matched, or NULL if none did
+ */
+static const char *cenv_matches(const char *str, args_array_t *array, char how) {
+  size_t len = strlen(str), match_len;
+  unsigned int idx;
+  for(idx = 0; idx < array->length; idx++) {
+    const char *match = array->args[idx];
+    match_len = strlen(match);
+    if(('m' == how && strstr(str, match)) ||
+       ('s' == how && 0 == strncmp(str, match, match_len)) ||
+       ('e' == how && len >= match_len && eq(str + len - match_len, match)))
+      return match;
+  }
+  return NULL;
+}
+
 /**
  * Check if we've seen this path before for the current environment variable.
  *
@@ -491,7 +877,7 @@ int cpath_seen_before(char *dir, unsigned int hash) {
         seen_before = 1;
         break;
       } else {
-        debug(3,("cpath_seen_before: Hash was the same, directory was different.\n",dir));
+        debug(3,("cpath_seen_before: Hash was the same, directory \"%s\" was different.\n",dir));
       }
     }
   }
@@ -530,39 +916,70 @@ int cpath_can_exec_dir(struct stat * file_stat) {
 }
 
 /**
- * Check if we should add (i.e., keep) this directory to the PATH in question
+ * Check if this is a readable file, the same way cpath_can_exec_dir() checks
+ * directories.
+ */
+int cpath_can_read_file(struct stat * file_stat) {
+  debug(3,("cpath_can_read_file(struct stat * file_stat)\n"));
+  return
+    (S_IROTH & file_stat->st_mode) ||
+    (file_stat->st_gid == gid && (file_stat->st_mode & S_IRGRP)) ||
+    (file_stat->st_uid == uid && (S_IRUSR & file_stat->st_mode));
+}
+
+/**
+ * Check if we should add (i.e., keep) this member of the path in question,
+ * according to the policy for its kind of path.
  *
  * @param dir the current directory string to check
  * @param the hash of that directory string. Passing it is more efficient that
  *        recomputing it.
  */
 unsigned char cpath_should_add(char *current_dir, unsigned int hash) {
+  cenv_policy_t *policy = path_info.policy;
   struct stat file_stat;
+  const char *match;
   debug(3,("cpath_should_add(\"%s\",%u)\n",current_dir,hash));
   /* if we don't keep empty dirs, don't bother with the rest */
-  if(opt_discard_empty && '\0' == *current_dir) {
-    verbose(2,("Ignoring empty string directory name \"%s\"\n",
+  if(! policy->empty && '\0' == *current_dir) {
+    verbose(2,("Ignoring empty string %s name \"%s\"\n", policy->what,
                current_dir));
     return 0;
   }
-  if( opt_remove_dupes && cpath_seen_before(current_dir,hash) ) {
+  if(NULL != (match = cenv_matches(current_dir, policy->exclude, 'm'))) {
+    verbose(2,("Removing \"%s\" (matched '%s')\n", current_dir, match));
+    return 0;
+  }
+  if( policy->nodupes && cpath_seen_before(current_dir,hash) ) {
     /* don't do anything with this dir */
-    verbose(2,("Ignoring previously seen directory \"%s\"\n",
+    verbose(2,("Ignoring previously seen %s \"%s\"\n", policy->what,
                current_dir));
     return 0;
-  } else if (opt_dir_exists && 0 != stat(current_dir, &file_stat)) {
+  } else if (NULL != (match = cenv_matches(current_dir, policy->include, 'm'))) {
+    verbose(2,("Keeping \"%s\" (matched '%s')\n", current_dir, match));
+    return 1;
+  } else if ('\0' == *current_dir) {
+    /* an empty member means the current directory, there is nothing to stat */
+    verbose(2,("Keeping empty path member\n"));
+    return 1;
+  } else if ((policy->exists || policy->exec || policy->read) && 0 != stat(current_dir, &file_stat)) {
     /* if we're only supposed to check if directories exist, and it
        doen't we let someone know if needed, and skip it */
-    verbose(2,("Ignoring non-existent directory \"%s\"\n",
+    verbose(2,("Ignoring non-existent %s \"%s\"\n", policy->what,
                current_dir));
     return 0;
-  } else if (opt_only_executable_dirs && /* if we only want executable
-                                            directories */
+  } else if (policy->exec && /* if we only want executable
+                                directories */
+             (policy->files ? S_ISDIR(file_stat.st_mode) : 1) &&
              ! cpath_can_exec_dir(&file_stat)
              ) {
     /* don't do anything with this dir */
     verbose(2,("Ignoring non-usable directory \"%s\"\n",current_dir));
     return 0;
+  } else if (policy->read && ! S_ISDIR(file_stat.st_mode) &&
+             ! cpath_can_read_file(&file_stat)) {
+    verbose(2,("Ignoring unreadable file \"%s\"\n",current_dir));
+    return 0;
   } else {
     /* If we got here, we have a keeper */
     verbose(2,("Keeping \"%s\"\n", current_dir));
@@ -570,39 +987,109 @@ unsigned char cpath_should_add(char *current_dir, unsigned int hash) {
   }
 }
 
+/**
+ * The current directory, looked up once for -a, or NULL if it can't be.
+ */
+static char *cenv_cwd(void) {
+  static char *cwd = NULL;
+  static boolean looked = 0;
+  if(! looked) {
+    looked = 1;
+    if(NULL == (cwd = getcwd(NULL, 0)))
+      verbose(1,("Leaving relative path members alone, no current directory: %s\n", strerror(errno)));
+  }
+  return cwd;
+}
+
+/**
+ * Canonicalize a path member using only its string: make it absolute (with
+ * -a), drop empty and "." components and trailing slashes, and drop ".."
+ * right after the root (and after any other component with -L). Nothing is
+ * stat()ed, so "/usr//bin/" and "/usr/./bin" are found to be duplicates of
+ * "/usr/bin" for free.
+ *
+ * @param member the member as it was in the path
+ * @param canon where to put the canonical member, which needs room for
+ *        the current directory, a slash and member
+ */
+static void cpath_canonicalize(const char *member, char *canon) {
+  char *read_ptr, *write_ptr, *root;
+  const char *cwd;
+  /* an empty member is only made absolute if it is going to be kept (-k),
+     otherwise it has to stay empty for cpath_should_add() to drop it */
+  if(opt_abspaths && '/' != *member && ('\0' != *member || path_info.policy->empty) &&
+     NULL != (cwd = cenv_cwd())) {
+    sprintf(canon, "%s/%s", cwd, member);
+  } else if('\0' == *member) {
+    *canon = '\0';
+    return;
+  } else {
+    strcpy(canon, member);
+  }
+  /* components are moved down in place, writing never passes reading */
+  read_ptr = write_ptr = root = canon + ('/' == *canon);
+  while(*read_ptr) {
+    char *component = read_ptr;
+    size_t len;
+    while(*read_ptr && '/' != *read_ptr) read_ptr++;
+    len = read_ptr - component;
+    while('/' == *read_ptr) read_ptr++;
+    if(0 == len || (1 == len && '.' == *component))
+      continue;
+    if(2 == len && '.' == component[0] && '.' == component[1]) {
+      char *last = write_ptr;
+      while(last > root && '/' != *(last - 1)) last--;
+      if(root != canon && write_ptr == root) /* "/.." is "/" */
+        continue;
+      if(opt_logical && write_ptr > root && ! (2 == write_ptr - last && '.' == last[0] && '.' == last[1])) {
+        write_ptr = last > root ? last - 1 : root;
+        continue;
+      }
+    }
+    if(write_ptr > root)
+      *(write_ptr++) = '/';
+    memmove(write_ptr, component, len);
+    write_ptr += len;
+  }
+  /* a relative member that was nothing but "." and slashes */
+  if(write_ptr == canon)
+    *(write_ptr++) = '.';
+  *write_ptr = '\0';
+}
+
 /**
  * Add this directory to the new path if and only if we should.
  *
- * @param dir the current directory string to check
- * @param the hash of that directory string. Passing it is more efficient that
- *        recomputing it.
+ * The member is canonicalized first and hashed after, so duplicates that
+ * are only spelled differently are caught.
+ *
+ * @param member the current member string, as it was in the path
  */
-void cpath_add_if(char *current_dir, unsigned int hash) {
+void cpath_add_if(const char *member) {
+  char *current_dir = path_info.canon_ptr;
+  unsigned int hash = 5381;
   debug(5,("cpath_add_if: before new_path = \"%s\"\n", path_info.new_path_string));
+  cpath_canonicalize(member, current_dir);
+  if(! eq(member, current_dir))
+    verbose(2,("Using \"%s\" for \"%s\"\n", current_dir, member));
+  /* keep it, it may be remembered by cpath_seen_before() */
+  path_info.canon_ptr += strlen(current_dir) + 1;
   { /* Start isolated block */
-    char *char_ptr = current_dir;
-    debug(4,("cpath_add_if: - Before trimming: \"%s\"\n", current_dir));
-    /* move to end of string */
-    while(*char_ptr) char_ptr ++;
-    /* back up one (b/c were at the null char */
-    char_ptr --;
-    /* back up over all trailing slashes "/" */
-    while('/' == *char_ptr ) char_ptr --;
-    /* move forward one */
-    char_ptr ++;
-    /* terminate string here. */
-    *char_ptr = '\0';
-    debug(4,("cpath_add_if: - After  trimming: \"%s\"\n", current_dir));
+    const char *char_ptr;
+    for(char_ptr = current_dir; *char_ptr; char_ptr++)
+      hash = ((hash << 5) + hash) + *char_ptr;
   } /* End isolated block */
   if( cpath_should_add(current_dir,hash) ){
     debug(3,("Adding \"%s\"\n", current_dir));
     /* If we're not at the start of the new path string, then we need
-       to add a "delim" separator for this directory */
-    if(path_info.new_path_string_ptr != path_info.new_path_string) {
+       to add a "delim" separator for this directory. An empty member
+       that is kept first needs one too, or it would vanish. */
+    if(path_info.new_path_string_ptr != path_info.new_path_string || path_info.kept_count) {
       debug(5,(" - adding delim '%c' to new_path=\"%s\"\n", path_info.delim, path_info.new_path_string));
       *(path_info.new_path_string_ptr) = path_info.delim;
       path_info.new_path_string_ptr ++;
     }
+    path_info.kept_count ++;
     while('\0' != *current_dir) {
       *(path_info.new_path_string_ptr) = *current_dir;
       path_info.new_path_string_ptr ++;
@@ -619,11 +1106,14 @@ void cpath_add_if(char *current_dir, unsigned int hash) {
 /**
  * Clean a given PATH environment variable.
  *
- * @param delim the path delimiter
+ * @param policy how to check its members (and its delimiter)
  * @param env_name the name of the environment variable
  * @param old_path_string the path string as it was before we did anything to it.
+ *
+ * @return the cleaned path string
  */
-void cpath_clean_path(char delim, const char *env_name,const char *old_path_string) {
+char *cpath_clean_path(cenv_policy_t *policy, const char *env_name,const char *old_path_string) {
+  path_info.policy                  = policy;
   path_info.env_name                = NULL;
   path_info.path_string_length      = 0;
   path_info.old_path_string         = NULL;
@@ -633,11 +1123,8 @@ void cpath_clean_path(char delim, const char *env_name,const char *old_path_stri
   path_info.old_directory_count     = 0;
   path_info.new_directory_count     = 0;
   path_info.directories             = NULL;
-  path_info.delim                   = delim;
-  if(! old_path_string) {
-    verbose(1,("OLD %s=\"\" # was unset\n",env_name));
-    return;
-  }
+  path_info.kept_count              = 0;
+  path_info.delim                   = policy->delim;
 
   verbose(1,("OLD %s=\"%s\"\n",env_name,old_path_string));
   {  /* Start isolated block */
@@ -664,25 +1151,26 @@ void cpath_clean_path(char delim, const char *env_name,const char *old_path_stri
   strcpy(path_info.old_path_string,old_path_string);
 
   /* we need anoth copy, since we'll "destroy" this one, and if we use old_path_string
-     we'd bee destroying the environment which this code sees. Probably only really
-     an issue because I allow people to specify the same environment variable more
-     than once.
-  */
+     we'd bee destroying the environment which this code sees. */
   char *old_path_string_copy = (char *)calloc(path_info.path_string_length + 1,1);
   if(! old_path_string_copy) fatal("Unable to allocate RAM for path copy 2.");
   strcpy(old_path_string_copy,old_path_string);
 
+  /* The canonical members, which with -a may each have the current
+     directory put in front of them */
+  size_t canon_length = path_info.path_string_length + 1;
+  if(opt_abspaths && cenv_cwd())
+    canon_length += (path_info.old_directory_count + 1) * (strlen(cenv_cwd()) + 2);
+  char *canon = (char *)calloc(canon_length,1);
+  if(! canon) fatal("Unable to allocate RAM for path copy 3.");
+  path_info.canon_ptr = canon;
+
   /* Here we'll store the "new" PATH as we build it */
-  path_info.new_path_string = (char *)calloc(path_info.path_string_length + 1,1);
+  path_info.new_path_string = (char *)calloc(canon_length,1);
   if(! path_info.new_path_string) fatal("Unable to allocate RAM for path copy.");
   path_info.new_path_string_ptr = path_info.new_path_string;
 
-  /* Need to keep track of all of the directories we've seen so far. An arguably
-     better (less RAM) way of doing this is just storing them all in the
-     path_info.new_path_string, since we know it has enough room and then at then
-     end replacing all the null terminators with path_info.delim except for the
-     last one. Next iteration of this code.
-   */
+  /* Need to keep track of all of the directories we've seen so far. */
   path_info.directories = (char **)malloc(sizeof(char*) * (path_info.old_directory_count + 1));
   if(! path_info.directories) fatal("Unable to allocate RAM for seen directories.");
   *path_info.directories = NULL;
@@ -696,50 +1184,424 @@ void cpath_clean_path(char delim, const char *env_name,const char *old_path_stri
   { /* Start isolated block */
     /* Start at the begining */
     char *current_dir = old_path_string_copy;
-    /* This is a magic hash number */
-    unsigned int hash = 5381;
+    char *char_ptr = old_path_string_copy;
     /* Loop through all the chars in the PATH string */
-    while('\0' != *old_path_string_copy) {
+    while('\0' != *char_ptr) {
       /* At each delimitor, process the previous directory */
-      if(path_info.delim == *old_path_string_copy) {
-        *old_path_string_copy = '\0';
-        cpath_add_if(current_dir, hash);
-        current_dir = old_path_string_copy+1;
-        /* Reset the hash value to the magic value */
-        hash = 5381;
-      } else {
-        /* Compute the hash */
-        hash = ((hash << 5) + hash) + (*old_path_string_copy);
+      if(path_info.delim == *char_ptr) {
+        *char_ptr = '\0';
+        cpath_add_if(current_dir);
+        current_dir = char_ptr+1;
       }
       /* Move to next char */
-      old_path_string_copy++;
+      char_ptr++;
     }
     /* Still have to process the last directory if any */
-    cpath_add_if(current_dir, hash);
+    cpath_add_if(current_dir);
   } /* End isolated block */
   verbose(1,("NEW %s=\"%s\"\n",env_name,path_info.new_path_string));
-  /* Now output a string to STDOUT as asked */
-  if(
-     opt_output_unchanged ||
-     (0 != strcmp(path_info.new_path_string,path_info.old_path_string))
-     ) {
-    switch(opt_target_shell) {
-    case CPATH_SHELL_NONE:
-      printf("%s=%s\n",env_name,path_info.new_path_string);
-      break;
-    case CPATH_SHELL_BASH:
-      printf("export %s=\"%s\";\n",env_name,path_info.new_path_string);
-      break;
-    case CPATH_SHELL_CSH:
-      printf("setenv %s=%s\n",env_name,path_info.new_path_string);
-      break;
-    default:
-      usage();
-      fatal("Unknown target shell '%d'\n",opt_target_shell);
-      exit(EXIT_FAILURE);
-      break;
+  free(old_path_string_copy);
+  free(canon);
+  free(path_info.directories);
+  free(path_info.directory_hashes);
+  free(path_info.old_path_string);
+  return path_info.new_path_string;
+}
+
+/**
+ * Should this variable be purged by any of the unsetenvs style criteria?
+ */
+static boolean cenv_should_purge(const char *env_name, const char *env_value) {
+  const char *match;
+  if(NULL != (match = cenv_matches(env_name, opt_name_match, 'm')) ||
+     NULL != (match = cenv_matches(env_name, opt_name_starts, 's')) ||
+     NULL != (match = cenv_matches(env_name, opt_name_ends, 'e'))) {
+    verbose(1,("Unsetting %s (name matched '%s')\n", env_name, match));
+    return 1;
+  }
+  if(NULL != (match = cenv_matches(env_value, opt_value_match, 'm')) ||
+     NULL != (match = cenv_matches(env_value, opt_value_starts, 's')) ||
+     NULL != (match = cenv_matches(env_value, opt_value_ends, 'e'))) {
+    verbose(1,("Unsetting %s (value matched '%s')\n", env_name, match));
+    return 1;
+  }
+  return 0;
+}
+
+
+static unsigned int cenv_class_hash(const char *name) {
+  unsigned int hash = 5381;
+  while(*name)
+    hash = ((hash << 5) + hash) + *(name++);
+  return hash;
+}
+
+/**
+ * Find a name's slot in the table, which is either its entry or empty.
+ */
+static cenv_class_t *cenv_class_slot(const char *name, unsigned int hash) {
+  unsigned int idx = hash & cenv_class_mask;
+  while(cenv_classes[idx].name && (cenv_classes[idx].hash != hash || ! eq(cenv_classes[idx].name, name)))
+    idx = (idx + 1) & cenv_class_mask;
+  return &cenv_classes[idx];
+}
+
+/**
+ * Add names to the table. Later calls override earlier ones for the same
+ * name.
+ */
+static void cenv_class_set(char **names, unsigned int count, int what) {
+  unsigned int idx;
+  for(idx = 0; idx < count; idx++) {
+    unsigned int hash = cenv_class_hash(names[idx]);
+    cenv_class_t *slot = cenv_class_slot(names[idx], hash);
+    slot->name = names[idx];
+    slot->hash = hash;
+    slot->what = what;
+  }
+}
+
+/**
+ * Build the table once the command-line has been parsed. Precedence, from
+ * lowest: the -C common paths, --pdir (and ENV_NAME) names, --pfile names,
+ * then --unset names.
+ *
+ * @param defaults whether to add the -C common paths and the default PATH,
+ *        which a rule file being compiled leaves to the command-line it's
+ *        used with
+ */
+static void cenv_classes_build(boolean defaults) {
+  unsigned int common_count = 0, size = 16;
+  static char *default_path[] = { "PATH" };
+  static char *common_files[] = { "CLASSPATH" };
+  while(*(common_paths[common_count])) common_count++;
+  /* at most half full */
+  while(size < 2 * (common_count + opt_pdir_envs->length + opt_pfile_envs->length +
+                    opt_unset->length + 1))
+    size *= 2;
+  cenv_classes = (cenv_class_t *)calloc(size, sizeof(cenv_class_t));
+  if(! cenv_classes) fatal("Unable to allocate RAM for variable classes.\n");
+  cenv_class_mask = size - 1;
+  if(defaults && opt_clean_common) {
+    cenv_class_set(common_paths, common_count, CENV_PDIR);
+    cenv_class_set(common_files, 1, CENV_PFILE);
+  }
+  /* With nothing else on the command-line, clean "PATH" */
+  if(defaults && ! opt_pdir_envs->length && ! opt_pfile_envs->length && ! cenv_rules_path_names &&
+     ! opt_pdir_all && ! opt_pfile_all && ! opt_clean_common)
+    cenv_class_set(default_path, 1, CENV_PDIR);
+  cenv_class_set(opt_pdir_envs->args, opt_pdir_envs->length, CENV_PDIR);
+  cenv_class_set(opt_pfile_envs->args, opt_pfile_envs->length, CENV_PFILE);
+  cenv_class_set(opt_unset->args, opt_unset->length, CENV_UNSET);
+}
+
+/**
+ * Decide, once, what to do with a variable.
+ *
+ * @return CENV_KEEP, CENV_UNSET, CENV_PDIR or CENV_PFILE
+ */
+static int cenv_classify(const char *env_name, const char *env_value) {
+  size_t len = strlen(env_name);
+  unsigned int hash = cenv_class_hash(env_name);
+  cenv_class_t *slot = cenv_class_slot(env_name, hash);
+  /* the command-line overrides a rule file */
+  int what = slot->name ? slot->what : cenv_rules_class(env_name, hash);
+  if(CENV_UNSET == what) {
+    verbose(1,("Unsetting %s\n", env_name));
+    return CENV_UNSET;
+  }
+  if(opt_purg_env && cenv_should_purge(env_name, env_value))
+    return CENV_UNSET;
+  if(CENV_KEEP != what)
+    return what;
+  /* the variables cenv cleans are kept, they were asked for by name */
+  if(keep_allow && ! cpath_allow_has(keep_allow, env_name) &&
+     ! (opt_pfile_all && len >= 9 && eq(env_name + len - 9, "CLASSPATH")) &&
+     ! (opt_pdir_all && len >= 4 && eq(env_name + len - 4, "PATH"))) {
+    verbose(1,("Unsetting %s (not kept)\n", env_name));
+    return CENV_UNSET;
+  }
+  if(opt_pfile_all && len >= 9 && eq(env_name + len - 9, "CLASSPATH"))
+    return CENV_PFILE;
+  if(opt_pdir_all && len >= 4 && eq(env_name + len - 4, "PATH"))
+    return CENV_PDIR;
+  return CENV_KEEP;
+}
+
+/**
+ * Add a list of patterns or names to the options hash.
+ */
+static unsigned long long cenv_options_hash_list(unsigned long long hash, args_array_t *array) {
+  unsigned int idx;
+  hash = cenv_snapshot_hash_bytes(hash, &array->length, sizeof(array->length));
+  for(idx = 0; idx < array->length; idx++)
+    hash = cenv_snapshot_hash_bytes(hash, array->args[idx], strlen(array->args[idx]) + 1);
+  return hash;
+}
+
+/**
+ * Add a way of checking members to the options hash.
+ */
+static unsigned long long cenv_options_hash_policy(unsigned long long hash, cenv_policy_t *policy) {
+  boolean flags[6];
+  flags[0] = policy->exists;
+  flags[1] = policy->exec;
+  flags[2] = policy->read;
+  flags[3] = policy->files;
+  flags[4] = policy->nodupes;
+  flags[5] = policy->empty;
+  hash = cenv_snapshot_hash_bytes(hash, flags, sizeof(flags));
+  hash = cenv_snapshot_hash_bytes(hash, &policy->delim, 1);
+  hash = cenv_options_hash_list(hash, policy->exclude);
+  return cenv_options_hash_list(hash, policy->include);
+}
+
+/**
+ * Hash everything that decides what happens to a variable: how each is
+ * classified, how members are checked, and the rule file, if any. With -a,
+ * the current directory is part of it too, since relative members are made
+ * absolute against it. A snapshot is only used with the options it was
+ * written with.
+ */
+static unsigned long long cenv_options_hash(void) {
+  unsigned long long hash = CENV_SNAPSHOT_HASH_START;
+  boolean flags[5];
+  unsigned int idx;
+  flags[0] = opt_pdir_all;
+  flags[1] = opt_pfile_all;
+  flags[2] = opt_abspaths;
+  flags[3] = opt_logical;
+  flags[4] = NULL != keep_allow;
+  hash = cenv_snapshot_hash_bytes(hash, flags, sizeof(flags));
+  hash = cenv_options_hash_policy(hash, &pdir_policy);
+  hash = cenv_options_hash_policy(hash, &pfile_policy);
+  hash = cenv_options_hash_list(hash, opt_name_match);
+  hash = cenv_options_hash_list(hash, opt_name_starts);
+  hash = cenv_options_hash_list(hash, opt_name_ends);
+  hash = cenv_options_hash_list(hash, opt_value_match);
+  hash = cenv_options_hash_list(hash, opt_value_starts);
+  hash = cenv_options_hash_list(hash, opt_value_ends);
+  hash = cenv_options_hash_list(hash, opt_keep);
+  hash = cenv_options_hash_list(hash, opt_keep_prefix);
+  for(idx = 0; idx <= cenv_class_mask; idx++)
+    if(cenv_classes[idx].name) {
+      hash = cenv_snapshot_hash_bytes(hash, cenv_classes[idx].name, strlen(cenv_classes[idx].name) + 1);
+      hash = cenv_snapshot_hash_bytes(hash, &cenv_classes[idx].what, sizeof(cenv_classes[idx].what));
+    }
+  if(cenv_rules_data)
+    hash = cenv_snapshot_hash_bytes(hash, cenv_rules_data,
+                                    ((const cenv_rules_header_t *)cenv_rules_data)->size);
+  if(opt_abspaths && cenv_cwd())
+    hash = cenv_snapshot_hash_bytes(hash, cenv_cwd(), strlen(cenv_cwd()) + 1);
+  return hash;
+}
+
+/**
+ * Print the new value of a variable for the target shell.
+ */
+static void cenv_output_set(const char *env_name, const char *value) {
+  switch(opt_target_shell) {
+  case CPATH_SHELL_NONE:
+    printf("%s=%s\n",env_name,value);
+    break;
+  case CPATH_SHELL_BASH:
+    printf("export %s=\"%s\";\n",env_name,value);
+    break;
+  case CPATH_SHELL_CSH:
+    printf("setenv %s \"%s\";\n",env_name,value);
+    break;
+  default:
+    usage();
+    fatal("Unknown target shell '%d'\n",opt_target_shell);
+    exit(EXIT_FAILURE);
+    break;
+  }
+}
+
+/**
+ * Print the unsetting of a variable for the target shell. Exported bash
+ * functions get an "unset -f" of their own, never a place in the held back
+ * statement.
+ */
+static void cenv_output_unset(const char *env_name) {
+  char *func = cpath_shell_bash_func(env_name);
+  if(func) {
+    /* only "unset -f" removes them, and it can't share a statement */
+    if(CPATH_SHELL_BASH == opt_target_shell)
+      printf("unset -f %s;\n",func);
+    else if(CPATH_SHELL_CSH == opt_target_shell)
+      verbose(0,("Not unsetting %s, csh can't remove exported functions\n",env_name));
+    free(func);
+    if(CPATH_SHELL_NONE != opt_target_shell)
+      return;
+  }
+  if(unset_pending) {
+    cpath_add_other_arg((char *)env_name, unset_pending);
+    return;
+  }
+  switch(opt_target_shell) {
+  case CPATH_SHELL_NONE:
+    printf("%s=\n",env_name);
+    break;
+  case CPATH_SHELL_BASH:
+    printf("unset %s;\n",env_name);
+    break;
+  case CPATH_SHELL_CSH:
+    printf("unsetenv %s;\n",env_name);
+    break;
+  default:
+    usage();
+    fatal("Unknown target shell '%d'\n",opt_target_shell);
+    exit(EXIT_FAILURE);
+    break;
+  }
+}
+
+/**
+ * Print the unsets held back in allowlist mode, as one statement.
+ */
+static void cenv_output_unset_pending(void) {
+  unsigned int idx;
+  if(! unset_pending || 0 == unset_pending->length)
+    return;
+  switch(opt_target_shell) {
+  case CPATH_SHELL_NONE:
+    for(idx = 0; idx < unset_pending->length; idx++)
+      printf("%s=\n",unset_pending->args[idx]);
+    return;
+  case CPATH_SHELL_BASH:
+    printf("unset");
+    break;
+  case CPATH_SHELL_CSH:
+    printf("unsetenv");
+    break;
+  }
+  for(idx = 0; idx < unset_pending->length; idx++)
+    printf(" %s",unset_pending->args[idx]);
+  printf(";\n");
+  unset_pending->length = 0;
+}
+
+/**
+ * Run a file, falling back to /bin/sh for scripts without a "#!" line the
+ * way execvp() does.
+ */
+static void cenv_execve(const char *file, char **argv, char **envp) {
+  unsigned int argc = 0;
+  char **sh_argv;
+  execve(file, argv, envp);
+  if(ENOEXEC != errno)
+    return;
+  while(argv[argc]) argc++;
+  sh_argv = (char **)malloc(sizeof(char *) * (argc + 2));
+  if(! sh_argv) fatal("Out of memory error. Could not allocate RAM for arguments.\n");
+  sh_argv[0] = "sh";
+  sh_argv[1] = (char *)file;
+  memcpy(sh_argv + 2, argv + 1, sizeof(char *) * argc);
+  execve("/bin/sh", sh_argv, envp);
+  errno = ENOEXEC;
+}
+
+/**
+ * Replace this process with the command, looked for in the new PATH the way
+ * execvp() would. Only returns on failure, with the exit status env(1) uses
+ * (127 if the command wasn't found, 126 if it couldn't be run).
+ *
+ * @param command the command and its arguments
+ * @param envp the new environment
+ */
+static int cenv_exec(char **command, char **envp) {
+  const char *path = "/usr/local/bin:/bin:/usr/bin", *cptr;
+  char file_name[4096];
+  int error = ENOENT;
+  unsigned int idx;
+  for(idx = 0; envp[idx]; idx++)
+    if(0 == strncmp(envp[idx], "PATH=", 5))
+      path = envp[idx] + 5;
+  if(strchr(command[0], '/')) {
+    cenv_execve(command[0], command, envp);
+    error = errno;
+  } else {
+    for(cptr = path; cptr; cptr = strchr(cptr, ':') ? strchr(cptr, ':') + 1 : NULL) {
+      size_t len = strchr(cptr, ':') ? (size_t)(strchr(cptr, ':') - cptr) : strlen(cptr);
+      /* an empty member means the current directory */
+      snprintf(file_name, sizeof(file_name), "%.*s%s%s", (int)len, cptr, len ? "/" : "", command[0]);
+      cenv_execve(file_name, command, envp);
+      /* keep going on anything that says "not here", remember anything else */
+      if(ENOENT != errno && ENOTDIR != errno && ENAMETOOLONG != errno)
+        error = errno;
+      if(EACCES != errno && ENOENT != errno && ENOTDIR != errno && ENAMETOOLONG != errno)
+        break;
+    }
+  }
+  fprintf(stderr, "%s: '%s': %s\n", get_progname(), command[0], strerror(error));
+  return ENOENT == error ? 127 : 126;
+}
+
+/**
+ * Use a snapshot instead of cleaning. Variables it has no record of (e.g.,
+ * set after it was written) are still classified, which needs no probing, so
+ * they are unset if they should be; one that would have to be cleaned means
+ * the snapshot can't be used.
+ *
+ * @param new_envp where the new environment goes, with room for all of envp
+ *
+ * @return zero if the snapshot can't be used, and nothing was done
+ */
+static int cenv_snapshot_use(cenv_snapshot_t *snap, char **envp, char **new_envp) {
+  unsigned int count = 0, kept = 0, idx;
+  int *whats;
+  while(envp[count]) count++;
+  whats = (int *)malloc(sizeof(int) * (count + 1));
+  if(! whats) fatal("Out of memory error. Could not allocate RAM for the new environment.\n");
+  for(idx = 0; idx < count; idx++) {
+    str_clone(definition, envp[idx]);
+    char *env_value = strchr(definition, '=');
+    whats[idx] = CENV_KEEP;
+    if(env_value && ! cenv_snapshot_find(snap, envp[idx])) {
+      *(env_value++) = '\0';
+      whats[idx] = cenv_classify(definition, env_value);
+      if(CENV_PDIR == whats[idx] || CENV_PFILE == whats[idx]) {
+        verbose(1,("Not using snapshot \"%s\": it has no record of %s\n", opt_load, definition));
+        free(definition);
+        free(whats);
+        return 0;
+      }
+    }
+    free(definition);
+  }
+  for(idx = 0; idx < count; idx++) {
+    cenv_snapshot_record_t *record = cenv_snapshot_find(snap, envp[idx]);
+    const char *value;
+    if(! record) {
+      if(CENV_UNSET != whats[idx]) {
+        new_envp[kept++] = envp[idx];
+      } else if(! cenv_command) {
+        str_clone(env_name, envp[idx]);
+        *strchr(env_name, '=') = '\0';
+        cenv_output_unset(env_name);
+        free(env_name);
+      }
+    } else if(CENV_SNAPSHOT_UNSET == record->definition) {
+      if(! cenv_command) {
+        str_clone(env_name, snap->pool + record->name);
+        cenv_output_unset(env_name);
+        free(env_name);
+      }
+    } else {
+      new_envp[kept++] = (char *)snap->pool + record->definition;
+      value = snap->pool + record->definition + record->name_len + 1;
+      if(! cenv_command && (opt_output_unchanged || ! eq(value, envp[idx] + record->name_len + 1))) {
+        str_clone(env_name, snap->pool + record->name);
+        env_name[record->name_len] = '\0';
+        cenv_output_set(env_name, value);
+        free(env_name);
+      }
     }
   }
+  new_envp[kept] = NULL;
+  free(whats);
+  return 1;
 }
 
 /**
@@ -757,59 +1619,110 @@ int main(int argc, char *argv[], char *envp[] ) {
   uid = getuid();
   gid = getgid();
   /* Get all the stuff on the command-line that was not an option */
-  args_array_t *env_array = cpath_parseargs(argc,argv);
+  cpath_parseargs(argc,argv);
+  pdir_policy.what = "directory";
+  pdir_policy.exclude = opt_pdir_exclude;
+  pdir_policy.include = opt_pdir_include;
+  pdir_policy.exists = opt_pdir_exists;
+  pdir_policy.exec = opt_pdir_exec;
+  pdir_policy.nodupes = opt_pdir_nodupes;
+  pdir_policy.empty = opt_pdir_empty;
+  pdir_policy.delim = opt_pdir_delim;
+  pfile_policy.what = "file";
+  pfile_policy.exclude = opt_pfile_exclude;
+  pfile_policy.include = opt_pfile_include;
+  pfile_policy.exists = opt_pfile_exists;
+  pfile_policy.exec = opt_pfile_exec;
+  pfile_policy.read = opt_pfile_read;
+  pfile_policy.files = 1;
+  pfile_policy.nodupes = opt_pfile_nodupes;
+  pfile_policy.empty = opt_pdir_empty;
+  pfile_policy.delim = opt_pfile_delim;
+  if(opt_compile) {
+    cenv_classes_build(0);
+    return cenv_rules_compile(opt_compile) ? 0 : EXIT_FAILURE;
+  }
+  cenv_classes_build(1);
   /* If we're supposed to include the "verbose" output to STDOUT,
      set it as such in utils.c */
-  if(opt_include_verbose)
+  if(opt_include_verbose && ! cenv_command)
     set_verbose_out(stdout);
+  if(! cenv_command && CPATH_SHELL_NONE != opt_target_shell)
+    sh_comments();
   /* Some vars */
-  unsigned int i,len = env_array->length;
-  /* If we're supposed to look at all variables that end in "PATH", then
-     do it now. */
-  if(opt_all_paths) {
-    debug(2,("Looking for all PATH environment variables\n"));
-    while(*envp) {
-      char *definition = (char*)malloc(sizeof(char) * (strlen(*envp) + 1));
-      if(!definition) fatal("Out of memory error. Could not allocate RAM for env definition.\n");
-      strcpy(definition,*envp);
-      char *env_name = definition;
-      char *cptr = definition;
-      char *env_value = definition;
-      /* Find first '='. NOTE: Should not have to check for '\0' as the envp
-         strings ALWAYS have at least on '=' */
-      while('=' != *cptr) cptr++;
-      /* Terminate env_name */
-      *cptr = '\0';
-      /* env_value should be everything after that */
-      env_value = cptr + 1;
-      debug(3,(" - Checking env_name=\"%s\"\n",env_name));
-      /* Backup to where PATH would be, if there is enough room
-         to back up. Also helps prevent going off in uncharted RAM */
-      if(cptr - env_name >= 4) {
-        cptr -= 4;
-        debug(4,(" - - test string=\"%s\"\n",cptr));
-        if(0 == strcmp(cptr,"PATH")) {
-          debug(3,(" - - Ends in PATH, will use.\n",env_name));
-          cpath_clean_path(opt_delim,env_name,env_value);
-        }
-      }
-      envp++;
-    }
+  unsigned int count = 0, kept = 0, idx;
+  int what;
+  if(opt_keep->length || opt_keep_prefix->length) {
+    keep_allow = cpath_allow_new(opt_keep->length + opt_keep_prefix->length);
+    for(idx = 0; idx < opt_keep->length; idx++)
+      cpath_allow_add(keep_allow, opt_keep->args[idx], 0);
+    for(idx = 0; idx < opt_keep_prefix->length; idx++)
+      cpath_allow_add(keep_allow, opt_keep_prefix->args[idx], 1);
+    if(! cenv_command)
+      unset_pending = cpath_new_args_array_t();
   }
-  if(opt_common_paths) {
-    /* Try to clean the common paths */
-    unsigned int i;
-    for(i=0; *(common_paths[i]); i++) {
-      cpath_clean_path(opt_delim,common_paths[i], getenv(common_paths[i]));
-    }
+  cenv_snapshot_t *snap = NULL;
+  char **new_envp;
+  while(envp[count]) count++;
+  new_envp = (char **)malloc(sizeof(char *) * (count + 1));
+  if(! new_envp) fatal("Out of memory error. Could not allocate RAM for the new environment.\n");
+  if(opt_load && NULL != (snap = cenv_snapshot_load(opt_load, envp, cenv_options_hash())) &&
+     cenv_snapshot_use(snap, envp, new_envp)) {
+    /* Nothing was probed, just applied what was saved */
+    if(cenv_command)
+      return cenv_exec(cenv_command, new_envp);
+    cenv_output_unset_pending();
+    return 0;
   }
-  /* If we were told to do some environment variables on the command-line, do them */
-  if(len) {
-    for(i=0;i<len;i++)
-      cpath_clean_path(opt_delim,env_array->args[i], getenv(env_array->args[i]));
-  } else if(! opt_common_paths && ! opt_all_paths) {
-      /* If there was nothing else on the command-line, clean "PATH" */
-      cpath_clean_path(opt_delim,"PATH", getenv("PATH"));
+  snap = NULL;
+  if(opt_save)
+    snap = cenv_snapshot_new(cenv_options_hash());
+  /* One pass over the environment: each variable is classified once, then
+     unset, cleaned as a directory or file path, or kept */
+  for(; *envp; envp++) {
+    str_clone(definition, *envp);
+    char *env_name = definition;
+    char *env_value = strchr(definition, '=');
+    if(! env_value) {
+      free(definition);
+      continue;
+    }
+    /* Terminate env_name, env_value is everything after the '=' */
+    *(env_value++) = '\0';
+    debug(3,(" - Checking env_name=\"%s\"\n",env_name));
+    what = cenv_classify(env_name, env_value);
+    if(CENV_UNSET == what) {
+      if(snap)
+        cenv_snapshot_add(snap, env_name, env_value, NULL);
+      if(! cenv_command)
+        cenv_output_unset(env_name);
+    } else if(CENV_KEEP != what) {
+      char *new_value = cpath_clean_path(CENV_PFILE == what ? &pfile_policy : &pdir_policy,
+                                         env_name, env_value);
+      if(snap)
+        cenv_snapshot_add(snap, env_name, env_value, new_value);
+      if(cenv_command) {
+        size_t name_len = strlen(env_name);
+        char *new_definition = (char *)malloc(name_len + strlen(new_value) + 2);
+        if(! new_definition) fatal("Out of memory error. Could not allocate RAM for env definition.\n");
+        memcpy(new_definition, env_name, name_len);
+        new_definition[name_len] = '=';
+        strcpy(new_definition + name_len + 1, new_value);
+        new_envp[kept++] = new_definition;
+      } else if(opt_output_unchanged || ! eq(new_value, env_value)) {
+        cenv_output_set(env_name, new_value);
+      }
+      free(new_value);
+    } else if(cenv_command) {
+      new_envp[kept++] = *envp;
+    }
+    free(definition);
   }
+  new_envp[kept] = NULL;
+  if(snap && ! cenv_snapshot_save(snap, opt_save))
+    return EXIT_FAILURE;
+  if(cenv_command)
+    return cenv_exec(cenv_command, new_envp);
+  cenv_output_unset_pending();
   return 0;
 }
@@ -65,6 +65,13 @@ FILE *debug_fh = NULL;
 #define CPATH_SHELL_BASH 1
 #define CPATH_SHELL_CSH  2
 
+/**
+ * What to do with elements the loader or man search on their own anyway
+ */
+#define CPATH_DEFAULTS_KEEP 0
+#define CPATH_DEFAULTS_DROP 1
+#define CPATH_DEFAULTS_LAST 2
+
 /**
  * Using one static global struct seemed neater than having a lot of static
  * globals or passing a struct around everywhere.
@@ -79,6 +86,8 @@ typedef struct path_info_t {
   unsigned int old_directory_count;
   unsigned int new_directory_count;
   char ** directories;
+  unsigned int kept_count;
+  char ** kept;
   char delim;
 } path_info_t;
 static path_info_t path_info;
@@ -99,7 +108,37 @@ static char   opt_delim = ':';
 static int    opt_target_shell = CPATH_SHELL_BASH;
 static int    opt_output_unchanged = 0;
 static int    opt_common_paths = 0;
+static int    opt_prune_content = 0;
+static char  *opt_reorder_by = NULL;
+static int    opt_shadow_report = 0;
+static int    opt_drop_shadowed = 0;
+static int    opt_flatten = 0;
+static char  *opt_view_dir = NULL;
+static args_array_t *opt_hash_cmds;
+static int    opt_which = 0;
+static args_array_t *opt_require_cmds;
+static args_array_t *opt_ld_programs;
+static int    opt_ld_minimize = 0;
+static int    opt_defaults = CPATH_DEFAULTS_KEEP;
+static int    opt_dedupe_jars = 0;
+static int    opt_collapse_jars = 0;
+static size_t opt_budget = 0;
+static char  *opt_budget_rules = NULL;
+static int    opt_env_size = 0;
+static char  *opt_cache_dir = NULL;
+static long   opt_prewarm = 0;
+static int    opt_batch_probe = 0;
+static long   opt_fs_schedule = 0;
+static char  *opt_single_flight = NULL;
+static long   opt_single_flight_wait = -1; /* -1 for CPATH_FLIGHT_WAIT */
+static char  *opt_root = NULL;
+static char  *opt_env_file = NULL;
+static char  *opt_root_batch = NULL;
+static char  *opt_manifest = NULL;
+static char  *opt_compile_manifest = NULL;
+static long   opt_manifest_max_age = 0; /* 0 for CPATH_MANIFEST_MAX_AGE */
 static args_array_t *opt_exclude_match;
+static struct cpath_trie_t *opt_exclude_subtree;
 
 /**
  * Print the start of a comment if needed
@@ -344,6 +383,58 @@ static char *common_paths[] = {
 static uid_t uid;
 static gid_t gid;
 
+#include "cpath-trie.c"
+#include "cpath-scan.c"
+#include "cpath-index.c"
+#include "cpath-view.c"
+#include "cpath-cache.c"
+#include "cpath-elf.c"
+#include "cpath-defaults.c"
+#include "cpath-jar.c"
+#include "cpath-budget.c"
+#include "cpath-mount.c"
+#include "cpath-manifest.c"
+#include "cpath-batch.c"
+#include "cpath-schedule.c"
+#include "cpath-flight.c"
+#include "cpath-root.c"
+
+/**
+ * The --manifest in use, if it's fresh
+ */
+static cpath_manifest_t *manifest = NULL;
+
+/**
+ * What --batch-probe found out about the elements, before cleaning
+ */
+static cpath_batch_t *batch = NULL;
+
+/**
+ * Which elements --fs-schedule has stat()ed concurrently
+ */
+static cpath_sched_t *sched = NULL;
+
+/**
+ * The other cleanpaths on this node we share stat() results with, for
+ * --single-flight
+ */
+static cpath_flight_t *flight = NULL;
+
+/**
+ * The image --root probes in, or -1 for probing the host as usual
+ */
+static int root_fd = -1;
+
+/**
+ * The environment's size, when --budget or --env-size asked for it
+ */
+static cpath_budget_t *env_budget = NULL;
+
+/**
+ * What to exit with, once everything is printed
+ */
+static int exit_status = EXIT_SUCCESS;
+
 
 /**
  * Prints out a (hopefully) useful help menssage
@@ -381,6 +472,9 @@ static void usage() {
          "Environment Variable VALUE Criteria:\n"
          "  -E st = Remove path elements that match the string 'st'. Can specify multiple.\n"
          "          Sorry, no regular expressions supported (yet).\n"
+         "  -S st = Remove path elements at or below the directory 'st', matching whole\n"
+         "          path components only (e.g., -S /sw/legacy removes /sw/legacy/bin but\n"
+         "          not /sw/legacy2/bin). Can specify multiple.\n"
          "  -d'X' = Set the path delimiter to 'X' (default ':').\n"
          "Output Formatting:\n"
          "  -b    = Print bash/sh/dash set compatible export \"FOO=bar\"; definitions\n"
@@ -391,6 +485,11 @@ static void usage() {
          "  -I    = Toggle on/off outputting unchanged variables (default: off)\n"
          "  -k    = Toggle on/off keeping empty PATH components\n"
          "  -n    = Print non-shell set compatible \"FOO=bar\".\n"
+         "  -p    = Toggle on/off dropping directories with nothing the variable could\n"
+         "          use (default: off): PATH dirs without executables, LD_LIBRARY_PATH\n"
+         "          dirs without *.so*, MANPATH dirs without man sections, and\n"
+         "          PYTHONPATH/PERL5LIB/PERLLIB dirs without modules. Unreadable\n"
+         "          directories are kept. Also --prune-content.\n"
          "  -q    = Decrease verbosity by 1. Can be used multiple times.\n"
          "  -r    = Toggle remove duplicate directories (default: on)\n"
          "  -u    = Toggle include only \"usable\" (executable) directories (default: on)\n"
@@ -399,8 +498,180 @@ static void usage() {
          "          scripts (default: off)\n"
          "  -x    = Toggle only allow directories (no files). (default: off)\n"
          "\n"
+         "PATH Optimization (only applied to PATH):\n"
+         "  --shadow-report\n"
+         "        = Toggle on/off printing, for each directory, its position, how many\n"
+         "          executables it holds and how many of those are not shadowed by an\n"
+         "          earlier directory (default: off).\n"
+         "  --drop-shadowed\n"
+         "        = Toggle on/off dropping directories whose executables are all\n"
+         "          shadowed by earlier directories (default: off).\n"
+         "  --reorder-by=FILE\n"
+         "        = Move directories holding frequently used commands earlier in PATH,\n"
+         "          but only where no command would resolve to a different file. FILE\n"
+         "          has one \"COUNT NAME\" pair (e.g., from sort | uniq -c) or one\n"
+         "          command line (e.g., shell history) per line.\n"
+         "\n"
+         "  --require=CMD[,CMD...]\n"
+         "        = Keep only the directories needed to find these commands, in\n"
+         "          their original order, so every one of them still resolves to\n"
+         "          the same file it does with the whole cleaned PATH. For jobs that\n"
+         "          know which commands they run. If any of them is missing, or\n"
+         "          relative elements make it uncertain, PATH is left as it is and\n"
+         "          cleanpath exits non-zero. Can specify multiple.\n"
+         "  --require-file=FILE\n"
+         "        = Same as --require for every command in FILE (one per line).\n"
+         "\n"
+         "  --hash=CMD[,CMD...]\n"
+         "        = After PATH, print bash \"hash -p /full/path CMD\" lines for these\n"
+         "          commands, resolved against the cleaned PATH, so shells that eval\n"
+         "          the output never search PATH for them. Can specify multiple.\n"
+         "          Only for bash output (-b).\n"
+         "  --hash-file=FILE\n"
+         "        = Same as --hash for every command in FILE (one per line).\n"
+         "\n"
+         "  --which CMD [CMD ...]\n"
+         "        = Instead of printing any variables, print the full path of each\n"
+         "          CMD as found in the cleaned PATH, like which(1). Uses an index of\n"
+         "          the PATH directories that is kept between runs and rebuilt when\n"
+         "          any of them changes. Exits non-zero if any CMD is not found.\n"
+         "  --cache-dir=DIR\n"
+         "        = Keep the --which index and jar digests in DIR instead of the default\n"
+         "          ($XDG_CACHE_HOME/cleanpath or ~/.cache/cleanpath).\n"
+         "\n"
+         "Default Directories (only applied to LD_LIBRARY_PATH and MANPATH):\n"
+         "  --defaults=drop|last|keep\n"
+         "        = What to do with elements that the loader or man search on their\n"
+         "          own anyway, i.e. the loader's system directories and everything\n"
+         "          in /etc/ld.so.conf (and its includes) for LD_LIBRARY_PATH, and\n"
+         "          man-db's MANDATORY_MANPATH and MANPATH_MAP directories for\n"
+         "          MANPATH. \"drop\" removes them, \"last\" moves them to the end.\n"
+         "          For MANPATH this only happens if it has an empty element (which\n"
+         "          is where man adds its own), and \"drop\" keeps one at the end.\n"
+         "          Use -v to see why each element was dropped or moved.\n"
+         "          Default: keep.\n"
+         "\n"
+         "LD_LIBRARY_PATH Optimization (only applied to LD_LIBRARY_PATH):\n"
+         "  --ld-simulate=PROGRAM[,PROGRAM...]\n"
+         "        = Read the ELF dynamic sections of PROGRAM and everything it loads\n"
+         "          and replay the dynamic loader's search (RPATH, LD_LIBRARY_PATH,\n"
+         "          RUNPATH, ld.so.cache, system directories) with the cleaned\n"
+         "          LD_LIBRARY_PATH. Prints where each library is found, how many\n"
+         "          open()s fail on the way, and how many would fail with the\n"
+         "          smallest LD_LIBRARY_PATH that finds the same files. Can specify\n"
+         "          multiple.\n"
+         "  --ld-minimize\n"
+         "        = With --ld-simulate, replace LD_LIBRARY_PATH with that smallest\n"
+         "          one, keeping the original order. Only the given programs are\n"
+         "          considered, so anything else that uses LD_LIBRARY_PATH (e.g.,\n"
+         "          dlopen()) may no longer find its libraries.\n"
+         "\n"
+         "CLASSPATH Optimization (only applied to variables ending in CLASSPATH):\n"
+         "  --dedupe-jars\n"
+         "        = Toggle on/off dropping jar (and zip) files whose contents are\n"
+         "          the same as an earlier one's, e.g. the same jar installed under\n"
+         "          several prefixes (default: off). Jars are hashed in parallel\n"
+         "          with a 128 bit non-cryptographic digest that is cached by\n"
+         "          device, inode, size and mtime (see --cache-dir).\n"
+         "  --collapse-jars\n"
+         "        = Toggle on/off replacing a run of consecutive jars that are all\n"
+         "          the jars in one directory with \"DIR/*\" (default: off). The JVM\n"
+         "          expands that in no particular order, so it's only done if no\n"
+         "          two of the jars hold the same class or resource. Use -v to see\n"
+         "          the bytes saved.\n"
+         "\n"
+         "Flattening (only applied to PATH and LD_LIBRARY_PATH):\n"
+         "  --flatten\n"
+         "        = Toggle on/off replacing the cleaned value with a single directory of\n"
+         "          symlinks to the first match for every name in it (default: off).\n"
+         "          The view is rebuilt only when a source directory's mtime changes,\n"
+         "          so other changes (e.g., a chmod of a file in it) are missed until\n"
+         "          then. Programs that find their own files relative to their\n"
+         "          location (e.g., python virtual environments) may not work from a\n"
+         "          view, and library directories with libraries that use $ORIGIN are\n"
+         "          not flattened.\n"
+         "  --view-dir=DIR\n"
+         "        = Keep views in DIR (default: $XDG_RUNTIME_DIR/cleanpath-views or\n"
+         "          /tmp/cleanpath-views-UID).\n"
+         "\n"
+         "Environment Size:\n"
+         "  --env-size\n"
+         "        = Toggle on/off reporting how many bytes the environment costs every\n"
+         "          exec once cleaned, and the largest variables (default: off).\n"
+         "  --budget=BYTES\n"
+         "        = After cleaning, also print what it takes to bring the environment\n"
+         "          under BYTES (K and M suffixes allowed), using --budget-rules.\n"
+         "  --budget-rules=RULES\n"
+         "        = Comma separated rules, tried in order: \"unset:PATTERN\" unsets\n"
+         "          matching variables, \"trim:PATTERN\" drops trailing elements of\n"
+         "          matching path variables. Largest variables go first. PATTERN is\n"
+         "          NAME, PREFIX* or *SUFFIX. Exported bash functions (BASH_FUNC_*)\n"
+         "          are removed with \"unset -f\", or left alone with csh (-c).\n"
+         "          Default:\n"
+         "          %s\n"
+         "\n"
+         "Performance:\n"
+         "  -j N  = Read directories with up to N threads (default: %d).\n"
+         "          Also --jobs=N.\n"
+         "  --prewarm=SECONDS\n"
+         "        = Before cleaning, trigger every automount (autofs) the elements\n"
+         "          need at the same time, and wait for them up to SECONDS (which may\n"
+         "          be fractional), so the wait is about one mount instead of one\n"
+         "          per mount. 0 turns it off (default: 0).\n"
+         "  --batch-probe=N\n"
+         "        = Before cleaning, read each directory that is the parent of N or\n"
+         "          more elements once, and drop the elements it doesn't list\n"
+         "          without stat()ing them. Only elements that are directories, and\n"
+         "          still need their permissions checked, are stat()ed. 0 turns it\n"
+         "          off (default: 0).\n"
+         "  --fs-schedule=SECONDS\n"
+         "        = Before cleaning, stat() the elements on network filesystems (NFS,\n"
+         "          Lustre, GPFS, automounts, ...) with up to -j threads at once, and\n"
+         "          wait for them up to SECONDS. Local elements are stat()ed inline as\n"
+         "          usual. Elements still not stat()ed by then are kept unchecked. With\n"
+         "          -v, reports the time taken per filesystem type. 0 turns it off\n"
+         "          (default: 0).\n"
+         "  --single-flight[=FILE]\n"
+         "        = Share stat() results with the other cleanpaths running on this\n"
+         "          node at the same time (e.g., the ranks of a job), so each element\n"
+         "          is stat()ed by one of them. They coordinate through FILE\n"
+         "          (default: /dev/shm/cleanpath-flight-UID). Results are reused for\n"
+         "          %d seconds.\n"
+         "  --single-flight-wait=SECONDS\n"
+         "        = How long to wait for another cleanpath's stat() before doing it\n"
+         "          ourselves (default: %g).\n"
+         "  --manifest=FILE\n"
+         "        = Keep the elements FILE lists under the prefixes it manages\n"
+         "          without stat()ing them, or checking them for -u or -x. Everything\n"
+         "          else is stat()ed as usual. Not used once it's older than\n"
+         "          --manifest-max-age, or if a managed prefix's mtime changed; an\n"
+         "          element removed deeper down is kept until it's compiled again.\n"
+         "  --compile-manifest=LIST\n"
+         "        = Compile LIST (\"-\" for stdin) into the --manifest FILE, and exit.\n"
+         "          LIST has a path per line, and \"@managed PREFIX\" lines naming\n"
+         "          the prefixes it lists everything under.\n"
+         "  --manifest-max-age=HOURS\n"
+         "        = Maximum age of a manifest (default: %d).\n"
+         "\n"
+         "Images:\n"
+         "  --root=DIR\n"
+         "        = Check elements inside DIR, as a container or chroot using it as\n"
+         "          its root would see them (absolute symlinks point into DIR, and\n"
+         "          relative elements are relative to it). Elements are only\n"
+         "          checked for existence and permissions: -p and the PATH\n"
+         "          Optimization, CLASSPATH Optimization and Flattening options are\n"
+         "          refused, since they would read the host, and the Performance\n"
+         "          options are not used. Needs Linux 5.6 or later.\n"
+         "  --env-file=FILE\n"
+         "        = Clean the environment in FILE (\"NAME=value\" lines) instead of\n"
+         "          ours, e.g., an image's.\n"
+         "  --root-batch=LIST\n"
+         "        = Check many images, up to -j at once. LIST (\"-\" for stdin) has\n"
+         "          a \"ROOT ENV_FILE\" line per image. The output for each image\n"
+         "          follows a \"# ENV_FILE in ROOT\" line, in LIST's order.\n"
+         "\n"
          "Help:\n"
-         "  -h or -? = Print this help message\n"
+         "  -h or -? = Print this help message. Also --help.\n"
          "--------------------------------------------------------------------------------\n"
          "Example usage in bash:\n"
          "\n"
@@ -419,6 +690,11 @@ static void usage() {
          "================================================================================\n"
          , get_progname()
          , get_progname()
+         , CPATH_BUDGET_DEFAULT_RULES
+         , CPATH_SCAN_DEFAULT_JOBS
+         , CPATH_FLIGHT_TTL
+         , CPATH_FLIGHT_WAIT / 1000.0
+         , CPATH_MANIFEST_MAX_AGE
          , '`'
          , get_progname()
          , get_progname()
@@ -435,6 +711,9 @@ static char *cpath_getval(int *idx, char **current_arg, int argc, char *args[])
   // If this is in the form -Abcdf, then use bcdf as the value of -A
   if('\0' != *(*(current_arg) + 1)) {
     next_arg = str_clone(++*(current_arg));
+    /* the rest of this argument was the value, so leave the caller on its
+       last character rather than parsing the value as more options */
+    *(current_arg) += strlen(*(current_arg)) - 1;
   } else {
     // Use next argv as value
     *(idx) += 1;
@@ -462,6 +741,169 @@ static char *cpath_getval(int *idx, char **current_arg, int argc, char *args[])
   return next_arg;
 }
 
+/**
+ * Add every name in a file, one per line, to an args_array. Blank lines and
+ * lines starting with '#' are skipped.
+ *
+ * @param file_name the file to read
+ * @param args_array the args_array_t to which to add them
+ */
+static void cpath_read_names(const char *file_name, args_array_t *args_array) {
+  char line[4096];
+  FILE *fh = fopen(file_name, "r");
+  if(! fh)
+    fatal("Could not read \"%s\": %s\n", file_name, strerror(errno));
+  while(fgets(line, sizeof(line), fh)) {
+    char *start = line, *end;
+    while(isspace((unsigned char)*start)) start++;
+    end = start + strlen(start);
+    while(end > start && isspace((unsigned char)*(end - 1))) end--;
+    *end = '\0';
+    if('\0' != *start && '#' != *start)
+      cpath_add_other_arg(start, args_array);
+  }
+  fclose(fh);
+}
+
+/**
+ * Get the value of a long argument, either from "--name=value" or from the
+ * next argv.
+ *
+ * @param idx the index of the current argument, advanced if the next argv is
+ *        used
+ * @param name the long argument name, without the "--"
+ * @param value what followed the '=', or NULL if there was no '='
+ */
+static char *cpath_long_getval(int *idx, const char *name, char *value, int argc, char *args[]) {
+  if(NULL != value)
+    return str_clone(value);
+  *(idx) += 1;
+  if(*(idx) >= argc)
+    fatal("ERROR: No argument provided for --%s!\n", name);
+  return str_clone(args[*idx]);
+}
+
+/**
+ * Parse one long argument (--name or --name=value).
+ *
+ * @param idx the index of the current argument, advanced if the option's value
+ *        is the next argv
+ * @param this_arg the argument without the leading "--"
+ */
+static void cpath_parse_long_arg(int *idx, char *this_arg, int argc, char *args[]) {
+  char *name = str_clone(this_arg);
+  char *value = strchr(name, '=');
+  if(NULL != value) {
+    *value = '\0';
+    value++;
+  }
+  debug(3, ("cpath_parse_long_arg(\"%s\", \"%s\")\n", name, value ? value : ""));
+  if(eq(name, "help")) {
+    usage();
+    exit(0);
+  } else if(eq(name, "prune-content")) {
+    toggle(opt_prune_content);
+  } else if(eq(name, "shadow-report")) {
+    toggle(opt_shadow_report);
+  } else if(eq(name, "drop-shadowed")) {
+    toggle(opt_drop_shadowed);
+  } else if(eq(name, "hash")) {
+    char *cmds = cpath_long_getval(idx, name, value, argc, args), *cmd;
+    for(cmd = strtok(cmds, ","); cmd; cmd = strtok(NULL, ","))
+      cpath_add_other_arg(cmd, opt_hash_cmds);
+  } else if(eq(name, "hash-file")) {
+    cpath_read_names(cpath_long_getval(idx, name, value, argc, args), opt_hash_cmds);
+  } else if(eq(name, "ld-simulate")) {
+    char *programs = cpath_long_getval(idx, name, value, argc, args), *program;
+    for(program = strtok(programs, ","); program; program = strtok(NULL, ","))
+      cpath_add_other_arg(program, opt_ld_programs);
+  } else if(eq(name, "defaults")) {
+    char *policy = cpath_long_getval(idx, name, value, argc, args);
+    if(eq(policy, "drop"))
+      opt_defaults = CPATH_DEFAULTS_DROP;
+    else if(eq(policy, "last"))
+      opt_defaults = CPATH_DEFAULTS_LAST;
+    else if(eq(policy, "keep"))
+      opt_defaults = CPATH_DEFAULTS_KEEP;
+    else
+      fatal("Unknown --defaults policy \"%s\", use drop, last or keep\n", policy);
+  } else if(eq(name, "dedupe-jars")) {
+    toggle(opt_dedupe_jars);
+  } else if(eq(name, "collapse-jars")) {
+    toggle(opt_collapse_jars);
+  } else if(eq(name, "env-size")) {
+    toggle(opt_env_size);
+  } else if(eq(name, "budget")) {
+    opt_budget = cpath_budget_parse_size(cpath_long_getval(idx, name, value, argc, args));
+  } else if(eq(name, "budget-rules")) {
+    opt_budget_rules = cpath_long_getval(idx, name, value, argc, args);
+    cpath_budget_check_rules(opt_budget_rules);
+  } else if(eq(name, "ld-minimize")) {
+    toggle(opt_ld_minimize);
+  } else if(eq(name, "require")) {
+    char *cmds = cpath_long_getval(idx, name, value, argc, args), *cmd;
+    for(cmd = strtok(cmds, ","); cmd; cmd = strtok(NULL, ","))
+      cpath_add_other_arg(cmd, opt_require_cmds);
+  } else if(eq(name, "require-file")) {
+    cpath_read_names(cpath_long_getval(idx, name, value, argc, args), opt_require_cmds);
+  } else if(eq(name, "which")) {
+    toggle(opt_which);
+  } else if(eq(name, "cache-dir")) {
+    opt_cache_dir = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "flatten")) {
+    toggle(opt_flatten);
+  } else if(eq(name, "view-dir")) {
+    opt_view_dir = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "reorder-by")) {
+    opt_reorder_by = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "manifest")) {
+    opt_manifest = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "compile-manifest")) {
+    opt_compile_manifest = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "manifest-max-age")) {
+    opt_manifest_max_age = atol(cpath_long_getval(idx, name, value, argc, args));
+  } else if(eq(name, "batch-probe")) {
+    char *min_children = cpath_long_getval(idx, name, value, argc, args);
+    char *end;
+    long count = strtol(min_children, &end, 10);
+    if(end == min_children || *end || count < 0)
+      fatal("--batch-probe needs a number of elements, not \"%s\"\n", min_children);
+    opt_batch_probe = (int)count;
+  } else if(eq(name, "root")) {
+    opt_root = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "env-file")) {
+    opt_env_file = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "root-batch")) {
+    opt_root_batch = cpath_long_getval(idx, name, value, argc, args);
+  } else if(eq(name, "single-flight")) {
+    opt_single_flight = value ? str_clone(value) : "";
+  } else if(eq(name, "single-flight-wait")) {
+    char *seconds = cpath_long_getval(idx, name, value, argc, args), *end;
+    double timeout = strtod(seconds, &end);
+    if(end == seconds || '\0' != *end || timeout < 0)
+      fatal("--single-flight-wait needs a number of seconds, not \"%s\"\n", seconds);
+    opt_single_flight_wait = (long)(timeout * 1000);
+  } else if(eq(name, "fs-schedule")) {
+    char *seconds = cpath_long_getval(idx, name, value, argc, args), *end;
+    double timeout = strtod(seconds, &end);
+    if(end == seconds || '\0' != *end || timeout < 0)
+      fatal("--fs-schedule needs a number of seconds, not \"%s\"\n", seconds);
+    opt_fs_schedule = (long)(timeout * 1000);
+  } else if(eq(name, "prewarm")) {
+    char *seconds = cpath_long_getval(idx, name, value, argc, args), *end;
+    double timeout = strtod(seconds, &end);
+    if(end == seconds || '\0' != *end || timeout < 0)
+      fatal("--prewarm needs a number of seconds, not \"%s\"\n", seconds);
+    opt_prewarm = (long)(timeout * 1000);
+  } else if(eq(name, "jobs")) {
+    cpath_scan_set_jobs(atoi(cpath_long_getval(idx, name, value, argc, args)));
+  } else {
+    usage();
+    fatal("Unknown parameter --%s\n", name);
+  }
+  free(name);
+}
+
 static args_array_t * cpath_new_args_array_t(void) {
   args_array_t *args_array = NULL;
   args_array = (args_array_t *)fatal_malloc(sizeof(args_array));
@@ -478,6 +920,10 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
   int i = 0;
   args_array_t *args_array = cpath_new_args_array_t();
   opt_exclude_match = cpath_new_args_array_t();
+  opt_exclude_subtree = cpath_trie_new();
+  opt_hash_cmds = cpath_new_args_array_t();
+  opt_require_cmds = cpath_new_args_array_t();
+  opt_ld_programs = cpath_new_args_array_t();
   for(
       i = 1; /* start at 1, not 0, since args[0] is the string with which
                 this programs was called */
@@ -496,9 +942,8 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
       if('-' == *this_arg) { /* if the argument was a "long" agument as *
                                 specified by using --argname, handle it *
                                 differently */
-        /* Not implemented yet */
-        usage();
-        fatal("Long args are not implemented yet.\n");
+        cpath_parse_long_arg(&i, this_arg + 1, argc, args);
+        continue;
       }
       while(*this_arg) {
         switch(*this_arg) {
@@ -565,11 +1010,25 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
           break;
         case 'E':
           cpath_add_other_arg(cpath_getval(&i, &this_arg, argc, args), opt_exclude_match);
-          verbose(1, ("# Exclude path members matching \"%s\"\n", opt_exclude_match));
+          verbose(1, ("# Exclude path members matching \"%s\"\n",
+                      opt_exclude_match->args[opt_exclude_match->length - 1]));
+          break;
+        case 'S':
+          {
+            char *subtree = cpath_getval(&i, &this_arg, argc, args);
+            cpath_trie_add(opt_exclude_subtree, subtree);
+            verbose(1, ("# Exclude path members at or below \"%s\"\n", subtree));
+          }
           break;
         case 'k':
           toggle(opt_discard_empty);
           break;
+        case 'p':
+          toggle(opt_prune_content);
+          break;
+        case 'j':
+          cpath_scan_set_jobs(atoi(cpath_getval(&i, &this_arg, argc, args)));
+          break;
         default:
           usage();
           fatal("Unknown parameter -%c\n", *this_arg);
@@ -652,6 +1111,7 @@ int cpath_can_exec_dir(struct stat * file_stat) {
  */
 unsigned char cpath_should_add(char *current_file_or_dir, unsigned int hash) {
   struct stat file_stat;
+  int probed;
   debug(3, ("cpath_should_add(\"%s\", %u)\n", current_file_or_dir, hash));
   /* if we don't keep empty dirs, don't bother with the rest */
   if(opt_discard_empty && '\0' == *current_file_or_dir) {
@@ -670,6 +1130,15 @@ unsigned char cpath_should_add(char *current_file_or_dir, unsigned int hash) {
       }
     }
   }
+  /* All subtree rules are checked in one walk over the element's components */
+  if(opt_exclude_subtree->rule_count > 0) {
+    const char *subtree = cpath_trie_match(opt_exclude_subtree, current_file_or_dir);
+    if(NULL != subtree) {
+      verbose(2, ("# Removing \"%s\" (at or below '%s')\n",
+                 current_file_or_dir, subtree));
+      return 0;
+    }
+  }
   if( opt_remove_dupes && cpath_seen_before(current_file_or_dir, hash) ) {
     /* don't do anything with this dir */
     verbose(2, ("# Ignoring duplicate file or directory \"%s\"\n",
@@ -678,9 +1147,42 @@ unsigned char cpath_should_add(char *current_file_or_dir, unsigned int hash) {
   }
   if ((0 == strcmp("", current_file_or_dir)) && (! opt_discard_empty)) {
     verbose(2, ("# Keeping Empty PATH component \"%s\"\n", current_file_or_dir));
+    return 1;
   } else {
     if (opt_only_executable_dirs || opt_check_exists) {
-      if(0 != stat(current_file_or_dir, &file_stat)) {
+      /* listed elements are trusted, anything else is stat()ed below */
+      if(manifest && cpath_manifest_lists(manifest, current_file_or_dir)) {
+        verbose(2, ("# Keeping \"%s\" (in the manifest)\n", current_file_or_dir));
+        return 1;
+      }
+      if(batch) {
+        switch(cpath_batch_lookup(batch, current_file_or_dir, hash)) {
+        case CPATH_BATCH_MISSING:
+          verbose(2, ("# Ignoring non-existent file or directory \"%s\"\n", current_file_or_dir));
+          return 0;
+        case CPATH_BATCH_OTHER:
+          if(opt_dirs_only) {
+            verbose(2, ("# Ignoring non-directory \"%s\"\n", current_file_or_dir));
+            return 0;
+          }
+          return 1;
+        case CPATH_BATCH_DIR:
+          /* only the permissions are left to check */
+          if(! opt_only_executable_dirs)
+            return 1;
+          break;
+        }
+      }
+      probed = flight ? cpath_flight_stat(flight, current_file_or_dir, hash, &file_stat) : CPATH_FLIGHT_UNKNOWN;
+      if(CPATH_FLIGHT_UNKNOWN == probed)
+        probed = sched ? cpath_sched_stat(sched, current_file_or_dir, hash, &file_stat) :
+          root_fd >= 0 ? cpath_root_stat(root_fd, current_file_or_dir, &file_stat) :
+          stat(current_file_or_dir, &file_stat);
+      if(CPATH_SCHED_LATE == probed) {
+        verbose(1, ("# Keeping \"%s\" unchecked, its filesystem didn't answer in time\n", current_file_or_dir));
+        return 1;
+      }
+      if(0 != probed) {
 	/* if we're only supposed to check if directories exist, and it
 	   doen't we let someone know if needed, and skip it */
 	verbose(2, ("# Ignoring non-existent file or directory \"%s\"\n",
@@ -728,21 +1230,27 @@ void cpath_add_if(char *current_file_or_dir, unsigned int hash) {
     debug(4, ("cpath_add_if: - Before trimming: \"%s\"\n", current_file_or_dir));
     /* move to end of string */
     while(*char_ptr) char_ptr ++;
-    /* back up one (b/c were at the null char */
-    char_ptr --;
-    /* back up over all trailing slashes "/" */
-    while('/' == *char_ptr ) char_ptr --;
-    /* move forward one */
-    char_ptr ++;
-    /* terminate string here. */
-    *char_ptr = '\0';
+    /* back up over all trailing slashes "/", but leave "/" itself alone */
+    while(char_ptr > current_file_or_dir + 1 && '/' == *(char_ptr - 1)) char_ptr --;
+    if(*char_ptr) {
+      /* terminate string here, and hash what's left so "/usr/bin/" is a
+         duplicate of "/usr/bin" */
+      *char_ptr = '\0';
+      hash = 5381;
+      for(char_ptr = current_file_or_dir; *char_ptr; char_ptr++)
+        hash = ((hash << 5) + hash) + *char_ptr;
+    }
     debug(4, ("cpath_add_if: - After  trimming: \"%s\"\n", current_file_or_dir));
   } /* End isolated block */
   if( cpath_should_add(current_file_or_dir, hash) ){
     debug(3, ("Adding \"%s\"\n", current_file_or_dir));
+    /* remember it for anything that works on the whole cleaned path */
+    path_info.kept[path_info.kept_count] = current_file_or_dir;
+    path_info.kept_count ++;
     /* If we're not at the start of the new path string, then we need
-       to add a "delim" separator for this directory */
-    if(path_info.new_path_string_ptr != path_info.new_path_string) {
+       to add a "delim" separator for this directory. An empty element
+       that is kept first needs one too, or it would vanish. */
+    if(path_info.new_path_string_ptr != path_info.new_path_string || path_info.kept_count > 1) {
       debug(5, (" - adding delim '%c' to new_path=\"%s\"\n", path_info.delim, path_info.new_path_string));
       *(path_info.new_path_string_ptr) = path_info.delim;
       path_info.new_path_string_ptr ++;
@@ -760,6 +1268,917 @@ void cpath_add_if(char *current_file_or_dir, unsigned int hash) {
   debug(5, ("cpath_add_if: after new_path = \"%s\"\n", path_info.new_path_string));
 }
 
+/**
+ * Rebuild path_info.new_path_string from path_info.kept, after something
+ * removed (or reordered, or replaced) kept elements.
+ */
+static void cpath_rebuild_new_path(void) {
+  size_t len = 1;
+  unsigned int idx;
+  char *cptr;
+  for(idx = 0; idx < path_info.kept_count; idx++)
+    len += strlen(path_info.kept[idx]) + 1;
+  free(path_info.new_path_string);
+  path_info.new_path_string = (char *)fatal_malloc(len);
+  cptr = path_info.new_path_string;
+  for(idx = 0; idx < path_info.kept_count; idx++) {
+    const char *element = path_info.kept[idx];
+    if(idx)
+      *(cptr++) = path_info.delim;
+    while(*element)
+      *(cptr++) = *(element++);
+  }
+  *cptr = '\0';
+  path_info.new_path_string_ptr = cptr;
+}
+
+/**
+ * Drop kept directories that hold nothing the variable could use, based on
+ * the variable's name (see cpath_scan_kind()). All directories are read in
+ * parallel before any are dropped.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_prune_content(const char *env_name) {
+  int kind = cpath_scan_kind(env_name);
+  unsigned int idx, count = 0, kept_count = 0;
+  cpath_scan_t **scans = NULL;
+  if(CPATH_KIND_NONE == kind) {
+    verbose(3, ("# No content rules for %s, not pruning\n", env_name));
+    return;
+  }
+  scans = (cpath_scan_t **)fatal_malloc(sizeof(cpath_scan_t *) * (path_info.kept_count + 1));
+  for(idx = 0; idx < path_info.kept_count; idx++) {
+    /* empty components are only here if we were asked to keep them */
+    if('\0' != *path_info.kept[idx])
+      scans[count++] = cpath_scan_get(path_info.kept[idx], kind);
+  }
+  cpath_scan_run(scans, count);
+  count = 0;
+  for(idx = 0; idx < path_info.kept_count; idx++) {
+    char *element = path_info.kept[idx];
+    if('\0' != *element) {
+      cpath_scan_t *scan = scans[count++];
+      if(CPATH_SCAN_UNREADABLE == scan->status) {
+        verbose(2, ("# Keeping unreadable \"%s\" (%s)\n", element, strerror(scan->error)));
+      } else if(0 == scan->matches) {
+        verbose(2, ("# Ignoring \"%s\" (no %s in %u entries)\n", element,
+                   cpath_scan_kind_name(kind), scan->entries));
+        continue;
+      }
+    }
+    path_info.kept[kept_count++] = element;
+  }
+  free(scans);
+  if(kept_count != path_info.kept_count) {
+    path_info.kept_count = kept_count;
+    cpath_rebuild_new_path();
+  }
+}
+
+/**
+ * Report and/or drop PATH directories that contribute nothing because every
+ * executable they hold is found in an earlier directory first. Dropping them
+ * can't change what any command resolves to, but saves a probe for each of
+ * them on every miss. Directories we could not read are never dropped, and
+ * neither are empty ones (see -p for those).
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_drop_shadowed(const char *env_name) {
+  unsigned int count = path_info.kept_count, pos, kept_count = 0;
+  cpath_index_t *index;
+  if(CPATH_KIND_EXEC != cpath_scan_kind(env_name)) {
+    verbose(3, ("# Not looking for shadowed directories in %s, it's not a PATH\n", env_name));
+    return;
+  }
+  index = cpath_index_build(path_info.kept, count, CPATH_KIND_EXEC);
+  if(opt_shadow_report) {
+    verbose_out("%s shadowing report (%u directories, %u distinct executables):\n",
+                env_name, count, index->name_count);
+    verbose_out("%5s %8s %8s  %-9s %s\n", "POS", "EXECS", "UNIQUE", "STATUS", "DIRECTORY");
+  }
+  for(pos = 0; pos < count; pos++) {
+    char *element = path_info.kept[pos];
+    const char *status = "ok";
+    unsigned int execs = index->scans[pos] ? index->scans[pos]->matches : 0;
+    int drop = 0;
+    if(! index->scans[pos]) {
+      status = "unknown";
+    } else if(0 == execs) {
+      status = "empty";
+    } else if(0 == index->unique[pos]) {
+      status = "shadowed";
+      drop = opt_drop_shadowed;
+    }
+    if(opt_shadow_report) {
+      if(index->scans[pos])
+        verbose_out("%5u %8u %8u  %-9s %s\n", pos + 1, execs, index->unique[pos], status, element);
+      else
+        verbose_out("%5u %8s %8s  %-9s %s\n", pos + 1, "-", "-", status, element);
+    }
+    if(drop) {
+      verbose(2, ("# Ignoring \"%s\" (all %u executables shadowed)\n", element, execs));
+      continue;
+    }
+    path_info.kept[kept_count++] = element;
+  }
+  cpath_index_free(index);
+  if(kept_count != path_info.kept_count) {
+    path_info.kept_count = kept_count;
+    cpath_rebuild_new_path();
+  }
+}
+
+/**
+ * Add command use counts from a file to the index. Each line is either
+ * "COUNT NAME" or a command line whose first word is counted once, which
+ * covers `sort | uniq -c` output, accounting summaries and shell history.
+ * Lines starting with '#' (including bash history timestamps) are skipped,
+ * as are names with a '/' since those are never looked up in PATH.
+ *
+ * @param index the executable index of the path being optimized
+ * @param file_name the frequency file
+ *
+ * @return the total number of uses of commands found in the index
+ */
+static unsigned long cpath_load_frequencies(cpath_index_t *index, const char *file_name) {
+  char line[4096];
+  unsigned long total = 0;
+  FILE *fh = fopen(file_name, "r");
+  if(! fh)
+    fatal("Could not read command frequency file \"%s\": %s\n", file_name, strerror(errno));
+  while(fgets(line, sizeof(line), fh)) {
+    char *cptr = line, *name = NULL;
+    unsigned long count = 1;
+    cpath_index_name_t *entry;
+    /* only the start of overly long lines matters, skip the rest */
+    if(NULL == strchr(line, '\n')) {
+      int chr;
+      while(EOF != (chr = fgetc(fh)) && '\n' != chr);
+    }
+    while(isspace((unsigned char)*cptr)) cptr++;
+    if('#' == *cptr || '\0' == *cptr)
+      continue;
+    name = cptr;
+    while(*cptr && ! isspace((unsigned char)*cptr)) cptr++;
+    if(isdigit((unsigned char)*name) && cptr == name + strspn(name, "0123456789")) {
+      /* "COUNT NAME" */
+      count = strtoul(name, NULL, 10);
+      while(isspace((unsigned char)*cptr)) cptr++;
+      name = cptr;
+      while(*cptr && ! isspace((unsigned char)*cptr)) cptr++;
+    }
+    *cptr = '\0';
+    if('\0' == *name || NULL != strchr(name, '/'))
+      continue;
+    entry = cpath_index_find(index, name);
+    if(entry) {
+      entry->count += count;
+      total += count;
+    }
+  }
+  fclose(fh);
+  return total;
+}
+
+/**
+ * Move directories that hold frequently used commands earlier, without
+ * changing what any command resolves to.
+ *
+ * If two directories hold the same name, the one it resolves to must stay
+ * ahead of the other. Directories whose contents we don't know keep their
+ * place relative to every other directory. Within those constraints
+ * directories are placed greedily by how often their commands are used,
+ * where a directory that has to come before a hot one counts as being as hot
+ * as it. The result is checked against the original resolution of every name
+ * before it's used.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_reorder_by_frequency(const char *env_name) {
+  unsigned int count = path_info.kept_count, pos, other, idx, placed_count;
+  int unchanged = 1;
+  unsigned char *before, *placed;
+  unsigned int *pred_count, *order;
+  unsigned long *hot, *priority, total, probes_before = 0, probes_after = 0;
+  cpath_index_t *index;
+  char **reordered;
+  if(CPATH_KIND_EXEC != cpath_scan_kind(env_name)) {
+    verbose(3, ("# Not reordering %s, it's not a PATH\n", env_name));
+    return;
+  }
+  if(count < 2)
+    return;
+  index = cpath_index_build(path_info.kept, count, CPATH_KIND_EXEC);
+  total = cpath_load_frequencies(index, opt_reorder_by);
+  verbose(2, ("# %lu uses of %u indexed commands in \"%s\"\n", total,
+             index->name_count, opt_reorder_by));
+  if(0 == total) {
+    cpath_index_free(index);
+    return;
+  }
+  /* before[pos * count + other] means pos must stay ahead of other */
+  before = (unsigned char *)calloc((size_t)count * count, 1);
+  placed = (unsigned char *)calloc(count, 1);
+  pred_count = (unsigned int *)calloc(count, sizeof(unsigned int));
+  order = (unsigned int *)calloc(count, sizeof(unsigned int));
+  hot = (unsigned long *)calloc(count, sizeof(unsigned long));
+  priority = (unsigned long *)calloc(count, sizeof(unsigned long));
+  if(! before || ! placed || ! pred_count || ! order || ! hot || ! priority)
+    fatal("Unable to allocate RAM for reordering %s.\n", env_name);
+  for(idx = 0; idx < index->slot_count; idx++) {
+    cpath_index_name_t *entry = &index->slots[idx];
+    if(entry->name) {
+      hot[entry->first] += entry->count;
+      probes_before += entry->count * (entry->first + 1);
+    }
+  }
+  for(pos = 0; pos < count; pos++) {
+    if(index->scans[pos]) {
+      for(idx = 0; idx < index->scans[pos]->matches; idx++) {
+        cpath_index_name_t *entry = cpath_index_find(index, index->scans[pos]->names[idx]);
+        if(entry->first != pos)
+          before[entry->first * count + pos] = 1;
+      }
+    } else {
+      /* unknown contents, nothing may cross it */
+      for(other = 0; other < count; other++) {
+        if(other < pos)
+          before[other * count + pos] = 1;
+        else if(other > pos)
+          before[pos * count + other] = 1;
+      }
+    }
+  }
+  /* Constraints always point from earlier to later, so one backwards pass
+     is enough to pull everything a directory depends on up with it. */
+  for(pos = count; pos-- > 0;) {
+    priority[pos] = hot[pos];
+    for(other = pos + 1; other < count; other++) {
+      if(before[pos * count + other]) {
+        pred_count[other]++;
+        if(priority[other] > priority[pos])
+          priority[pos] = priority[other];
+      }
+    }
+  }
+  for(placed_count = 0; placed_count < count; placed_count++) {
+    unsigned int best = CPATH_INDEX_NONE;
+    for(pos = 0; pos < count; pos++) {
+      if(placed[pos] || pred_count[pos])
+        continue;
+      if(CPATH_INDEX_NONE == best ||
+         priority[pos] > priority[best] ||
+         (priority[pos] == priority[best] && hot[pos] > hot[best]))
+        best = pos;
+    }
+    if(CPATH_INDEX_NONE == best)
+      fatal("Reordering %s found a cycle. This should not be possible.\n", env_name);
+    placed[best] = 1;
+    order[placed_count] = best;
+    for(other = best + 1; other < count; other++)
+      if(before[best * count + other])
+        pred_count[other]--;
+  }
+  /* Prove nothing resolves differently: walk the new order the way a PATH
+     search would and compare with the original resolution. */
+  for(idx = 0; unchanged && idx < count; idx++) {
+    pos = order[idx];
+    if(! index->scans[pos])
+      continue;
+    for(other = 0; other < index->scans[pos]->matches; other++) {
+      cpath_index_name_t *entry = cpath_index_find(index, index->scans[pos]->names[other]);
+      if(CPATH_INDEX_NONE == entry->scratch) {
+        entry->scratch = pos;
+        if(entry->first != pos) {
+          verbose(1, ("# Not reordering %s: \"%s\" would resolve to \"%s\" instead of \"%s\"\n",
+                     env_name, entry->name, path_info.kept[pos], path_info.kept[entry->first]));
+          unchanged = 0;
+          break;
+        }
+        probes_after += entry->count * (idx + 1);
+      }
+    }
+  }
+  if(unchanged) {
+    verbose(1, ("# Reordering %s: %lu directory probes for %lu command uses before, %lu after\n",
+               env_name, probes_before, total, probes_after));
+  }
+  if(unchanged && probes_after < probes_before) {
+    reordered = (char **)fatal_malloc(sizeof(char *) * (count + 1));
+    for(idx = 0; idx < count; idx++) {
+      pos = order[idx];
+      if(idx != pos)
+        verbose(2, ("# Moving \"%s\" from %u to %u (%lu uses)\n", path_info.kept[pos],
+                   pos + 1, idx + 1, hot[pos]));
+      reordered[idx] = path_info.kept[pos];
+    }
+    memcpy(path_info.kept, reordered, sizeof(char *) * count);
+    free(reordered);
+    cpath_rebuild_new_path();
+  }
+  free(before);
+  free(placed);
+  free(pred_count);
+  free(order);
+  free(hot);
+  free(priority);
+  cpath_index_free(index);
+}
+
+/**
+ * Cut PATH down to the directories the --require commands resolve to. A
+ * directory before one of those that held the same command would have been
+ * the answer instead, so dropping all the others can't change where any of
+ * them resolve. The result is checked anyway.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_require_commands(const char *env_name) {
+  unsigned int count = path_info.kept_count, pos, idx, minimal_count = 0;
+  unsigned int *resolved;
+  cpath_index_t *index;
+  char **minimal;
+  int *needed, complete = 1;
+  if(CPATH_KIND_EXEC != cpath_scan_kind(env_name)) {
+    verbose(3, ("# Not keeping only required directories in %s, it's not a PATH\n", env_name));
+    return;
+  }
+  needed = (int *)calloc(count + 1, sizeof(int));
+  resolved = (unsigned int *)fatal_malloc(sizeof(unsigned int) * opt_require_cmds->length);
+  minimal = (char **)fatal_malloc(sizeof(char *) * (count + 1));
+  if(! needed) fatal("Unable to allocate RAM for required commands.\n");
+  index = cpath_index_build(path_info.kept, count, CPATH_KIND_EXEC);
+  for(idx = 0; idx < opt_require_cmds->length; idx++) {
+    const char *cmd = opt_require_cmds->args[idx];
+    int uncertain = 0;
+    resolved[idx] = cpath_index_resolve(index, cmd, &uncertain);
+    if(CPATH_INDEX_NONE == resolved[idx]) {
+      verbose(0, ("# Required command \"%s\" is not in %s, keeping %s as is\n", cmd, env_name, env_name));
+      complete = 0;
+    } else if(uncertain) {
+      verbose(0, ("# Required command \"%s\" may resolve elsewhere from other directories, %s has relative "
+                  "elements, keeping it as is\n", cmd, env_name));
+      complete = 0;
+    } else {
+      verbose(2, ("# Required command \"%s\" is in \"%s\"\n", cmd, path_info.kept[resolved[idx]]));
+      needed[resolved[idx]] = 1;
+    }
+  }
+  cpath_index_free(index);
+  /* never drop anything on a partial answer */
+  if(! complete) {
+    exit_status = EXIT_FAILURE;
+    free(needed);
+    free(resolved);
+    free(minimal);
+    return;
+  }
+  for(pos = 0; pos < count; pos++) {
+    if(needed[pos])
+      minimal[minimal_count++] = path_info.kept[pos];
+    else
+      verbose(2, ("# Ignoring \"%s\" (no required command resolves to it)\n", path_info.kept[pos]));
+  }
+  /* make sure, the scans are cached so this is cheap */
+  index = cpath_index_build(minimal, minimal_count, CPATH_KIND_EXEC);
+  for(idx = 0; idx < opt_require_cmds->length; idx++) {
+    int uncertain = 0;
+    unsigned int now = cpath_index_resolve(index, opt_require_cmds->args[idx], &uncertain);
+    if(CPATH_INDEX_NONE == now || ! eq(minimal[now], path_info.kept[resolved[idx]])) {
+      verbose(1, ("# \"%s\" would resolve differently with only the required directories, keeping %s as is\n",
+                  opt_require_cmds->args[idx], env_name));
+      minimal_count = count;
+      break;
+    }
+  }
+  cpath_index_free(index);
+  if(minimal_count != count) {
+    verbose(1, ("# Kept %u of %u directories in %s for %u required commands\n", minimal_count, count,
+                env_name, opt_require_cmds->length));
+    memcpy(path_info.kept, minimal, sizeof(char *) * minimal_count);
+    path_info.kept_count = minimal_count;
+    cpath_rebuild_new_path();
+  }
+  free(needed);
+  free(resolved);
+  free(minimal);
+}
+
+/**
+ * Drop jars whose contents are the same as an earlier jar's. The JVM would
+ * open and index every copy, but can only ever load classes from the first.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_dedupe_jars(const char *env_name) {
+  unsigned int count = path_info.kept_count, pos, idx, jar_count = 0, kept_count = 0;
+  unsigned int *jar_pos;
+  char **paths;
+  cpath_jar_t *jars;
+  if(! cpath_jar_is_classpath(env_name)) {
+    verbose(3, ("# Not looking for duplicate jars in %s, it's not a CLASSPATH\n", env_name));
+    return;
+  }
+  jar_pos = (unsigned int *)fatal_malloc(sizeof(unsigned int) * (count + 1));
+  paths = (char **)fatal_malloc(sizeof(char *) * (count + 1));
+  for(pos = 0; pos < count; pos++) {
+    jar_pos[pos] = CPATH_INDEX_NONE;
+    if(cpath_jar_is_jar(path_info.kept[pos])) {
+      jar_pos[pos] = jar_count;
+      paths[jar_count++] = path_info.kept[pos];
+    }
+  }
+  if(jar_count < 2) {
+    free(jar_pos);
+    free(paths);
+    return;
+  }
+  if(! opt_cache_dir)
+    opt_cache_dir = cpath_cache_default_dir();
+  jars = cpath_jar_digests(paths, jar_count, opt_cache_dir);
+  for(pos = 0; pos < count; pos++) {
+    cpath_jar_t *jar = CPATH_INDEX_NONE == jar_pos[pos] ? NULL : &jars[jar_pos[pos]];
+    int duplicate = 0;
+    if(jar && CPATH_JAR_OK == jar->status) {
+      for(idx = 0; idx < jar_pos[pos] && ! duplicate; idx++) {
+        cpath_jar_t *earlier = &jars[idx];
+        /* dropped ones are marked unreadable so each jar is only shown once */
+        if(CPATH_JAR_OK == earlier->status && earlier->key.size == jar->key.size &&
+           earlier->key.digest[0] == jar->key.digest[0] && earlier->key.digest[1] == jar->key.digest[1]) {
+          verbose(1, ("# Ignoring \"%s\" (same contents as \"%s\")\n", jar->path, earlier->path));
+          duplicate = 1;
+        }
+      }
+    } else if(jar) {
+      verbose(2, ("# Keeping \"%s\", unable to read it: %s\n", jar->path, strerror(jar->error)));
+    }
+    if(duplicate)
+      jar->status = CPATH_JAR_UNREADABLE;
+    else
+      path_info.kept[kept_count++] = path_info.kept[pos];
+  }
+  if(kept_count != count) {
+    path_info.kept_count = kept_count;
+    cpath_rebuild_new_path();
+  }
+  free(jars);
+  free(jar_pos);
+  free(paths);
+}
+
+/**
+ * Replace the jars from element start up to (not including) end, which are
+ * all in the same directory, with the directory's wildcard if that means the
+ * same thing to the JVM: they have to be all the jars the wildcard expands to, and
+ * since it expands them in no particular order, no two of them may hold the
+ * same class or resource.
+ *
+ * @param dir_len the length of the directory part of the elements, including
+ *        the trailing '/'
+ *
+ * @return the wildcard, or NULL to keep the jars as they are
+ */
+static char *cpath_collapse_run(unsigned int start, unsigned int end, size_t dir_len) {
+  unsigned int run_count = end - start, name_count, idx, pos;
+  char *dir = (char *)fatal_malloc(dir_len + 2), *why = NULL, *wildcard = NULL;
+  char **names;
+  int all = 1;
+  memcpy(dir, path_info.kept[start], dir_len);
+  dir[dir_len] = '\0';
+  names = cpath_jar_wildcard(dir, &name_count);
+  if(! names) {
+    verbose(2, ("# Not collapsing jars in \"%s\", unable to read it: %s\n", dir, strerror(errno)));
+    free(dir);
+    return NULL;
+  }
+  all = name_count == run_count;
+  for(idx = 0; idx < name_count && all; idx++) {
+    for(pos = start; pos < end; pos++)
+      if(eq(path_info.kept[pos] + dir_len, names[idx]))
+        break;
+    all = pos < end;
+  }
+  if(! all) {
+    verbose(2, ("# Not collapsing %u jars in \"%s\", the directory has %u jars\n", run_count, dir,
+                name_count));
+  } else if(run_count > 1 && ! cpath_jar_disjoint(path_info.kept + start, run_count, &why)) {
+    verbose(1, ("# Not collapsing the jars in \"%s\", their order matters: %s\n", dir, why));
+  } else {
+    dir[dir_len] = '*';
+    dir[dir_len + 1] = '\0';
+    wildcard = dir;
+  }
+  for(idx = 0; idx < name_count; idx++)
+    free(names[idx]);
+  free(names);
+  free(why);
+  if(! wildcard)
+    free(dir);
+  return wildcard;
+}
+
+/**
+ * Shrink a CLASSPATH by replacing runs of jars that are all the jars in a
+ * directory with a wildcard (see cpath_collapse_run()).
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_collapse_jars(const char *env_name) {
+  unsigned int count = path_info.kept_count, pos = 0, end, kept_count = 0, collapsed = 0, wildcards = 0;
+  size_t saved = 0;
+  if(! cpath_jar_is_classpath(env_name)) {
+    verbose(3, ("# Not collapsing jars in %s, it's not a CLASSPATH\n", env_name));
+    return;
+  }
+  while(pos < count) {
+    const char *element = path_info.kept[pos], *slash = strrchr(element, '/');
+    size_t dir_len = slash ? (size_t)(slash - element + 1) : 0, run_len;
+    char *wildcard;
+    if(! cpath_jar_in_wildcard(element + dir_len)) {
+      path_info.kept[kept_count++] = path_info.kept[pos++];
+      continue;
+    }
+    run_len = strlen(element);
+    for(end = pos + 1; end < count; end++) {
+      const char *next = path_info.kept[end];
+      if(0 != strncmp(next, element, dir_len) || strchr(next + dir_len, '/') ||
+         ! cpath_jar_in_wildcard(next + dir_len))
+        break;
+      run_len += strlen(next) + 1;
+    }
+    wildcard = cpath_collapse_run(pos, end, dir_len);
+    if(wildcard) {
+      verbose(2, ("# Collapsed %u jars into \"%s\"\n", end - pos, wildcard));
+      collapsed += end - pos;
+      wildcards++;
+      saved += run_len - strlen(wildcard);
+      path_info.kept[kept_count++] = wildcard;
+    } else {
+      while(pos < end)
+        path_info.kept[kept_count++] = path_info.kept[pos++];
+    }
+    pos = end;
+  }
+  if(wildcards) {
+    verbose(1, ("# Collapsed %u jars into %u wildcard%s in %s, saving %lu bytes\n", collapsed,
+                wildcards, 1 == wildcards ? "" : "s", env_name, (unsigned long)saved));
+    path_info.kept_count = kept_count;
+    cpath_rebuild_new_path();
+  }
+}
+
+/**
+ * Drop, or move to the end, the elements that only repeat a place the loader
+ * (LD_LIBRARY_PATH) or man (MANPATH) searches on its own anyway, so a miss
+ * isn't looked for there twice.
+ *
+ * Once MANPATH is set, man only adds its own directories where MANPATH has an
+ * empty element, so without one nothing is searched twice and nothing is
+ * done.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_elide_defaults(const char *env_name) {
+  static cpath_defaults_t *lib_defaults = NULL;
+  static cpath_defaults_t *man_defaults = NULL;
+  int kind = cpath_scan_kind(env_name);
+  unsigned int pos, kept_count = 0, moved_count = 0, count = path_info.kept_count, last;
+  int has_empty = 0;
+  cpath_defaults_t *defaults;
+  char **moved;
+  if(CPATH_KIND_LIB == kind) {
+    if(! lib_defaults)
+      lib_defaults = cpath_defaults_lib();
+    defaults = lib_defaults;
+  } else if(CPATH_KIND_MAN == kind) {
+    const char *old = path_info.old_path_string, *cptr;
+    int has_empty = '\0' == *old || path_info.delim == *old;
+    for(cptr = old; *cptr && ! has_empty; cptr++)
+      if(path_info.delim == *cptr && (path_info.delim == cptr[1] || '\0' == cptr[1]))
+        has_empty = 1;
+    if(! has_empty) {
+      verbose(2, ("# Not eliding defaults from %s, it has no empty element so man doesn't add its own\n",
+                  env_name));
+      return;
+    }
+    if(! man_defaults)
+      man_defaults = cpath_defaults_man();
+    defaults = man_defaults;
+  } else {
+    verbose(3, ("# Not eliding defaults from %s, it's not LD_LIBRARY_PATH or MANPATH\n", env_name));
+    return;
+  }
+  /* the last element that stays, the ones dropped or moved before it were
+     searched before it and now aren't, which can change what is found */
+  for(last = count; last > 0 && 0 <= cpath_defaults_find(defaults, path_info.kept[last - 1]); last--);
+  moved = (char **)fatal_malloc(sizeof(char *) * (count + 1));
+  for(pos = 0; pos < count; pos++) {
+    char *element = path_info.kept[pos];
+    int found = cpath_defaults_find(defaults, element);
+    if(found < 0) {
+      path_info.kept[kept_count++] = element;
+      if('\0' == *element)
+        has_empty = 1;
+      continue;
+    }
+    if(CPATH_DEFAULTS_DROP == opt_defaults) {
+      verbose(1, ("# Dropping \"%s\" from %s, it's %s (\"%s\")\n", element, env_name,
+                  defaults->why[found], defaults->paths[found]));
+    } else {
+      verbose(1, ("# Moving \"%s\" to the end of %s, it's %s (\"%s\")\n", element, env_name,
+                  defaults->why[found], defaults->paths[found]));
+      moved[moved_count++] = element;
+    }
+    if(pos + 1 < last)
+      verbose(1, ("# \"%s\" is now searched after \"%s\", which can change what %s finds\n", element,
+                  path_info.kept[last - 1], env_name));
+  }
+  if(kept_count == count) {
+    free(moved);
+    return;
+  }
+  for(pos = 0; pos < moved_count; pos++)
+    path_info.kept[kept_count++] = moved[pos];
+  /* man has to be told to add its own where the dropped ones were, unless
+     an empty element is kept (-k) already */
+  if(CPATH_KIND_MAN == kind && CPATH_DEFAULTS_DROP == opt_defaults && ! has_empty)
+    path_info.kept[kept_count++] = "";
+  path_info.kept_count = kept_count;
+  cpath_rebuild_new_path();
+  free(moved);
+}
+
+/**
+ * Simulate the dynamic loader for the --ld-simulate programs, report how
+ * many open()s fail, and work out the smallest LD_LIBRARY_PATH that resolves
+ * every library to the same file: just the elements some library is found
+ * in. Any element before those that holds the same name would have been
+ * found first, so dropping everything else can't change what is found, but
+ * every simulation is replayed with the smaller path to make sure.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_ld_simulate(const char *env_name) {
+  unsigned int count = path_info.kept_count, pos, prog, idx, minimal_count = 0;
+  unsigned long failed = 0, minimal_failed = 0;
+  cpath_elf_sim_t **sims;
+  char **minimal;
+  int *needed, same = 1;
+  if(CPATH_KIND_LIB != cpath_scan_kind(env_name)) {
+    verbose(3, ("# Not simulating the loader for %s, it's not LD_LIBRARY_PATH\n", env_name));
+    return;
+  }
+  sims = (cpath_elf_sim_t **)fatal_malloc(sizeof(cpath_elf_sim_t *) * opt_ld_programs->length);
+  needed = (int *)calloc(count + 1, sizeof(int));
+  minimal = (char **)fatal_malloc(sizeof(char *) * (count + 1));
+  if(! needed) fatal("Unable to allocate RAM for loader simulation.\n");
+  for(prog = 0; prog < opt_ld_programs->length; prog++) {
+    const char *program = opt_ld_programs->args[prog];
+    cpath_elf_sim_t *sim = sims[prog] = cpath_elf_simulate(program, path_info.kept, count);
+    if(! sim)
+      continue;
+    verbose_out("%s loader simulation for %s (%u searches, %lu failed opens):\n",
+                env_name, program, sim->lib_count, sim->failed);
+    verbose_out("%7s  %-15s %s\n", "FAILED", "FOUND IN", "LIBRARY => FILE");
+    for(idx = 0; idx < sim->lib_count; idx++) {
+      cpath_elf_lib_t *lib = &sim->libs[idx];
+      if(CPATH_ELF_FROM_LOADED == lib->source) {
+        verbose(2, ("%7u  %-15s %s\n", lib->failed, cpath_elf_source_name(lib->source), lib->name));
+        continue;
+      }
+      verbose_out("%7u  %-15s %s => %s\n", lib->failed, cpath_elf_source_name(lib->source),
+                  lib->name, lib->object >= 0 ? sim->objs[lib->object].path : "?");
+      if(CPATH_ELF_FROM_LLP == lib->source)
+        needed[lib->llp_pos] = 1;
+    }
+    failed += sim->failed;
+  }
+  for(pos = 0; pos < count; pos++)
+    if(needed[pos])
+      minimal[minimal_count++] = path_info.kept[pos];
+  for(prog = 0; prog < opt_ld_programs->length; prog++) {
+    cpath_elf_sim_t *sim;
+    if(! sims[prog])
+      continue;
+    sim = cpath_elf_simulate(opt_ld_programs->args[prog], minimal, minimal_count);
+    if(! sim || ! cpath_elf_same(sims[prog], sim)) {
+      verbose(1, ("# The smaller %s does not load the same files for %s, keeping it as is\n",
+                  env_name, opt_ld_programs->args[prog]));
+      cpath_elf_sim_free(sim);
+      same = 0;
+      break;
+    }
+    minimal_failed += sim->failed;
+    cpath_elf_sim_free(sim);
+  }
+  if(same) {
+    verbose_out("%s failed opens: %lu with %u elements, %lu with the minimal %u elements\n",
+                env_name, failed, count, minimal_failed, minimal_count);
+    if(opt_ld_minimize && minimal_count != count) {
+      memcpy(path_info.kept, minimal, sizeof(char *) * minimal_count);
+      path_info.kept_count = minimal_count;
+      cpath_rebuild_new_path();
+    }
+  }
+  for(prog = 0; prog < opt_ld_programs->length; prog++)
+    cpath_elf_sim_free(sims[prog]);
+  free(needed);
+  free(minimal);
+  free(sims);
+}
+
+/**
+ * Replace the cleaned value with a single view directory (see cpath-view.c).
+ * Leaves the value alone if it can't be flattened.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_flatten(const char *env_name) {
+  int kind = cpath_scan_kind(env_name);
+  char *view;
+  if(CPATH_KIND_EXEC != kind && CPATH_KIND_LIB != kind) {
+    verbose(3, ("# Not flattening %s, only PATH and LD_LIBRARY_PATH can be\n", env_name));
+    return;
+  }
+  if(path_info.kept_count < 2)
+    return;
+  if(! opt_view_dir)
+    opt_view_dir = cpath_view_default_base();
+  if(! cpath_view_base_ok(opt_view_dir))
+    return;
+  view = cpath_view_get(path_info.kept, path_info.kept_count, kind, opt_view_dir);
+  if(! view)
+    return;
+  verbose(1, ("# Flattened %u directories of %s into \"%s\"\n", path_info.kept_count,
+             env_name, view));
+  path_info.kept[0] = view;
+  path_info.kept_count = 1;
+  cpath_rebuild_new_path();
+}
+
+/**
+ * Print the new value of a variable for the target shell.
+ *
+ * @param env_name the name of the environment variable
+ * @param value the new value
+ */
+static void cpath_output_var(const char *env_name, const char *value) {
+  switch(opt_target_shell) {
+  case CPATH_SHELL_NONE:
+    printf("%s=%s\n", env_name, value);
+    break;
+  case CPATH_SHELL_BASH:
+    printf("export %s=\"%s\";\n", env_name, value);
+    break;
+  case CPATH_SHELL_CSH:
+    printf("setenv %s \"%s\";\n", env_name, value);
+    break;
+  default:
+    usage();
+    fatal("Unknown target shell '%d'\n", opt_target_shell);
+    exit(EXIT_FAILURE);
+    break;
+  }
+}
+
+/**
+ * Print the unsetting of a variable for the target shell. Exported bash
+ * functions are removed with "unset -f", which is the only thing that does.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_output_unset(const char *env_name) {
+  char *func;
+  switch(opt_target_shell) {
+  case CPATH_SHELL_NONE:
+    printf("%s=\n", env_name);
+    break;
+  case CPATH_SHELL_BASH:
+    if(NULL != (func = cpath_shell_bash_func(env_name))) {
+      printf("unset -f %s;\n", func);
+      free(func);
+    } else {
+      printf("unset %s;\n", env_name);
+    }
+    break;
+  case CPATH_SHELL_CSH:
+    printf("unsetenv %s;\n", env_name);
+    break;
+  default:
+    usage();
+    fatal("Unknown target shell '%d'\n", opt_target_shell);
+    exit(EXIT_FAILURE);
+    break;
+  }
+}
+
+/**
+ * Print what it takes to bring the (cleaned) environment under --budget, and
+ * report its size if asked to.
+ */
+static void cpath_output_budget(void) {
+  unsigned int idx;
+  if(opt_budget) {
+    if(! opt_budget_rules)
+      opt_budget_rules = CPATH_BUDGET_DEFAULT_RULES;
+    cpath_budget_fit(env_budget, opt_budget, opt_budget_rules);
+    for(idx = 0; idx < env_budget->count; idx++) {
+      cpath_budget_var_t *var = &env_budget->vars[idx];
+      if(! var->fitted)
+        continue;
+      if(var->value)
+        cpath_output_var(var->name, var->value);
+      else
+        cpath_output_unset(var->name);
+    }
+  }
+  if(opt_env_size)
+    cpath_budget_report(env_budget);
+}
+
+/**
+ * Print "hash -p" lines for the --hash commands, resolved against the cleaned
+ * PATH with the executable index. Commands that are not found, or that
+ * resolve past an empty or relative element (so that the answer depends on
+ * the current directory), are left for the shell to search for.
+ *
+ * @param env_name the name of the environment variable
+ */
+static void cpath_output_hash_cmds(const char *env_name) {
+  unsigned int idx;
+  cpath_index_t *index;
+  if(CPATH_KIND_EXEC != cpath_scan_kind(env_name))
+    return;
+  if(CPATH_SHELL_BASH != opt_target_shell) {
+    verbose(1, ("# Not printing hash commands, they are only supported for bash output\n"));
+    return;
+  }
+  index = cpath_index_build(path_info.kept, path_info.kept_count, CPATH_KIND_EXEC);
+  for(idx = 0; idx < opt_hash_cmds->length; idx++) {
+    const char *cmd = opt_hash_cmds->args[idx];
+    int uncertain = 0;
+    unsigned int pos;
+    if(NULL != strchr(cmd, '/') || NULL != strpbrk(cmd, "\"'`$\\ \t")) {
+      verbose(1, ("# Not hashing \"%s\", it's not a plain command name\n", cmd));
+      continue;
+    }
+    pos = cpath_index_resolve(index, cmd, &uncertain);
+    if(CPATH_INDEX_NONE == pos) {
+      verbose(2, ("# Not hashing \"%s\", not found in %s\n", cmd, env_name));
+    } else if(uncertain) {
+      verbose(2, ("# Not hashing \"%s\", it depends on the current directory\n", cmd));
+    } else {
+      printf("hash -p \"%s/%s\" %s;\n", path_info.kept[pos], cmd, cmd);
+    }
+  }
+  cpath_index_free(index);
+}
+
+/**
+ * Print the full path of each command the way which(1) does, resolved against
+ * the cleaned PATH with the persistent executable index (see cpath-cache.c).
+ *
+ * @param cmds the commands to look up
+ *
+ * @return 0 if all of them were found, 1 otherwise
+ */
+static int cpath_which(args_array_t *cmds) {
+  cpath_cache_t *cache = NULL;
+  unsigned int idx, pos;
+  int status = 0;
+  struct stat file_stat;
+  if(! opt_cache_dir)
+    opt_cache_dir = cpath_cache_default_dir();
+  for(idx = 0; idx < cmds->length; idx++) {
+    const char *cmd = cmds->args[idx];
+    if(NULL != strchr(cmd, '/')) {
+      /* not searched for, just checked, same as the shell does */
+      if(0 == stat(cmd, &file_stat) && cpath_can_exec_file(&file_stat)) {
+        printf("%s\n", cmd);
+      } else {
+        verbose(1, ("# %s: not an executable file\n", cmd));
+        status = 1;
+      }
+      continue;
+    }
+    if(! cache) {
+      if(NULL == path_info.kept) /* PATH was unset */
+        path_info.kept_count = 0;
+      cache = cpath_cache_get(path_info.kept, path_info.kept_count, opt_cache_dir);
+    }
+    pos = cpath_cache_resolve(cache, cmd);
+    if(CPATH_INDEX_NONE == pos) {
+      verbose(1, ("# %s: not found in PATH\n", cmd));
+      status = 1;
+    } else {
+      printf("%s%s%s\n", path_info.kept[pos], '\0' == *path_info.kept[pos] ? "" : "/", cmd);
+    }
+  }
+  return status;
+}
+
 /**
  * Clean a given PATH environment variable.
  *
@@ -777,6 +2196,8 @@ void cpath_clean_path(char delim, const char *env_name, const char *old_path_str
   path_info.old_directory_count     = 0;
   path_info.new_directory_count     = 0;
   path_info.directories             = NULL;
+  path_info.kept_count              = 0;
+  path_info.kept                    = NULL;
   path_info.delim                   = delim;
   if(! old_path_string) {
     verbose(3, ("# OLD %s=\"\" # was unset\n", env_name));
@@ -836,6 +2257,10 @@ void cpath_clean_path(char delim, const char *env_name, const char *old_path_str
   path_info.directory_hashes = (unsigned int *)calloc(sizeof(unsigned int) * (path_info.old_directory_count + 1), 1);
   if(! path_info.directory_hashes) fatal("Unable to allocate RAM for seen directories lengths.");
 
+  /* The elements we keep, in order, for anything that works on the whole
+     cleaned path after the first pass. */
+  path_info.kept = (char **)fatal_malloc(sizeof(char*) * (path_info.old_directory_count + 1));
+
   debug(3, ("Building new...\n"));
   { /* Start isolated block */
     /* Start at the begining */
@@ -861,29 +2286,210 @@ void cpath_clean_path(char delim, const char *env_name, const char *old_path_str
     /* Still have to process the last directory if any */
     cpath_add_if(current_file_or_dir, hash);
   } /* End isolated block */
+  if(opt_prune_content)
+    cpath_prune_content(env_name);
+  if(opt_dedupe_jars)
+    cpath_dedupe_jars(env_name);
+  if(opt_collapse_jars)
+    cpath_collapse_jars(env_name);
+  if(opt_shadow_report || opt_drop_shadowed)
+    cpath_drop_shadowed(env_name);
+  if(opt_reorder_by)
+    cpath_reorder_by_frequency(env_name);
+  if(opt_require_cmds->length > 0)
+    cpath_require_commands(env_name);
+  if(CPATH_DEFAULTS_KEEP != opt_defaults)
+    cpath_elide_defaults(env_name);
+  if(opt_ld_programs->length > 0)
+    cpath_ld_simulate(env_name);
+  if(opt_flatten)
+    cpath_flatten(env_name);
   verbose(3, ("# NEW %s=\"%s\"\n", env_name, path_info.new_path_string));
+  if(opt_which)
+    return;
+  if(env_budget)
+    cpath_budget_set(env_budget, env_name, path_info.new_path_string);
   /* Now output a string to STDOUT as asked */
   if(
      opt_output_unchanged ||
      (0 != strcmp(path_info.new_path_string, path_info.old_path_string))
      ) {
-    switch(opt_target_shell) {
-    case CPATH_SHELL_NONE:
-      printf("%s=%s\n", env_name, path_info.new_path_string);
-      break;
-    case CPATH_SHELL_BASH:
-      printf("export %s=\"%s\";\n", env_name, path_info.new_path_string);
-      break;
-    case CPATH_SHELL_CSH:
-      printf("setenv %s \"%s\";\n", env_name, path_info.new_path_string);
-      break;
-    default:
-      usage();
-      fatal("Unknown target shell '%d'\n", opt_target_shell);
-      exit(EXIT_FAILURE);
+    cpath_output_var(env_name, path_info.new_path_string);
+  }
+  if(opt_hash_cmds->length > 0)
+    cpath_output_hash_cmds(env_name);
+}
+
+/**
+ * Call add() with each element of a path variable that isn't excluded anyway.
+ */
+static void cpath_each_element_of(const char *path, void (*add)(void *, const char *), void *arg) {
+  char element[PATH_MAX];
+  const char *end;
+  unsigned int i;
+  if(! path)
+    return;
+  while(1) {
+    end = strchr(path, opt_delim);
+    if(! end) end = path + strlen(path);
+    if(end - path < (long)sizeof(element)) {
+      int excluded = 0;
+      memcpy(element, path, end - path);
+      element[end - path] = '\0';
+      for(i = 0; i < opt_exclude_match->length && ! excluded; i++)
+        excluded = NULL != strstr(element, opt_exclude_match->args[i]);
+      if(! excluded && opt_exclude_subtree->rule_count > 0)
+        excluded = NULL != cpath_trie_match(opt_exclude_subtree, element);
+      if(! excluded)
+        add(arg, element);
+    }
+    if('\0' == *end)
       break;
+    path = end + 1;
+  }
+}
+
+/**
+ * Call add() with each element of every variable we're about to clean, before
+ * cleaning any of them.
+ */
+static void cpath_each_element(args_array_t *env_array, char **envp, void (*add)(void *, const char *),
+                               void *arg) {
+  unsigned int i;
+  if(opt_all_paths) {
+    for(; *envp; envp++) {
+      const char *equals = strchr(*envp, '=');
+      if(equals && equals - *envp >= 4 && 0 == strncmp(equals - 4, "PATH", 4))
+        cpath_each_element_of(equals + 1, add, arg);
     }
   }
+  if(opt_common_paths)
+    for(i=0; *(common_paths[i]); i++)
+      cpath_each_element_of(getenv(common_paths[i]), add, arg);
+  if(opt_which || (! env_array->length && ! opt_common_paths && ! opt_all_paths))
+    cpath_each_element_of(getenv("PATH"), add, arg);
+  else if(! opt_which)
+    for(i=0; i<env_array->length; i++)
+      cpath_each_element_of(getenv(env_array->args[i]), add, arg);
+}
+
+typedef struct cpath_prewarm_arg_t {
+  cpath_prewarm_t *prewarm;
+  cpath_mounts_t *table;
+} cpath_prewarm_arg_t;
+
+static void cpath_prewarm_element(void *arg, const char *element) {
+  cpath_prewarm_add(((cpath_prewarm_arg_t *)arg)->prewarm, ((cpath_prewarm_arg_t *)arg)->table, element);
+}
+
+/**
+ * Pre-warm the automounts of every variable we're about to clean, all at
+ * once.
+ */
+static void cpath_prewarm(args_array_t *env_array, char **envp, cpath_mounts_t *table) {
+  cpath_prewarm_arg_t arg;
+  arg.prewarm = cpath_prewarm_new();
+  arg.table = table;
+  cpath_each_element(env_array, envp, cpath_prewarm_element, &arg);
+  cpath_prewarm_run(arg.prewarm, opt_prewarm);
+}
+
+static void cpath_sched_element(void *arg, const char *element) {
+  /* the manifest answers for these without a stat(), and --single-flight
+     does its own */
+  if((manifest && cpath_manifest_lists(manifest, element)) ||
+     (flight && cpath_flight_has(flight, element)))
+    return;
+  cpath_sched_add((cpath_sched_t *)arg, element);
+}
+
+/**
+ * stat() the elements on network filesystems of every variable we're about
+ * to clean, all at once.
+ */
+static void cpath_fs_schedule(args_array_t *env_array, char **envp, cpath_mounts_t *table) {
+  sched = cpath_sched_new(table);
+  cpath_each_element(env_array, envp, cpath_sched_element, sched);
+  cpath_sched_run(sched, cpath_scan_jobs, opt_fs_schedule);
+}
+
+typedef struct cpath_flight_arg_t {
+  cpath_flight_t *flight;
+  long long now;
+} cpath_flight_arg_t;
+
+static void cpath_flight_element(void *arg, const char *element) {
+  /* the manifest answers for these without a stat() */
+  if(manifest && cpath_manifest_lists(manifest, element))
+    return;
+  cpath_flight_claim(((cpath_flight_arg_t *)arg)->flight, element, ((cpath_flight_arg_t *)arg)->now);
+}
+
+/**
+ * Claim the elements of every variable we're about to clean that no other
+ * cleanpath on this node has, and stat() them for everyone.
+ */
+static void cpath_single_flight(args_array_t *env_array, char **envp) {
+  cpath_flight_arg_t arg;
+  flight = cpath_flight_open(*opt_single_flight ? opt_single_flight : NULL,
+                             opt_single_flight_wait >= 0 ? opt_single_flight_wait : CPATH_FLIGHT_WAIT);
+  if(! flight)
+    return;
+  arg.flight = flight;
+  arg.now = cpath_flight_now();
+  cpath_each_element(env_array, envp, cpath_flight_element, &arg);
+  cpath_flight_run(flight);
+}
+
+static void cpath_batch_element(void *arg, const char *element) {
+  /* the manifest answers for these without reading anything */
+  if(manifest && cpath_manifest_lists(manifest, element))
+    return;
+  cpath_batch_add((cpath_batch_t *)arg, element);
+}
+
+/**
+ * Read the parents of the elements of every variable we're about to clean,
+ * for cpath_should_add() to answer from.
+ */
+static void cpath_batch_probe(args_array_t *env_array, char **envp, cpath_mounts_t *table) {
+  batch = cpath_batch_new(opt_batch_probe);
+  cpath_each_element(env_array, envp, cpath_batch_element, batch);
+  cpath_batch_run(batch, table);
+}
+
+/**
+ * Which option given reads the host's files beyond stat()ing the elements,
+ * which --root doesn't redirect.
+ *
+ * @return its name, or NULL if there is none
+ */
+static const char *cpath_host_only_option() {
+  if(opt_prune_content)
+    return "-p";
+  if(opt_shadow_report)
+    return "--shadow-report";
+  if(opt_drop_shadowed)
+    return "--drop-shadowed";
+  if(opt_reorder_by)
+    return "--reorder-by";
+  if(opt_require_cmds->length > 0)
+    return "--require";
+  if(opt_which)
+    return "--which";
+  if(opt_hash_cmds->length > 0)
+    return "--hash";
+  if(CPATH_DEFAULTS_KEEP != opt_defaults)
+    return "--defaults";
+  if(opt_ld_programs->length > 0)
+    return "--ld-simulate";
+  if(opt_flatten)
+    return "--flatten";
+  if(opt_dedupe_jars)
+    return "--dedupe-jars";
+  if(opt_collapse_jars)
+    return "--collapse-jars";
+  return NULL;
 }
 
 /**
@@ -908,6 +2514,50 @@ int main(int argc, char *argv[], char *envp[] ) {
     set_verbose_out(stdout);
   /* Some vars */
   unsigned int i, len = env_array->length;
+  cpath_mounts_t *mounts = NULL;
+  if(opt_compile_manifest) {
+    if(! opt_manifest)
+      fatal("--compile-manifest needs --manifest=FILE to write to\n");
+    return cpath_manifest_compile(opt_compile_manifest, opt_manifest) ? 0 : EXIT_FAILURE;
+  }
+  /* Only returns in the child checking each image */
+  if(opt_root_batch)
+    cpath_root_batch(opt_root_batch, cpath_scan_jobs, &opt_root);
+  else if(opt_env_file && ! cpath_root_load_env(opt_env_file))
+    fatal("Unable to read the env file \"%s\": %s\n", opt_env_file, strerror(errno));
+  if(opt_root_batch || opt_env_file) {
+    extern char **environ;
+    envp = environ;
+  }
+  if(opt_root) {
+    const char *host_only = cpath_host_only_option();
+    if(host_only)
+      fatal("%s can't be used with --root, it would read the host's files instead of the image's\n", host_only);
+    root_fd = cpath_root_open(opt_root);
+    opt_manifest = NULL;
+    opt_prewarm = 0;
+    opt_batch_probe = 0;
+    opt_fs_schedule = 0;
+    opt_single_flight = NULL;
+  }
+  /* Take stock before envp is walked below */
+  if(opt_budget || opt_env_size)
+    env_budget = cpath_budget_new(envp, opt_delim, CPATH_SHELL_CSH != opt_target_shell);
+  if(opt_manifest)
+    manifest = cpath_manifest_open(opt_manifest, opt_manifest_max_age ? opt_manifest_max_age :
+                                   CPATH_MANIFEST_MAX_AGE);
+  if(opt_prewarm || opt_batch_probe || opt_fs_schedule)
+    mounts = cpath_mounts_read();
+  if(opt_prewarm)
+    cpath_prewarm(env_array, envp, mounts);
+  if(opt_only_executable_dirs || opt_check_exists) {
+    if(opt_single_flight)
+      cpath_single_flight(env_array, envp);
+    if(opt_batch_probe)
+      cpath_batch_probe(env_array, envp, mounts);
+    if(opt_fs_schedule)
+      cpath_fs_schedule(env_array, envp, mounts);
+  }
   /* If we're supposed to look at all variables that end in "PATH", then
      do it now. */
   if(opt_all_paths) {
@@ -947,6 +2597,15 @@ int main(int argc, char *argv[], char *envp[] ) {
       cpath_clean_path(opt_delim, common_paths[i], getenv(common_paths[i]));
     }
   }
+  /* In --which mode the rest of the command-line is commands, not variables */
+  if(opt_which) {
+    cpath_clean_path(opt_delim, "PATH", getenv("PATH"));
+    if(sched)
+      cpath_sched_report(sched);
+    if(flight)
+      cpath_flight_report(flight);
+    return cpath_which(env_array);
+  }
   /* If we were told to do some environment variables on the command-line, do them */
   if(len) {
     for(i=0;i<len;i++)
@@ -955,5 +2614,11 @@ int main(int argc, char *argv[], char *envp[] ) {
       /* If there was nothing else on the command-line, clean "PATH" */
       cpath_clean_path(opt_delim, "PATH", getenv("PATH"));
   }
-  return 0;
+  if(sched)
+    cpath_sched_report(sched);
+  if(flight)
+    cpath_flight_report(flight);
+  if(env_budget)
+    cpath_output_budget();
+  return exit_status;
 }
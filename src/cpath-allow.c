@@ -0,0 +1,111 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_ALLOW_LOADED_SEMAPHORE
+#define _CPATH_ALLOW_LOADED_SEMAPHORE
+
+#include "cpath-element.c"
+
+/**
+ * An allowlist of variable names and name prefixes, for "keep only these,
+ * unset everything else" clean-room environments.
+ *
+ * Names and prefixes share one open addressed hash table, built once. A
+ * variable is decided in one walk over its name: the name is hashed as it is
+ * walked (the hash is the same one used for path members, which can be
+ * extended a character at a time), and the table is probed at each length
+ * some prefix has, then once for the whole name. With the usual handful of
+ * prefix lengths that is a few probes, whatever the size of the lists.
+ */
+
+typedef struct cpath_allow_slot_t {
+  const char *name;          /* NULL for an empty slot */
+  unsigned int len;
+  unsigned int hash;
+  unsigned char prefix;      /* matches names starting with it */
+} cpath_allow_slot_t;
+
+typedef struct cpath_allow_t {
+  cpath_allow_slot_t *slots;
+  unsigned int mask;
+  unsigned int count;
+  unsigned int *prefix_lens; /* the distinct prefix lengths, ascending */
+  unsigned int prefix_len_count;
+} cpath_allow_t;
+
+/**
+ * Create an empty allowlist with room for count names and prefixes.
+ */
+static cpath_allow_t *cpath_allow_new(unsigned int count) {
+  cpath_allow_t *allow = (cpath_allow_t *)calloc(1, sizeof(cpath_allow_t));
+  unsigned int size = 16;
+  /* at most half full */
+  while(size < 2 * count) size *= 2;
+  if(! allow) fatal("Unable to allocate RAM for the allowlist.\n");
+  allow->slots = (cpath_allow_slot_t *)calloc(size, sizeof(cpath_allow_slot_t));
+  allow->prefix_lens = (unsigned int *)malloc(sizeof(unsigned int) * (count + 1));
+  if(! allow->slots || ! allow->prefix_lens) fatal("Unable to allocate RAM for the allowlist.\n");
+  allow->mask = size - 1;
+  return allow;
+}
+
+/**
+ * Add a name, or a prefix, to the allowlist.
+ */
+static void cpath_allow_add(cpath_allow_t *allow, const char *name, unsigned char prefix) {
+  unsigned int hash = CPATH_ELEMENT_HASH_SEED, len = 0, idx;
+  while(name[len])
+    hash = cpath_element_hash_step(hash, name[len++]);
+  if(prefix && 0 == len)
+    fatal("An empty prefix would keep everything\n");
+  for(idx = hash & allow->mask; allow->slots[idx].name; idx = (idx + 1) & allow->mask)
+    if(allow->slots[idx].hash == hash && allow->slots[idx].prefix == prefix && eq(allow->slots[idx].name, name))
+      return;
+  allow->slots[idx].name = name;
+  allow->slots[idx].len = len;
+  allow->slots[idx].hash = hash;
+  allow->slots[idx].prefix = prefix;
+  allow->count++;
+  if(prefix) {
+    /* keep the lengths sorted, without duplicates */
+    unsigned int pos = allow->prefix_len_count;
+    for(idx = 0; idx < allow->prefix_len_count; idx++)
+      if(allow->prefix_lens[idx] == len)
+        return;
+    while(pos > 0 && allow->prefix_lens[pos - 1] > len) {
+      allow->prefix_lens[pos] = allow->prefix_lens[pos - 1];
+      pos--;
+    }
+    allow->prefix_lens[pos] = len;
+    allow->prefix_len_count++;
+  }
+}
+
+/**
+ * Probe for an entry with this hash, length and kind.
+ */
+static int cpath_allow_probe(cpath_allow_t *allow, const char *name, unsigned int len, unsigned int hash,
+                             unsigned char prefix) {
+  unsigned int idx;
+  for(idx = hash & allow->mask; allow->slots[idx].name; idx = (idx + 1) & allow->mask)
+    if(allow->slots[idx].hash == hash && allow->slots[idx].len == len &&
+       allow->slots[idx].prefix == prefix && 0 == strncmp(allow->slots[idx].name, name, len))
+      return 1;
+  return 0;
+}
+
+/**
+ * Is this variable on the allowlist, by name or by prefix?
+ */
+static int cpath_allow_has(cpath_allow_t *allow, const char *name) {
+  unsigned int hash = CPATH_ELEMENT_HASH_SEED, len = 0, next = 0;
+  while(name[len]) {
+    hash = cpath_element_hash_step(hash, name[len++]);
+    while(next < allow->prefix_len_count && allow->prefix_lens[next] < len)
+      next++;
+    if(next < allow->prefix_len_count && allow->prefix_lens[next] == len &&
+       cpath_allow_probe(allow, name, len, hash, 1))
+      return 1;
+  }
+  return cpath_allow_probe(allow, name, len, hash, 0);
+}
+
+#endif /* _CPATH_ALLOW_LOADED_SEMAPHORE */
@@ -0,0 +1,248 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_BATCH_LOADED_SEMAPHORE
+#define _CPATH_BATCH_LOADED_SEMAPHORE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include "cpath-scan.c"
+#include "cpath-mount.c"
+#include "cpath-element.c"
+
+/**
+ * Batched probing: answering existence (and type) for sibling elements from
+ * one read of their parent, instead of a stat() each.
+ *
+ * Module-inflated paths hold many elements that share a parent (e.g.,
+ * /sw/X/1.0/bin, /sw/X/1.0/lib and /sw/X/1.0/lib64 across PATH,
+ * LD_LIBRARY_PATH and friends, or whole trees that were removed). Before
+ * cleaning, every element is grouped with its siblings, and each parent with
+ * enough of them is read once with getdents64(2) (one open(), two or so
+ * getdents64() and one close()). An element the parent doesn't list doesn't
+ * exist, and neither does any element of a parent that doesn't exist (one
+ * failed open() for all of them). d_type answers whether the others are
+ * directories, so only the elements that still need their permission bits
+ * are stat()ed afterwards.
+ *
+ * Symlinks and entries whose d_type the filesystem doesn't fill in are left
+ * to stat(), as is every element of a parent that is an automount point
+ * (which only lists what's already mounted) or that can't be read.
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone()
+ * and the debug() and verbose() macros.
+ */
+
+/**
+ * What a batch knows about an element
+ */
+#define CPATH_BATCH_UNKNOWN 0 /* not batched, stat() it */
+#define CPATH_BATCH_MISSING 1 /* doesn't exist */
+#define CPATH_BATCH_DIR     2 /* a directory */
+#define CPATH_BATCH_OTHER   3 /* exists, and isn't a directory or a symlink */
+
+typedef struct cpath_batch_child_t {
+  cpath_element_t element;          /* must be first */
+  char *parent;                     /* its parent, as the element spells it */
+  const char *name;                 /* its last component, within the path */
+  unsigned char state;
+} cpath_batch_child_t;
+
+typedef struct cpath_batch_t {
+  cpath_elements_t elements;
+  cpath_batch_child_t **children;
+  unsigned int count;
+  unsigned int size;
+  unsigned int min_children;        /* only read parents with this many */
+} cpath_batch_t;
+
+/**
+ * Create an empty batch.
+ *
+ * @param min_children how many elements a parent needs before it's worth
+ *        reading instead of stat()ing them
+ */
+static cpath_batch_t *cpath_batch_new(unsigned int min_children) {
+  cpath_batch_t *batch = (cpath_batch_t *)fatal_malloc(sizeof(cpath_batch_t));
+  memset(batch, 0, sizeof(cpath_batch_t));
+  batch->size = 64;
+  batch->children = (cpath_batch_child_t **)fatal_malloc(sizeof(cpath_batch_child_t *) * batch->size);
+  batch->min_children = min_children ? min_children : 1;
+  return batch;
+}
+
+/**
+ * Add an element, with trailing slashes dropped the way cpath_add_if() drops
+ * them. Duplicates, relative elements and elements ending in "." or ".." are
+ * left out.
+ */
+static void cpath_batch_add(cpath_batch_t *batch, const char *element) {
+  cpath_batch_child_t *child;
+  unsigned int hash;
+  size_t len = cpath_element_len(element), slash;
+  char *path;
+  if('/' != *element || len < 2)
+    return;
+  hash = cpath_element_hash(element, len);
+  if(cpath_element_find(&batch->elements, element, len, hash))
+    return;
+  for(slash = len - 1; '/' != element[slash]; slash--);
+  if('.' == element[slash + 1] && (len == slash + 2 || ('.' == element[slash + 2] && len == slash + 3)))
+    return;
+  path = (char *)fatal_malloc(len + 1);
+  memcpy(path, element, len);
+  path[len] = '\0';
+  child = (cpath_batch_child_t *)fatal_malloc(sizeof(cpath_batch_child_t));
+  child->element.path = path;
+  child->element.hash = hash;
+  child->name = path + slash + 1;
+  child->parent = (char *)fatal_malloc(slash + 2);
+  memcpy(child->parent, path, slash ? slash : 1);
+  child->parent[slash ? slash : 1] = '\0';
+  child->state = CPATH_BATCH_UNKNOWN;
+  cpath_element_insert(&batch->elements, &child->element);
+  if(batch->count == batch->size) {
+    batch->size *= 2;
+    batch->children = (cpath_batch_child_t **)realloc(batch->children, sizeof(cpath_batch_child_t *) * batch->size);
+    if(! batch->children) fatal("Unable to allocate RAM for the probe batch.\n");
+  }
+  batch->children[batch->count++] = child;
+}
+
+/**
+ * Order elements by parent, then by name, for qsort().
+ */
+static int cpath_batch_cmp(const void *a, const void *b) {
+  const cpath_batch_child_t *child_a = *(const cpath_batch_child_t **)a;
+  const cpath_batch_child_t *child_b = *(const cpath_batch_child_t **)b;
+  int cmp = strcmp(child_a->parent, child_b->parent);
+  return cmp ? cmp : strcmp(child_a->name, child_b->name);
+}
+
+/**
+ * Find a name among the (sorted) elements of one parent.
+ */
+static cpath_batch_child_t *cpath_batch_find(cpath_batch_child_t **children, unsigned int count,
+                                             const char *name) {
+  unsigned int low = 0, high = count;
+  while(low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    int cmp = strcmp(children[mid]->name, name);
+    if(0 == cmp)
+      return children[mid];
+    if(cmp < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return NULL;
+}
+
+/**
+ * Read one parent and answer for its elements.
+ *
+ * @param children the parent's elements, sorted by name
+ * @param buffer a CPATH_SCAN_BUFFER_SIZE buffer
+ *
+ * @return zero if the parent couldn't be read, and nothing was answered
+ */
+static int cpath_batch_read(cpath_batch_child_t **children, unsigned int count, char *buffer) {
+  int dir_fd = open(children[0]->parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  long nread;
+  unsigned int idx;
+  if(dir_fd < 0) {
+    if(ENOENT != errno && ENOTDIR != errno) {
+      debug(3, ("cpath_batch_read: \"%s\": %s\n", children[0]->parent, strerror(errno)));
+      return 0;
+    }
+    for(idx = 0; idx < count; idx++)
+      children[idx]->state = CPATH_BATCH_MISSING;
+    return 1;
+  }
+  /* whatever the parent doesn't list is missing */
+  for(idx = 0; idx < count; idx++)
+    children[idx]->state = CPATH_BATCH_MISSING;
+  while(0 < (nread = syscall(SYS_getdents64, dir_fd, buffer, CPATH_SCAN_BUFFER_SIZE))) {
+    long offset = 0;
+    while(offset < nread) {
+      cpath_dirent64_t *entry = (cpath_dirent64_t *)(buffer + offset);
+      cpath_batch_child_t *child;
+      offset += entry->d_reclen;
+      if(NULL == (child = cpath_batch_find(children, count, entry->d_name)))
+        continue;
+      switch(entry->d_type) {
+      case DT_DIR:     child->state = CPATH_BATCH_DIR; break;
+      case DT_LNK:
+      case DT_UNKNOWN: child->state = CPATH_BATCH_UNKNOWN; break;
+      default:         child->state = CPATH_BATCH_OTHER; break;
+      }
+    }
+  }
+  close(dir_fd);
+  if(nread < 0) {
+    debug(3, ("cpath_batch_read: \"%s\": %s\n", children[0]->parent, strerror(errno)));
+    for(idx = 0; idx < count; idx++)
+      children[idx]->state = CPATH_BATCH_UNKNOWN;
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Read every parent with enough elements.
+ *
+ * @param table the mount table, to leave automount points alone
+ */
+static void cpath_batch_run(cpath_batch_t *batch, cpath_mounts_t *table) {
+  char *buffer;
+  unsigned int start, end, parents = 0, answered = 0, missing = 0;
+  struct timeval begin, finish;
+  if(! batch->count)
+    return;
+  gettimeofday(&begin, NULL);
+  buffer = (char *)fatal_malloc(CPATH_SCAN_BUFFER_SIZE);
+  qsort(batch->children, batch->count, sizeof(cpath_batch_child_t *), cpath_batch_cmp);
+  for(start = 0; start < batch->count; start = end) {
+    cpath_mount_t *mount;
+    for(end = start + 1; end < batch->count && eq(batch->children[end]->parent, batch->children[start]->parent);
+        end++);
+    if(end - start < batch->min_children)
+      continue;
+    mount = cpath_mount_of(table, batch->children[start]->parent);
+    if(mount && eq(mount->fstype, "autofs")) {
+      debug(3, ("cpath_batch_run: not reading automount \"%s\"\n", batch->children[start]->parent));
+      continue;
+    }
+    if(cpath_batch_read(batch->children + start, end - start, buffer)) {
+      unsigned int idx;
+      parents++;
+      for(idx = start; idx < end; idx++)
+        if(CPATH_BATCH_UNKNOWN != batch->children[idx]->state) {
+          answered++;
+          if(CPATH_BATCH_MISSING == batch->children[idx]->state)
+            missing++;
+        }
+    }
+  }
+  free(buffer);
+  gettimeofday(&finish, NULL);
+  verbose(1, ("# Read %u parent directories for %u of %u elements (%u missing) in %ld ms\n",
+              parents, answered, batch->count, missing,
+              (long)((finish.tv_sec - begin.tv_sec) * 1000 + (finish.tv_usec - begin.tv_usec) / 1000)));
+}
+
+/**
+ * What the batch knows about an element.
+ *
+ * @param hash the element's hash, as cpath_should_add() has it
+ *
+ * @return one of the CPATH_BATCH_* values
+ */
+static unsigned char cpath_batch_lookup(cpath_batch_t *batch, const char *path, unsigned int hash) {
+  cpath_batch_child_t *child = (cpath_batch_child_t *)cpath_element_find(&batch->elements, path, strlen(path),
+                                                                         hash);
+  return child ? child->state : CPATH_BATCH_UNKNOWN;
+}
+
+#endif /* _CPATH_BATCH_LOADED_SEMAPHORE */
@@ -0,0 +1,339 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_BUDGET_LOADED_SEMAPHORE
+#define _CPATH_BUDGET_LOADED_SEMAPHORE
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpath-shell.c"
+
+/**
+ * Environment size accounting, shared by cleanpath and unsetenvs.
+ *
+ * Every execve() copies the whole environment onto the new program's stack,
+ * and the kernel refuses (E2BIG) once the arguments and environment together
+ * pass ARG_MAX, or once any single "NAME=value" string passes
+ * MAX_ARG_STRLEN. What counts is each string with its '\0' plus the pointer
+ * to it, which is what is measured here.
+ *
+ * The tool records the changes it is going to print (cpath_budget_set()),
+ * then cpath_budget_fit() works down an ordered list of rules until the
+ * environment is under a byte budget:
+ *
+ *   unset:PATTERN  unset the variables matching PATTERN, largest first
+ *   trim:PATTERN   drop trailing (last searched) elements from the path
+ *                  variables matching PATTERN, largest first, always
+ *                  keeping the first element
+ *
+ * A PATTERN is a name, "PREFIX*" or "*SUFFIX". Earlier rules are used up
+ * before later ones are tried, so the order is the priority.
+ *
+ * Functions exported by bash (see cpath-shell.c) only count as unset if the
+ * shell can remove them; with csh they are left alone.
+ */
+
+#define CPATH_BUDGET_DEFAULT_RULES "unset:BASH_FUNC_*,trim:INFOPATH,trim:MANPATH"
+/* MAX_ARG_STRLEN on Linux, 32 pages */
+#define CPATH_BUDGET_STRLEN_MAX (32 * 4096)
+/* Prefix for verbose() messages; unsetenvs' verbose_out() already adds "# " */
+#ifndef CPATH_BUDGET_NOTE
+#define CPATH_BUDGET_NOTE "# "
+#endif
+/* How many of the largest variables the report shows (all with -v) */
+#define CPATH_BUDGET_REPORT_TOP 20
+
+typedef struct cpath_budget_var_t {
+  char *name;
+  char *value;        /* NULL once unset */
+  size_t old_size;    /* what it cost before anything was changed */
+  int fitted;         /* changed by cpath_budget_fit(), so not printed yet */
+} cpath_budget_var_t;
+
+typedef struct cpath_budget_t {
+  unsigned int count;
+  unsigned int size;
+  cpath_budget_var_t *vars;
+  char delim;
+  int funcs;          /* the shell can remove exported bash functions */
+} cpath_budget_t;
+
+/**
+ * What a variable costs an exec: "NAME=value\0" plus its pointer.
+ */
+static size_t cpath_budget_var_size(const cpath_budget_var_t *var) {
+  if(NULL == var->value)
+    return 0;
+  return strlen(var->name) + strlen(var->value) + 2 + sizeof(char *);
+}
+
+/**
+ * Take stock of an environment.
+ *
+ * @param envp the environment as "NAME=value" strings
+ * @param delim the path delimiter, for trim rules
+ * @param funcs non-zero if the shell can remove exported bash functions
+ */
+static cpath_budget_t *cpath_budget_new(char **envp, char delim, int funcs) {
+  cpath_budget_t *budget = (cpath_budget_t *)fatal_malloc(sizeof(cpath_budget_t));
+  budget->count = 0;
+  budget->size = 64;
+  budget->delim = delim;
+  budget->funcs = funcs;
+  budget->vars = (cpath_budget_var_t *)fatal_malloc(sizeof(cpath_budget_var_t) * budget->size);
+  for(; *envp; envp++) {
+    cpath_budget_var_t *var;
+    char *equals;
+    if(budget->count == budget->size) {
+      budget->size *= 2;
+      budget->vars = (cpath_budget_var_t *)realloc(budget->vars, sizeof(cpath_budget_var_t) * budget->size);
+      if(! budget->vars) fatal("Unable to allocate RAM for the environment budget.\n");
+    }
+    var = &budget->vars[budget->count++];
+    var->name = str_clone(*envp);
+    equals = strchr(var->name, '=');
+    if(equals) {
+      *equals = '\0';
+      var->value = equals + 1;
+    } else {
+      var->value = var->name + strlen(var->name);
+    }
+    var->old_size = cpath_budget_var_size(var);
+    var->fitted = 0;
+  }
+  return budget;
+}
+
+/**
+ * Find a variable.
+ *
+ * @return the variable, or NULL if it isn't in the environment
+ */
+static cpath_budget_var_t *cpath_budget_find(cpath_budget_t *budget, const char *name) {
+  unsigned int idx;
+  for(idx = 0; idx < budget->count; idx++)
+    if(eq(budget->vars[idx].name, name))
+      return &budget->vars[idx];
+  return NULL;
+}
+
+/**
+ * Can the shell unset a variable? Not if it is an exported bash function
+ * and the shell can't remove those.
+ */
+static int cpath_budget_unsettable(cpath_budget_t *budget, const char *name) {
+  char *func;
+  if(budget->funcs || NULL == (func = cpath_shell_bash_func(name)))
+    return 1;
+  free(func);
+  return 0;
+}
+
+/**
+ * Record a change the tool has printed (or is going to).
+ *
+ * @param name the variable
+ * @param value the new value, or NULL if it is unset
+ */
+static void cpath_budget_set(cpath_budget_t *budget, const char *name, const char *value) {
+  cpath_budget_var_t *var = cpath_budget_find(budget, name);
+  if(! var)
+    return; /* new variables are not something we make */
+  if(! value && ! cpath_budget_unsettable(budget, name))
+    return;
+  var->value = value ? str_clone((char *)value) : NULL;
+}
+
+/**
+ * How many bytes the environment costs an exec as it stands.
+ */
+static size_t cpath_budget_size(cpath_budget_t *budget) {
+  unsigned int idx;
+  size_t size = sizeof(char *); /* the terminating NULL */
+  for(idx = 0; idx < budget->count; idx++)
+    size += cpath_budget_var_size(&budget->vars[idx]);
+  return size;
+}
+
+/**
+ * Parse a byte count, optionally followed by K or M (powers of 1024).
+ */
+static size_t cpath_budget_parse_size(const char *spec) {
+  char *end;
+  unsigned long size = strtoul(spec, &end, 10);
+  if(end == spec)
+    fatal("Invalid byte count \"%s\"\n", spec);
+  if('k' == *end || 'K' == *end) {
+    size *= 1024;
+    end++;
+  } else if('m' == *end || 'M' == *end) {
+    size *= 1024 * 1024;
+    end++;
+  }
+  if('\0' != *end)
+    fatal("Invalid byte count \"%s\"\n", spec);
+  return size;
+}
+
+/**
+ * Does a name match a rule pattern (NAME, PREFIX* or *SUFFIX)?
+ */
+static int cpath_budget_match(const char *pattern, const char *name) {
+  size_t len = strlen(pattern), name_len;
+  if(len && '*' == pattern[len - 1])
+    return 0 == strncmp(name, pattern, len - 1);
+  if('*' == *pattern) {
+    name_len = strlen(name);
+    return name_len >= len - 1 && eq(name + name_len - (len - 1), pattern + 1);
+  }
+  return eq(name, pattern);
+}
+
+/**
+ * Split a rule into what to do and the pattern.
+ *
+ * @param trim out: non-zero for a trim rule, zero for an unset rule
+ *
+ * @return the pattern, or NULL if the rule is not valid
+ */
+static const char *cpath_budget_rule(const char *rule, int *trim) {
+  *trim = 0 == strncmp(rule, "trim:", 5);
+  if(*trim)
+    return rule + 5;
+  if(0 == strncmp(rule, "unset:", 6))
+    return rule + 6;
+  return NULL;
+}
+
+/**
+ * Make sure every rule in a list is valid, so a bad one is caught before
+ * anything is printed.
+ */
+static void cpath_budget_check_rules(const char *rules) {
+  char *rule_list = str_clone((char *)rules), *rule, *save;
+  int trim;
+  for(rule = strtok_r(rule_list, ",", &save); rule; rule = strtok_r(NULL, ",", &save))
+    if(NULL == cpath_budget_rule(rule, &trim))
+      fatal("Invalid budget rule \"%s\", use unset:PATTERN or trim:PATTERN\n", rule);
+  free(rule_list);
+}
+
+/**
+ * Order variables largest first.
+ */
+static int cpath_budget_larger(const void *left, const void *right) {
+  size_t left_size = cpath_budget_var_size(*(cpath_budget_var_t * const *)left);
+  size_t right_size = cpath_budget_var_size(*(cpath_budget_var_t * const *)right);
+  return left_size < right_size ? 1 : left_size > right_size ? -1 : 0;
+}
+
+/**
+ * Get the variables, largest first.
+ *
+ * @param count out: how many there are
+ */
+static cpath_budget_var_t **cpath_budget_sorted(cpath_budget_t *budget, unsigned int *count) {
+  cpath_budget_var_t **sorted = (cpath_budget_var_t **)fatal_malloc(sizeof(cpath_budget_var_t *) *
+                                                                    (budget->count + 1));
+  unsigned int idx;
+  *count = 0;
+  for(idx = 0; idx < budget->count; idx++)
+    if(budget->vars[idx].value)
+      sorted[(*count)++] = &budget->vars[idx];
+  qsort(sorted, *count, sizeof(cpath_budget_var_t *), cpath_budget_larger);
+  return sorted;
+}
+
+/**
+ * Print the size of the environment and what each variable adds to it.
+ */
+static void cpath_budget_report(cpath_budget_t *budget) {
+  unsigned int count, idx;
+  size_t size = cpath_budget_size(budget), old_size = sizeof(char *);
+  cpath_budget_var_t **sorted = cpath_budget_sorted(budget, &count);
+  for(idx = 0; idx < budget->count; idx++)
+    old_size += budget->vars[idx].old_size;
+  verbose_out("Environment: %lu bytes in %u variables (was %lu), ARG_MAX is %ld\n",
+              (unsigned long)size, count, (unsigned long)old_size, sysconf(_SC_ARG_MAX));
+  for(idx = 0; idx < count && (idx < CPATH_BUDGET_REPORT_TOP || opt_verbosity > 0); idx++)
+    verbose_out("%10lu %5.1f%% %s\n", (unsigned long)cpath_budget_var_size(sorted[idx]),
+                100.0 * cpath_budget_var_size(sorted[idx]) / size, sorted[idx]->name);
+  if(idx < count)
+    verbose_out("(%u smaller variables not shown, use -v to see them)\n", count - idx);
+  free(sorted);
+}
+
+/**
+ * Warn about variables no exec can pass on, however small the rest is.
+ */
+static void cpath_budget_check_strlen(cpath_budget_t *budget) {
+  unsigned int idx;
+  for(idx = 0; idx < budget->count; idx++) {
+    cpath_budget_var_t *var = &budget->vars[idx];
+    size_t len = cpath_budget_var_size(var) - sizeof(char *);
+    if(var->value && len > CPATH_BUDGET_STRLEN_MAX)
+      verbose(0, (CPATH_BUDGET_NOTE "%s is %lu bytes, more than an exec can pass on (%u), exec will "
+                  "fail with E2BIG\n", var->name, (unsigned long)len, CPATH_BUDGET_STRLEN_MAX));
+  }
+}
+
+/**
+ * Apply the rules, in order, until the environment costs at most limit bytes.
+ * Changed variables are marked fitted for the caller to print.
+ *
+ * @param limit the budget in bytes
+ * @param rules comma separated "unset:PATTERN" and "trim:PATTERN" rules
+ *
+ * @return non-zero if the environment is under budget
+ */
+static int cpath_budget_fit(cpath_budget_t *budget, size_t limit, const char *rules) {
+  char *rule_list = str_clone((char *)rules), *rule, *save;
+  size_t size = cpath_budget_size(budget);
+  unsigned int count, idx;
+  cpath_budget_check_strlen(budget);
+  for(rule = strtok_r(rule_list, ",", &save); rule && size > limit; rule = strtok_r(NULL, ",", &save)) {
+    cpath_budget_var_t **sorted;
+    int trim;
+    const char *pattern = cpath_budget_rule(rule, &trim);
+    if(! pattern)
+      fatal("Invalid budget rule \"%s\", use unset:PATTERN or trim:PATTERN\n", rule);
+    sorted = cpath_budget_sorted(budget, &count);
+    for(idx = 0; idx < count && size > limit; idx++) {
+      cpath_budget_var_t *var = sorted[idx];
+      size_t before = cpath_budget_var_size(var);
+      if(! cpath_budget_match(pattern, var->name))
+        continue;
+      if(trim) {
+        char *value = str_clone(var->value), *last;
+        while(size - before + strlen(var->name) + strlen(value) + 2 + sizeof(char *) > limit &&
+              NULL != (last = strrchr(value, budget->delim)))
+          *last = '\0';
+        if(strlen(value) == strlen(var->value)) {
+          free(value);
+          continue;
+        }
+        verbose(1, (CPATH_BUDGET_NOTE "Budget: trimming %s from %lu to %lu bytes\n", var->name,
+                    (unsigned long)strlen(var->value), (unsigned long)strlen(value)));
+        var->value = value;
+      } else if(! cpath_budget_unsettable(budget, var->name)) {
+        verbose(0, (CPATH_BUDGET_NOTE "Budget: not unsetting %s, the shell can't remove exported "
+                    "functions\n", var->name));
+        continue;
+      } else {
+        verbose(1, (CPATH_BUDGET_NOTE "Budget: unsetting %s (%lu bytes)\n", var->name,
+                    (unsigned long)before));
+        var->value = NULL;
+      }
+      var->fitted = 1;
+      size = size - before + cpath_budget_var_size(var);
+    }
+    free(sorted);
+  }
+  free(rule_list);
+  if(size > limit)
+    verbose(0, (CPATH_BUDGET_NOTE "Environment is still %lu bytes, over the budget of %lu, after all "
+                "the rules\n", (unsigned long)size, (unsigned long)limit));
+  return size <= limit;
+}
+
+#endif /* _CPATH_BUDGET_LOADED_SEMAPHORE */
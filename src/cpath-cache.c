@@ -0,0 +1,407 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_CACHE_LOADED_SEMAPHORE
+#define _CPATH_CACHE_LOADED_SEMAPHORE
+
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "cpath-index.c"
+
+/**
+ * Persistent executable index, so that looking up commands in a PATH does not
+ * have to read every directory again in every process.
+ *
+ * The index for a list of directories is kept in one file, named after a hash
+ * of the directories (and of our uid/gid, since that decides what counts as
+ * executable). The file is position independent so it can be used straight
+ * from mmap(2):
+ *
+ *   header | one record per directory | hash table | string pool
+ *
+ * Each directory record holds the device, inode and mtime the directory had
+ * when it was read. The file is only used if every directory still has the
+ * same ones, so checking an index costs one stat() per directory, after
+ * which every lookup is a hash table probe with no syscalls at all. Adding,
+ * removing or renaming a command changes its directory's mtime. A directory
+ * modified within a second of the index being built is treated as changed,
+ * since a coarse mtime could otherwise hide a change made right after it was
+ * read.
+ *
+ * Elements with unknown contents (empty or relative elements, unreadable
+ * directories) are recorded as such and are probed with stat() at lookup
+ * time, as are the files the index points to, since changing permissions
+ * doesn't change a directory's mtime.
+ *
+ * Files are written under a temporary name and renamed into place. The files
+ * are native endian and only meant for the machine (or identical ones) that
+ * wrote them.
+ */
+
+#define CPATH_CACHE_MAGIC   "CPIDX001"
+/* Directory mtimes this close (in seconds) to build time don't count */
+#define CPATH_CACHE_RACY_SECS 1
+
+typedef struct cpath_cache_header_t {
+  char magic[8];
+  unsigned int header_size;   /* sizeof(cpath_cache_header_t), catches ABI changes */
+  unsigned int dir_count;
+  unsigned int slot_count;    /* always a power of two */
+  unsigned int name_count;
+  unsigned int uid;
+  unsigned int gid;
+  long long built;            /* time() when the directories were stat()ed */
+  unsigned long long size;    /* of the whole file */
+} cpath_cache_header_t;
+
+typedef struct cpath_cache_dir_t {
+  unsigned long long dev;
+  unsigned long long ino;
+  long long mtime_sec;
+  long long mtime_nsec;
+  unsigned int path;          /* offset in the string pool */
+  unsigned int known;         /* zero if the contents are unknown */
+} cpath_cache_dir_t;
+
+typedef struct cpath_cache_slot_t {
+  unsigned int hash;
+  unsigned int name;          /* offset in the string pool, 0 for empty */
+  unsigned int first;         /* position of the directory the name resolves to */
+} cpath_cache_slot_t;
+
+typedef struct cpath_cache_t {
+  char *data;                 /* the mapped file, or the freshly built index */
+  size_t size;
+  int mapped;                 /* whether data came from mmap() */
+  cpath_cache_header_t *header;
+  cpath_cache_dir_t *dirs;
+  cpath_cache_slot_t *slots;
+  char *pool;
+  char **paths;               /* the directories, in search order */
+} cpath_cache_t;
+
+/**
+ * Get the default directory for index files: $XDG_CACHE_HOME/cleanpath, or
+ * ~/.cache/cleanpath if that's not set.
+ *
+ * @return the directory, or NULL if there is no home directory to use
+ */
+static char *cpath_cache_default_dir(void) {
+  char *cache_home = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  char *dir;
+  if(cache_home && '/' == *cache_home) {
+    dir = (char *)fatal_malloc(PATH_MAX);
+    snprintf(dir, PATH_MAX, "%s/cleanpath", cache_home);
+  } else if(home && '/' == *home) {
+    dir = (char *)fatal_malloc(PATH_MAX);
+    snprintf(dir, PATH_MAX, "%s/.cache", home);
+    mkdir(dir, 0700);
+    snprintf(dir, PATH_MAX, "%s/.cache/cleanpath", home);
+  } else {
+    return NULL;
+  }
+  return dir;
+}
+
+/**
+ * Make sure the cache directory exists and is safe to use, i.e. it's a
+ * directory we own that nobody else can write to. Otherwise someone else
+ * could plant an index that sends our lookups wherever they like.
+ *
+ * @return non-zero if the directory is usable
+ */
+static int cpath_cache_dir_ok(const char *dir) {
+  struct stat file_stat;
+  if(0 != mkdir(dir, 0700) && EEXIST != errno) {
+    verbose(2, ("# Unable to create cache directory \"%s\": %s\n", dir, strerror(errno)));
+    return 0;
+  }
+  if(0 != lstat(dir, &file_stat) || ! S_ISDIR(file_stat.st_mode) ||
+     file_stat.st_uid != uid || (file_stat.st_mode & (S_IWGRP | S_IWOTH))) {
+    verbose(1, ("# Not using cache directory \"%s\": not a directory owned by and only writable by us\n",
+               dir));
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Get the name of the index file for a list of directories.
+ */
+static void cpath_cache_file_name(char *file_name, size_t size, const char *cache_dir,
+                                  char **dirs, unsigned int count) {
+  unsigned long long hash = CPATH_INDEX_FNV_SEED;
+  unsigned int pos;
+  hash = cpath_index_fnv(hash, &uid, sizeof(uid));
+  hash = cpath_index_fnv(hash, &gid, sizeof(gid));
+  for(pos = 0; pos < count; pos++)
+    hash = cpath_index_fnv(hash, dirs[pos], strlen(dirs[pos]) + 1);
+  snprintf(file_name, size, "%s/index-%016llx", cache_dir, hash);
+}
+
+/**
+ * Fill in a directory record from the directory as it is now. Only absolute
+ * directories are worth recording, the contents of relative ones depend on
+ * where we are.
+ *
+ * @return non-zero if the directory could be stat()ed
+ */
+static int cpath_cache_stat_dir(const char *dir, cpath_cache_dir_t *record) {
+  struct stat file_stat;
+  memset(record, 0, sizeof(cpath_cache_dir_t));
+  if('/' != *dir || 0 != stat(dir, &file_stat))
+    return 0;
+  record->dev = file_stat.st_dev;
+  record->ino = file_stat.st_ino;
+  record->mtime_sec = file_stat.st_mtim.tv_sec;
+  record->mtime_nsec = file_stat.st_mtim.tv_nsec;
+  return 1;
+}
+
+/**
+ * Point a cache's section pointers into its data, checking that the data
+ * is an index for this list of directories and our uid/gid.
+ *
+ * @return non-zero if it is
+ */
+static int cpath_cache_attach(cpath_cache_t *cache, char **dirs, unsigned int count) {
+  cpath_cache_header_t *header = (cpath_cache_header_t *)cache->data;
+  size_t pool_offset;
+  unsigned int pos;
+  if(cache->size < sizeof(cpath_cache_header_t) ||
+     0 != memcmp(header->magic, CPATH_CACHE_MAGIC, sizeof(header->magic)) ||
+     header->header_size != sizeof(cpath_cache_header_t) ||
+     header->size != cache->size || header->dir_count != count ||
+     header->uid != (unsigned int)uid || header->gid != (unsigned int)gid ||
+     0 == header->slot_count || 0 != (header->slot_count & (header->slot_count - 1)))
+    return 0;
+  pool_offset = sizeof(cpath_cache_header_t) + sizeof(cpath_cache_dir_t) * count +
+    sizeof(cpath_cache_slot_t) * (size_t)header->slot_count;
+  if(pool_offset >= cache->size || '\0' != cache->data[cache->size - 1])
+    return 0;
+  cache->header = header;
+  cache->dirs = (cpath_cache_dir_t *)(cache->data + sizeof(cpath_cache_header_t));
+  cache->slots = (cpath_cache_slot_t *)(cache->dirs + count);
+  cache->pool = cache->data + pool_offset;
+  cache->paths = dirs;
+  for(pos = 0; pos < count; pos++)
+    if(cache->dirs[pos].path >= cache->size - pool_offset ||
+       ! eq(cache->pool + cache->dirs[pos].path, dirs[pos]))
+      return 0;
+  return 1;
+}
+
+/**
+ * Map an existing index file and check that it's current.
+ *
+ * @return the index, or NULL if there is none or it's stale
+ */
+static cpath_cache_t *cpath_cache_open(const char *file_name, char **dirs, unsigned int count) {
+  cpath_cache_t *cache;
+  struct stat file_stat;
+  unsigned int pos;
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return NULL;
+  if(0 != fstat(fd, &file_stat) || file_stat.st_uid != uid ||
+     file_stat.st_size < (off_t)sizeof(cpath_cache_header_t)) {
+    close(fd);
+    return NULL;
+  }
+  cache = (cpath_cache_t *)fatal_malloc(sizeof(cpath_cache_t));
+  cache->size = file_stat.st_size;
+  cache->mapped = 1;
+  cache->data = (char *)mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(MAP_FAILED == cache->data) {
+    free(cache);
+    return NULL;
+  }
+  if(! cpath_cache_attach(cache, dirs, count)) {
+    verbose(2, ("# Ignoring index \"%s\", it's not for this path\n", file_name));
+    munmap(cache->data, cache->size);
+    free(cache);
+    return NULL;
+  }
+  for(pos = 0; pos < count; pos++) {
+    cpath_cache_dir_t now, *then = &cache->dirs[pos];
+    int known = cpath_cache_stat_dir(dirs[pos], &now);
+    if(! then->known && ! known)
+      continue;
+    if(known != (then->known ? 1 : 0) || now.dev != then->dev || now.ino != then->ino ||
+       now.mtime_sec != then->mtime_sec || now.mtime_nsec != then->mtime_nsec ||
+       now.mtime_sec + CPATH_CACHE_RACY_SECS >= cache->header->built) {
+      verbose(2, ("# Index \"%s\" is stale, \"%s\" changed\n", file_name, dirs[pos]));
+      munmap(cache->data, cache->size);
+      free(cache);
+      return NULL;
+    }
+  }
+  debug(3, ("cpath_cache_open: using \"%s\"\n", file_name));
+  return cache;
+}
+
+/**
+ * Build the index for a list of directories in RAM.
+ */
+static cpath_cache_t *cpath_cache_build(char **dirs, unsigned int count) {
+  cpath_cache_t *cache = (cpath_cache_t *)fatal_malloc(sizeof(cpath_cache_t));
+  cpath_cache_dir_t *records = (cpath_cache_dir_t *)fatal_malloc(sizeof(cpath_cache_dir_t) * (count + 1));
+  cpath_cache_header_t *header;
+  cpath_index_t *index;
+  size_t pool_size = 1, pool_offset, used;
+  unsigned int pos, slot;
+  long long built = (long long)time(NULL);
+  /* stat before reading, so a change made while we read shows up as stale */
+  for(pos = 0; pos < count; pos++)
+    records[pos].known = cpath_cache_stat_dir(dirs[pos], &records[pos]);
+  index = cpath_index_build(dirs, count, CPATH_KIND_EXEC);
+  for(pos = 0; pos < count; pos++) {
+    if(NULL == index->scans[pos])
+      records[pos].known = 0;
+    pool_size += strlen(dirs[pos]) + 1;
+  }
+  for(slot = 0; slot < index->slot_count; slot++)
+    if(index->slots[slot].name)
+      pool_size += strlen(index->slots[slot].name) + 1;
+  pool_offset = sizeof(cpath_cache_header_t) + sizeof(cpath_cache_dir_t) * count +
+    sizeof(cpath_cache_slot_t) * (size_t)index->slot_count;
+  cache->size = pool_offset + pool_size;
+  cache->data = (char *)calloc(cache->size, 1);
+  if(! cache->data) fatal("Unable to allocate RAM for executable index.\n");
+  cache->mapped = 0;
+  header = (cpath_cache_header_t *)cache->data;
+  memcpy(header->magic, CPATH_CACHE_MAGIC, sizeof(header->magic));
+  header->header_size = sizeof(cpath_cache_header_t);
+  header->dir_count = count;
+  header->slot_count = index->slot_count;
+  header->name_count = index->name_count;
+  header->uid = (unsigned int)uid;
+  header->gid = (unsigned int)gid;
+  header->built = built;
+  header->size = cache->size;
+  /* offset 0 of the pool is "", so a 0 name marks an empty slot */
+  used = 1;
+  for(pos = 0; pos < count; pos++) {
+    records[pos].path = used;
+    strcpy(cache->data + pool_offset + used, dirs[pos]);
+    used += strlen(dirs[pos]) + 1;
+  }
+  memcpy(cache->data + sizeof(cpath_cache_header_t), records, sizeof(cpath_cache_dir_t) * count);
+  for(slot = 0; slot < index->slot_count; slot++) {
+    cpath_cache_slot_t *out = (cpath_cache_slot_t *)
+      (cache->data + sizeof(cpath_cache_header_t) + sizeof(cpath_cache_dir_t) * count) + slot;
+    if(NULL == index->slots[slot].name)
+      continue;
+    out->hash = index->slots[slot].hash;
+    out->first = index->slots[slot].first;
+    out->name = used;
+    strcpy(cache->data + pool_offset + used, index->slots[slot].name);
+    used += strlen(index->slots[slot].name) + 1;
+  }
+  free(records);
+  cpath_cache_attach(cache, dirs, count);
+  return cache;
+}
+
+/**
+ * Write an index to its file, under a temporary name that is then renamed
+ * into place. Failing to write is not an error, the next run just builds
+ * the index again.
+ */
+static void cpath_cache_write(cpath_cache_t *cache, const char *file_name) {
+  char tmp_name[PATH_MAX + 16];
+  size_t written = 0;
+  int fd;
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int)getpid());
+  fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0) {
+    verbose(2, ("# Unable to write index \"%s\": %s\n", tmp_name, strerror(errno)));
+    return;
+  }
+  while(written < cache->size) {
+    ssize_t count = write(fd, cache->data + written, cache->size - written);
+    if(count <= 0) {
+      verbose(2, ("# Unable to write index \"%s\": %s\n", tmp_name, strerror(errno)));
+      close(fd);
+      unlink(tmp_name);
+      return;
+    }
+    written += count;
+  }
+  if(0 != close(fd) || 0 != rename(tmp_name, file_name)) {
+    verbose(2, ("# Unable to write index \"%s\": %s\n", file_name, strerror(errno)));
+    unlink(tmp_name);
+    return;
+  }
+  verbose(2, ("# Wrote index \"%s\" with %u names\n", file_name, cache->header->name_count));
+}
+
+/**
+ * Get a current index for a list of directories, from the cache if there is
+ * one, building (and saving) it otherwise.
+ *
+ * @param dirs the directories, in search order
+ * @param count how many there are
+ * @param cache_dir where index files are kept, NULL to not use any
+ */
+static cpath_cache_t *cpath_cache_get(char **dirs, unsigned int count, const char *cache_dir) {
+  char file_name[PATH_MAX];
+  cpath_cache_t *cache;
+  if(! cache_dir || ! cpath_cache_dir_ok(cache_dir))
+    return cpath_cache_build(dirs, count);
+  cpath_cache_file_name(file_name, sizeof(file_name), cache_dir, dirs, count);
+  if(NULL != (cache = cpath_cache_open(file_name, dirs, count)))
+    return cache;
+  cache = cpath_cache_build(dirs, count);
+  cpath_cache_write(cache, file_name);
+  return cache;
+}
+
+/**
+ * Check if dir/name is something we could execute.
+ */
+static int cpath_cache_probe(const char *dir, const char *name) {
+  char file_name[PATH_MAX];
+  struct stat file_stat;
+  snprintf(file_name, sizeof(file_name), "%s%s%s", dir, '\0' == *dir ? "" : "/", name);
+  return 0 == stat(file_name, &file_stat) && cpath_can_exec_file(&file_stat);
+}
+
+/**
+ * Find the directory a command resolves to, the way a PATH search from here
+ * would.
+ *
+ * @param cache the index
+ * @param name the command
+ *
+ * @return the position of the directory, or CPATH_INDEX_NONE if no
+ *         directory holds it
+ */
+static unsigned int cpath_cache_resolve(cpath_cache_t *cache, const char *name) {
+  unsigned int hash = cpath_index_hash(name), mask = cache->header->slot_count - 1;
+  unsigned int slot = hash & mask, first = cache->header->dir_count, pos;
+  size_t pool_size = cache->size - (cache->pool - cache->data);
+  while(0 != cache->slots[slot].name) {
+    if(cache->slots[slot].name >= pool_size || cache->slots[slot].first >= first)
+      break; /* garbage, so don't trust any of it */
+    if(cache->slots[slot].hash == hash && eq(cache->pool + cache->slots[slot].name, name)) {
+      first = cache->slots[slot].first;
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  for(pos = 0; pos < cache->header->dir_count; pos++) {
+    if(pos < first && cache->dirs[pos].known)
+      continue;
+    if(cpath_cache_probe(cache->paths[pos], name))
+      return pos;
+    /* the file the index pointed at has changed since (e.g., it was
+       chmod'ed), so fall back to probing everything after it */
+    if(pos == first)
+      first = 0;
+  }
+  return CPATH_INDEX_NONE;
+}
+
+#endif /* _CPATH_CACHE_LOADED_SEMAPHORE */
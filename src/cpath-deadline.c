@@ -0,0 +1,61 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_DEADLINE_LOADED_SEMAPHORE
+#define _CPATH_DEADLINE_LOADED_SEMAPHORE
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * Work handed to threads that are waited for, but only up to a deadline:
+ * the probes that can hang on a slow server (automount pre-warming, stat()s
+ * on network filesystems). The threads are detached, so a thread stuck past
+ * the deadline is simply left behind and never holds up the exit.
+ *
+ * Workers count what they finished in a counter guarded by a mutex, and
+ * signal a condition variable each time.
+ */
+
+/**
+ * Work out the deadline timeout milliseconds from now.
+ */
+static void cpath_deadline_in(struct timespec *deadline, long timeout) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += timeout / 1000;
+  deadline->tv_nsec += (timeout % 1000) * 1000000L;
+  if(deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+/**
+ * Start a detached thread.
+ *
+ * @return non-zero if it's running
+ */
+static int cpath_deadline_start(void *(*worker)(void *), void *arg) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  int started;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  started = 0 == pthread_create(&thread, &attr, worker, arg);
+  pthread_attr_destroy(&attr);
+  return started;
+}
+
+/**
+ * Wait until count things are finished, or the deadline has passed. Called,
+ * and returns, with lock held.
+ *
+ * @param finished how many are, updated by the workers under lock
+ */
+static void cpath_deadline_wait(pthread_mutex_t *lock, pthread_cond_t *done, const unsigned int *finished,
+                                unsigned int count, const struct timespec *deadline) {
+  while(*finished < count)
+    if(ETIMEDOUT == pthread_cond_timedwait(done, lock, deadline))
+      break;
+}
+
+#endif /* _CPATH_DEADLINE_LOADED_SEMAPHORE */
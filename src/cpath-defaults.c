@@ -0,0 +1,202 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_DEFAULTS_LOADED_SEMAPHORE
+#define _CPATH_DEFAULTS_LOADED_SEMAPHORE
+
+#include <glob.h>
+#include <limits.h>
+#include "cpath-elf.c"
+
+/**
+ * The places the dynamic loader and man search on their own, so elements of
+ * LD_LIBRARY_PATH and MANPATH that only repeat them can be recognized.
+ *
+ * For the loader that is the system (trusted) directories, which it always
+ * searches last, and every directory in /etc/ld.so.conf (following include
+ * globs), whose libraries it finds through /etc/ld.so.cache. For man it is
+ * the MANDATORY_MANPATH entries of the man-db config, and the MANPATH_MAP
+ * entries for the directories in PATH.
+ *
+ * Directories are compared by device and inode, so /lib and /usr/lib are the
+ * same on merged-/usr systems.
+ */
+
+#define CPATH_DEFAULTS_LD_CONF "/etc/ld.so.conf"
+/* man-db's config, Debian and Red Hat style */
+#define CPATH_DEFAULTS_MAN_CONF_1 "/etc/manpath.config"
+#define CPATH_DEFAULTS_MAN_CONF_2 "/etc/man_db.conf"
+/* ld.so.conf includes nested deeper than this are ignored */
+#define CPATH_DEFAULTS_MAX_DEPTH 8
+
+typedef struct cpath_defaults_t {
+  unsigned int count;
+  unsigned int size;
+  char **paths;
+  const char **why;          /* how the directory is searched anyway */
+  dev_t *devs;
+  ino_t *inos;
+} cpath_defaults_t;
+
+/**
+ * Create an empty set of default directories.
+ */
+static cpath_defaults_t *cpath_defaults_new(void) {
+  cpath_defaults_t *defaults = (cpath_defaults_t *)fatal_malloc(sizeof(cpath_defaults_t));
+  defaults->count = 0;
+  defaults->size = 16;
+  defaults->paths = (char **)fatal_malloc(sizeof(char *) * defaults->size);
+  defaults->why = (const char **)fatal_malloc(sizeof(char *) * defaults->size);
+  defaults->devs = (dev_t *)fatal_malloc(sizeof(dev_t) * defaults->size);
+  defaults->inos = (ino_t *)fatal_malloc(sizeof(ino_t) * defaults->size);
+  return defaults;
+}
+
+/**
+ * Find a directory in the set.
+ *
+ * @return its position, or -1 if it's not there (or doesn't exist)
+ */
+static int cpath_defaults_find(cpath_defaults_t *defaults, const char *dir) {
+  struct stat file_stat;
+  unsigned int idx;
+  if('/' != *dir || 0 != stat(dir, &file_stat) || ! S_ISDIR(file_stat.st_mode))
+    return -1;
+  for(idx = 0; idx < defaults->count; idx++)
+    if(defaults->devs[idx] == file_stat.st_dev && defaults->inos[idx] == file_stat.st_ino)
+      return idx;
+  return -1;
+}
+
+/**
+ * Add a directory to the set, if it exists and isn't in it already.
+ */
+static void cpath_defaults_add(cpath_defaults_t *defaults, const char *dir, const char *why) {
+  struct stat file_stat;
+  if('/' != *dir || 0 != stat(dir, &file_stat) || ! S_ISDIR(file_stat.st_mode) ||
+     0 <= cpath_defaults_find(defaults, dir))
+    return;
+  if(defaults->count == defaults->size) {
+    defaults->size *= 2;
+    defaults->paths = (char **)realloc(defaults->paths, sizeof(char *) * defaults->size);
+    defaults->why = (const char **)realloc(defaults->why, sizeof(char *) * defaults->size);
+    defaults->devs = (dev_t *)realloc(defaults->devs, sizeof(dev_t) * defaults->size);
+    defaults->inos = (ino_t *)realloc(defaults->inos, sizeof(ino_t) * defaults->size);
+    if(! defaults->paths || ! defaults->why || ! defaults->devs || ! defaults->inos)
+      fatal("Unable to allocate RAM for default directories.\n");
+  }
+  debug(3, ("cpath_defaults_add(\"%s\", \"%s\")\n", dir, why));
+  defaults->paths[defaults->count] = str_clone((char *)dir);
+  defaults->why[defaults->count] = why;
+  defaults->devs[defaults->count] = file_stat.st_dev;
+  defaults->inos[defaults->count] = file_stat.st_ino;
+  defaults->count++;
+}
+
+/**
+ * Add the directories in an ld.so.conf style file, following includes the
+ * way ldconfig does (relative include patterns are relative to the
+ * including file's directory).
+ */
+static void cpath_defaults_ld_conf(cpath_defaults_t *defaults, const char *file_name, int depth) {
+  char line[PATH_MAX + 64], *save;
+  FILE *fh;
+  if(depth > CPATH_DEFAULTS_MAX_DEPTH || NULL == (fh = fopen(file_name, "r")))
+    return;
+  while(fgets(line, sizeof(line), fh)) {
+    char *cptr = strchr(line, '#'), *word;
+    if(cptr) *cptr = '\0';
+    cptr = line;
+    while(isspace((unsigned char)*cptr)) cptr++;
+    if(0 == strncmp(cptr, "include", 7) && isspace((unsigned char)cptr[7])) {
+      char pattern[PATH_MAX];
+      glob_t matches;
+      size_t idx;
+      /* strtok_r(), since we recurse in the middle of it */
+      for(word = strtok_r(cptr + 8, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if('/' == *word) {
+          snprintf(pattern, sizeof(pattern), "%s", word);
+        } else {
+          const char *slash = strrchr(file_name, '/');
+          snprintf(pattern, sizeof(pattern), "%.*s%s", slash ? (int)(slash - file_name + 1) : 0,
+                   file_name, word);
+        }
+        if(0 == glob(pattern, 0, NULL, &matches)) {
+          for(idx = 0; idx < matches.gl_pathc; idx++)
+            cpath_defaults_ld_conf(defaults, matches.gl_pathv[idx], depth + 1);
+          globfree(&matches);
+        }
+      }
+      continue;
+    }
+    if(0 == strncmp(cptr, "hwcap", 5) && isspace((unsigned char)cptr[5]))
+      continue;
+    for(word = strtok_r(cptr, " \t\r\n:,", &save); word; word = strtok_r(NULL, " \t\r\n:,", &save)) {
+      char *type = strchr(word, '=');
+      if(type) *type = '\0'; /* old "dir=libc5" style */
+      cpath_defaults_add(defaults, word, "found through ld.so.cache (ld.so.conf)");
+    }
+  }
+  fclose(fh);
+}
+
+/**
+ * Get the directories the dynamic loader searches on its own.
+ */
+static cpath_defaults_t *cpath_defaults_lib(void) {
+  cpath_defaults_t *defaults = cpath_defaults_new();
+  cpath_elf_obj_t self;
+  const char *interp = "";
+  char **dirs;
+  int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  if(fd >= 0) {
+    /* the loader we were started with is as good a guess as any */
+    if(cpath_elf_read(fd, "/proc/self/exe", &self) && self.interp)
+      interp = self.interp;
+    close(fd);
+  }
+  for(dirs = cpath_elf_defaults(interp); *dirs; dirs++)
+    cpath_defaults_add(defaults, *dirs, "a system directory the loader always searches");
+  cpath_defaults_ld_conf(defaults, CPATH_DEFAULTS_LD_CONF, 0);
+  return defaults;
+}
+
+/**
+ * Get the directories man searches on its own when MANPATH has an empty
+ * element.
+ */
+static cpath_defaults_t *cpath_defaults_man(void) {
+  cpath_defaults_t *defaults = cpath_defaults_new();
+  char line[PATH_MAX * 2 + 64], *path = getenv("PATH");
+  FILE *fh = fopen(CPATH_DEFAULTS_MAN_CONF_1, "r");
+  if(! fh)
+    fh = fopen(CPATH_DEFAULTS_MAN_CONF_2, "r");
+  if(! fh) {
+    verbose(2, ("# No man config (%s or %s), not eliding anything from MANPATH\n",
+                CPATH_DEFAULTS_MAN_CONF_1, CPATH_DEFAULTS_MAN_CONF_2));
+    return defaults;
+  }
+  while(fgets(line, sizeof(line), fh)) {
+    char *key = strtok(line, " \t\r\n"), *first, *second;
+    if(! key || '#' == *key || NULL == (first = strtok(NULL, " \t\r\n")))
+      continue;
+    second = strtok(NULL, " \t\r\n");
+    if(eq(key, "MANDATORY_MANPATH")) {
+      cpath_defaults_add(defaults, first, "searched by man (MANDATORY_MANPATH)");
+    } else if(eq(key, "MANPATH_MAP") && second && path) {
+      /* only used if its bin directory is in PATH */
+      size_t len = strlen(first);
+      const char *cptr = path;
+      while(cptr) {
+        if(0 == strncmp(cptr, first, len) && (':' == cptr[len] || '\0' == cptr[len])) {
+          cpath_defaults_add(defaults, second, "searched by man (MANPATH_MAP for PATH)");
+          break;
+        }
+        cptr = strchr(cptr, ':');
+        if(cptr) cptr++;
+      }
+    }
+  }
+  fclose(fh);
+  return defaults;
+}
+
+#endif /* _CPATH_DEFAULTS_LOADED_SEMAPHORE */
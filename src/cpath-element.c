@@ -0,0 +1,85 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_ELEMENT_LOADED_SEMAPHORE
+#define _CPATH_ELEMENT_LOADED_SEMAPHORE
+
+/**
+ * Tables of path elements, for the passes that look at every element before
+ * cleaning (batch probing, scheduling and single-flight) and answer for them
+ * while cleaning.
+ *
+ * Elements are kept the way cpath_add_if() keeps them, without trailing
+ * slashes, and hashed with the same DJB hash (hash * 33 + c from 5381), so
+ * the hash cpath_should_add() is handed finds them without hashing again.
+ * A table is a fixed number of buckets, each a chain of entries. Callers put
+ * a cpath_element_t first in their own entries and chain those.
+ *
+ * The helpers are inline so tools that only want the hash (the allowlist)
+ * can include this without carrying unused functions.
+ */
+
+/* Same magic number used everywhere else for DJB hashes */
+#define CPATH_ELEMENT_HASH_SEED 5381
+/* Number of buckets in a table, must be a power of two */
+#define CPATH_ELEMENT_BUCKETS 1024
+
+/**
+ * Add a character to a DJB hash.
+ */
+#define cpath_element_hash_step(hash, c) (((hash) << 5) + (hash) + (c))
+
+typedef struct cpath_element_t {
+  const char *path;                 /* without trailing slashes */
+  unsigned int hash;                /* of path */
+  struct cpath_element_t *next;     /* next in this bucket */
+} cpath_element_t;
+
+typedef struct cpath_elements_t {
+  cpath_element_t *buckets[CPATH_ELEMENT_BUCKETS];
+} cpath_elements_t;
+
+/**
+ * The length of an element without its trailing slashes (but "/" stays).
+ */
+static inline size_t cpath_element_len(const char *element) {
+  size_t len = strlen(element);
+  while(len > 1 && '/' == element[len - 1]) len--;
+  return len;
+}
+
+/**
+ * Hash the first len characters of an element.
+ */
+static inline unsigned int cpath_element_hash(const char *element, size_t len) {
+  unsigned int hash = CPATH_ELEMENT_HASH_SEED;
+  size_t idx;
+  for(idx = 0; idx < len; idx++)
+    hash = cpath_element_hash_step(hash, element[idx]);
+  return hash;
+}
+
+/**
+ * Find an element.
+ *
+ * @param len its length, without trailing slashes
+ * @param hash its hash, from cpath_element_hash() or cpath_should_add()
+ *
+ * @return its entry, or NULL if it's not in the table
+ */
+static inline cpath_element_t *cpath_element_find(cpath_elements_t *table, const char *element, size_t len,
+                                                  unsigned int hash) {
+  cpath_element_t *entry;
+  for(entry = table->buckets[hash & (CPATH_ELEMENT_BUCKETS - 1)]; entry; entry = entry->next)
+    if(entry->hash == hash && 0 == strncmp(entry->path, element, len) && '\0' == entry->path[len])
+      return entry;
+  return NULL;
+}
+
+/**
+ * Add an entry, whose path and hash are set, to the table.
+ */
+static inline void cpath_element_insert(cpath_elements_t *table, cpath_element_t *entry) {
+  entry->next = table->buckets[entry->hash & (CPATH_ELEMENT_BUCKETS - 1)];
+  table->buckets[entry->hash & (CPATH_ELEMENT_BUCKETS - 1)] = entry;
+}
+
+#endif /* _CPATH_ELEMENT_LOADED_SEMAPHORE */
@@ -0,0 +1,788 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_ELF_LOADED_SEMAPHORE
+#define _CPATH_ELF_LOADED_SEMAPHORE
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+/**
+ * Dynamic loader (glibc ld.so) search simulator.
+ *
+ * Reads the ELF dynamic sections of a program and of everything it loads and
+ * replays the search ld.so does for every DT_NEEDED entry, in the order it
+ * does it (breadth first), counting every open() that fails. For each name
+ * that isn't already loaded, the search goes:
+ *
+ *   1. a name with a '/' in it is opened as is
+ *   2. DT_RPATH of the object asking for it and of the objects that loaded
+ *      it, up to the program, unless the object asking has a DT_RUNPATH
+ *   3. LD_LIBRARY_PATH
+ *   4. DT_RUNPATH of the object asking for it
+ *   5. /etc/ld.so.cache, then the system directories, unless the object asking
+ *      was linked with -z nodefaultlib
+ *
+ * $ORIGIN, $LIB and $PLATFORM are expanded in DT_RPATH/DT_RUNPATH. A file of
+ * the wrong class or machine is skipped like ld.so skips it (and counted as a
+ * failed open), and a directory that turns out not to exist is not tried
+ * again. Libraries that are already loaded are matched by name and soname,
+ * then by device and inode.
+ *
+ * Not simulated: glibc-hwcaps subdirectories (which cost at most one failed
+ * open per directory per process), LD_PRELOAD, /etc/ld.so.preload, dlopen()
+ * and audit modules. The system directories are guessed from where the
+ * program's interpreter lives.
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone()
+ * and the debug() and verbose() macros.
+ */
+
+/* Where a library was found, in search order */
+#define CPATH_ELF_FROM_NONE    0 /* not found */
+#define CPATH_ELF_FROM_LOADED  1 /* already loaded */
+#define CPATH_ELF_FROM_DIRECT  2 /* a name with a '/' in it */
+#define CPATH_ELF_FROM_RPATH   3
+#define CPATH_ELF_FROM_LLP     4 /* LD_LIBRARY_PATH */
+#define CPATH_ELF_FROM_RUNPATH 5
+#define CPATH_ELF_FROM_CACHE   6 /* /etc/ld.so.cache */
+#define CPATH_ELF_FROM_DEFAULT 7 /* the system directories */
+
+#define CPATH_ELF_CACHE_FILE  "/etc/ld.so.cache"
+#define CPATH_ELF_CACHE_MAGIC "glibc-ld.so.cache1.1"
+#define CPATH_ELF_OLD_CACHE_MAGIC "ld.so-1.7.0"
+/* Objects we'll follow before assuming something is wrong */
+#define CPATH_ELF_MAX_OBJECTS 4096
+
+typedef struct cpath_elf_obj_t {
+  char *path;                /* as it was opened */
+  dev_t dev;
+  ino_t ino;
+  unsigned char elf_class;
+  unsigned char elf_data;
+  unsigned short machine;
+  int nodeflib;              /* linked with -z nodefaultlib */
+  int loader;                /* the object it was loaded for, -1 for the program */
+  char *soname;
+  char *rpath;               /* NULL if there is a DT_RUNPATH */
+  char *runpath;
+  char *interp;
+  char **needed;
+  unsigned int needed_count;
+  char **names;              /* every name it was asked for by */
+  unsigned int name_count;
+} cpath_elf_obj_t;
+
+typedef struct cpath_elf_lib_t {
+  char *name;                /* as in DT_NEEDED */
+  int requester;             /* the object whose DT_NEEDED it is */
+  int object;                /* the object it resolved to, -1 if none */
+  int source;                /* one of the CPATH_ELF_FROM_* values */
+  unsigned int llp_pos;      /* the LD_LIBRARY_PATH element, if from there */
+  unsigned int failed;       /* open()s that failed on the way */
+} cpath_elf_lib_t;
+
+typedef struct cpath_elf_dir_t {
+  char *path;
+  int missing;               /* known not to exist */
+} cpath_elf_dir_t;
+
+typedef struct cpath_elf_sim_t {
+  char **llp;                /* LD_LIBRARY_PATH */
+  unsigned int llp_count;
+  cpath_elf_obj_t *objs;
+  unsigned int obj_count;
+  unsigned int obj_size;
+  cpath_elf_lib_t *libs;
+  unsigned int lib_count;
+  unsigned int lib_size;
+  cpath_elf_dir_t *dirs;     /* directories tried, so missing ones are skipped */
+  unsigned int dir_count;
+  unsigned int dir_size;
+  unsigned long failed;
+} cpath_elf_sim_t;
+
+/* /etc/ld.so.cache as (name, path) pairs, loaded once */
+static char **cpath_elf_cache_entries = NULL;
+static unsigned int cpath_elf_cache_count = 0;
+static int cpath_elf_cache_loaded = 0;
+/* The system directories, guessed once per interpreter */
+static char *cpath_elf_default_interp = NULL;
+static char *cpath_elf_default_dirs[5];
+
+/**
+ * Read the ELF header of a mapped file and check it's one we can handle.
+ *
+ * @return non-zero if it is a native endian 32 or 64 bit ELF file
+ */
+static int cpath_elf_header_ok(const unsigned char *data, size_t size) {
+  if(size < sizeof(Elf32_Ehdr) || 0 != memcmp(data, ELFMAG, SELFMAG))
+    return 0;
+  if(ELFCLASS64 == data[EI_CLASS] && size < sizeof(Elf64_Ehdr))
+    return 0;
+  if(ELFCLASS32 != data[EI_CLASS] && ELFCLASS64 != data[EI_CLASS])
+    return 0;
+  {
+    const unsigned short one = 1;
+    unsigned char host_data = *(const unsigned char *)&one ? ELFDATA2LSB : ELFDATA2MSB;
+    return host_data == data[EI_DATA];
+  }
+}
+
+/**
+ * Translate a virtual address to a file offset using the PT_LOAD segments.
+ *
+ * @return the offset, or 0 if the address is not in the file
+ */
+static size_t cpath_elf_vaddr_offset(const unsigned char *data, size_t size, unsigned long long vaddr) {
+  int is64 = ELFCLASS64 == data[EI_CLASS];
+  unsigned long long phoff = is64 ? ((Elf64_Ehdr *)data)->e_phoff : ((Elf32_Ehdr *)data)->e_phoff;
+  unsigned int phnum = is64 ? ((Elf64_Ehdr *)data)->e_phnum : ((Elf32_Ehdr *)data)->e_phnum;
+  size_t phsize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+  unsigned int idx;
+  /* written so that nothing in the headers can make it wrap around */
+  if(phoff > size || phnum > (size - phoff) / phsize)
+    return 0;
+  for(idx = 0; idx < phnum; idx++) {
+    const unsigned char *ph = data + phoff + idx * phsize;
+    unsigned long long type = is64 ? ((Elf64_Phdr *)ph)->p_type : ((Elf32_Phdr *)ph)->p_type;
+    unsigned long long start = is64 ? ((Elf64_Phdr *)ph)->p_vaddr : ((Elf32_Phdr *)ph)->p_vaddr;
+    unsigned long long filesz = is64 ? ((Elf64_Phdr *)ph)->p_filesz : ((Elf32_Phdr *)ph)->p_filesz;
+    unsigned long long offset = is64 ? ((Elf64_Phdr *)ph)->p_offset : ((Elf32_Phdr *)ph)->p_offset;
+    if(PT_LOAD == type && vaddr >= start && vaddr - start < filesz && offset <= size &&
+       vaddr - start < size - offset)
+      return offset + (vaddr - start);
+  }
+  return 0;
+}
+
+/**
+ * Copy a string out of the dynamic string table, NULL if it doesn't fit.
+ */
+static char *cpath_elf_string(const unsigned char *data, size_t size, size_t strtab,
+                              unsigned long long offset) {
+  if(0 == strtab || strtab >= size || offset >= size - strtab ||
+     NULL == memchr(data + strtab + offset, '\0', size - strtab - offset))
+    return NULL;
+  return str_clone((char *)data + strtab + offset);
+}
+
+/**
+ * Read the parts of a mapped ELF file's dynamic section and program headers
+ * that matter to the search into obj.
+ */
+static void cpath_elf_parse(cpath_elf_obj_t *obj, const unsigned char *data, size_t size) {
+  int is64 = ELFCLASS64 == data[EI_CLASS];
+  unsigned long long phoff = is64 ? ((Elf64_Ehdr *)data)->e_phoff : ((Elf32_Ehdr *)data)->e_phoff;
+  unsigned int phnum = is64 ? ((Elf64_Ehdr *)data)->e_phnum : ((Elf32_Ehdr *)data)->e_phnum;
+  size_t phsize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+  size_t dynsize = is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+  size_t dyn = 0, dyn_end = 0, strtab = 0, pos;
+  long long soname = -1, rpath = -1, runpath = -1;
+  unsigned int idx;
+  obj->machine = is64 ? ((Elf64_Ehdr *)data)->e_machine : ((Elf32_Ehdr *)data)->e_machine;
+  if(phoff > size || phnum > (size - phoff) / phsize)
+    return;
+  for(idx = 0; idx < phnum; idx++) {
+    const unsigned char *ph = data + phoff + idx * phsize;
+    unsigned long long type = is64 ? ((Elf64_Phdr *)ph)->p_type : ((Elf32_Phdr *)ph)->p_type;
+    unsigned long long offset = is64 ? ((Elf64_Phdr *)ph)->p_offset : ((Elf32_Phdr *)ph)->p_offset;
+    unsigned long long filesz = is64 ? ((Elf64_Phdr *)ph)->p_filesz : ((Elf32_Phdr *)ph)->p_filesz;
+    if(offset > size || filesz > size - offset)
+      continue;
+    if(PT_DYNAMIC == type) {
+      dyn = offset;
+      dyn_end = offset + filesz;
+    } else if(PT_INTERP == type && filesz > 0 && '\0' == data[offset + filesz - 1]) {
+      obj->interp = str_clone((char *)data + offset);
+    }
+  }
+  if(0 == dyn)
+    return;
+  /* first find the string table, the entries can come in any order */
+  for(pos = dyn; pos + dynsize <= dyn_end; pos += dynsize) {
+    long long tag = is64 ? ((Elf64_Dyn *)(data + pos))->d_tag : ((Elf32_Dyn *)(data + pos))->d_tag;
+    unsigned long long val = is64 ? ((Elf64_Dyn *)(data + pos))->d_un.d_val : ((Elf32_Dyn *)(data + pos))->d_un.d_val;
+    if(DT_NULL == tag)
+      break;
+    if(DT_STRTAB == tag)
+      strtab = cpath_elf_vaddr_offset(data, size, val);
+    else if(DT_NEEDED == tag)
+      obj->needed_count++;
+  }
+  obj->needed = (char **)fatal_malloc(sizeof(char *) * (obj->needed_count + 1));
+  obj->needed_count = 0;
+  for(pos = dyn; pos + dynsize <= dyn_end; pos += dynsize) {
+    long long tag = is64 ? ((Elf64_Dyn *)(data + pos))->d_tag : ((Elf32_Dyn *)(data + pos))->d_tag;
+    unsigned long long val = is64 ? ((Elf64_Dyn *)(data + pos))->d_un.d_val : ((Elf32_Dyn *)(data + pos))->d_un.d_val;
+    char *name;
+    if(DT_NULL == tag)
+      break;
+    switch(tag) {
+    case DT_NEEDED:
+      if(NULL != (name = cpath_elf_string(data, size, strtab, val)))
+        obj->needed[obj->needed_count++] = name;
+      break;
+    case DT_SONAME:  soname = val; break;
+    case DT_RPATH:   rpath = val; break;
+    case DT_RUNPATH: runpath = val; break;
+    case DT_FLAGS_1:
+      if(val & DF_1_NODEFLIB)
+        obj->nodeflib = 1;
+      break;
+    }
+  }
+  if(soname >= 0)
+    obj->soname = cpath_elf_string(data, size, strtab, soname);
+  /* ld.so ignores DT_RPATH when there is a DT_RUNPATH */
+  if(runpath >= 0)
+    obj->runpath = cpath_elf_string(data, size, strtab, runpath);
+  else if(rpath >= 0)
+    obj->rpath = cpath_elf_string(data, size, strtab, rpath);
+}
+
+/**
+ * Read an open ELF file into obj.
+ *
+ * @return non-zero if it's an ELF file we can handle
+ */
+static int cpath_elf_read(int fd, const char *path, cpath_elf_obj_t *obj) {
+  struct stat file_stat;
+  unsigned char *data;
+  memset(obj, 0, sizeof(cpath_elf_obj_t));
+  obj->loader = -1;
+  if(0 != fstat(fd, &file_stat) || ! S_ISREG(file_stat.st_mode) || 0 == file_stat.st_size)
+    return 0;
+  data = (unsigned char *)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(MAP_FAILED == data)
+    return 0;
+  if(! cpath_elf_header_ok(data, file_stat.st_size)) {
+    munmap(data, file_stat.st_size);
+    return 0;
+  }
+  obj->path = str_clone((char *)path);
+  obj->dev = file_stat.st_dev;
+  obj->ino = file_stat.st_ino;
+  obj->elf_class = data[EI_CLASS];
+  obj->elf_data = data[EI_DATA];
+  cpath_elf_parse(obj, data, file_stat.st_size);
+  munmap(data, file_stat.st_size);
+  return 1;
+}
+
+/**
+ * Free what cpath_elf_read() put into obj.
+ */
+static void cpath_elf_obj_free(cpath_elf_obj_t *obj) {
+  unsigned int idx;
+  for(idx = 0; idx < obj->needed_count; idx++)
+    free(obj->needed[idx]);
+  free(obj->needed);
+  free(obj->path);
+  free(obj->soname);
+  free(obj->rpath);
+  free(obj->runpath);
+  free(obj->interp);
+}
+
+/**
+ * Does a library look for others relative to itself, with $ORIGIN in its
+ * DT_RPATH or DT_RUNPATH? ld.so takes a library's $ORIGIN from the path it
+ * was opened by, without resolving symlinks, so such a library finds nothing
+ * when it's opened through a symlink somewhere else.
+ */
+static int cpath_elf_uses_origin(const char *path) {
+  cpath_elf_obj_t obj;
+  const char *search;
+  int uses_origin = 0, fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return 0;
+  if(cpath_elf_read(fd, path, &obj)) {
+    search = obj.runpath ? obj.runpath : obj.rpath;
+    uses_origin = search && (strstr(search, "$ORIGIN") || strstr(search, "${ORIGIN}"));
+    cpath_elf_obj_free(&obj);
+  }
+  close(fd);
+  return uses_origin;
+}
+
+/**
+ * Is the file on fd an ELF object that could be loaded into the program?
+ */
+static int cpath_elf_compatible(int fd, cpath_elf_obj_t *program) {
+  unsigned char ident[sizeof(Elf64_Ehdr)];
+  unsigned short machine;
+  ssize_t count = pread(fd, ident, sizeof(ident), 0);
+  if(count < (ssize_t)sizeof(Elf32_Ehdr) || ! cpath_elf_header_ok(ident, count))
+    return 0;
+  machine = ELFCLASS64 == ident[EI_CLASS] ? ((Elf64_Ehdr *)ident)->e_machine : ((Elf32_Ehdr *)ident)->e_machine;
+  return ident[EI_CLASS] == program->elf_class && machine == program->machine;
+}
+
+/**
+ * Load /etc/ld.so.cache (the new format, alone or after the old one).
+ */
+static void cpath_elf_load_cache(void) {
+  struct stat file_stat;
+  const unsigned char *data;
+  size_t size, start = 0, entries, idx;
+  unsigned int count;
+  int fd;
+  cpath_elf_cache_loaded = 1;
+  if(0 > (fd = open(CPATH_ELF_CACHE_FILE, O_RDONLY | O_CLOEXEC)))
+    return;
+  if(0 != fstat(fd, &file_stat) || file_stat.st_size < 48) {
+    close(fd);
+    return;
+  }
+  size = file_stat.st_size;
+  data = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(MAP_FAILED == data)
+    return;
+  if(0 == memcmp(data, CPATH_ELF_OLD_CACHE_MAGIC, strlen(CPATH_ELF_OLD_CACHE_MAGIC))) {
+    /* old header (12 bytes magic, count), 12 byte entries, then the new one */
+    memcpy(&count, data + 12, sizeof(count));
+    start = (16 + (size_t)count * 12 + 7) & ~(size_t)7;
+  }
+  if(start + 48 > size ||
+     0 != memcmp(data + start, CPATH_ELF_CACHE_MAGIC, strlen(CPATH_ELF_CACHE_MAGIC))) {
+    verbose(2, ("# Unable to understand \"%s\", not simulating it\n", CPATH_ELF_CACHE_FILE));
+    munmap((void *)data, size);
+    return;
+  }
+  /* header: magic and version (20 bytes), count, string length, flags, ... */
+  memcpy(&count, data + start + 20, sizeof(count));
+  entries = start + 48;
+  cpath_elf_cache_entries = (char **)fatal_malloc(sizeof(char *) * 2 * ((size_t)count + 1));
+  for(idx = 0; idx < count && entries + (idx + 1) * 24 <= size; idx++) {
+    unsigned int key, value;
+    memcpy(&key, data + entries + idx * 24 + 4, sizeof(key));
+    memcpy(&value, data + entries + idx * 24 + 8, sizeof(value));
+    if(start + key >= size || start + value >= size ||
+       NULL == memchr(data + start + key, '\0', size - start - key) ||
+       NULL == memchr(data + start + value, '\0', size - start - value))
+      continue;
+    cpath_elf_cache_entries[2 * cpath_elf_cache_count] = str_clone((char *)data + start + key);
+    cpath_elf_cache_entries[2 * cpath_elf_cache_count + 1] = str_clone((char *)data + start + value);
+    cpath_elf_cache_count++;
+  }
+  munmap((void *)data, size);
+  debug(3, ("cpath_elf_load_cache: %u entries\n", cpath_elf_cache_count));
+}
+
+/**
+ * Guess the system directories from where the interpreter really lives,
+ * since that's where glibc was installed (e.g., /lib64 and /usr/lib64).
+ * Multiarch installs (e.g., /lib/x86_64-linux-gnu) also search /lib and
+ * /usr/lib after their own.
+ *
+ * @return the directories, NULL terminated
+ */
+static char **cpath_elf_defaults(const char *interp) {
+  char real[PATH_MAX], *slash, *dir;
+  unsigned int count = 2;
+  if(cpath_elf_default_interp && eq(cpath_elf_default_interp, interp))
+    return cpath_elf_default_dirs;
+  cpath_elf_default_interp = str_clone((char *)interp);
+  if(NULL == realpath(interp, real) || NULL == (slash = strrchr(real, '/')) || slash == real)
+    strcpy(real, "/lib/x");
+  slash = strrchr(real, '/');
+  *slash = '\0';
+  dir = 0 == strncmp(real, "/usr/", 5) ? real + 4 : real;
+  cpath_elf_default_dirs[0] = str_clone(dir);
+  cpath_elf_default_dirs[1] = (char *)fatal_malloc(strlen(dir) + 5);
+  sprintf(cpath_elf_default_dirs[1], "/usr%s", dir);
+  if(0 == strncmp(dir, "/lib/", 5)) {
+    cpath_elf_default_dirs[count++] = "/lib";
+    cpath_elf_default_dirs[count++] = "/usr/lib";
+  }
+  cpath_elf_default_dirs[count] = NULL;
+  return cpath_elf_default_dirs;
+}
+
+/**
+ * Expand $ORIGIN, $LIB and $PLATFORM (also as ${...}) in one RPATH/RUNPATH
+ * element.
+ */
+static void cpath_elf_expand(char *out, size_t size, const char *element, size_t len,
+                             cpath_elf_obj_t *obj) {
+  static struct utsname uts;
+  static int have_uts = 0;
+  size_t used = 0;
+  const char *end = element + len;
+  if(! have_uts)
+    have_uts = 0 == uname(&uts) ? 1 : -1;
+  while(element < end && used + 1 < size) {
+    const char *value = NULL;
+    char origin[PATH_MAX];
+    size_t skip = 0;
+    if('$' == *element) {
+      static const char *tokens[] = { "ORIGIN", "LIB", "PLATFORM" };
+      unsigned int idx;
+      for(idx = 0; idx < 3 && ! value; idx++) {
+        size_t token_len = strlen(tokens[idx]);
+        if((size_t)(end - element) >= token_len + 1 &&
+           0 == strncmp(element + 1, tokens[idx], token_len) &&
+           (element + 1 + token_len == end || ! (isalnum((unsigned char)element[1 + token_len]) ||
+                                                  '_' == element[1 + token_len])))
+          skip = token_len + 1;
+        else if((size_t)(end - element) >= token_len + 3 && '{' == element[1] &&
+                0 == strncmp(element + 2, tokens[idx], token_len) && '}' == element[2 + token_len])
+          skip = token_len + 3;
+        if(! skip)
+          continue;
+        if(0 == idx) {
+          char *slash;
+          snprintf(origin, sizeof(origin), "%s", obj->path);
+          slash = strrchr(origin, '/');
+          if(slash == origin) slash[1] = '\0';
+          else if(slash) *slash = '\0';
+          else strcpy(origin, ".");
+          value = origin;
+        } else if(1 == idx) {
+          value = ELFCLASS64 == obj->elf_class ? "lib64" : "lib";
+        } else {
+          value = have_uts > 0 ? uts.machine : "";
+        }
+      }
+    }
+    if(value) {
+      used += snprintf(out + used, size - used, "%s", value);
+      if(used >= size) used = size - 1;
+      element += skip;
+    } else {
+      out[used++] = *(element++);
+    }
+  }
+  out[used] = '\0';
+}
+
+/**
+ * Look for a directory in the list of directories already tried.
+ */
+static cpath_elf_dir_t *cpath_elf_dir(cpath_elf_sim_t *sim, const char *dir) {
+  unsigned int idx;
+  for(idx = 0; idx < sim->dir_count; idx++)
+    if(eq(sim->dirs[idx].path, dir))
+      return &sim->dirs[idx];
+  if(sim->dir_count == sim->dir_size) {
+    sim->dir_size = sim->dir_size ? 2 * sim->dir_size : 64;
+    sim->dirs = (cpath_elf_dir_t *)realloc(sim->dirs, sizeof(cpath_elf_dir_t) * sim->dir_size);
+    if(! sim->dirs) fatal("Unable to allocate RAM for loader simulation.\n");
+  }
+  sim->dirs[sim->dir_count].path = str_clone((char *)dir);
+  sim->dirs[sim->dir_count].missing = 0;
+  return &sim->dirs[sim->dir_count++];
+}
+
+/**
+ * Add an object to the simulation, which then owns what it holds, or find
+ * the one already loaded from the same file (and free obj's).
+ *
+ * @return the object's index
+ */
+static int cpath_elf_add_obj(cpath_elf_sim_t *sim, cpath_elf_obj_t *obj) {
+  unsigned int idx;
+  for(idx = 0; idx < sim->obj_count; idx++)
+    if(sim->objs[idx].dev == obj->dev && sim->objs[idx].ino == obj->ino) {
+      cpath_elf_obj_free(obj);
+      return idx;
+    }
+  if(sim->obj_count == sim->obj_size) {
+    sim->obj_size = sim->obj_size ? 2 * sim->obj_size : 32;
+    sim->objs = (cpath_elf_obj_t *)realloc(sim->objs, sizeof(cpath_elf_obj_t) * sim->obj_size);
+    if(! sim->objs) fatal("Unable to allocate RAM for loader simulation.\n");
+  }
+  obj->names = (char **)fatal_malloc(sizeof(char *) * 2);
+  obj->name_count = 0;
+  if(obj->soname)
+    obj->names[obj->name_count++] = obj->soname;
+  sim->objs[sim->obj_count] = *obj;
+  return sim->obj_count++;
+}
+
+/**
+ * Remember that an object was asked for by name, so it's found by that name
+ * from then on.
+ */
+static void cpath_elf_add_name(cpath_elf_obj_t *obj, char *name) {
+  unsigned int idx;
+  for(idx = 0; idx < obj->name_count; idx++)
+    if(eq(obj->names[idx], name))
+      return;
+  obj->names = (char **)realloc(obj->names, sizeof(char *) * (obj->name_count + 1));
+  if(! obj->names) fatal("Unable to allocate RAM for loader simulation.\n");
+  obj->names[obj->name_count++] = name;
+}
+
+/**
+ * Try to open dir/name the way ld.so would.
+ *
+ * @param lib the search, its failed count is updated
+ * @param dir the directory, NULL if name is to be opened as is
+ *
+ * @return the loaded object's index, or -1 if it's not there or not usable
+ */
+static int cpath_elf_try(cpath_elf_sim_t *sim, cpath_elf_lib_t *lib, const char *dir) {
+  char file_name[PATH_MAX];
+  cpath_elf_dir_t *dir_info = NULL;
+  cpath_elf_obj_t obj;
+  struct stat file_stat;
+  int fd, idx;
+  if(dir) {
+    dir_info = cpath_elf_dir(sim, dir);
+    if(dir_info->missing)
+      return -1;
+    snprintf(file_name, sizeof(file_name), "%s%s%s", dir,
+             '\0' == *dir || '/' == dir[strlen(dir) - 1] ? "" : "/", lib->name);
+  } else {
+    snprintf(file_name, sizeof(file_name), "%s", lib->name);
+  }
+  fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    lib->failed++;
+    /* ld.so stops trying a directory once it knows it doesn't exist */
+    if(dir_info && ENOENT == errno && '\0' != *dir && 0 != stat(dir, &file_stat))
+      dir_info->missing = 1;
+    return -1;
+  }
+  if(! cpath_elf_compatible(fd, &sim->objs[0]) || ! cpath_elf_read(fd, file_name, &obj)) {
+    close(fd);
+    lib->failed++;
+    return -1;
+  }
+  close(fd);
+  idx = cpath_elf_add_obj(sim, &obj);
+  if(-1 == sim->objs[idx].loader && 0 != idx)
+    sim->objs[idx].loader = lib->requester;
+  return idx;
+}
+
+/**
+ * Try every element of a colon separated RPATH/RUNPATH.
+ *
+ * @return the loaded object's index, or -1
+ */
+static int cpath_elf_try_rpath(cpath_elf_sim_t *sim, cpath_elf_lib_t *lib, const char *rpath,
+                               int owner) {
+  char dir[PATH_MAX];
+  const char *start = rpath, *end;
+  int found;
+  for(;;) {
+    end = strchr(start, ':');
+    if(! end) end = start + strlen(start);
+    /* by index, trying can move the objects */
+    cpath_elf_expand(dir, sizeof(dir), start, end - start, &sim->objs[owner]);
+    if(0 <= (found = cpath_elf_try(sim, lib, dir)))
+      return found;
+    if('\0' == *end)
+      return -1;
+    start = end + 1;
+  }
+}
+
+/**
+ * Search for one DT_NEEDED entry.
+ */
+static void cpath_elf_search(cpath_elf_sim_t *sim, cpath_elf_lib_t *lib) {
+  /* copied, trying can move the objects */
+  cpath_elf_obj_t requester = sim->objs[lib->requester];
+  int has_slash = NULL != strchr(lib->name, '/');
+  unsigned int idx;
+  int obj = -1;
+  lib->object = -1;
+  lib->source = CPATH_ELF_FROM_NONE;
+  for(idx = 0; idx < sim->obj_count; idx++) {
+    unsigned int name;
+    for(name = 0; name < sim->objs[idx].name_count; name++)
+      if(eq(sim->objs[idx].names[name], lib->name)) {
+        lib->object = idx;
+        lib->source = CPATH_ELF_FROM_LOADED;
+        return;
+      }
+  }
+  if(has_slash) {
+    obj = cpath_elf_try(sim, lib, NULL);
+    lib->source = CPATH_ELF_FROM_DIRECT;
+  }
+  if(obj < 0 && ! requester.runpath && ! has_slash) {
+    int owner;
+    for(owner = lib->requester; owner >= 0 && obj < 0; owner = sim->objs[owner].loader)
+      if(sim->objs[owner].rpath)
+        obj = cpath_elf_try_rpath(sim, lib, sim->objs[owner].rpath, owner);
+    lib->source = CPATH_ELF_FROM_RPATH;
+  }
+  for(idx = 0; obj < 0 && idx < sim->llp_count && ! has_slash; idx++) {
+    obj = cpath_elf_try(sim, lib, sim->llp[idx]);
+    lib->source = CPATH_ELF_FROM_LLP;
+    lib->llp_pos = idx;
+  }
+  if(obj < 0 && requester.runpath && ! has_slash) {
+    obj = cpath_elf_try_rpath(sim, lib, requester.runpath, lib->requester);
+    lib->source = CPATH_ELF_FROM_RUNPATH;
+  }
+  if(obj < 0 && ! requester.nodeflib && ! has_slash) {
+    if(! cpath_elf_cache_loaded)
+      cpath_elf_load_cache();
+    for(idx = 0; obj < 0 && idx < cpath_elf_cache_count; idx++) {
+      if(eq(cpath_elf_cache_entries[2 * idx], lib->name)) {
+        unsigned int failed = lib->failed;
+        char *saved_name = lib->name;
+        /* the cache holds full paths, and entries for other ABIs */
+        lib->name = cpath_elf_cache_entries[2 * idx + 1];
+        obj = cpath_elf_try(sim, lib, NULL);
+        lib->name = saved_name;
+        lib->failed = failed;
+        lib->source = CPATH_ELF_FROM_CACHE;
+      }
+    }
+  }
+  if(obj < 0 && ! requester.nodeflib && ! has_slash) {
+    char **defaults = cpath_elf_defaults(sim->objs[0].interp ? sim->objs[0].interp : "");
+    for(idx = 0; obj < 0 && defaults[idx]; idx++) {
+      obj = cpath_elf_try(sim, lib, defaults[idx]);
+      lib->source = CPATH_ELF_FROM_DEFAULT;
+    }
+  }
+  if(obj < 0) {
+    lib->source = CPATH_ELF_FROM_NONE;
+    return;
+  }
+  lib->object = obj;
+  cpath_elf_add_name(&sim->objs[obj], lib->name);
+}
+
+/**
+ * Record a search.
+ */
+static cpath_elf_lib_t *cpath_elf_add_lib(cpath_elf_sim_t *sim, char *name, int requester) {
+  cpath_elf_lib_t *lib;
+  if(sim->lib_count == sim->lib_size) {
+    sim->lib_size = sim->lib_size ? 2 * sim->lib_size : 64;
+    sim->libs = (cpath_elf_lib_t *)realloc(sim->libs, sizeof(cpath_elf_lib_t) * sim->lib_size);
+    if(! sim->libs) fatal("Unable to allocate RAM for loader simulation.\n");
+  }
+  lib = &sim->libs[sim->lib_count++];
+  memset(lib, 0, sizeof(cpath_elf_lib_t));
+  lib->name = name;
+  lib->requester = requester;
+  return lib;
+}
+
+/**
+ * Simulate starting a program with a given LD_LIBRARY_PATH.
+ *
+ * @param program the program
+ * @param llp the LD_LIBRARY_PATH elements
+ * @param llp_count how many there are
+ *
+ * @return the simulation, or NULL if program is not a dynamic ELF program
+ *         we can read
+ */
+static cpath_elf_sim_t *cpath_elf_simulate(const char *program, char **llp, unsigned int llp_count) {
+  cpath_elf_sim_t *sim;
+  cpath_elf_obj_t obj;
+  unsigned int current, idx;
+  int fd = open(program, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    verbose(1, ("# Unable to simulate loading \"%s\": %s\n", program, strerror(errno)));
+    return NULL;
+  }
+  if(! cpath_elf_read(fd, program, &obj)) {
+    verbose(1, ("# Unable to simulate loading \"%s\": not an ELF file we can read\n", program));
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  sim = (cpath_elf_sim_t *)calloc(1, sizeof(cpath_elf_sim_t));
+  if(! sim) fatal("Unable to allocate RAM for loader simulation.\n");
+  sim->llp = llp;
+  sim->llp_count = llp_count;
+  cpath_elf_add_obj(sim, &obj);
+  /* $ORIGIN of the program is where it really is */
+  {
+    char real[PATH_MAX];
+    if(realpath(program, real)) {
+      free(sim->objs[0].path);
+      sim->objs[0].path = str_clone(real);
+    }
+  }
+  /* the interpreter is already loaded by the time the search starts */
+  if(sim->objs[0].interp && 0 <= (fd = open(sim->objs[0].interp, O_RDONLY | O_CLOEXEC))) {
+    if(cpath_elf_read(fd, sim->objs[0].interp, &obj)) {
+      int interp = cpath_elf_add_obj(sim, &obj);
+      cpath_elf_add_name(&sim->objs[interp], sim->objs[0].interp);
+    }
+    close(fd);
+  }
+  /* breadth first, like ld.so */
+  for(current = 0; current < sim->obj_count && current < CPATH_ELF_MAX_OBJECTS; current++) {
+    for(idx = 0; idx < sim->objs[current].needed_count; idx++) {
+      cpath_elf_lib_t *lib = cpath_elf_add_lib(sim, sim->objs[current].needed[idx], current);
+      cpath_elf_search(sim, lib);
+      sim->failed += lib->failed;
+    }
+  }
+  return sim;
+}
+
+/**
+ * Free a simulation and the objects it loaded.
+ */
+static void cpath_elf_sim_free(cpath_elf_sim_t *sim) {
+  unsigned int idx;
+  if(! sim)
+    return;
+  /* names point into the objects' sonames and DT_NEEDED entries */
+  for(idx = 0; idx < sim->obj_count; idx++) {
+    cpath_elf_obj_free(&sim->objs[idx]);
+    free(sim->objs[idx].names);
+  }
+  for(idx = 0; idx < sim->dir_count; idx++)
+    free(sim->dirs[idx].path);
+  free(sim->objs);
+  free(sim->libs);
+  free(sim->dirs);
+  free(sim);
+}
+
+/**
+ * Check that two simulations of the same program load the same files for
+ * every search.
+ */
+static int cpath_elf_same(cpath_elf_sim_t *sim1, cpath_elf_sim_t *sim2) {
+  unsigned int idx;
+  if(sim1->lib_count != sim2->lib_count)
+    return 0;
+  for(idx = 0; idx < sim1->lib_count; idx++) {
+    cpath_elf_lib_t *lib1 = &sim1->libs[idx], *lib2 = &sim2->libs[idx];
+    if((lib1->object < 0) != (lib2->object < 0) || ! eq(lib1->name, lib2->name))
+      return 0;
+    if(lib1->object >= 0 &&
+       (sim1->objs[lib1->object].dev != sim2->objs[lib2->object].dev ||
+        sim1->objs[lib1->object].ino != sim2->objs[lib2->object].ino))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Human readable name for where a library was found.
+ */
+static const char *cpath_elf_source_name(int source) {
+  switch(source) {
+  case CPATH_ELF_FROM_LOADED:  return "loaded";
+  case CPATH_ELF_FROM_DIRECT:  return "direct";
+  case CPATH_ELF_FROM_RPATH:   return "RPATH";
+  case CPATH_ELF_FROM_LLP:     return "LD_LIBRARY_PATH";
+  case CPATH_ELF_FROM_RUNPATH: return "RUNPATH";
+  case CPATH_ELF_FROM_CACHE:   return "ld.so.cache";
+  case CPATH_ELF_FROM_DEFAULT: return "system";
+  }
+  return "NOT FOUND";
+}
+
+#endif /* _CPATH_ELF_LOADED_SEMAPHORE */
@@ -0,0 +1,364 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_FLIGHT_LOADED_SEMAPHORE
+#define _CPATH_FLIGHT_LOADED_SEMAPHORE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "cpath-element.c"
+
+/**
+ * Single-flight probing: one stat() per element per node, however many
+ * cleanpaths run on the node at once.
+ *
+ * When a job array starts, every rank on a node runs the same cleanpath at
+ * the same moment, and each stat()s the same (often NFS) directories. With a
+ * coordination file, the processes share one table of results, mapped from a
+ * file in /dev/shm (one per user, as results are only shared between
+ * processes that may read each other's environments anyway):
+ *
+ *   header | slots
+ *
+ * Each slot is an element's result: empty, claimed (someone is stat()ing
+ * it) or done (the mode, owner and group stat() found, or its errno).
+ * Before cleaning, a process takes the file's flock(2) once and claims every
+ * one of its elements nobody has claimed, then stat()s those and publishes
+ * each result as it gets it. Elements someone else claimed are waited for when
+ * they come up, briefly, after which the process stat()s them itself. A claim
+ * held by a process that died, or for longer than the wait, is taken over.
+ *
+ * Results are reused for CPATH_FLIGHT_TTL seconds, which covers the ranks of
+ * a job starting, and not much more. Once the table is three quarters full,
+ * the next process to claim replaces the file with an empty one (processes
+ * still using the old one carry on with it).
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), the uid
+ * global and the debug() and verbose() macros.
+ */
+
+#define CPATH_FLIGHT_MAGIC "CPFLT001"
+/* Number of slots, must be a power of two */
+#define CPATH_FLIGHT_SLOTS 8192
+/* Longest element that is coordinated, longer ones are just stat()ed */
+#define CPATH_FLIGHT_PATH_MAX 216
+/* How long a result is good for, in seconds */
+#define CPATH_FLIGHT_TTL 30
+/* Default for how long to wait for someone else's stat(), in milliseconds */
+#define CPATH_FLIGHT_WAIT 2000
+
+/**
+ * Slot states
+ */
+#define CPATH_FLIGHT_EMPTY   0
+#define CPATH_FLIGHT_CLAIMED 1
+#define CPATH_FLIGHT_DONE    2
+
+/* What cpath_flight_stat() returns for an element it can't answer for */
+#define CPATH_FLIGHT_UNKNOWN -2
+
+typedef struct cpath_flight_header_t {
+  char magic[8];
+  unsigned int header_size;   /* sizeof(cpath_flight_header_t), catches ABI changes */
+  unsigned int slot_size;     /* sizeof(cpath_flight_slot_t) */
+  unsigned int slot_count;
+  unsigned int used;          /* slots ever claimed, only changed under the lock */
+} cpath_flight_header_t;
+
+typedef struct cpath_flight_slot_t {
+  unsigned int state;         /* read and written atomically */
+  unsigned int hash;
+  int pid;                    /* of the claimer */
+  int result;                 /* of stat() */
+  int error;                  /* errno if it failed */
+  unsigned int mode;
+  unsigned int uid;
+  unsigned int gid;
+  long long when;             /* claimed, then done, in ms since the epoch */
+  char path[CPATH_FLIGHT_PATH_MAX];
+} cpath_flight_slot_t;
+
+typedef struct cpath_flight_entry_t {
+  cpath_element_t element;    /* must be first, its path is the slot's */
+  cpath_flight_slot_t *slot;
+  int mine;                   /* we claimed it */
+} cpath_flight_entry_t;
+
+typedef struct cpath_flight_t {
+  int fd;
+  cpath_flight_header_t *header;
+  cpath_flight_slot_t *slots;
+  long wait;                  /* in milliseconds */
+  cpath_elements_t elements;  /* our own elements */
+  cpath_flight_entry_t **mine;
+  unsigned int mine_count;
+  unsigned int mine_size;
+  unsigned int shared;        /* results someone else got for us */
+  unsigned int waited;        /* of them, ones we had to wait for */
+} cpath_flight_t;
+
+#define CPATH_FLIGHT_SIZE (sizeof(cpath_flight_header_t) + sizeof(cpath_flight_slot_t) * CPATH_FLIGHT_SLOTS)
+
+/**
+ * Now, in milliseconds since the epoch.
+ */
+static long long cpath_flight_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Open (and lock) the coordination file, creating or replacing it if needs
+ * be.
+ *
+ * @return the locked fd, or -1
+ */
+static int cpath_flight_open_locked(const char *file_name) {
+  struct stat file_stat;
+  int tries;
+  for(tries = 0; tries < 4; tries++) {
+    int fd = open(file_name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0) {
+      verbose(1, ("# Not coordinating through \"%s\": %s\n", file_name, strerror(errno)));
+      return -1;
+    }
+    if(0 != flock(fd, LOCK_EX) || 0 != fstat(fd, &file_stat)) {
+      verbose(1, ("# Not coordinating through \"%s\": %s\n", file_name, strerror(errno)));
+      close(fd);
+      return -1;
+    }
+    if(file_stat.st_uid != uid || (file_stat.st_mode & (S_IWGRP | S_IWOTH)) || ! S_ISREG(file_stat.st_mode)) {
+      verbose(1, ("# Not coordinating through \"%s\": it's not ours, or others can write it\n", file_name));
+      close(fd);
+      return -1;
+    }
+    /* replaced while we waited for the lock, try the new one */
+    if(0 == file_stat.st_nlink) {
+      close(fd);
+      continue;
+    }
+    if(0 != file_stat.st_size && (off_t)CPATH_FLIGHT_SIZE != file_stat.st_size) {
+      verbose(1, ("# Not coordinating through \"%s\": it's not a coordination file, or not this version's\n",
+                  file_name));
+      close(fd);
+      return -1;
+    }
+    if(0 == file_stat.st_size) {
+      cpath_flight_header_t header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, CPATH_FLIGHT_MAGIC, 8);
+      header.header_size = sizeof(cpath_flight_header_t);
+      header.slot_size = sizeof(cpath_flight_slot_t);
+      header.slot_count = CPATH_FLIGHT_SLOTS;
+      if(0 != ftruncate(fd, CPATH_FLIGHT_SIZE) || (ssize_t)sizeof(header) != pwrite(fd, &header, sizeof(header), 0)) {
+        verbose(1, ("# Not coordinating through \"%s\": %s\n", file_name, strerror(errno)));
+        close(fd);
+        return -1;
+      }
+    }
+    return fd;
+  }
+  verbose(1, ("# Not coordinating through \"%s\": it keeps being replaced\n", file_name));
+  return -1;
+}
+
+/**
+ * Map the coordination file, replacing it with an empty one if it's full.
+ *
+ * @param file_name the file, or NULL for the default one in /dev/shm
+ * @param wait how long to wait for someone else's stat(), in milliseconds
+ *
+ * @return the coordination, with the file locked, or NULL (in which case
+ *         elements are simply stat()ed)
+ */
+static cpath_flight_t *cpath_flight_open(const char *file_name, long wait) {
+  char default_name[64];
+  cpath_flight_t *flight;
+  void *data;
+  int fd;
+  if(! file_name) {
+    snprintf(default_name, sizeof(default_name), "/dev/shm/cleanpath-flight-%u", (unsigned int)uid);
+    file_name = default_name;
+  }
+  if(0 > (fd = cpath_flight_open_locked(file_name)))
+    return NULL;
+  if(MAP_FAILED == (data = mmap(NULL, CPATH_FLIGHT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ||
+     0 != memcmp(((cpath_flight_header_t *)data)->magic, CPATH_FLIGHT_MAGIC, 8) ||
+     ((cpath_flight_header_t *)data)->header_size != sizeof(cpath_flight_header_t) ||
+     ((cpath_flight_header_t *)data)->slot_size != sizeof(cpath_flight_slot_t) ||
+     ((cpath_flight_header_t *)data)->slot_count != CPATH_FLIGHT_SLOTS) {
+    verbose(1, ("# Not coordinating through \"%s\": it's not a coordination file, or not this version's\n",
+                file_name));
+    if(MAP_FAILED != data)
+      munmap(data, CPATH_FLIGHT_SIZE);
+    close(fd);
+    return NULL;
+  }
+  if(((cpath_flight_header_t *)data)->used > CPATH_FLIGHT_SLOTS / 4 * 3) {
+    /* start over, whoever has the old one mapped keeps using it */
+    debug(2, ("cpath_flight_open: \"%s\" is full, replacing it\n", file_name));
+    munmap(data, CPATH_FLIGHT_SIZE);
+    unlink(file_name);
+    close(fd);
+    return cpath_flight_open(file_name, wait);
+  }
+  flight = (cpath_flight_t *)fatal_malloc(sizeof(cpath_flight_t));
+  memset(flight, 0, sizeof(cpath_flight_t));
+  flight->fd = fd;
+  flight->header = (cpath_flight_header_t *)data;
+  flight->slots = (cpath_flight_slot_t *)((char *)data + sizeof(cpath_flight_header_t));
+  flight->wait = wait;
+  flight->mine_size = 64;
+  flight->mine = (cpath_flight_entry_t **)fatal_malloc(sizeof(cpath_flight_entry_t *) * flight->mine_size);
+  return flight;
+}
+
+/**
+ * Can a claim be taken over: its claimer is gone, or has had it too long?
+ */
+static int cpath_flight_abandoned(cpath_flight_t *flight, cpath_flight_slot_t *slot, long long now) {
+  return now - slot->when > flight->wait || (0 != kill(slot->pid, 0) && ESRCH == errno);
+}
+
+/**
+ * Claim an element, or find who has. Only called with the file locked.
+ */
+static void cpath_flight_claim(cpath_flight_t *flight, const char *element, long long now) {
+  cpath_flight_entry_t *entry;
+  cpath_flight_slot_t *slot = NULL;
+  unsigned int hash, idx, probes;
+  size_t len = cpath_element_len(element);
+  if('/' != *element || len >= CPATH_FLIGHT_PATH_MAX)
+    return;
+  hash = cpath_element_hash(element, len);
+  if(cpath_element_find(&flight->elements, element, len, hash))
+    return;
+  for(idx = hash & (CPATH_FLIGHT_SLOTS - 1), probes = 0; probes < CPATH_FLIGHT_SLOTS;
+      idx = (idx + 1) & (CPATH_FLIGHT_SLOTS - 1), probes++) {
+    slot = &flight->slots[idx];
+    if(CPATH_FLIGHT_EMPTY == slot->state ||
+       (slot->hash == hash && 0 == strncmp(slot->path, element, len) && '\0' == slot->path[len]))
+      break;
+  }
+  if(probes == CPATH_FLIGHT_SLOTS)
+    return;
+  entry = (cpath_flight_entry_t *)fatal_malloc(sizeof(cpath_flight_entry_t));
+  entry->element.path = slot->path;
+  entry->element.hash = hash;
+  entry->slot = slot;
+  entry->mine = 0;
+  if(CPATH_FLIGHT_EMPTY == slot->state) {
+    memcpy(slot->path, element, len);
+    slot->path[len] = '\0';
+    slot->hash = hash;
+    flight->header->used++;
+    entry->mine = 1;
+  } else if(CPATH_FLIGHT_DONE == slot->state) {
+    entry->mine = now - slot->when > CPATH_FLIGHT_TTL * 1000;
+  } else {
+    entry->mine = cpath_flight_abandoned(flight, slot, now);
+  }
+  if(entry->mine) {
+    slot->pid = getpid();
+    slot->when = now;
+    __atomic_store_n(&slot->state, CPATH_FLIGHT_CLAIMED, __ATOMIC_RELEASE);
+    if(flight->mine_count == flight->mine_size) {
+      flight->mine_size *= 2;
+      flight->mine = (cpath_flight_entry_t **)realloc(flight->mine, sizeof(cpath_flight_entry_t *) *
+                                                      flight->mine_size);
+      if(! flight->mine) fatal("Unable to allocate RAM for the coordination.\n");
+    }
+    flight->mine[flight->mine_count++] = entry;
+  }
+  cpath_element_insert(&flight->elements, &entry->element);
+}
+
+/**
+ * Is an element coordinated?
+ */
+static int cpath_flight_has(cpath_flight_t *flight, const char *element) {
+  size_t len = cpath_element_len(element);
+  return NULL != cpath_element_find(&flight->elements, element, len, cpath_element_hash(element, len));
+}
+
+/**
+ * Let the others at the file, then stat() everything we claimed, publishing
+ * each result as we get it.
+ */
+static void cpath_flight_run(cpath_flight_t *flight) {
+  unsigned int idx;
+  flock(flight->fd, LOCK_UN);
+  for(idx = 0; idx < flight->mine_count; idx++) {
+    cpath_flight_slot_t *slot = flight->mine[idx]->slot;
+    struct stat file_stat;
+    int result = stat(flight->mine[idx]->element.path, &file_stat);
+    /* someone else took it over, or the file was started over */
+    if(CPATH_FLIGHT_CLAIMED != __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) || slot->pid != getpid())
+      continue;
+    slot->result = result;
+    slot->error = result ? errno : 0;
+    slot->mode = result ? 0 : file_stat.st_mode;
+    slot->uid = result ? 0 : file_stat.st_uid;
+    slot->gid = result ? 0 : file_stat.st_gid;
+    slot->when = cpath_flight_now();
+    __atomic_store_n(&slot->state, CPATH_FLIGHT_DONE, __ATOMIC_RELEASE);
+  }
+  verbose(1, ("# Probed %u elements for this node\n", flight->mine_count));
+}
+
+/**
+ * Report how many results came from other processes.
+ */
+static void cpath_flight_report(cpath_flight_t *flight) {
+  verbose(1, ("# Used %u results other processes probed, waiting for %u of them\n", flight->shared,
+              flight->waited));
+}
+
+/**
+ * stat() an element, or rather, get what whoever claimed it found.
+ *
+ * @param hash the element's hash, as cpath_should_add() has it
+ *
+ * @return what stat() returned, with errno set and the mode, owner and
+ *         group of file_stat filled in, or CPATH_FLIGHT_UNKNOWN if it isn't
+ *         coordinated, or waiting for it took too long
+ */
+static int cpath_flight_stat(cpath_flight_t *flight, const char *path, unsigned int hash, struct stat *file_stat) {
+  cpath_flight_entry_t *entry = (cpath_flight_entry_t *)cpath_element_find(&flight->elements, path, strlen(path), hash);
+  cpath_flight_slot_t *slot;
+  long long deadline;
+  long nap = 1;
+  if(! entry)
+    return CPATH_FLIGHT_UNKNOWN;
+  slot = entry->slot;
+  deadline = cpath_flight_now() + flight->wait;
+  while(CPATH_FLIGHT_DONE != __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) ||
+        ! eq(slot->path, path)) {
+    struct timespec sleep_for;
+    if(CPATH_FLIGHT_CLAIMED != __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) || ! eq(slot->path, path) ||
+       cpath_flight_now() >= deadline) {
+      debug(3, ("cpath_flight_stat: gave up waiting for \"%s\"\n", path));
+      return CPATH_FLIGHT_UNKNOWN;
+    }
+    if(1 == nap && ! entry->mine)
+      flight->waited++;
+    sleep_for.tv_sec = 0;
+    sleep_for.tv_nsec = nap * 1000000L;
+    nanosleep(&sleep_for, NULL);
+    if(nap < 16) nap *= 2;
+  }
+  if(! entry->mine)
+    flight->shared++;
+  memset(file_stat, 0, sizeof(struct stat));
+  file_stat->st_mode = slot->mode;
+  file_stat->st_uid = slot->uid;
+  file_stat->st_gid = slot->gid;
+  errno = slot->error;
+  return slot->result;
+}
+
+#endif /* _CPATH_FLIGHT_LOADED_SEMAPHORE */
@@ -0,0 +1,205 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_INDEX_LOADED_SEMAPHORE
+#define _CPATH_INDEX_LOADED_SEMAPHORE
+
+#include <limits.h>
+#include "cpath-scan.c"
+
+/**
+ * In-memory executable index over an ordered list of directories (e.g., a
+ * cleaned PATH). Other kinds of content (e.g., shared objects for
+ * LD_LIBRARY_PATH) can be indexed the same way.
+ *
+ * Every directory is read once, in parallel, with an indexed scan (see
+ * cpath-scan.c). The names are then put in one hash table that records, for
+ * each name, the position of the directory a search would find it in, i.e.
+ * the first one holding it. That answers "where does this command resolve
+ * to" and "what does this directory contribute" without any further
+ * syscalls.
+ *
+ * Elements whose contents are unknown (empty elements, which mean the current
+ * directory, and directories we could not read) have no scan. Anything that
+ * moves or drops directories must treat those as possibly holding anything.
+ */
+
+/* Marks "no position", e.g. for a name no directory holds */
+#define CPATH_INDEX_NONE ((unsigned int)-1)
+/* Starting value for cpath_index_fnv() */
+#define CPATH_INDEX_FNV_SEED 0xcbf29ce484222325ULL
+
+typedef struct cpath_index_name_t {
+  const char *name;      /* points into a scan's name pool, NULL if unused */
+  unsigned int hash;
+  unsigned int first;    /* position of the directory this name resolves to */
+  unsigned int scratch;  /* free for callers, e.g. position under a new order */
+  unsigned long count;   /* how often the name is used, if known */
+} cpath_index_name_t;
+
+typedef struct cpath_index_t {
+  unsigned int dir_count;
+  char **dirs;
+  cpath_scan_t **scans;     /* NULL where the contents are unknown */
+  cpath_index_name_t *slots;
+  unsigned int slot_count;  /* always a power of two */
+  unsigned int name_count;
+  unsigned int *unique;     /* per directory, how many names resolve to it */
+} cpath_index_t;
+
+/**
+ * DJB hash, same as everywhere else.
+ */
+static unsigned int cpath_index_hash(const char *name) {
+  unsigned int hash = 5381;
+  while(*name) {
+    hash = ((hash << 5) + hash) + (*name);
+    name++;
+  }
+  return hash;
+}
+
+/**
+ * Fold some bytes into a 64 bit FNV-1a hash, for naming things on disk after
+ * what they were built from.
+ */
+static unsigned long long cpath_index_fnv(unsigned long long hash, const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  while(len--) {
+    hash ^= *(bytes++);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * Find the slot for a name, which is either the slot holding it or the empty
+ * slot where it would go.
+ */
+static cpath_index_name_t *cpath_index_slot(cpath_index_t *index, const char *name,
+                                            unsigned int hash) {
+  unsigned int slot = hash & (index->slot_count - 1);
+  while(NULL != index->slots[slot].name) {
+    if(index->slots[slot].hash == hash && eq(index->slots[slot].name, name))
+      break;
+    slot = (slot + 1) & (index->slot_count - 1);
+  }
+  return &index->slots[slot];
+}
+
+/**
+ * Look up a name.
+ *
+ * @return the entry for the name or NULL if no directory holds it
+ */
+static cpath_index_name_t *cpath_index_find(cpath_index_t *index, const char *name) {
+  cpath_index_name_t *entry = cpath_index_slot(index, name, cpath_index_hash(name));
+  return entry->name ? entry : NULL;
+}
+
+/**
+ * Do we know what is in the directory at this position?
+ */
+static int cpath_index_known(cpath_index_t *index, unsigned int pos) {
+  return NULL != index->scans[pos] && CPATH_SCAN_OK == index->scans[pos]->status;
+}
+
+/**
+ * Build the index for an ordered list of directories.
+ *
+ * @param dirs the directories, in search order
+ * @param count how many there are
+ * @param kind what to index, one of the CPATH_KIND_* values
+ */
+static cpath_index_t *cpath_index_build(char **dirs, unsigned int count, int kind) {
+  cpath_index_t *index = (cpath_index_t *)fatal_malloc(sizeof(cpath_index_t));
+  cpath_scan_t **todo = (cpath_scan_t **)fatal_malloc(sizeof(cpath_scan_t *) * (count + 1));
+  unsigned int pos, idx, todo_count = 0, total = 0;
+  index->dir_count = count;
+  index->dirs = dirs;
+  index->scans = (cpath_scan_t **)fatal_malloc(sizeof(cpath_scan_t *) * (count + 1));
+  index->unique = (unsigned int *)calloc(count + 1, sizeof(unsigned int));
+  if(! index->unique) fatal("Unable to allocate RAM for executable index.\n");
+  for(pos = 0; pos < count; pos++) {
+    index->scans[pos] = NULL;
+    if('\0' != *dirs[pos])
+      todo[todo_count++] = index->scans[pos] = cpath_scan_lookup(dirs[pos], kind, 1);
+  }
+  cpath_scan_run(todo, todo_count);
+  free(todo);
+  for(pos = 0; pos < count; pos++) {
+    if(cpath_index_known(index, pos))
+      total += index->scans[pos]->matches;
+    else
+      index->scans[pos] = NULL;
+  }
+  /* keep the table at most half full */
+  index->slot_count = 64;
+  while(index->slot_count < 2 * total)
+    index->slot_count *= 2;
+  index->slots = (cpath_index_name_t *)calloc(index->slot_count, sizeof(cpath_index_name_t));
+  if(! index->slots) fatal("Unable to allocate RAM for executable index.\n");
+  index->name_count = 0;
+  for(pos = 0; pos < count; pos++) {
+    if(NULL == index->scans[pos])
+      continue;
+    for(idx = 0; idx < index->scans[pos]->matches; idx++) {
+      const char *name = index->scans[pos]->names[idx];
+      unsigned int hash = cpath_index_hash(name);
+      cpath_index_name_t *entry = cpath_index_slot(index, name, hash);
+      if(NULL == entry->name) {
+        entry->name = name;
+        entry->hash = hash;
+        entry->first = pos;
+        entry->scratch = CPATH_INDEX_NONE;
+        entry->count = 0;
+        index->name_count++;
+        index->unique[pos]++;
+      }
+    }
+  }
+  debug(3, ("cpath_index_build: %u names in %u directories\n", index->name_count, count));
+  return index;
+}
+
+/**
+ * Free an index. The scans stay cached, and dirs belongs to the caller.
+ */
+static void cpath_index_free(cpath_index_t *index) {
+  free(index->scans);
+  free(index->unique);
+  free(index->slots);
+  free(index);
+}
+
+/**
+ * Find the directory a name resolves to, the way a PATH search would.
+ * Directories the index could not read are probed for the name directly.
+ *
+ * @param index the index
+ * @param name the name to look up
+ * @param uncertain set non-zero if an element whose contents depend on
+ *        where the search is done from (an empty or relative one) comes
+ *        before the answer, so the answer may not hold everywhere
+ *
+ * @return the position of the directory, or CPATH_INDEX_NONE if no
+ *         directory holds name
+ */
+static unsigned int cpath_index_resolve(cpath_index_t *index, const char *name, int *uncertain) {
+  cpath_index_name_t *entry = cpath_index_find(index, name);
+  unsigned int last = entry ? entry->first : index->dir_count, pos;
+  char file_name[PATH_MAX];
+  struct stat file_stat;
+  *uncertain = 0;
+  for(pos = 0; pos <= last && pos < index->dir_count; pos++) {
+    const char *dir = index->dirs[pos];
+    if('/' != *dir)
+      *uncertain = 1;
+    if(index->scans[pos])
+      continue;
+    snprintf(file_name, sizeof(file_name), "%s%s%s", dir, '\0' == *dir ? "" : "/", name);
+    if(0 == stat(file_name, &file_stat) && cpath_can_exec_file(&file_stat))
+      return pos;
+  }
+  return entry ? entry->first : CPATH_INDEX_NONE;
+}
+
+#endif /* _CPATH_INDEX_LOADED_SEMAPHORE */
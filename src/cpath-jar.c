@@ -0,0 +1,629 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_JAR_LOADED_SEMAPHORE
+#define _CPATH_JAR_LOADED_SEMAPHORE
+
+#include <limits.h>
+#include <stddef.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include "cpath-cache.c"
+#include "cpath-element.c"
+
+/**
+ * Content digests of jar files, so copies of the same jar installed under
+ * different prefixes can be recognized.
+ *
+ * The digest is MurmurHash3 x64 128 of the whole file (fast, not
+ * cryptographic, so only meant for our own files, not for files someone could
+ * craft to collide). Files are hashed in the same kind of thread pool the
+ * directory scans use (see cpath-scan.c).
+ *
+ * Digests are kept between runs in one file in the cache directory (see
+ * cpath-cache.c), keyed on device, inode, size and mtime, so an unchanged jar
+ * is only read once. In memory they are indexed by an open addressed table
+ * on the DJB hash of the key, so looking up every jar of a long classpath
+ * stays linear.
+ *
+ * Jars can also be listed by their zip central directory, to tell whether the
+ * jars of a directory can be replaced by the directory's wildcard (its name
+ * followed by a slash and a "*"), which the JVM expands in no particular
+ * order.
+ */
+
+#define CPATH_JAR_CACHE_NAME  "jar-digests"
+#define CPATH_JAR_CACHE_MAGIC "CPJAR001"
+/* Don't let the digest cache grow past this many entries */
+#define CPATH_JAR_CACHE_MAX   16384
+#define CPATH_JAR_SEED        0x636c65616e706174ULL
+
+#define CPATH_JAR_PENDING    0 /* not hashed yet */
+#define CPATH_JAR_OK         1 /* digest is valid */
+#define CPATH_JAR_UNREADABLE 2 /* could not be read */
+
+/* One cache entry, also the on-disk record */
+typedef struct cpath_jar_key_t {
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+  unsigned long long digest[2];
+} cpath_jar_key_t;
+
+typedef struct cpath_jar_t {
+  const char *path;
+  cpath_jar_key_t key;
+  int status;
+  int error;
+} cpath_jar_t;
+
+typedef struct cpath_jar_pool_t {
+  cpath_jar_t **jars;
+  unsigned int count;
+  unsigned int next;  /* next jar to hand out, taken atomically */
+} cpath_jar_pool_t;
+
+/* The digest cache, loaded once */
+static cpath_jar_key_t *cpath_jar_cache = NULL;
+static unsigned int cpath_jar_cache_count = 0;
+static unsigned int cpath_jar_cache_size = 0;
+static int cpath_jar_cache_dirty = 0;
+/* Where each digest is, by key: the entry's index + 1, 0 is an empty slot */
+static unsigned int *cpath_jar_cache_slots = NULL;
+static unsigned int cpath_jar_cache_mask = 0;
+
+/**
+ * Is this a CLASSPATH-like variable, i.e. does its name end in CLASSPATH?
+ */
+static int cpath_jar_is_classpath(const char *env_name) {
+  size_t len = strlen(env_name);
+  return len >= 9 && eq(env_name + len - 9, "CLASSPATH");
+}
+
+/**
+ * Is this element a jar (or zip) file, by name?
+ */
+static int cpath_jar_is_jar(const char *path) {
+  size_t len = strlen(path);
+  return len > 4 && (0 == strcasecmp(path + len - 4, ".jar") || 0 == strcasecmp(path + len - 4, ".zip"));
+}
+
+static unsigned long long cpath_jar_rotl(unsigned long long x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long cpath_jar_fmix(unsigned long long k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/**
+ * MurmurHash3 x64 128.
+ *
+ * @param out where to put the 128 bit digest
+ */
+static void cpath_jar_murmur3(const unsigned char *data, size_t len, unsigned long long seed,
+                              unsigned long long *out) {
+  const unsigned long long c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  unsigned long long h1 = seed, h2 = seed, k1, k2;
+  const unsigned char *tail = data + (len & ~(size_t)15);
+  size_t block;
+  for(block = 0; block < len / 16; block++) {
+    memcpy(&k1, data + block * 16, sizeof(k1));
+    memcpy(&k2, data + block * 16 + 8, sizeof(k2));
+    k1 *= c1; k1 = cpath_jar_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = cpath_jar_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = cpath_jar_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = cpath_jar_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+  k1 = k2 = 0;
+  switch(len & 15) {
+  case 15: k2 ^= (unsigned long long)tail[14] << 48; /* fall through */
+  case 14: k2 ^= (unsigned long long)tail[13] << 40; /* fall through */
+  case 13: k2 ^= (unsigned long long)tail[12] << 32; /* fall through */
+  case 12: k2 ^= (unsigned long long)tail[11] << 24; /* fall through */
+  case 11: k2 ^= (unsigned long long)tail[10] << 16; /* fall through */
+  case 10: k2 ^= (unsigned long long)tail[9] << 8;   /* fall through */
+  case 9:
+    k2 ^= (unsigned long long)tail[8];
+    k2 *= c2; k2 = cpath_jar_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    /* fall through */
+  case 8: k1 ^= (unsigned long long)tail[7] << 56;   /* fall through */
+  case 7: k1 ^= (unsigned long long)tail[6] << 48;   /* fall through */
+  case 6: k1 ^= (unsigned long long)tail[5] << 40;   /* fall through */
+  case 5: k1 ^= (unsigned long long)tail[4] << 32;   /* fall through */
+  case 4: k1 ^= (unsigned long long)tail[3] << 24;   /* fall through */
+  case 3: k1 ^= (unsigned long long)tail[2] << 16;   /* fall through */
+  case 2: k1 ^= (unsigned long long)tail[1] << 8;    /* fall through */
+  case 1:
+    k1 ^= (unsigned long long)tail[0];
+    k1 *= c1; k1 = cpath_jar_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = cpath_jar_fmix(h1);
+  h2 = cpath_jar_fmix(h2);
+  h1 += h2;
+  h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
+
+/**
+ * Hash one jar. Safe to call from worker threads.
+ */
+static void cpath_jar_digest(cpath_jar_t *jar) {
+  int fd = open(jar->path, O_RDONLY | O_CLOEXEC);
+  unsigned char *data;
+  if(fd < 0) {
+    jar->error = errno;
+    jar->status = CPATH_JAR_UNREADABLE;
+    return;
+  }
+  if(0 == jar->key.size) {
+    cpath_jar_murmur3((const unsigned char *)"", 0, CPATH_JAR_SEED, jar->key.digest);
+    jar->status = CPATH_JAR_OK;
+    close(fd);
+    return;
+  }
+  data = (unsigned char *)mmap(NULL, jar->key.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(MAP_FAILED == data) {
+    jar->error = errno;
+    jar->status = CPATH_JAR_UNREADABLE;
+    return;
+  }
+  madvise(data, jar->key.size, MADV_SEQUENTIAL);
+  cpath_jar_murmur3(data, jar->key.size, CPATH_JAR_SEED, jar->key.digest);
+  munmap(data, jar->key.size);
+  jar->status = CPATH_JAR_OK;
+}
+
+/**
+ * Body of each hashing thread.
+ */
+static void *cpath_jar_worker(void *arg) {
+  cpath_jar_pool_t *pool = (cpath_jar_pool_t *)arg;
+  unsigned int idx;
+  while((idx = __sync_fetch_and_add(&pool->next, 1)) < pool->count)
+    cpath_jar_digest(pool->jars[idx]);
+  return NULL;
+}
+
+/**
+ * Hash jars in parallel, with as many threads as directory scans use.
+ */
+static void cpath_jar_run(cpath_jar_t **jars, unsigned int count) {
+  cpath_jar_pool_t pool;
+  pthread_t threads[CPATH_SCAN_MAX_JOBS];
+  unsigned int idx, thread_count, started = 0;
+  pool.jars = jars;
+  pool.count = count;
+  pool.next = 0;
+  thread_count = count < (unsigned int)cpath_scan_jobs ? count : (unsigned int)cpath_scan_jobs;
+  if(thread_count > 1) {
+    for(idx = 0; idx < thread_count; idx++) {
+      if(0 != pthread_create(&threads[idx], NULL, cpath_jar_worker, &pool))
+        break;
+      started++;
+    }
+  }
+  cpath_jar_worker(&pool);
+  for(idx = 0; idx < started; idx++)
+    pthread_join(threads[idx], NULL);
+}
+
+/**
+ * Hash the key of a digest, i.e. everything but the digest.
+ */
+static unsigned int cpath_jar_cache_hash(const cpath_jar_key_t *key) {
+  return cpath_element_hash((const char *)key, offsetof(cpath_jar_key_t, digest));
+}
+
+/**
+ * Put an entry of the cache in the index.
+ */
+static void cpath_jar_cache_insert(unsigned int idx) {
+  unsigned int slot = cpath_jar_cache_hash(&cpath_jar_cache[idx]) & cpath_jar_cache_mask;
+  while(cpath_jar_cache_slots[slot])
+    slot = (slot + 1) & cpath_jar_cache_mask;
+  cpath_jar_cache_slots[slot] = idx + 1;
+}
+
+/**
+ * (Re)build the index, with room for as many entries as the cache has.
+ */
+static void cpath_jar_cache_index(void) {
+  unsigned int slot_count = 64, idx;
+  while(slot_count < 2 * cpath_jar_cache_size)
+    slot_count *= 2;
+  free(cpath_jar_cache_slots);
+  cpath_jar_cache_slots = (unsigned int *)calloc(slot_count, sizeof(unsigned int));
+  if(! cpath_jar_cache_slots) fatal("Unable to allocate RAM for jar digests.\n");
+  cpath_jar_cache_mask = slot_count - 1;
+  for(idx = 0; idx < cpath_jar_cache_count; idx++)
+    cpath_jar_cache_insert(idx);
+}
+
+/**
+ * Load the digest cache.
+ */
+static void cpath_jar_cache_load(const char *file_name) {
+  char magic[8];
+  unsigned int count = 0;
+  FILE *fh;
+  cpath_jar_cache_size = 256;
+  cpath_jar_cache = (cpath_jar_key_t *)fatal_malloc(sizeof(cpath_jar_key_t) * cpath_jar_cache_size);
+  if(! file_name || NULL == (fh = fopen(file_name, "r"))) {
+    cpath_jar_cache_index();
+    return;
+  }
+  if(1 == fread(magic, sizeof(magic), 1, fh) && 0 == memcmp(magic, CPATH_JAR_CACHE_MAGIC, sizeof(magic)) &&
+     1 == fread(&count, sizeof(count), 1, fh) && count <= CPATH_JAR_CACHE_MAX) {
+    if(count > cpath_jar_cache_size) {
+      cpath_jar_cache_size = count;
+      cpath_jar_cache = (cpath_jar_key_t *)realloc(cpath_jar_cache, sizeof(cpath_jar_key_t) * count);
+      if(! cpath_jar_cache) fatal("Unable to allocate RAM for jar digests.\n");
+    }
+    cpath_jar_cache_count = fread(cpath_jar_cache, sizeof(cpath_jar_key_t), count, fh);
+  }
+  fclose(fh);
+  cpath_jar_cache_index();
+  debug(3, ("cpath_jar_cache_load: %u digests\n", cpath_jar_cache_count));
+}
+
+/**
+ * Find a jar's digest in the cache.
+ *
+ * @return non-zero if it was there, in which case the digest is filled in
+ */
+static int cpath_jar_cache_find(cpath_jar_key_t *key) {
+  unsigned int slot;
+  for(slot = cpath_jar_cache_hash(key) & cpath_jar_cache_mask; cpath_jar_cache_slots[slot];
+      slot = (slot + 1) & cpath_jar_cache_mask) {
+    cpath_jar_key_t *entry = &cpath_jar_cache[cpath_jar_cache_slots[slot] - 1];
+    if(entry->ino == key->ino && entry->dev == key->dev && entry->size == key->size &&
+       entry->mtime_sec == key->mtime_sec && entry->mtime_nsec == key->mtime_nsec) {
+      key->digest[0] = entry->digest[0];
+      key->digest[1] = entry->digest[1];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Add a digest to the cache. It may grow past CPATH_JAR_CACHE_MAX until
+ * cpath_jar_cache_trim().
+ */
+static void cpath_jar_cache_add(cpath_jar_key_t *key) {
+  if(cpath_jar_cache_count == cpath_jar_cache_size) {
+    cpath_jar_cache_size *= 2;
+    cpath_jar_cache = (cpath_jar_key_t *)realloc(cpath_jar_cache, sizeof(cpath_jar_key_t) * cpath_jar_cache_size);
+    if(! cpath_jar_cache) fatal("Unable to allocate RAM for jar digests.\n");
+    cpath_jar_cache_index();
+  }
+  cpath_jar_cache[cpath_jar_cache_count++] = *key;
+  cpath_jar_cache_insert(cpath_jar_cache_count - 1);
+  cpath_jar_cache_dirty = 1;
+}
+
+/**
+ * Drop the oldest digests past CPATH_JAR_CACHE_MAX, all at once.
+ */
+static void cpath_jar_cache_trim(void) {
+  unsigned int extra;
+  if(cpath_jar_cache_count <= CPATH_JAR_CACHE_MAX)
+    return;
+  extra = cpath_jar_cache_count - CPATH_JAR_CACHE_MAX;
+  memmove(cpath_jar_cache, cpath_jar_cache + extra, sizeof(cpath_jar_key_t) * CPATH_JAR_CACHE_MAX);
+  cpath_jar_cache_count = CPATH_JAR_CACHE_MAX;
+  cpath_jar_cache_index();
+}
+
+/**
+ * Write the digest cache back, if anything was added, under a temporary name
+ * that is then renamed into place.
+ */
+static void cpath_jar_cache_save(const char *file_name) {
+  char tmp_name[PATH_MAX + 16];
+  FILE *fh;
+  if(! file_name || ! cpath_jar_cache_dirty)
+    return;
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int)getpid());
+  if(NULL == (fh = fopen(tmp_name, "w"))) {
+    verbose(2, ("# Unable to write jar digests \"%s\": %s\n", tmp_name, strerror(errno)));
+    return;
+  }
+  if(1 != fwrite(CPATH_JAR_CACHE_MAGIC, 8, 1, fh) ||
+     1 != fwrite(&cpath_jar_cache_count, sizeof(cpath_jar_cache_count), 1, fh) ||
+     cpath_jar_cache_count != fwrite(cpath_jar_cache, sizeof(cpath_jar_key_t), cpath_jar_cache_count, fh) ||
+     0 != fclose(fh) || 0 != rename(tmp_name, file_name)) {
+    verbose(2, ("# Unable to write jar digests \"%s\": %s\n", file_name, strerror(errno)));
+    unlink(tmp_name);
+    return;
+  }
+  cpath_jar_cache_dirty = 0;
+}
+
+/**
+ * Get the digests of some jars, from the cache where possible, hashing the
+ * rest in parallel.
+ *
+ * @param paths the jar files
+ * @param count how many there are
+ * @param cache_dir where the digest cache is kept, NULL to not use one
+ *
+ * @return one cpath_jar_t per path, status tells if the digest is valid
+ */
+static cpath_jar_t *cpath_jar_digests(char **paths, unsigned int count, const char *cache_dir) {
+  cpath_jar_t *jars = (cpath_jar_t *)fatal_malloc(sizeof(cpath_jar_t) * (count + 1));
+  cpath_jar_t **todo = (cpath_jar_t **)fatal_malloc(sizeof(cpath_jar_t *) * (count + 1));
+  char cache_file[PATH_MAX], *cache_name = NULL;
+  unsigned int idx, pending = 0;
+  struct stat file_stat;
+  if(cache_dir && cpath_cache_dir_ok(cache_dir)) {
+    snprintf(cache_file, sizeof(cache_file), "%s/%s", cache_dir, CPATH_JAR_CACHE_NAME);
+    cache_name = cache_file;
+  }
+  if(! cpath_jar_cache)
+    cpath_jar_cache_load(cache_name);
+  for(idx = 0; idx < count; idx++) {
+    cpath_jar_t *jar = &jars[idx];
+    memset(jar, 0, sizeof(cpath_jar_t));
+    jar->path = paths[idx];
+    if(0 != stat(jar->path, &file_stat) || ! S_ISREG(file_stat.st_mode)) {
+      jar->status = CPATH_JAR_UNREADABLE;
+      continue;
+    }
+    jar->key.dev = file_stat.st_dev;
+    jar->key.ino = file_stat.st_ino;
+    jar->key.size = file_stat.st_size;
+    jar->key.mtime_sec = file_stat.st_mtim.tv_sec;
+    jar->key.mtime_nsec = file_stat.st_mtim.tv_nsec;
+    if(cpath_jar_cache_find(&jar->key))
+      jar->status = CPATH_JAR_OK;
+    else
+      todo[pending++] = jar;
+  }
+  debug(3, ("cpath_jar_digests: %u of %u jars to hash\n", pending, count));
+  cpath_jar_run(todo, pending);
+  for(idx = 0; idx < pending; idx++)
+    if(CPATH_JAR_OK == todo[idx]->status)
+      cpath_jar_cache_add(&todo[idx]->key);
+  cpath_jar_cache_trim();
+  cpath_jar_cache_save(cache_name);
+  free(todo);
+  return jars;
+}
+
+/* Zip record signatures */
+#define CPATH_JAR_EOCD_SIG      0x06054b50
+#define CPATH_JAR_ZIP64_LOC_SIG 0x07064b50
+#define CPATH_JAR_ZIP64_SIG     0x06064b50
+#define CPATH_JAR_CENTRAL_SIG   0x02014b50
+/* The end of central directory record can be followed by a comment this long */
+#define CPATH_JAR_MAX_COMMENT   65535
+
+static unsigned int cpath_jar_u16(const unsigned char *data) {
+  return data[0] | (data[1] << 8);
+}
+
+static unsigned int cpath_jar_u32(const unsigned char *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+}
+
+static unsigned long long cpath_jar_u64(const unsigned char *data) {
+  return cpath_jar_u32(data) | ((unsigned long long)cpath_jar_u32(data + 4) << 32);
+}
+
+/**
+ * List the entries of a jar from its zip central directory (zip64 too).
+ *
+ * @param path the jar
+ * @param count out: how many entries there are
+ *
+ * @return the entry names, or NULL if the jar can't be read
+ */
+static char **cpath_jar_entries(const char *path, unsigned int *count) {
+  unsigned long long entries, cd_size, cd_offset, pos;
+  const unsigned char *data, *eocd = NULL;
+  struct stat file_stat;
+  size_t size, back;
+  char **names;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  *count = 0;
+  if(fd < 0)
+    return NULL;
+  if(0 != fstat(fd, &file_stat) || file_stat.st_size < 22) {
+    close(fd);
+    return NULL;
+  }
+  size = file_stat.st_size;
+  data = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(MAP_FAILED == data)
+    return NULL;
+  for(back = 22; back <= size && back <= 22 + CPATH_JAR_MAX_COMMENT && ! eocd; back++)
+    if(CPATH_JAR_EOCD_SIG == cpath_jar_u32(data + size - back))
+      eocd = data + size - back;
+  if(! eocd) {
+    munmap((void *)data, size);
+    return NULL;
+  }
+  entries = cpath_jar_u16(eocd + 10);
+  cd_size = cpath_jar_u32(eocd + 12);
+  cd_offset = cpath_jar_u32(eocd + 16);
+  if((0xffff == entries || 0xffffffff == cd_size || 0xffffffff == cd_offset) &&
+     (size_t)(eocd - data) >= 20 && CPATH_JAR_ZIP64_LOC_SIG == cpath_jar_u32(eocd - 20)) {
+    unsigned long long zip64 = cpath_jar_u64(eocd - 20 + 8);
+    if(zip64 + 56 <= size && CPATH_JAR_ZIP64_SIG == cpath_jar_u32(data + zip64)) {
+      entries = cpath_jar_u64(data + zip64 + 32);
+      cd_size = cpath_jar_u64(data + zip64 + 40);
+      cd_offset = cpath_jar_u64(data + zip64 + 48);
+    }
+  }
+  if(cd_offset > size || cd_size > size - cd_offset || entries > cd_size / 46) {
+    munmap((void *)data, size);
+    return NULL;
+  }
+  names = (char **)fatal_malloc(sizeof(char *) * (entries + 1));
+  for(pos = cd_offset; *count < entries; ) {
+    unsigned int name_len, extra_len, comment_len;
+    if(pos + 46 > cd_offset + cd_size || CPATH_JAR_CENTRAL_SIG != cpath_jar_u32(data + pos))
+      break;
+    name_len = cpath_jar_u16(data + pos + 28);
+    extra_len = cpath_jar_u16(data + pos + 30);
+    comment_len = cpath_jar_u16(data + pos + 32);
+    if(pos + 46 + name_len > cd_offset + cd_size)
+      break;
+    names[*count] = (char *)fatal_malloc(name_len + 1);
+    memcpy(names[*count], data + pos + 46, name_len);
+    names[(*count)++][name_len] = '\0';
+    pos += 46 + name_len + extra_len + comment_len;
+  }
+  munmap((void *)data, size);
+  if(*count != entries) {
+    while(*count)
+      free(names[--(*count)]);
+    free(names);
+    return NULL;
+  }
+  return names;
+}
+
+/**
+ * Would the JVM's wildcard for a directory pick up this file name, i.e. does it end
+ * in exactly ".jar" or ".JAR"?
+ */
+static int cpath_jar_in_wildcard(const char *name) {
+  size_t len = strlen(name);
+  return len >= 4 && (eq(name + len - 4, ".jar") || eq(name + len - 4, ".JAR"));
+}
+
+/**
+ * List the names a directory's wildcard expands to, in no particular order, the
+ * same as the JVM.
+ *
+ * @param dir the directory ("" for the current one)
+ * @param count out: how many names there are
+ *
+ * @return the names, or NULL if the directory can't be read
+ */
+static char **cpath_jar_wildcard(const char *dir, unsigned int *count) {
+  unsigned int size = 16;
+  struct dirent *entry;
+  char **names;
+  DIR *dh = opendir('\0' == *dir ? "." : dir);
+  *count = 0;
+  if(! dh)
+    return NULL;
+  names = (char **)fatal_malloc(sizeof(char *) * size);
+  while(NULL != (entry = readdir(dh))) {
+    if(! cpath_jar_in_wildcard(entry->d_name))
+      continue;
+    if(*count == size) {
+      size *= 2;
+      names = (char **)realloc(names, sizeof(char *) * size);
+      if(! names) fatal("Unable to allocate RAM for jar names.\n");
+    }
+    names[(*count)++] = str_clone(entry->d_name);
+  }
+  closedir(dh);
+  return names;
+}
+
+/**
+ * Does this entry matter for which jar a class or resource is loaded from?
+ * Directory entries don't, and neither does META-INF (manifests, signatures,
+ * licenses, service lists that are all read anyway), except for the classes
+ * of multi-release jars under META-INF/versions/.
+ */
+static int cpath_jar_entry_matters(const char *name) {
+  size_t len = strlen(name);
+  if(0 == len || '/' == name[len - 1])
+    return 0;
+  if(0 == strncmp(name, "META-INF/", 9))
+    return 0 == strncmp(name, "META-INF/versions/", 18);
+  return 1;
+}
+
+/**
+ * Check that no two jars hold the same class or resource, so they can be
+ * searched in any order, as the JVM does for the jars of a wildcard.
+ *
+ * @param paths the jars
+ * @param count how many there are
+ * @param why out: on failure, a message saying which entry (or jar) is the
+ *        problem, to be freed by the caller
+ *
+ * @return non-zero if the order doesn't matter
+ */
+static int cpath_jar_disjoint(char **paths, unsigned int count, char **why) {
+  char ***entries = (char ***)fatal_malloc(sizeof(char **) * (count + 1));
+  unsigned int *entry_counts = (unsigned int *)fatal_malloc(sizeof(unsigned int) * (count + 1));
+  unsigned int idx, pos, total = 0, slot_count = 64;
+  unsigned int *slots;
+  int disjoint = 1;
+  *why = NULL;
+  for(idx = 0; idx < count && disjoint; idx++) {
+    entries[idx] = cpath_jar_entries(paths[idx], &entry_counts[idx]);
+    if(! entries[idx]) {
+      *why = (char *)fatal_malloc(strlen(paths[idx]) + 64);
+      sprintf(*why, "unable to read \"%s\" as a zip file", paths[idx]);
+      disjoint = 0;
+    }
+    total += entry_counts[idx];
+  }
+  count = idx;
+  /* each slot is a pair of unsigned ints: slots[slot * 2] is the jar + 1
+     (so 0 is an empty slot) and slots[slot * 2 + 1] is the entry */
+  while(slot_count < 2 * total)
+    slot_count *= 2;
+  slots = (unsigned int *)calloc(slot_count * 2, sizeof(unsigned int));
+  if(! slots) fatal("Unable to allocate RAM for jar entries.\n");
+  for(idx = 0; idx < count && disjoint; idx++) {
+    for(pos = 0; pos < entry_counts[idx] && disjoint; pos++) {
+      const char *name = entries[idx][pos];
+      unsigned int slot;
+      if(! cpath_jar_entry_matters(name))
+        continue;
+      slot = (unsigned int)cpath_index_fnv(CPATH_INDEX_FNV_SEED, name, strlen(name)) & (slot_count - 1);
+      while(slots[slot * 2]) {
+        unsigned int other = slots[slot * 2] - 1;
+        if(eq(entries[other][slots[slot * 2 + 1]], name)) {
+          if(other != idx) {
+            *why = (char *)fatal_malloc(strlen(name) + strlen(paths[other]) + strlen(paths[idx]) + 64);
+            sprintf(*why, "\"%s\" is in both \"%s\" and \"%s\"", name, paths[other], paths[idx]);
+            disjoint = 0;
+          }
+          break;
+        }
+        slot = (slot + 1) & (slot_count - 1);
+      }
+      if(! slots[slot * 2]) {
+        slots[slot * 2] = idx + 1;
+        slots[slot * 2 + 1] = pos;
+      }
+    }
+  }
+  for(idx = 0; idx < count; idx++) {
+    if(! entries[idx])
+      continue;
+    for(pos = 0; pos < entry_counts[idx]; pos++)
+      free(entries[idx][pos]);
+    free(entries[idx]);
+  }
+  free(slots);
+  free(entries);
+  free(entry_counts);
+  return disjoint;
+}
+
+#endif /* _CPATH_JAR_LOADED_SEMAPHORE */
@@ -0,0 +1,404 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_MANIFEST_LOADED_SEMAPHORE
+#define _CPATH_MANIFEST_LOADED_SEMAPHORE
+
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "cpath-index.c"
+
+/**
+ * Manifests: an authoritative list of the directories (and any files, such
+ * as jars) that exist under some "managed" prefixes (e.g., a software tree,
+ * listed nightly by its admins), so elements under those prefixes can be
+ * kept without touching the filesystem at all. A listed element is taken to
+ * exist and to be usable, so neither -u nor -x is checked for it; list only
+ * what everyone may use. An element the manifest doesn't list is stat()ed as
+ * usual, since it may have been installed after the list was made.
+ *
+ * The list is text, one directory per line, with "@managed PREFIX" lines
+ * naming the prefixes it covers and "#" comments. It's compiled into a file
+ * that is used straight from mmap(2):
+ *
+ *   header | managed prefixes | Bloom filter | block index | blocks
+ *
+ * A lookup first asks the Bloom filter, which answers "not listed" for most
+ * missing directories with a few bit tests. Anything it lets through is
+ * binary searched in the sorted list, which is front coded in blocks of
+ * CPATH_MANIFEST_BLOCK entries: each block starts with a whole path, and
+ * every other entry is the length it shares with the one before it (as an
+ * unsigned short) followed by the rest of it. Paths under one tree share
+ * most of their bytes, so this is much smaller than the list.
+ *
+ * A manifest is stale, and not used, once it's older than the maximum age,
+ * or if any managed prefix's mtime differs from when it was compiled (which
+ * costs one stat() per prefix). That only notices changes right under a
+ * prefix: something removed deeper in the tree is kept until the manifest is
+ * compiled again or gets too old. Elements outside every managed prefix are
+ * always checked with stat() as usual.
+ *
+ * Files are native endian, for the machines of one site.
+ */
+
+#define CPATH_MANIFEST_MAGIC "CPMANI01"
+/* Entries per front coded block */
+#define CPATH_MANIFEST_BLOCK 16
+/* Bloom filter bits per entry, and bits tested per lookup (about 1% false
+   positives) */
+#define CPATH_MANIFEST_BLOOM_BITS 10
+#define CPATH_MANIFEST_BLOOM_K    7
+/* Default maximum age, in hours */
+#define CPATH_MANIFEST_MAX_AGE 48
+
+typedef struct cpath_manifest_header_t {
+  char magic[8];
+  unsigned int header_size;   /* sizeof(cpath_manifest_header_t), catches ABI changes */
+  unsigned int prefix_count;
+  unsigned int entry_count;
+  unsigned int block_count;
+  unsigned int bloom_words;   /* 64 bit words */
+  unsigned int pad;
+  long long created;
+  unsigned long long size;    /* of the whole file */
+} cpath_manifest_header_t;
+
+typedef struct cpath_manifest_prefix_t {
+  long long mtime_sec;        /* of the prefix when compiled */
+  long long mtime_nsec;
+  unsigned int path;          /* offset from the start of the blocks */
+  unsigned int len;
+} cpath_manifest_prefix_t;
+
+typedef struct cpath_manifest_t {
+  char *data;
+  size_t size;
+  cpath_manifest_header_t *header;
+  cpath_manifest_prefix_t *prefixes;
+  unsigned long long *bloom;
+  unsigned int *blocks;       /* offset of each block */
+  char *pool;                 /* the blocks, and the prefixes */
+  size_t pool_size;
+} cpath_manifest_t;
+
+/**
+ * The Bloom filter positions of a path: k positions from two hashes.
+ */
+static void cpath_manifest_bits(const char *path, size_t len, unsigned long long bits,
+                                unsigned long long *positions) {
+  unsigned long long hash = cpath_index_fnv(CPATH_INDEX_FNV_SEED, path, len);
+  unsigned long long first = hash & 0xffffffffULL, second = (hash >> 32) | 1;
+  unsigned int idx;
+  for(idx = 0; idx < CPATH_MANIFEST_BLOOM_K; idx++)
+    positions[idx] = (first + idx * second) % bits;
+}
+
+/**
+ * Is a path under (or one of) the managed prefixes?
+ */
+static int cpath_manifest_managed(cpath_manifest_t *manifest, const char *path) {
+  unsigned int idx;
+  for(idx = 0; idx < manifest->header->prefix_count; idx++) {
+    cpath_manifest_prefix_t *prefix = &manifest->prefixes[idx];
+    if(0 == strncmp(path, manifest->pool + prefix->path, prefix->len) &&
+       ('\0' == path[prefix->len] || '/' == path[prefix->len]))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Is a path in the manifest? Only meaningful for managed paths.
+ */
+static int cpath_manifest_has(cpath_manifest_t *manifest, const char *path) {
+  unsigned long long positions[CPATH_MANIFEST_BLOOM_K];
+  unsigned long long bits = (unsigned long long)manifest->header->bloom_words * 64;
+  char entry[PATH_MAX];
+  unsigned int idx, low = 0, high = manifest->header->block_count;
+  size_t len = strlen(path);
+  const char *cptr, *end = manifest->pool + manifest->pool_size;
+  cpath_manifest_bits(path, len, bits, positions);
+  for(idx = 0; idx < CPATH_MANIFEST_BLOOM_K; idx++)
+    if(! (manifest->bloom[positions[idx] / 64] & (1ULL << (positions[idx] % 64))))
+      return 0;
+  /* the last block whose first entry is <= path */
+  while(high - low > 1) {
+    unsigned int middle = (low + high) / 2;
+    if(strcmp(manifest->pool + manifest->blocks[middle], path) <= 0)
+      low = middle;
+    else
+      high = middle;
+  }
+  if(0 == manifest->header->block_count)
+    return 0;
+  cptr = manifest->pool + manifest->blocks[low];
+  snprintf(entry, sizeof(entry), "%s", cptr);
+  cptr += strlen(cptr) + 1;
+  for(idx = 1; ; idx++) {
+    int cmp = strcmp(entry, path);
+    unsigned short shared;
+    if(0 == cmp)
+      return 1;
+    if(cmp > 0 || idx == CPATH_MANIFEST_BLOCK || cptr + sizeof(shared) >= end ||
+       (low + 1 < manifest->header->block_count && cptr >= manifest->pool + manifest->blocks[low + 1]))
+      return 0;
+    memcpy(&shared, cptr, sizeof(shared));
+    cptr += sizeof(shared);
+    if(shared >= sizeof(entry) || shared + strlen(cptr) >= sizeof(entry))
+      return 0;
+    strcpy(entry + shared, cptr);
+    cptr += strlen(cptr) + 1;
+  }
+}
+
+/**
+ * Does the manifest list a path, so it can be kept without a stat()?
+ */
+static int cpath_manifest_lists(cpath_manifest_t *manifest, const char *path) {
+  return '/' == *path && cpath_manifest_managed(manifest, path) && cpath_manifest_has(manifest, path);
+}
+
+/**
+ * Map a manifest and check that it's fresh.
+ *
+ * @param max_age in hours
+ *
+ * @return the manifest, or NULL if there is none or it's stale
+ */
+static cpath_manifest_t *cpath_manifest_open(const char *file_name, long max_age) {
+  cpath_manifest_t *manifest;
+  cpath_manifest_header_t *header;
+  struct stat file_stat;
+  size_t pool_offset;
+  unsigned int idx;
+  char *data;
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    verbose(1, ("# Not using manifest \"%s\": %s\n", file_name, strerror(errno)));
+    return NULL;
+  }
+  if(0 != fstat(fd, &file_stat) || file_stat.st_size < (off_t)sizeof(cpath_manifest_header_t) ||
+     MAP_FAILED == (data = (char *)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+    verbose(1, ("# Not using manifest \"%s\": it's not a manifest\n", file_name));
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  header = (cpath_manifest_header_t *)data;
+  pool_offset = sizeof(cpath_manifest_header_t) +
+    sizeof(cpath_manifest_prefix_t) * (size_t)header->prefix_count +
+    sizeof(unsigned long long) * (size_t)header->bloom_words +
+    sizeof(unsigned int) * (size_t)header->block_count;
+  if(0 != memcmp(header->magic, CPATH_MANIFEST_MAGIC, sizeof(header->magic)) ||
+     header->header_size != sizeof(cpath_manifest_header_t) ||
+     header->size != (unsigned long long)file_stat.st_size || 0 == header->bloom_words ||
+     header->prefix_count > file_stat.st_size || header->block_count > file_stat.st_size ||
+     header->bloom_words > file_stat.st_size || pool_offset >= (size_t)file_stat.st_size ||
+     '\0' != data[file_stat.st_size - 1]) {
+    verbose(1, ("# Not using manifest \"%s\": it's not a manifest, or it's truncated\n", file_name));
+    munmap(data, file_stat.st_size);
+    return NULL;
+  }
+  manifest = (cpath_manifest_t *)fatal_malloc(sizeof(cpath_manifest_t));
+  manifest->data = data;
+  manifest->size = file_stat.st_size;
+  manifest->header = header;
+  manifest->prefixes = (cpath_manifest_prefix_t *)(data + sizeof(cpath_manifest_header_t));
+  manifest->bloom = (unsigned long long *)(manifest->prefixes + header->prefix_count);
+  manifest->blocks = (unsigned int *)(manifest->bloom + header->bloom_words);
+  manifest->pool = data + pool_offset;
+  manifest->pool_size = manifest->size - pool_offset;
+  for(idx = 0; idx < header->block_count; idx++)
+    if(manifest->blocks[idx] >= manifest->pool_size)
+      break;
+  if(idx < header->block_count) {
+    verbose(1, ("# Not using manifest \"%s\": it's corrupt\n", file_name));
+    munmap(data, manifest->size);
+    free(manifest);
+    return NULL;
+  }
+  if(time(NULL) - header->created > max_age * 3600) {
+    verbose(1, ("# Not using manifest \"%s\": it's more than %ld hours old\n", file_name, max_age));
+    munmap(data, manifest->size);
+    free(manifest);
+    return NULL;
+  }
+  for(idx = 0; idx < header->prefix_count; idx++) {
+    cpath_manifest_prefix_t *prefix = &manifest->prefixes[idx];
+    const char *path = manifest->pool + prefix->path;
+    if(prefix->path >= manifest->pool_size || prefix->len != strlen(path) ||
+       0 != stat(path, &file_stat) || file_stat.st_mtim.tv_sec != prefix->mtime_sec ||
+       file_stat.st_mtim.tv_nsec != prefix->mtime_nsec) {
+      verbose(1, ("# Not using manifest \"%s\": \"%s\" has changed since it was compiled\n",
+                  file_name, prefix->path < manifest->pool_size ? path : "?"));
+      munmap(data, manifest->size);
+      free(manifest);
+      return NULL;
+    }
+  }
+  verbose(2, ("# Using manifest \"%s\" with %u directories under %u prefixes\n", file_name,
+              header->entry_count, header->prefix_count));
+  return manifest;
+}
+
+static int cpath_manifest_cmp(const void *left, const void *right) {
+  return strcmp(*(char * const *)left, *(char * const *)right);
+}
+
+/**
+ * Append bytes to the manifest being compiled.
+ *
+ * @return their offset
+ */
+static size_t cpath_manifest_put(char **data, size_t *size, size_t *used, const void *bytes, size_t len) {
+  size_t offset = *used;
+  while(*used + len > *size) {
+    *size *= 2;
+    *data = (char *)realloc(*data, *size);
+    if(! *data) fatal("Unable to allocate RAM for the manifest.\n");
+  }
+  memcpy(*data + *used, bytes, len);
+  *used += len;
+  return offset;
+}
+
+/**
+ * Compile a list of directories into a manifest.
+ *
+ * @param list_name the list, or "-" for stdin
+ *
+ * @return non-zero on success
+ */
+static int cpath_manifest_compile(const char *list_name, const char *file_name) {
+  unsigned int path_count = 0, path_size = 1024, prefix_count = 0, prefix_size = 16;
+  unsigned int entry_count = 0, block_count, bloom_words, idx, kept;
+  char **paths = (char **)fatal_malloc(sizeof(char *) * path_size);
+  char **prefixes = (char **)fatal_malloc(sizeof(char *) * prefix_size);
+  size_t size = 65536, used = 0, pool_offset;
+  char *pool = (char *)fatal_malloc(size);
+  cpath_manifest_header_t header;
+  cpath_manifest_prefix_t *prefix_records;
+  unsigned long long *bloom;
+  unsigned int *blocks;
+  char line[PATH_MAX + 16], tmp_name[PATH_MAX + 16];
+  FILE *fh = eq(list_name, "-") ? stdin : fopen(list_name, "r");
+  if(! fh) {
+    verbose(0, ("# Unable to read \"%s\": %s\n", list_name, strerror(errno)));
+    return 0;
+  }
+  while(fgets(line, sizeof(line), fh)) {
+    char *start = line, *end;
+    int managed = 0;
+    if(NULL != (end = strchr(line, '#'))) *end = '\0';
+    while(isspace((unsigned char)*start)) start++;
+    if(0 == strncmp(start, "@managed", 8) && isspace((unsigned char)start[8])) {
+      managed = 1;
+      start += 9;
+      while(isspace((unsigned char)*start)) start++;
+    }
+    end = start + strlen(start);
+    while(end > start && isspace((unsigned char)*(end - 1))) end--;
+    /* same trim as the elements get */
+    while(end > start + 1 && '/' == *(end - 1)) end--;
+    *end = '\0';
+    if('\0' == *start)
+      continue;
+    if('/' != *start) {
+      verbose(0, ("# Ignoring relative path \"%s\" in \"%s\"\n", start, list_name));
+      continue;
+    }
+    if(managed) {
+      if(prefix_count == prefix_size) {
+        prefix_size *= 2;
+        prefixes = (char **)realloc(prefixes, sizeof(char *) * prefix_size);
+        if(! prefixes) fatal("Unable to allocate RAM for the manifest.\n");
+      }
+      prefixes[prefix_count++] = str_clone(start);
+    } else {
+      if(path_count == path_size) {
+        path_size *= 2;
+        paths = (char **)realloc(paths, sizeof(char *) * path_size);
+        if(! paths) fatal("Unable to allocate RAM for the manifest.\n");
+      }
+      paths[path_count++] = str_clone(start);
+    }
+  }
+  if(stdin != fh)
+    fclose(fh);
+  if(! prefix_count) {
+    verbose(0, ("# \"%s\" has no \"@managed PREFIX\" lines, so a manifest of it would never be used\n",
+                list_name));
+    return 0;
+  }
+  qsort(paths, path_count, sizeof(char *), cpath_manifest_cmp);
+  for(idx = 0, kept = 0; idx < path_count; idx++)
+    if(0 == kept || ! eq(paths[idx], paths[kept - 1]))
+      paths[kept++] = paths[idx];
+  entry_count = kept;
+  block_count = (entry_count + CPATH_MANIFEST_BLOCK - 1) / CPATH_MANIFEST_BLOCK;
+  bloom_words = (entry_count * CPATH_MANIFEST_BLOOM_BITS + 63) / 64;
+  if(0 == bloom_words) bloom_words = 1;
+  prefix_records = (cpath_manifest_prefix_t *)fatal_malloc(sizeof(cpath_manifest_prefix_t) * prefix_count);
+  bloom = (unsigned long long *)calloc(bloom_words, sizeof(unsigned long long));
+  blocks = (unsigned int *)fatal_malloc(sizeof(unsigned int) * (block_count + 1));
+  if(! bloom) fatal("Unable to allocate RAM for the manifest.\n");
+  /* the blocks */
+  for(idx = 0; idx < entry_count; idx++) {
+    unsigned long long positions[CPATH_MANIFEST_BLOOM_K];
+    unsigned int bit;
+    size_t len = strlen(paths[idx]);
+    cpath_manifest_bits(paths[idx], len, (unsigned long long)bloom_words * 64, positions);
+    for(bit = 0; bit < CPATH_MANIFEST_BLOOM_K; bit++)
+      bloom[positions[bit] / 64] |= 1ULL << (positions[bit] % 64);
+    if(0 == idx % CPATH_MANIFEST_BLOCK) {
+      blocks[idx / CPATH_MANIFEST_BLOCK] = cpath_manifest_put(&pool, &size, &used, paths[idx], len + 1);
+    } else {
+      unsigned short shared = 0;
+      while(shared < len && paths[idx][shared] == paths[idx - 1][shared] && shared < USHRT_MAX)
+        shared++;
+      cpath_manifest_put(&pool, &size, &used, &shared, sizeof(shared));
+      cpath_manifest_put(&pool, &size, &used, paths[idx] + shared, len - shared + 1);
+    }
+  }
+  for(idx = 0; idx < prefix_count; idx++) {
+    struct stat file_stat;
+    if(0 != stat(prefixes[idx], &file_stat)) {
+      verbose(0, ("# Managed prefix \"%s\" doesn't exist: %s\n", prefixes[idx], strerror(errno)));
+      return 0;
+    }
+    prefix_records[idx].mtime_sec = file_stat.st_mtim.tv_sec;
+    prefix_records[idx].mtime_nsec = file_stat.st_mtim.tv_nsec;
+    prefix_records[idx].len = strlen(prefixes[idx]);
+    prefix_records[idx].path = cpath_manifest_put(&pool, &size, &used, prefixes[idx],
+                                                  prefix_records[idx].len + 1);
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CPATH_MANIFEST_MAGIC, sizeof(header.magic));
+  header.header_size = sizeof(cpath_manifest_header_t);
+  header.prefix_count = prefix_count;
+  header.entry_count = entry_count;
+  header.block_count = block_count;
+  header.bloom_words = bloom_words;
+  header.created = time(NULL);
+  pool_offset = sizeof(header) + sizeof(cpath_manifest_prefix_t) * prefix_count +
+    sizeof(unsigned long long) * bloom_words + sizeof(unsigned int) * block_count;
+  header.size = pool_offset + used;
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int)getpid());
+  if(NULL == (fh = fopen(tmp_name, "w"))) {
+    verbose(0, ("# Unable to write manifest \"%s\": %s\n", tmp_name, strerror(errno)));
+    return 0;
+  }
+  if(1 != fwrite(&header, sizeof(header), 1, fh) ||
+     1 != fwrite(prefix_records, sizeof(cpath_manifest_prefix_t) * prefix_count, 1, fh) ||
+     1 != fwrite(bloom, sizeof(unsigned long long) * bloom_words, 1, fh) ||
+     (block_count && 1 != fwrite(blocks, sizeof(unsigned int) * block_count, 1, fh)) ||
+     1 != fwrite(pool, used, 1, fh) || 0 != fclose(fh) || 0 != rename(tmp_name, file_name)) {
+    verbose(0, ("# Unable to write manifest \"%s\": %s\n", file_name, strerror(errno)));
+    unlink(tmp_name);
+    return 0;
+  }
+  verbose(1, ("# Wrote manifest \"%s\": %u directories under %u prefixes in %llu bytes\n", file_name,
+              entry_count, prefix_count, header.size));
+  return 1;
+}
+
+#endif /* _CPATH_MANIFEST_LOADED_SEMAPHORE */
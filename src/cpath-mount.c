@@ -0,0 +1,252 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_MOUNT_LOADED_SEMAPHORE
+#define _CPATH_MOUNT_LOADED_SEMAPHORE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include "cpath-deadline.c"
+
+/**
+ * The mount table, and pre-warming the automounts a path needs.
+ *
+ * Elements under an autofs mount that isn't mounted yet wait for the mount
+ * when they are first stat()ed, and the first pass stats elements one after
+ * another, so a PATH that needs ten automounts waits for ten mounts in a row.
+ * Pre-warming finds the distinct automounts the elements need and triggers
+ * them all at once from a thread each, then waits for them up to a deadline,
+ * which costs about as long as the slowest mount.
+ *
+ * For an indirect map (autofs at /sw, mounts at /sw/KEY) the trigger is
+ * /sw/KEY; for a direct map (autofs at /data/projB) it's the mount point
+ * itself. An element is only a trigger if the deepest mount above it is the
+ * autofs one, so anything already mounted is left alone.
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone()
+ * and the debug() and verbose() macros.
+ */
+
+#ifndef CPATH_MOUNT_INFO
+#define CPATH_MOUNT_INFO "/proc/self/mountinfo"
+#endif
+/* At most this many automounts are pre-warmed */
+#define CPATH_MOUNT_MAX_TRIGGERS 256
+
+typedef struct cpath_mount_t {
+  char *path;
+  size_t len;
+  char *fstype;
+} cpath_mount_t;
+
+typedef struct cpath_mounts_t {
+  unsigned int count;
+  unsigned int size;
+  cpath_mount_t *mounts;
+} cpath_mounts_t;
+
+/**
+ * Undo the octal escapes (e.g., "\040" for a space) mountinfo uses, in place.
+ */
+static void cpath_mount_unescape(char *str) {
+  char *write_ptr = str;
+  while(*str) {
+    if('\\' == str[0] && str[1] >= '0' && str[1] <= '3' && str[2] >= '0' && str[2] <= '7' &&
+       str[3] >= '0' && str[3] <= '7') {
+      *(write_ptr++) = (char)(((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0'));
+      str += 4;
+    } else {
+      *(write_ptr++) = *(str++);
+    }
+  }
+  *write_ptr = '\0';
+}
+
+/**
+ * Read the mount table.
+ *
+ * @return the mounts, in the order they were mounted, or an empty table if
+ *         there's no mountinfo
+ */
+static cpath_mounts_t *cpath_mounts_read(void) {
+  cpath_mounts_t *table = (cpath_mounts_t *)fatal_malloc(sizeof(cpath_mounts_t));
+  char line[8192];
+  FILE *fh = fopen(CPATH_MOUNT_INFO, "r");
+  table->count = 0;
+  table->size = 64;
+  table->mounts = (cpath_mount_t *)fatal_malloc(sizeof(cpath_mount_t) * table->size);
+  if(! fh) {
+    verbose(2, ("# No %s, no mount table\n", CPATH_MOUNT_INFO));
+    return table;
+  }
+  while(fgets(line, sizeof(line), fh)) {
+    /* ID PARENT MAJ:MIN ROOT MOUNT_POINT OPTIONS [OPTIONAL...] - FSTYPE SOURCE SUPER_OPTIONS */
+    char *field, *mount_point = NULL, *fstype = NULL, *save;
+    int idx = 0, after_dash = 0;
+    for(field = strtok_r(line, " \n", &save); field; field = strtok_r(NULL, " \n", &save), idx++) {
+      if(4 == idx)
+        mount_point = field;
+      else if(after_dash) {
+        fstype = field;
+        break;
+      } else if(idx > 5 && eq(field, "-"))
+        after_dash = 1;
+    }
+    if(! mount_point || ! fstype)
+      continue;
+    if(table->count == table->size) {
+      table->size *= 2;
+      table->mounts = (cpath_mount_t *)realloc(table->mounts, sizeof(cpath_mount_t) * table->size);
+      if(! table->mounts) fatal("Unable to allocate RAM for the mount table.\n");
+    }
+    cpath_mount_unescape(mount_point);
+    table->mounts[table->count].path = str_clone(mount_point);
+    table->mounts[table->count].len = strlen(mount_point);
+    table->mounts[table->count].fstype = str_clone(fstype);
+    table->count++;
+  }
+  fclose(fh);
+  return table;
+}
+
+/**
+ * Find the mount a path is on, as far as its string says: the deepest mount
+ * point that is the path or one of its parents. Later mounts hide earlier
+ * ones on the same point.
+ *
+ * @return the mount, or NULL for a relative path
+ */
+static cpath_mount_t *cpath_mount_of(cpath_mounts_t *table, const char *path) {
+  cpath_mount_t *found = NULL;
+  unsigned int idx;
+  if('/' != *path)
+    return NULL;
+  for(idx = 0; idx < table->count; idx++) {
+    cpath_mount_t *mount = &table->mounts[idx];
+    if(0 == strncmp(path, mount->path, mount->len) &&
+       ('/' == path[mount->len] || '\0' == path[mount->len] || 1 == mount->len) &&
+       (! found || mount->len >= found->len))
+      found = mount;
+  }
+  return found;
+}
+
+typedef struct cpath_prewarm_t {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  unsigned int count;
+  unsigned int started;
+  unsigned int finished;
+  char *triggers[CPATH_MOUNT_MAX_TRIGGERS];
+  int errors[CPATH_MOUNT_MAX_TRIGGERS];   /* -1 until finished */
+} cpath_prewarm_t;
+
+/**
+ * Add the automount (if any) that an element needs.
+ */
+static void cpath_prewarm_add(cpath_prewarm_t *prewarm, cpath_mounts_t *table, const char *element) {
+  cpath_mount_t *mount = cpath_mount_of(table, element);
+  char *trigger;
+  unsigned int idx;
+  size_t len;
+  if(! mount || ! eq(mount->fstype, "autofs"))
+    return;
+  /* the mount point itself (direct map), or the key below it (indirect) */
+  len = mount->len;
+  if('/' == element[len]) {
+    len++;
+    while(element[len] && '/' != element[len]) len++;
+  }
+  for(idx = 0; idx < prewarm->count; idx++)
+    if(strlen(prewarm->triggers[idx]) == len && 0 == strncmp(prewarm->triggers[idx], element, len))
+      return;
+  if(prewarm->count == CPATH_MOUNT_MAX_TRIGGERS) {
+    verbose(2, ("# Too many automounts to pre-warm, not pre-warming \"%s\"\n", element));
+    return;
+  }
+  trigger = (char *)fatal_malloc(len + 1);
+  memcpy(trigger, element, len);
+  trigger[len] = '\0';
+  debug(3, ("cpath_prewarm_add: \"%s\" needs automount \"%s\"\n", element, trigger));
+  prewarm->triggers[prewarm->count] = trigger;
+  prewarm->errors[prewarm->count] = -1;
+  prewarm->count++;
+}
+
+typedef struct cpath_prewarm_job_t {
+  cpath_prewarm_t *prewarm;
+  unsigned int idx;
+} cpath_prewarm_job_t;
+
+/**
+ * Trigger one automount. Runs detached, and may outlive the deadline.
+ */
+static void *cpath_prewarm_worker(void *arg) {
+  cpath_prewarm_job_t *job = (cpath_prewarm_job_t *)arg;
+  cpath_prewarm_t *prewarm = job->prewarm;
+  struct stat file_stat;
+  int error = 0 == stat(prewarm->triggers[job->idx], &file_stat) ? 0 : errno;
+  pthread_mutex_lock(&prewarm->lock);
+  prewarm->errors[job->idx] = error;
+  prewarm->finished++;
+  pthread_cond_signal(&prewarm->done);
+  pthread_mutex_unlock(&prewarm->lock);
+  return NULL;
+}
+
+/**
+ * Trigger all the automounts at once, and wait for them, but no longer than
+ * the deadline. Mounts that miss it carry on in the background (and the
+ * first pass waits for them as it always did).
+ *
+ * @param timeout how long to wait, in milliseconds
+ */
+static void cpath_prewarm_run(cpath_prewarm_t *prewarm, long timeout) {
+  struct timespec deadline;
+  struct timeval start, end;
+  unsigned int idx;
+  if(! prewarm->count)
+    return;
+  gettimeofday(&start, NULL);
+  cpath_deadline_in(&deadline, timeout);
+  pthread_mutex_lock(&prewarm->lock);
+  for(idx = 0; idx < prewarm->count; idx++) {
+    /* never freed, a worker may still be using it when we exit */
+    cpath_prewarm_job_t *job = (cpath_prewarm_job_t *)fatal_malloc(sizeof(cpath_prewarm_job_t));
+    job->prewarm = prewarm;
+    job->idx = idx;
+    if(! cpath_deadline_start(cpath_prewarm_worker, job)) {
+      verbose(2, ("# Unable to start a thread to pre-warm \"%s\"\n", prewarm->triggers[idx]));
+      free(job);
+      prewarm->errors[idx] = EAGAIN;
+      prewarm->finished++;
+      continue;
+    }
+    prewarm->started++;
+  }
+  cpath_deadline_wait(&prewarm->lock, &prewarm->done, &prewarm->finished, prewarm->count, &deadline);
+  gettimeofday(&end, NULL);
+  for(idx = 0; idx < prewarm->count; idx++) {
+    if(-1 == prewarm->errors[idx]) {
+      verbose(1, ("# Automount \"%s\" still not there after %ld ms\n", prewarm->triggers[idx], timeout));
+    } else if(prewarm->errors[idx]) {
+      verbose(2, ("# Automount \"%s\" failed: %s\n", prewarm->triggers[idx], strerror(prewarm->errors[idx])));
+    }
+  }
+  verbose(1, ("# Pre-warmed %u of %u automounts in %ld ms\n", prewarm->finished, prewarm->count,
+              (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000)));
+  pthread_mutex_unlock(&prewarm->lock);
+}
+
+/**
+ * Create an empty set of automounts to pre-warm.
+ */
+static cpath_prewarm_t *cpath_prewarm_new(void) {
+  cpath_prewarm_t *prewarm = (cpath_prewarm_t *)fatal_malloc(sizeof(cpath_prewarm_t));
+  memset(prewarm, 0, sizeof(cpath_prewarm_t));
+  pthread_mutex_init(&prewarm->lock, NULL);
+  pthread_cond_init(&prewarm->done, NULL);
+  return prewarm;
+}
+
+#endif /* _CPATH_MOUNT_LOADED_SEMAPHORE */
@@ -0,0 +1,262 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_ROOT_LOADED_SEMAPHORE
+#define _CPATH_ROOT_LOADED_SEMAPHORE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/**
+ * Probing inside another root: checking the environment of a container or
+ * chroot image from the host, without starting it.
+ *
+ * Every element is resolved with openat2(2) and RESOLVE_IN_ROOT, so "/" and
+ * ".." stop at the image's root and absolute symlinks (which images are full
+ * of, e.g. /usr/lib64 -> /usr/lib) point into the image rather than at the
+ * host. Relative elements are taken relative to the image's root. openat2()
+ * needs Linux 5.6; there is no safe way to do this without it, so older
+ * kernels are a fatal error rather than a silent escape to the host.
+ *
+ * Environments come from env files: "NAME=value" lines (an "export " in
+ * front is allowed), with blank lines and "#" comments ignored and values
+ * taken as they are, without any quoting.
+ *
+ * A batch is a list of images, one "ROOT ENV_FILE" per line (with blank
+ * lines and "#" comments ignored). Each image gets a process of its own, up
+ * to a number of them at once, and their output is printed in list order,
+ * each after a comment naming the image.
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone()
+ * and the debug() macro.
+ */
+
+#ifndef O_PATH
+#define O_PATH 010000000
+#endif
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+#ifndef RESOLVE_NO_MAGICLINKS
+#define RESOLVE_NO_MAGICLINKS 0x02
+#endif
+#ifndef RESOLVE_IN_ROOT
+#define RESOLVE_IN_ROOT 0x10
+#endif
+
+/**
+ * Not every libc exposes openat2(), so we use the raw syscall with the
+ * kernel's struct open_how.
+ */
+typedef struct cpath_open_how_t {
+  unsigned long long flags;
+  unsigned long long mode;
+  unsigned long long resolve;
+} cpath_open_how_t;
+
+/**
+ * Open the root to probe in.
+ *
+ * @return an O_PATH fd for it
+ */
+static int cpath_root_open(const char *root) {
+  int root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  cpath_open_how_t how;
+  if(root_fd < 0)
+    fatal("Unable to use \"%s\" as the root: %s\n", root, strerror(errno));
+  /* make sure openat2() is there before relying on it */
+  memset(&how, 0, sizeof(how));
+  how.flags = O_PATH | O_CLOEXEC;
+  how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+  if(0 > syscall(SYS_openat2, root_fd, ".", &how, sizeof(how)) && ENOSYS == errno)
+    fatal("--root needs openat2(2), which this kernel doesn't have (Linux 5.6 or later)\n");
+  return root_fd;
+}
+
+/**
+ * stat() an element inside the root.
+ *
+ * @return what stat() would have, with errno set
+ */
+static int cpath_root_stat(int root_fd, const char *path, struct stat *file_stat) {
+  cpath_open_how_t how;
+  int fd, result, error;
+  memset(&how, 0, sizeof(how));
+  how.flags = O_PATH | O_CLOEXEC;
+  how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+  /* openat2() retries with EAGAIN if a rename raced with the lookup */
+  do {
+    fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+  } while(fd < 0 && EAGAIN == errno);
+  if(fd < 0)
+    return -1;
+  result = fstat(fd, file_stat);
+  error = errno;
+  close(fd);
+  errno = error;
+  debug(4, ("cpath_root_stat: \"%s\": %d\n", path, result));
+  return result;
+}
+
+/**
+ * Replace the environment with the one in an env file.
+ *
+ * @return zero if the file can't be read
+ */
+static int cpath_root_load_env(const char *file_name) {
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t line_len;
+  unsigned int line_no = 0;
+  FILE *fh = fopen(file_name, "r");
+  if(! fh)
+    return 0;
+  clearenv();
+  /* getline(), path values can be far longer than any fixed buffer */
+  while(0 < (line_len = getline(&line, &line_size, fh))) {
+    char *definition = line, *end = line + line_len;
+    line_no++;
+    while(end > line && ('\n' == end[-1] || '\r' == end[-1])) *(--end) = '\0';
+    while(' ' == *definition || '\t' == *definition) definition++;
+    if('\0' == *definition || '#' == *definition)
+      continue;
+    if(0 == strncmp(definition, "export ", 7))
+      definition += 7;
+    if(NULL == strchr(definition, '=') || '=' == *definition) {
+      fclose(fh);
+      fatal("%s:%u: not a NAME=value line\n", file_name, line_no);
+    }
+    putenv(str_clone(definition));
+  }
+  free(line);
+  fclose(fh);
+  return 1;
+}
+
+typedef struct cpath_root_item_t {
+  char *root;
+  char *env_file;
+  pid_t pid;                  /* 0 until it's started */
+  int status;
+  int finished;
+  FILE *out;                  /* its stdout and stderr, until printed */
+  FILE *err;
+} cpath_root_item_t;
+
+/**
+ * Copy what an image printed to where it belongs.
+ */
+static void cpath_root_copy(FILE *from, FILE *to) {
+  char buffer[8192];
+  size_t nread;
+  rewind(from);
+  while(0 < (nread = fread(buffer, 1, sizeof(buffer), from)))
+    fwrite(buffer, 1, nread, to);
+  fclose(from);
+}
+
+/**
+ * Read a batch list.
+ *
+ * @return the images, and their count in count
+ */
+static cpath_root_item_t *cpath_root_read_list(const char *file_name, unsigned int *count) {
+  char line[PATH_MAX * 2 + 16];
+  unsigned int size = 16, line_no = 0;
+  cpath_root_item_t *items = (cpath_root_item_t *)fatal_malloc(sizeof(cpath_root_item_t) * size);
+  FILE *fh = eq(file_name, "-") ? stdin : fopen(file_name, "r");
+  if(! fh)
+    fatal("Unable to read the batch \"%s\": %s\n", file_name, strerror(errno));
+  *count = 0;
+  while(fgets(line, sizeof(line), fh)) {
+    char *root, *env_file, *extra, *save;
+    line_no++;
+    root = strtok_r(line, " \t\r\n", &save);
+    if(! root || '#' == *root)
+      continue;
+    env_file = strtok_r(NULL, " \t\r\n", &save);
+    extra = strtok_r(NULL, " \t\r\n", &save);
+    if(! env_file || extra)
+      fatal("%s:%u: not a \"ROOT ENV_FILE\" line\n", file_name, line_no);
+    if(*count == size) {
+      size *= 2;
+      items = (cpath_root_item_t *)realloc(items, sizeof(cpath_root_item_t) * size);
+      if(! items) fatal("Unable to allocate RAM for the batch.\n");
+    }
+    memset(&items[*count], 0, sizeof(cpath_root_item_t));
+    items[*count].root = str_clone(root);
+    items[*count].env_file = str_clone(env_file);
+    (*count)++;
+  }
+  if(stdin != fh)
+    fclose(fh);
+  return items;
+}
+
+/**
+ * Check a batch of images, up to jobs at once. Each image is checked by a
+ * child process, in which this returns, with the image's environment loaded
+ * and its root in root. In the parent, it waits for them all, prints what
+ * they printed and exits.
+ *
+ * @param file_name the list, or "-" for stdin
+ */
+static void cpath_root_batch(const char *file_name, unsigned int jobs, char **root) {
+  unsigned int count, idx, next = 0, running = 0, printed = 0, failed = 0;
+  cpath_root_item_t *items = cpath_root_read_list(file_name, &count);
+  if(! jobs) jobs = 1;
+  while(printed < count) {
+    /* start as many as we may */
+    while(next < count && running < jobs) {
+      cpath_root_item_t *item = &items[next++];
+      if(NULL == (item->out = tmpfile()) || NULL == (item->err = tmpfile()))
+        fatal("Unable to make a temporary file for \"%s\": %s\n", item->env_file, strerror(errno));
+      fflush(stdout);
+      fflush(stderr);
+      if(0 > (item->pid = fork()))
+        fatal("Unable to start checking \"%s\": %s\n", item->env_file, strerror(errno));
+      if(0 == item->pid) {
+        if(0 > dup2(fileno(item->out), STDOUT_FILENO) || 0 > dup2(fileno(item->err), STDERR_FILENO))
+          fatal("Unable to redirect the output for \"%s\": %s\n", item->env_file, strerror(errno));
+        if(! cpath_root_load_env(item->env_file))
+          fatal("Unable to read the env file \"%s\": %s\n", item->env_file, strerror(errno));
+        *root = item->root;
+        return;
+      }
+      running++;
+    }
+    /* wait for one */
+    {
+      int status;
+      pid_t pid = wait(&status);
+      if(pid < 0)
+        fatal("Lost track of the batch: %s\n", strerror(errno));
+      for(idx = 0; idx < next; idx++)
+        if(items[idx].pid == pid) {
+          items[idx].status = status;
+          items[idx].finished = 1;
+          running--;
+        }
+    }
+    /* print whatever is finished, in order */
+    for(; printed < next && items[printed].finished; printed++) {
+      cpath_root_item_t *item = &items[printed];
+      printf("# %s in %s\n", item->env_file, item->root);
+      fflush(stdout);
+      cpath_root_copy(item->out, stdout);
+      cpath_root_copy(item->err, stderr);
+      fflush(stdout);
+      fflush(stderr);
+      if(! WIFEXITED(item->status) || 0 != WEXITSTATUS(item->status)) {
+        if(WIFSIGNALED(item->status))
+          fprintf(stderr, "Checking \"%s\" was killed by signal %d\n", item->env_file, WTERMSIG(item->status));
+        failed++;
+      }
+    }
+  }
+  exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+#endif /* _CPATH_ROOT_LOADED_SEMAPHORE */
@@ -0,0 +1,478 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_SCAN_LOADED_SEMAPHORE
+#define _CPATH_SCAN_LOADED_SEMAPHORE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/**
+ * Directory content scanning.
+ *
+ * Reads directories with getdents64(2) in a pool of threads and decides, per
+ * variable type, whether a directory holds anything the variable could ever
+ * find there (executables for PATH, shared objects for LD_LIBRARY_PATH, man
+ * sections for MANPATH, modules for PYTHONPATH/PERL5LIB). Results are cached
+ * for the life of the process, so a directory that shows up in several
+ * variables, or several times in one, is only read once.
+ *
+ * Scans can also be "indexed", in which case the whole directory is read and
+ * the names of all matching entries are kept, sorted, for lookups (see
+ * cpath-index.c).
+ *
+ * Worker threads never print anything. All reporting is done by the caller
+ * once the pool has finished, so verbose output stays in order.
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone(),
+ * the uid/gid globals and the debug() macro.
+ */
+
+/**
+ * What kind of content makes a directory worth keeping
+ */
+#define CPATH_KIND_NONE   0 /* no content rules, keep everything */
+#define CPATH_KIND_EXEC   1 /* executables, e.g. PATH */
+#define CPATH_KIND_LIB    2 /* shared objects, e.g. LD_LIBRARY_PATH */
+#define CPATH_KIND_MAN    3 /* man sections, e.g. MANPATH */
+#define CPATH_KIND_PYTHON 4 /* importable python modules, e.g. PYTHONPATH */
+#define CPATH_KIND_PERL   5 /* perl modules, e.g. PERL5LIB */
+
+/**
+ * Scan states
+ */
+#define CPATH_SCAN_PENDING    0 /* not read yet */
+#define CPATH_SCAN_OK         1 /* read, matches is valid */
+#define CPATH_SCAN_UNREADABLE 2 /* could not be read, contents unknown */
+
+/* Size of the getdents64 buffer, big enough for most directories in one go */
+#define CPATH_SCAN_BUFFER_SIZE 32768
+/* Number of buckets in the scan cache, must be a power of two */
+#define CPATH_SCAN_CACHE_SIZE  1024
+/* Default and maximum number of scanning threads */
+#define CPATH_SCAN_DEFAULT_JOBS 8
+#define CPATH_SCAN_MAX_JOBS     64
+
+/**
+ * Not every libc exposes getdents64(), so we use the raw syscall with the
+ * kernel's record layout.
+ */
+typedef struct cpath_dirent64_t {
+  unsigned long long d_ino;
+  long long          d_off;
+  unsigned short     d_reclen;
+  unsigned char      d_type;
+  char               d_name[];
+} cpath_dirent64_t;
+
+typedef struct cpath_scan_t {
+  char *path;
+  unsigned int hash;
+  int kind;
+  int status;
+  int error;                 /* errno if CPATH_SCAN_UNREADABLE */
+  int queued;                /* already handed to a pool */
+  unsigned int entries;      /* entries read, not counting "." and ".." */
+  unsigned int matches;      /* entries that count for kind */
+  int indexed;               /* keep the names of matching entries */
+  char *name_pool;           /* the names, each '\0' terminated */
+  size_t name_pool_len;
+  size_t name_pool_size;
+  char **names;              /* sorted pointers into name_pool */
+  struct cpath_scan_t *next; /* next in this cache bucket */
+} cpath_scan_t;
+
+static cpath_scan_t *cpath_scan_cache[CPATH_SCAN_CACHE_SIZE];
+static int cpath_scan_jobs = CPATH_SCAN_DEFAULT_JOBS;
+
+/**
+ * Figure out which content rules apply to a variable, by name.
+ *
+ * @param env_name the name of the environment variable
+ *
+ * @return one of the CPATH_KIND_* values
+ */
+static int cpath_scan_kind(const char *env_name) {
+  if(eq(env_name, "PATH"))
+    return CPATH_KIND_EXEC;
+  if(eq(env_name, "LD_LIBRARY_PATH"))
+    return CPATH_KIND_LIB;
+  if(eq(env_name, "MANPATH"))
+    return CPATH_KIND_MAN;
+  if(eq(env_name, "PYTHONPATH"))
+    return CPATH_KIND_PYTHON;
+  if(eq(env_name, "PERL5LIB") || eq(env_name, "PERLLIB"))
+    return CPATH_KIND_PERL;
+  return CPATH_KIND_NONE;
+}
+
+/**
+ * Human readable name for what a kind looks for. Used in verbose output.
+ */
+static const char *cpath_scan_kind_name(int kind) {
+  switch(kind) {
+  case CPATH_KIND_EXEC:   return "executables";
+  case CPATH_KIND_LIB:    return "shared objects";
+  case CPATH_KIND_MAN:    return "man sections";
+  case CPATH_KIND_PYTHON: return "python modules";
+  case CPATH_KIND_PERL:   return "perl modules";
+  }
+  return "anything";
+}
+
+/**
+ * Check if this is a file the current user could execute. Mirrors
+ * cpath_can_exec_dir().
+ *
+ * @param file_stat the struct stat of the file
+ */
+static int cpath_can_exec_file(struct stat *file_stat) {
+  return
+    S_ISREG(file_stat->st_mode) &&
+    (
+     (S_IXOTH & file_stat->st_mode) ||
+     (file_stat->st_gid == gid && (file_stat->st_mode & S_IXGRP)) ||
+     (file_stat->st_uid == uid && (S_IXUSR & file_stat->st_mode))
+     );
+}
+
+/**
+ * Does name end in suffix?
+ */
+static int cpath_ends_with(const char *name, const char *suffix) {
+  size_t name_len = strlen(name), suffix_len = strlen(suffix);
+  return name_len >= suffix_len && eq(name + name_len - suffix_len, suffix);
+}
+
+/**
+ * Does name look like a shared object, i.e. match "*.so*" the way the
+ * loader's names do ("libfoo.so", "libfoo.so.1", "libfoo.so.1.2.3")?
+ */
+static int cpath_is_shared_object(const char *name) {
+  const char *cptr = name;
+  while(NULL != (cptr = strstr(cptr, ".so"))) {
+    if('\0' == cptr[3] || '.' == cptr[3])
+      return cptr != name;
+    cptr += 3;
+  }
+  return 0;
+}
+
+/**
+ * Is name a valid python/perl identifier, i.e. could it be a package?
+ */
+static int cpath_is_identifier(const char *name) {
+  if(! (isalpha((unsigned char)*name) || '_' == *name))
+    return 0;
+  for(name++; *name; name++)
+    if(! (isalnum((unsigned char)*name) || '_' == *name))
+      return 0;
+  return 1;
+}
+
+/**
+ * Does name look like a man locale directory ("de", "pt_BR", "zh_CN.UTF-8")?
+ * man(1) looks for sections under those too, so we keep them.
+ */
+static int cpath_is_man_locale(const char *name) {
+  return
+    islower((unsigned char)name[0]) && islower((unsigned char)name[1]) &&
+    ('\0' == name[2] || '_' == name[2] || '.' == name[2] || '@' == name[2]);
+}
+
+/**
+ * Resolve the type of a directory entry when d_type was not enough.
+ *
+ * @return the S_IF* file type bits, or 0 if it could not be stat'ed (e.g., a
+ *         broken symlink)
+ */
+static mode_t cpath_scan_entry_type(int dir_fd, const char *name, unsigned char d_type,
+                                    struct stat *file_stat) {
+  switch(d_type) {
+  case DT_DIR: return S_IFDIR;
+  case DT_REG: return S_IFREG;
+  case DT_LNK:
+  case DT_UNKNOWN:
+    if(0 == fstatat(dir_fd, name, file_stat, 0))
+      return file_stat->st_mode & S_IFMT;
+    return 0;
+  }
+  return S_IFIFO; /* something we never care about */
+}
+
+/**
+ * Does this directory entry count for the given kind?
+ *
+ * @param dir_fd the open directory, for fstatat()
+ * @param name the entry's name
+ * @param d_type the entry's d_type from getdents64
+ * @param kind one of the CPATH_KIND_* values
+ */
+static int cpath_scan_entry_matches(int dir_fd, const char *name, unsigned char d_type,
+                                    int kind) {
+  struct stat file_stat;
+  switch(kind) {
+  case CPATH_KIND_EXEC:
+    /* cheapest test first, then we need the permission bits */
+    if(DT_DIR == d_type)
+      return 0;
+    if(0 != fstatat(dir_fd, name, &file_stat, 0))
+      return 0;
+    return cpath_can_exec_file(&file_stat);
+  case CPATH_KIND_LIB:
+    return DT_DIR != d_type && cpath_is_shared_object(name);
+  case CPATH_KIND_MAN:
+    if(! (0 == strncmp(name, "man", 3) || 0 == strncmp(name, "cat", 3) ||
+          cpath_is_man_locale(name)))
+      return 0;
+    return S_IFDIR == cpath_scan_entry_type(dir_fd, name, d_type, &file_stat);
+  case CPATH_KIND_PYTHON:
+    if(cpath_ends_with(name, ".py") || cpath_ends_with(name, ".pyc") ||
+       cpath_ends_with(name, ".so") || cpath_ends_with(name, ".zip") ||
+       cpath_ends_with(name, ".egg"))
+      return 1;
+    /* packages, including namespace packages which need no __init__.py */
+    return cpath_is_identifier(name) &&
+      S_IFDIR == cpath_scan_entry_type(dir_fd, name, d_type, &file_stat);
+  case CPATH_KIND_PERL:
+    if(cpath_ends_with(name, ".pm") || cpath_ends_with(name, ".pmc") ||
+       cpath_ends_with(name, ".pl"))
+      return 1;
+    /* Namespaces (Foo/Bar.pm) and the version/arch directories perl adds for
+       every PERL5LIB entry may hold modules further down. */
+    return S_IFDIR == cpath_scan_entry_type(dir_fd, name, d_type, &file_stat);
+  }
+  return 1;
+}
+
+/**
+ * Keep the name of a matching entry in an indexed scan.
+ *
+ * @return 0 if we ran out of RAM, non-zero otherwise
+ */
+static int cpath_scan_keep_name(cpath_scan_t *scan, const char *name) {
+  size_t len = strlen(name) + 1;
+  if(scan->name_pool_len + len > scan->name_pool_size) {
+    char *name_pool;
+    scan->name_pool_size = 2 * (scan->name_pool_size + len) + 1024;
+    name_pool = (char *)realloc(scan->name_pool, scan->name_pool_size);
+    if(! name_pool) return 0;
+    scan->name_pool = name_pool;
+  }
+  memcpy(scan->name_pool + scan->name_pool_len, name, len);
+  scan->name_pool_len += len;
+  return 1;
+}
+
+/**
+ * qsort()/bsearch() comparison for the names of an indexed scan
+ */
+static int cpath_scan_name_cmp(const void *left, const void *right) {
+  return strcmp(*(char * const *)left, *(char * const *)right);
+}
+
+/**
+ * Point names at the entries of name_pool, sorted, once it's complete.
+ *
+ * @return 0 if we ran out of RAM, non-zero otherwise
+ */
+static int cpath_scan_sort_names(cpath_scan_t *scan) {
+  unsigned int idx;
+  char *cptr = scan->name_pool;
+  scan->names = (char **)malloc(sizeof(char *) * (scan->matches + 1));
+  if(! scan->names) return 0;
+  for(idx = 0; idx < scan->matches; idx++) {
+    scan->names[idx] = cptr;
+    cptr += strlen(cptr) + 1;
+  }
+  qsort(scan->names, scan->matches, sizeof(char *), cpath_scan_name_cmp);
+  return 1;
+}
+
+/**
+ * Read one directory and fill in the scan's status and counts. Unless the
+ * scan is indexed, stops at the first match since all we need to know is
+ * whether there is one.
+ *
+ * Safe to call from worker threads.
+ *
+ * @param scan the scan to perform
+ * @param buffer a CPATH_SCAN_BUFFER_SIZE buffer owned by the caller
+ */
+static void cpath_scan_dir(cpath_scan_t *scan, char *buffer) {
+  int dir_fd = open(scan->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  long nread = 0;
+  int done = 0;
+  if(dir_fd < 0) {
+    scan->error = errno;
+    scan->status = CPATH_SCAN_UNREADABLE;
+    return;
+  }
+  while(! done &&
+        0 < (nread = syscall(SYS_getdents64, dir_fd, buffer, CPATH_SCAN_BUFFER_SIZE))) {
+    long offset = 0;
+    while(offset < nread) {
+      cpath_dirent64_t *entry = (cpath_dirent64_t *)(buffer + offset);
+      offset += entry->d_reclen;
+      if('.' == entry->d_name[0] &&
+         ('\0' == entry->d_name[1] ||
+          ('.' == entry->d_name[1] && '\0' == entry->d_name[2])))
+        continue;
+      scan->entries++;
+      if(cpath_scan_entry_matches(dir_fd, entry->d_name, entry->d_type, scan->kind)) {
+        if(scan->indexed && ! cpath_scan_keep_name(scan, entry->d_name)) {
+          nread = -1;
+          errno = ENOMEM;
+          done = 1;
+          break;
+        }
+        scan->matches++;
+        if(! scan->indexed) {
+          done = 1;
+          break;
+        }
+      }
+    }
+  }
+  if(nread >= 0 && scan->indexed && ! cpath_scan_sort_names(scan)) {
+    nread = -1;
+    errno = ENOMEM;
+  }
+  if(nread < 0) {
+    scan->error = errno;
+    scan->status = CPATH_SCAN_UNREADABLE;
+  } else {
+    scan->status = CPATH_SCAN_OK;
+  }
+  close(dir_fd);
+}
+
+/**
+ * Get the cached scan for a directory and kind, creating a pending one if
+ * there is none yet.
+ *
+ * @param path the directory
+ * @param kind one of the CPATH_KIND_* values
+ * @param indexed whether the names of matching entries are needed
+ */
+static cpath_scan_t *cpath_scan_lookup(const char *path, int kind, int indexed) {
+  unsigned int hash = 5381;
+  const char *cptr;
+  cpath_scan_t **bucket, *scan;
+  for(cptr = path; *cptr; cptr++)
+    hash = ((hash << 5) + hash) + (*cptr);
+  bucket = &cpath_scan_cache[hash & (CPATH_SCAN_CACHE_SIZE - 1)];
+  for(scan = *bucket; scan; scan = scan->next)
+    if(scan->hash == hash && scan->kind == kind && scan->indexed == indexed &&
+       eq(scan->path, path))
+      return scan;
+  scan = (cpath_scan_t *)fatal_malloc(sizeof(cpath_scan_t));
+  scan->path = str_clone((char *)path);
+  scan->hash = hash;
+  scan->kind = kind;
+  scan->status = CPATH_SCAN_PENDING;
+  scan->error = 0;
+  scan->queued = 0;
+  scan->entries = 0;
+  scan->matches = 0;
+  scan->indexed = indexed;
+  scan->name_pool = NULL;
+  scan->name_pool_len = 0;
+  scan->name_pool_size = 0;
+  scan->names = NULL;
+  scan->next = *bucket;
+  *bucket = scan;
+  return scan;
+}
+
+/**
+ * Get the cached scan that answers whether a directory has anything of the
+ * given kind.
+ */
+static cpath_scan_t *cpath_scan_get(const char *path, int kind) {
+  return cpath_scan_lookup(path, kind, 0);
+}
+
+/**
+ * Work shared by the scanning threads
+ */
+typedef struct cpath_scan_pool_t {
+  cpath_scan_t **scans;
+  unsigned int count;
+  unsigned int next;  /* next scan to hand out, taken atomically */
+} cpath_scan_pool_t;
+
+/**
+ * Body of each scanning thread: keep taking the next pending scan until
+ * there are none left.
+ */
+static void *cpath_scan_worker(void *arg) {
+  cpath_scan_pool_t *pool = (cpath_scan_pool_t *)arg;
+  char *buffer = (char *)malloc(CPATH_SCAN_BUFFER_SIZE);
+  unsigned int idx;
+  if(! buffer)
+    return NULL; /* the other threads, or the caller, will pick up the work */
+  while((idx = __sync_fetch_and_add(&pool->next, 1)) < pool->count)
+    cpath_scan_dir(pool->scans[idx], buffer);
+  free(buffer);
+  return NULL;
+}
+
+/**
+ * Perform all pending scans, in parallel if there is more than one.
+ *
+ * @param scans the scans, already looked up with cpath_scan_get()
+ * @param count how many there are
+ */
+static void cpath_scan_run(cpath_scan_t **scans, unsigned int count) {
+  cpath_scan_pool_t pool;
+  pthread_t threads[CPATH_SCAN_MAX_JOBS];
+  unsigned int idx, pending = 0, thread_count, started = 0;
+  cpath_scan_t **todo = (cpath_scan_t **)fatal_malloc(sizeof(cpath_scan_t *) * (count + 1));
+  /* Only hand out what is not cached already, and each directory only once */
+  for(idx = 0; idx < count; idx++) {
+    if(CPATH_SCAN_PENDING == scans[idx]->status && ! scans[idx]->queued) {
+      scans[idx]->queued = 1;
+      todo[pending++] = scans[idx];
+    }
+  }
+  debug(3, ("cpath_scan_run: %u of %u directories to read\n", pending, count));
+  pool.scans = todo;
+  pool.count = pending;
+  pool.next = 0;
+  thread_count = pending < (unsigned int)cpath_scan_jobs ? pending : (unsigned int)cpath_scan_jobs;
+  if(thread_count > 1) {
+    for(idx = 0; idx < thread_count; idx++) {
+      if(0 != pthread_create(&threads[idx], NULL, cpath_scan_worker, &pool))
+        break;
+      started++;
+    }
+  }
+  /* The calling thread helps too, and finishes the job alone if no threads
+     could be started */
+  cpath_scan_worker(&pool);
+  for(idx = 0; idx < started; idx++)
+    pthread_join(threads[idx], NULL);
+  /* Only possible if every thread ran out of RAM for its buffer */
+  for(idx = 0; idx < pending; idx++) {
+    if(CPATH_SCAN_PENDING == todo[idx]->status) {
+      todo[idx]->status = CPATH_SCAN_UNREADABLE;
+      todo[idx]->error = ENOMEM;
+    }
+  }
+  free(todo);
+}
+
+/**
+ * Set the number of scanning threads.
+ *
+ * @param jobs the number of threads, 1 means no threads
+ */
+static void cpath_scan_set_jobs(int jobs) {
+  if(jobs < 1 || jobs > CPATH_SCAN_MAX_JOBS)
+    fatal("Number of jobs must be between 1 and %d, not %d.\n", CPATH_SCAN_MAX_JOBS, jobs);
+  cpath_scan_jobs = jobs;
+}
+
+#endif /* _CPATH_SCAN_LOADED_SEMAPHORE */
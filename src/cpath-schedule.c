@@ -0,0 +1,415 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_SCHEDULE_LOADED_SEMAPHORE
+#define _CPATH_SCHEDULE_LOADED_SEMAPHORE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <time.h>
+#include "cpath-scan.c"
+#include "cpath-mount.c"
+#include "cpath-element.c"
+#include "cpath-deadline.c"
+
+/**
+ * Scheduling probes by the type of filesystem an element is on.
+ *
+ * A stat() on a local filesystem (ext4, xfs, tmpfs, ...) takes microseconds,
+ * one on a network filesystem (NFS, Lustre, GPFS, ...) or an automount that
+ * isn't mounted yet can take milliseconds, or much longer when a server is
+ * struggling. Before cleaning, each element is put on its mount (from the
+ * mount table, after following its symlinks), and the elements on network filesystems are stat()ed by a
+ * pool of threads at once, up to a deadline. Local elements are still
+ * stat()ed inline as they come up, which is cheaper than handing them to a
+ * thread.
+ *
+ * An element whose stat() missed the deadline is kept as it is, unchecked,
+ * rather than waited for or dropped.
+ *
+ * Without a mount table (e.g., no /proc), the type comes from one statfs()
+ * per top level directory instead.
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone()
+ * and the debug() and verbose() macros.
+ */
+
+/**
+ * Results of cpath_sched_stat() besides stat()'s own
+ */
+#define CPATH_SCHED_LATE 1 /* a network stat() that missed the deadline */
+
+/* Most symlinks followed to find an element's mount, as for ELOOP */
+#define CPATH_SCHED_MAX_LINKS 40
+
+/* At most this many filesystem types are told apart in the timings */
+#define CPATH_SCHED_MAX_FSTYPES 32
+
+/**
+ * Types that are stat()ed concurrently. "fuse." ones are network ones when
+ * the fuse daemon is a network client.
+ */
+static const char *cpath_sched_network_types[] = {
+  "nfs", "nfs4", "lustre", "gpfs", "cifs", "smb3", "smbfs", "ceph", "beegfs", "panfs", "afs",
+  "glusterfs", "ocfs2", "gfs2", "9p", "autofs", "fuse.sshfs", "fuse.glusterfs", "fuse.cvmfs2",
+  "fuse.s3fs", "fuse.gcsfuse", "fuse.rclone", ""
+};
+
+typedef struct cpath_sched_fstype_t {
+  const char *name;
+  int network;
+  unsigned int count;               /* elements stat()ed */
+  unsigned int late;                /* of them, after the deadline */
+  long usec;                        /* total */
+  long max_usec;                    /* slowest */
+} cpath_sched_fstype_t;
+
+typedef struct cpath_sched_entry_t {
+  cpath_element_t element;          /* must be first */
+  cpath_sched_fstype_t *fstype;
+  int done;                         /* stat() finished */
+  int late;                         /* it wasn't when we needed it */
+  int result;                       /* of stat() */
+  int error;                        /* errno if it failed */
+  struct stat file_stat;
+  long usec;
+} cpath_sched_entry_t;
+
+typedef struct cpath_sched_t {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  cpath_elements_t elements;
+  cpath_sched_entry_t **network;    /* the elements the threads stat() */
+  unsigned int network_count;
+  unsigned int network_size;
+  unsigned int next;                /* next one for a thread to take */
+  unsigned int finished;
+  cpath_sched_fstype_t fstypes[CPATH_SCHED_MAX_FSTYPES];
+  unsigned int fstype_count;
+  cpath_mounts_t *table;
+  char **statfs_dirs;               /* without a mount table, the top level */
+  cpath_sched_fstype_t **statfs_types; /* directories statfs() has typed */
+  unsigned int statfs_count;
+} cpath_sched_t;
+
+/**
+ * Create an empty schedule.
+ *
+ * @param table the mount table
+ */
+static cpath_sched_t *cpath_sched_new(cpath_mounts_t *table) {
+  cpath_sched_t *sched = (cpath_sched_t *)fatal_malloc(sizeof(cpath_sched_t));
+  memset(sched, 0, sizeof(cpath_sched_t));
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->done, NULL);
+  sched->network_size = 64;
+  sched->network = (cpath_sched_entry_t **)fatal_malloc(sizeof(cpath_sched_entry_t *) * sched->network_size);
+  sched->table = table;
+  return sched;
+}
+
+/**
+ * Get the timings for a filesystem type, by name.
+ */
+static cpath_sched_fstype_t *cpath_sched_fstype(cpath_sched_t *sched, const char *name) {
+  unsigned int idx;
+  for(idx = 0; idx < sched->fstype_count; idx++)
+    if(eq(sched->fstypes[idx].name, name))
+      return &sched->fstypes[idx];
+  if(CPATH_SCHED_MAX_FSTYPES == sched->fstype_count)
+    return &sched->fstypes[CPATH_SCHED_MAX_FSTYPES - 1];
+  sched->fstypes[sched->fstype_count].name = name;
+  for(idx = 0; *cpath_sched_network_types[idx]; idx++)
+    if(eq(cpath_sched_network_types[idx], name))
+      sched->fstypes[sched->fstype_count].network = 1;
+  return &sched->fstypes[sched->fstype_count++];
+}
+
+/**
+ * Name a filesystem type statfs(2) returned, for the ones that matter here.
+ */
+static const char *cpath_sched_statfs_name(long f_type) {
+  switch((unsigned long)f_type & 0xffffffffUL) {
+  case 0x6969UL:     return "nfs";
+  case 0x0bd00bd0UL: return "lustre";
+  case 0x47504653UL: return "gpfs";
+  case 0xff534d42UL: return "cifs";
+  case 0xfe534d42UL: return "smb3";
+  case 0x00c36400UL: return "ceph";
+  case 0x5346414fUL: return "afs";
+  case 0x0187UL:     return "autofs";
+  }
+  return "local";
+}
+
+/**
+ * Is a mount on a filesystem that is stat()ed concurrently?
+ */
+static int cpath_sched_network_mount(cpath_sched_t *sched, cpath_mount_t *mount) {
+  return mount && cpath_sched_fstype(sched, mount->fstype)->network;
+}
+
+/**
+ * Find the mount an element is really on, following its symlinks the way
+ * the kernel would (e.g., /home -> /nfs/home is on the NFS mount, not on
+ * "/"). Only components on local filesystems are lstat()ed; once the path
+ * reaches a network filesystem that is where it is, and nothing on it is
+ * touched.
+ *
+ * @return the mount, or NULL if it's not in the table
+ */
+static cpath_mount_t *cpath_sched_mount_of(cpath_sched_t *sched, const char *element) {
+  char resolved[PATH_MAX], rest[PATH_MAX], target[PATH_MAX];
+  size_t resolved_len = 0;
+  unsigned int links = 0;
+  if(strlen(element) >= sizeof(rest))
+    return cpath_mount_of(sched->table, element);
+  strcpy(rest, element);
+  resolved[0] = '\0';
+  while('\0' != *rest) {
+    struct stat file_stat;
+    char *next = rest, *component;
+    size_t len;
+    ssize_t target_len;
+    cpath_mount_t *mount;
+    while('/' == *next) next++;
+    component = next;
+    while(*next && '/' != *next) next++;
+    len = next - component;
+    if(0 == len || (1 == len && '.' == *component)) {
+      memmove(rest, next, strlen(next) + 1);
+      continue;
+    }
+    if(2 == len && '.' == component[0] && '.' == component[1]) {
+      while(resolved_len && '/' != resolved[resolved_len - 1]) resolved_len--;
+      if(resolved_len) resolved_len--;
+      resolved[resolved_len] = '\0';
+      memmove(rest, next, strlen(next) + 1);
+      continue;
+    }
+    if(resolved_len + 1 + len >= sizeof(resolved))
+      return cpath_mount_of(sched->table, element);
+    resolved[resolved_len] = '/';
+    memcpy(resolved + resolved_len + 1, component, len);
+    resolved[resolved_len + 1 + len] = '\0';
+    memmove(rest, next, strlen(next) + 1);
+    mount = cpath_mount_of(sched->table, resolved);
+    if(cpath_sched_network_mount(sched, mount))
+      return mount;
+    if(0 != lstat(resolved, &file_stat) || ! S_ISLNK(file_stat.st_mode)) {
+      resolved_len += 1 + len;
+      continue;
+    }
+    if(++links > CPATH_SCHED_MAX_LINKS ||
+       0 > (target_len = readlink(resolved, target, sizeof(target) - 1)) ||
+       (size_t)target_len + 1 + strlen(rest) >= sizeof(rest))
+      return cpath_mount_of(sched->table, element);
+    /* the rest of the path now starts with where the link points */
+    memmove(rest + target_len + 1, rest, strlen(rest) + 1);
+    memcpy(rest, target, target_len);
+    rest[target_len] = '/';
+    if('/' == *target)
+      resolved_len = 0;
+    resolved[resolved_len] = '\0';
+  }
+  return cpath_mount_of(sched->table, resolved_len ? resolved : "/");
+}
+
+/**
+ * Find the filesystem type an element is on: its mount's, or, without a mount
+ * table, whatever statfs() says about its top level directory.
+ */
+static cpath_sched_fstype_t *cpath_sched_type_of(cpath_sched_t *sched, const char *path) {
+  struct statfs fs_stat;
+  const char *end;
+  char *top;
+  unsigned int idx;
+  if(sched->table->count) {
+    cpath_mount_t *mount = cpath_sched_mount_of(sched, path);
+    return cpath_sched_fstype(sched, mount ? mount->fstype : "unknown");
+  }
+  for(end = path + 1; *end && '/' != *end; end++);
+  for(idx = 0; idx < sched->statfs_count; idx++)
+    if(strlen(sched->statfs_dirs[idx]) == (size_t)(end - path) &&
+       0 == strncmp(sched->statfs_dirs[idx], path, end - path))
+      return sched->statfs_types[idx];
+  top = (char *)fatal_malloc(end - path + 1);
+  memcpy(top, path, end - path);
+  top[end - path] = '\0';
+  if(0 == sched->statfs_count % 16) {
+    sched->statfs_dirs = (char **)realloc(sched->statfs_dirs, sizeof(char *) * (sched->statfs_count + 16));
+    sched->statfs_types = (cpath_sched_fstype_t **)realloc(sched->statfs_types, sizeof(cpath_sched_fstype_t *) *
+                                                            (sched->statfs_count + 16));
+    if(! sched->statfs_dirs || ! sched->statfs_types) fatal("Unable to allocate RAM for the probe schedule.\n");
+  }
+  sched->statfs_dirs[sched->statfs_count] = top;
+  sched->statfs_types[sched->statfs_count] =
+    cpath_sched_fstype(sched, 0 == statfs(top, &fs_stat) ? cpath_sched_statfs_name(fs_stat.f_type) : "unknown");
+  return sched->statfs_types[sched->statfs_count++];
+}
+
+/**
+ * Add an element. Relative elements and duplicates are left out, and are
+ * stat()ed inline as usual.
+ */
+static void cpath_sched_add(cpath_sched_t *sched, const char *element) {
+  cpath_sched_entry_t *entry;
+  unsigned int hash;
+  size_t len = cpath_element_len(element);
+  char *path;
+  if('/' != *element)
+    return;
+  hash = cpath_element_hash(element, len);
+  if(cpath_element_find(&sched->elements, element, len, hash))
+    return;
+  entry = (cpath_sched_entry_t *)fatal_malloc(sizeof(cpath_sched_entry_t));
+  memset(entry, 0, sizeof(cpath_sched_entry_t));
+  path = (char *)fatal_malloc(len + 1);
+  memcpy(path, element, len);
+  path[len] = '\0';
+  entry->element.path = path;
+  entry->element.hash = hash;
+  entry->fstype = cpath_sched_type_of(sched, path);
+  cpath_element_insert(&sched->elements, &entry->element);
+  if(! entry->fstype->network)
+    return;
+  if(sched->network_count == sched->network_size) {
+    sched->network_size *= 2;
+    sched->network = (cpath_sched_entry_t **)realloc(sched->network, sizeof(cpath_sched_entry_t *) *
+                                                     sched->network_size);
+    if(! sched->network) fatal("Unable to allocate RAM for the probe schedule.\n");
+  }
+  sched->network[sched->network_count++] = entry;
+}
+
+/**
+ * stat() an element, and time it.
+ */
+static void cpath_sched_probe(cpath_sched_entry_t *entry, struct stat *file_stat, int *result, int *error,
+                              long *usec) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *result = stat(entry->element.path, file_stat);
+  *error = *result ? errno : 0;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *usec = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/**
+ * Take network elements, one at a time, and stat() them. Runs detached, and
+ * may outlive the deadline.
+ */
+static void *cpath_sched_worker(void *arg) {
+  cpath_sched_t *sched = (cpath_sched_t *)arg;
+  pthread_mutex_lock(&sched->lock);
+  while(sched->next < sched->network_count) {
+    cpath_sched_entry_t *entry = sched->network[sched->next++];
+    struct stat file_stat;
+    int result, error;
+    long usec;
+    pthread_mutex_unlock(&sched->lock);
+    cpath_sched_probe(entry, &file_stat, &result, &error, &usec);
+    pthread_mutex_lock(&sched->lock);
+    entry->file_stat = file_stat;
+    entry->result = result;
+    entry->error = error;
+    entry->usec = usec;
+    entry->done = 1;
+    sched->finished++;
+    pthread_cond_signal(&sched->done);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return NULL;
+}
+
+/**
+ * stat() the network elements with up to jobs threads at once, and wait for
+ * them, but no longer than the deadline.
+ *
+ * @param timeout how long to wait, in milliseconds
+ */
+static void cpath_sched_run(cpath_sched_t *sched, unsigned int jobs, long timeout) {
+  struct timespec deadline;
+  unsigned int idx, started = 0;
+  if(! sched->network_count)
+    return;
+  cpath_deadline_in(&deadline, timeout);
+  if(jobs > sched->network_count)
+    jobs = sched->network_count;
+  for(idx = 0; idx < jobs; idx++)
+    if(cpath_deadline_start(cpath_sched_worker, sched))
+      started++;
+  pthread_mutex_lock(&sched->lock);
+  if(started)
+    cpath_deadline_wait(&sched->lock, &sched->done, &sched->finished, sched->network_count, &deadline);
+  verbose(1, ("# Probed %u of %u elements on network filesystems with %u threads, within %ld ms\n",
+              sched->finished, sched->network_count, started, timeout));
+  pthread_mutex_unlock(&sched->lock);
+  /* no threads at all, so they're all inline, however long they take */
+  if(! started)
+    for(idx = 0; idx < sched->network_count; idx++)
+      sched->network[idx]->fstype->network = 0;
+}
+
+/**
+ * stat() an element: local ones now, network ones from what the threads
+ * found.
+ *
+ * @param hash the element's hash, as cpath_should_add() has it
+ *
+ * @return what stat() returned (with errno set), or CPATH_SCHED_LATE if a
+ *         thread is still waiting on it
+ */
+static int cpath_sched_stat(cpath_sched_t *sched, const char *path, unsigned int hash, struct stat *file_stat) {
+  cpath_sched_entry_t *entry = (cpath_sched_entry_t *)cpath_element_find(&sched->elements, path, strlen(path),
+                                                                         hash);
+  int result, error;
+  long usec;
+  if(! entry)
+    return stat(path, file_stat);
+  if(entry->fstype->network) {
+    pthread_mutex_lock(&sched->lock);
+    if(! entry->done) {
+      if(! entry->late) {
+        entry->late = 1;
+        entry->fstype->late++;
+      }
+      pthread_mutex_unlock(&sched->lock);
+      return CPATH_SCHED_LATE;
+    }
+    *file_stat = entry->file_stat;
+    result = entry->result;
+    error = entry->error;
+    usec = entry->usec;
+    pthread_mutex_unlock(&sched->lock);
+  } else {
+    cpath_sched_probe(entry, file_stat, &result, &error, &usec);
+  }
+  entry->fstype->count++;
+  entry->fstype->usec += usec;
+  if(usec > entry->fstype->max_usec)
+    entry->fstype->max_usec = usec;
+  errno = error;
+  return result;
+}
+
+/**
+ * Report the time stat() took, per filesystem type.
+ */
+static void cpath_sched_report(cpath_sched_t *sched) {
+  unsigned int idx;
+  for(idx = 0; idx < sched->fstype_count; idx++) {
+    cpath_sched_fstype_t *fstype = &sched->fstypes[idx];
+    char late[64] = "";
+    if(! fstype->count && ! fstype->late)
+      continue;
+    if(fstype->late)
+      snprintf(late, sizeof(late), ", %u missed the deadline", fstype->late);
+    verbose(1, ("# %s (%s): %u elements in %ld us, slowest %ld us%s\n",
+                fstype->name, fstype->network ? "concurrent" : "inline", fstype->count, fstype->usec,
+                fstype->max_usec, late));
+  }
+}
+
+#endif /* _CPATH_SCHEDULE_LOADED_SEMAPHORE */
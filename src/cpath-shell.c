@@ -0,0 +1,40 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_SHELL_LOADED_SEMAPHORE
+#define _CPATH_SHELL_LOADED_SEMAPHORE
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Variables the shells can't simply unset.
+ *
+ * bash exports a function as a variable named "BASH_FUNC_NAME%%" (or
+ * "BASH_FUNC_NAME()" with some distributions' patches), and rebuilds the
+ * variable from the function for every command it runs. "unset" refuses
+ * the name, or quietly leaves the function alone, and "export NAME=" is not
+ * a valid identifier; only "unset -f NAME" gets rid of it. csh has no way
+ * to remove it at all, so it is left alone there.
+ */
+
+#define CPATH_SHELL_FUNC_PREFIX "BASH_FUNC_"
+
+/**
+ * Is a variable a function exported by bash?
+ *
+ * @return the function's name, which the caller frees, or NULL if it isn't one
+ */
+static char *cpath_shell_bash_func(const char *env_name) {
+  size_t len = strlen(env_name), prefix_len = strlen(CPATH_SHELL_FUNC_PREFIX);
+  char *func;
+  if(len <= prefix_len + 2 || 0 != strncmp(env_name, CPATH_SHELL_FUNC_PREFIX, prefix_len) ||
+     (0 != strcmp(env_name + len - 2, "%%") && 0 != strcmp(env_name + len - 2, "()")))
+    return NULL;
+  len -= prefix_len + 2;
+  func = (char *)malloc(len + 1);
+  if(! func) fatal("Unable to allocate RAM for a function name.\n");
+  memcpy(func, env_name + prefix_len, len);
+  func[len] = '\0';
+  return func;
+}
+
+#endif /* _CPATH_SHELL_LOADED_SEMAPHORE */
@@ -0,0 +1,232 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_TRIE_LOADED_SEMAPHORE
+#define _CPATH_TRIE_LOADED_SEMAPHORE
+
+/**
+ * Path component trie used for component-anchored ("subtree") exclusion.
+ *
+ * Unlike the -E substring rules, a subtree rule such as "/sw/legacy" only
+ * matches whole path components, so it excludes "/sw/legacy" and
+ * "/sw/legacy/bin" but not "/sw/legacy2" or "/opt/sw/legacy". All rules are
+ * stored in one trie so that each path element is checked in a single walk
+ * over its components, no matter how many rules there are.
+ *
+ * Edges are kept in one open addressing table keyed on (parent node,
+ * component hash), which keeps lookups O(1) even for nodes with thousands of
+ * children (e.g., /sw/<every package>).
+ *
+ * Expects the including file to provide fatal(), fatal_malloc(), str_clone()
+ * and the debug() macro.
+ */
+
+/* Absolute paths get this as their first component */
+#define CPATH_TRIE_ROOT_NAME "/"
+/* Same magic number used everywhere else for DJB hashes */
+#define CPATH_TRIE_HASH_SEED 5381
+
+typedef struct cpath_trie_node_t {
+  unsigned int parent;     /* index of the parent node (root is 0) */
+  unsigned int hash;       /* DJB hash of this component */
+  unsigned int name_len;   /* length of this component */
+  char *name;              /* this component, not '\0' terminated */
+  char *rule;              /* the rule as given, if a rule ends here */
+} cpath_trie_node_t;
+
+typedef struct cpath_trie_t {
+  cpath_trie_node_t *nodes;
+  unsigned int node_count;
+  unsigned int node_size;
+  unsigned int *slots;     /* node index + 1, 0 is an empty slot */
+  unsigned int slot_count; /* always a power of two */
+  unsigned int rule_count;
+} cpath_trie_t;
+
+/**
+ * Hash a component the same way cpath_clean_path() hashes directories.
+ *
+ * @param str the component start
+ * @param len the component length
+ */
+static unsigned int cpath_trie_hash(const char *str, unsigned int len) {
+  unsigned int hash = CPATH_TRIE_HASH_SEED;
+  while(len--) {
+    hash = ((hash << 5) + hash) + (*str);
+    str++;
+  }
+  return hash;
+}
+
+/**
+ * Where to start probing in the edge table for a (parent, hash) pair.
+ */
+static unsigned int cpath_trie_slot(cpath_trie_t *trie, unsigned int parent,
+                                    unsigned int hash) {
+  return (hash ^ (parent * 0x9E3779B1u)) & (trie->slot_count - 1);
+}
+
+/**
+ * Create a new empty trie with only a root node.
+ */
+static cpath_trie_t *cpath_trie_new(void) {
+  cpath_trie_t *trie = (cpath_trie_t *)fatal_malloc(sizeof(cpath_trie_t));
+  trie->node_size = 64;
+  trie->node_count = 1;
+  trie->nodes = (cpath_trie_node_t *)fatal_malloc(sizeof(cpath_trie_node_t) * trie->node_size);
+  trie->nodes[0].parent = 0;
+  trie->nodes[0].hash = 0;
+  trie->nodes[0].name_len = 0;
+  trie->nodes[0].name = "";
+  trie->nodes[0].rule = NULL;
+  trie->slot_count = 128;
+  trie->slots = (unsigned int *)calloc(trie->slot_count, sizeof(unsigned int));
+  if(! trie->slots) fatal("Unable to allocate RAM for exclusion trie.\n");
+  trie->rule_count = 0;
+  return trie;
+}
+
+/**
+ * Find the child of parent named by the component str/len.
+ *
+ * @return the child's node index, or 0 if there is no such child.
+ */
+static unsigned int cpath_trie_child(cpath_trie_t *trie, unsigned int parent,
+                                     const char *str, unsigned int len,
+                                     unsigned int hash) {
+  unsigned int slot = cpath_trie_slot(trie, parent, hash);
+  while(trie->slots[slot]) {
+    cpath_trie_node_t *node = &trie->nodes[trie->slots[slot] - 1];
+    if(node->parent == parent && node->hash == hash && node->name_len == len &&
+       0 == memcmp(node->name, str, len))
+      return trie->slots[slot] - 1;
+    slot = (slot + 1) & (trie->slot_count - 1);
+  }
+  return 0;
+}
+
+/**
+ * Double the edge table and re-insert every edge.
+ */
+static void cpath_trie_grow_slots(cpath_trie_t *trie) {
+  unsigned int idx;
+  free(trie->slots);
+  trie->slot_count *= 2;
+  trie->slots = (unsigned int *)calloc(trie->slot_count, sizeof(unsigned int));
+  if(! trie->slots) fatal("Unable to allocate RAM for exclusion trie.\n");
+  for(idx = 1; idx < trie->node_count; idx++) {
+    unsigned int slot = cpath_trie_slot(trie, trie->nodes[idx].parent, trie->nodes[idx].hash);
+    while(trie->slots[slot])
+      slot = (slot + 1) & (trie->slot_count - 1);
+    trie->slots[slot] = idx + 1;
+  }
+}
+
+/**
+ * Add a child to parent, growing whatever needs growing.
+ *
+ * @return the new node's index
+ */
+static unsigned int cpath_trie_add_child(cpath_trie_t *trie, unsigned int parent,
+                                         const char *str, unsigned int len,
+                                         unsigned int hash) {
+  unsigned int idx, slot;
+  /* keep the edge table at most half full */
+  if(2 * trie->node_count >= trie->slot_count)
+    cpath_trie_grow_slots(trie);
+  if(trie->node_count == trie->node_size) {
+    trie->node_size *= 2;
+    trie->nodes = (cpath_trie_node_t *)realloc(trie->nodes, sizeof(cpath_trie_node_t) * trie->node_size);
+    if(! trie->nodes) fatal("Unable to allocate RAM for exclusion trie.\n");
+  }
+  idx = trie->node_count++;
+  trie->nodes[idx].parent = parent;
+  trie->nodes[idx].hash = hash;
+  trie->nodes[idx].name_len = len;
+  trie->nodes[idx].name = (char *)fatal_malloc(len + 1);
+  memcpy(trie->nodes[idx].name, str, len);
+  trie->nodes[idx].name[len] = '\0';
+  trie->nodes[idx].rule = NULL;
+  slot = cpath_trie_slot(trie, parent, hash);
+  while(trie->slots[slot])
+    slot = (slot + 1) & (trie->slot_count - 1);
+  trie->slots[slot] = idx + 1;
+  return idx;
+}
+
+/**
+ * Get the next component of a path, skipping empty ("//") and "." ones.
+ *
+ * @param cptr in: where to start looking, out: just past the component
+ * @param len out: the length of the component
+ *
+ * @return the start of the component or NULL if there are no more.
+ */
+static const char *cpath_trie_next_component(const char **cptr, unsigned int *len) {
+  const char *start = *cptr;
+  for(;;) {
+    while('/' == *start) start++;
+    if('\0' == *start) return NULL;
+    *cptr = start;
+    while('\0' != **cptr && '/' != **cptr) (*cptr)++;
+    *len = *cptr - start;
+    if(1 == *len && '.' == *start) {
+      start = *cptr;
+      continue;
+    }
+    return start;
+  }
+}
+
+/**
+ * Add a subtree rule. The rule and everything below it will match.
+ *
+ * @param rule the directory whose subtree should match, e.g. "/sw/legacy"
+ */
+static void cpath_trie_add(cpath_trie_t *trie, const char *rule) {
+  unsigned int node = 0, len = 0, hash;
+  const char *cptr = rule, *component;
+  debug(3, ("cpath_trie_add(\"%s\")\n", rule));
+  if('/' == *rule) {
+    hash = cpath_trie_hash(CPATH_TRIE_ROOT_NAME, 1);
+    node = cpath_trie_child(trie, 0, CPATH_TRIE_ROOT_NAME, 1, hash);
+    if(! node)
+      node = cpath_trie_add_child(trie, 0, CPATH_TRIE_ROOT_NAME, 1, hash);
+  }
+  while(NULL != (component = cpath_trie_next_component(&cptr, &len))) {
+    unsigned int child;
+    hash = cpath_trie_hash(component, len);
+    child = cpath_trie_child(trie, node, component, len, hash);
+    node = child ? child : cpath_trie_add_child(trie, node, component, len, hash);
+  }
+  if(0 == node)
+    fatal("Subtree rule \"%s\" has no path components.\n", rule);
+  if(! trie->nodes[node].rule) {
+    trie->nodes[node].rule = str_clone((char *)rule);
+    trie->rule_count++;
+  }
+}
+
+/**
+ * Check if a path is at or below any of the subtree rules.
+ *
+ * @param path the path element to check
+ *
+ * @return the rule that matched, or NULL if none did.
+ */
+static const char *cpath_trie_match(cpath_trie_t *trie, const char *path) {
+  unsigned int node = 0, len = 0;
+  const char *cptr = path, *component;
+  if('/' == *path) {
+    node = cpath_trie_child(trie, 0, CPATH_TRIE_ROOT_NAME, 1,
+                            cpath_trie_hash(CPATH_TRIE_ROOT_NAME, 1));
+    if(! node) return NULL;
+    if(trie->nodes[node].rule) return trie->nodes[node].rule;
+  }
+  while(NULL != (component = cpath_trie_next_component(&cptr, &len))) {
+    node = cpath_trie_child(trie, node, component, len, cpath_trie_hash(component, len));
+    if(! node) return NULL;
+    if(trie->nodes[node].rule) return trie->nodes[node].rule;
+  }
+  return NULL;
+}
+
+#endif /* _CPATH_TRIE_LOADED_SEMAPHORE */
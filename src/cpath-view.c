@@ -0,0 +1,211 @@
+/* Make sure we only load this file once by using a define semaphore  */
+#ifndef _CPATH_VIEW_LOADED_SEMAPHORE
+#define _CPATH_VIEW_LOADED_SEMAPHORE
+
+#include <limits.h>
+#include "cpath-index.c"
+#include "cpath-elf.c"
+
+/**
+ * Path flattening into a "view": one directory of symlinks that holds the
+ * first match for every name found in a list of directories, so a search
+ * path of 80 entries can be replaced by a single one. Every miss then costs
+ * one failed lookup instead of 80.
+ *
+ * Views are content addressed. Their name is a hash of the kind of view and,
+ * for every source directory, its path, device, inode and mtime. Adding or
+ * removing an entry changes a directory's mtime and so the view's name, so an
+ * existing view is always current and the only cost of an unchanged path is
+ * one stat() per source directory. Views are built under a temporary name
+ * and renamed into place, so concurrent builds are harmless.
+ *
+ * Only the mtime of a source directory is part of the name, so changes that
+ * leave it alone (e.g., a chmod of a file in it) don't make a new view.
+ *
+ * Library directories are not flattened if the loader would search them on
+ * its own (hardware capability subdirectories), or if a library in them
+ * finds others through $ORIGIN, which would then be the view instead of
+ * where the library really is.
+ *
+ * Old views are not removed. They are small, and may still be in use by a
+ * running process.
+ */
+
+/* The view name is this many hex digits of the hash */
+#define CPATH_VIEW_NAME_LEN 16
+
+/**
+ * Get the default base directory for views: $XDG_RUNTIME_DIR/cleanpath-views
+ * if there is one, /tmp/cleanpath-views-UID otherwise.
+ */
+static char *cpath_view_default_base(void) {
+  char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  char *base = (char *)fatal_malloc(PATH_MAX);
+  if(runtime_dir && '/' == *runtime_dir)
+    snprintf(base, PATH_MAX, "%s/cleanpath-views", runtime_dir);
+  else
+    snprintf(base, PATH_MAX, "/tmp/cleanpath-views-%u", (unsigned int)uid);
+  return base;
+}
+
+/**
+ * Make sure the base directory exists and is safe to put views in, i.e. it's
+ * a directory we own that nobody else can write to. Otherwise someone else
+ * could swap the symlinks we emit.
+ *
+ * @return non-zero if the base is usable
+ */
+static int cpath_view_base_ok(const char *base) {
+  struct stat file_stat;
+  if(0 != mkdir(base, 0700) && EEXIST != errno) {
+    verbose(1, ("# Unable to create view directory \"%s\": %s\n", base, strerror(errno)));
+    return 0;
+  }
+  if(0 != lstat(base, &file_stat) || ! S_ISDIR(file_stat.st_mode) ||
+     file_stat.st_uid != uid || (file_stat.st_mode & (S_IWGRP | S_IWOTH))) {
+    verbose(1, ("# Not using view directory \"%s\": not a directory owned by and only writable by us\n",
+               base));
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Remove a partly built view.
+ */
+static void cpath_view_remove(const char *view) {
+  char *buffer = (char *)fatal_malloc(CPATH_SCAN_BUFFER_SIZE);
+  int dir_fd = open(view, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  long nread;
+  if(dir_fd >= 0) {
+    while(0 < (nread = syscall(SYS_getdents64, dir_fd, buffer, CPATH_SCAN_BUFFER_SIZE))) {
+      long offset = 0;
+      while(offset < nread) {
+        cpath_dirent64_t *entry = (cpath_dirent64_t *)(buffer + offset);
+        offset += entry->d_reclen;
+        if(DT_LNK == entry->d_type)
+          unlinkat(dir_fd, entry->d_name, 0);
+      }
+    }
+    close(dir_fd);
+  }
+  rmdir(view);
+  free(buffer);
+}
+
+/**
+ * Does a library directory have subdirectories the loader searches on its
+ * own (glibc-hwcaps, or the legacy tls one)? Those can't be flattened.
+ */
+static int cpath_view_has_hwcaps(const char *dir) {
+  char sub_dir[PATH_MAX];
+  struct stat file_stat;
+  snprintf(sub_dir, sizeof(sub_dir), "%s/glibc-hwcaps", dir);
+  if(0 == stat(sub_dir, &file_stat) && S_ISDIR(file_stat.st_mode))
+    return 1;
+  snprintf(sub_dir, sizeof(sub_dir), "%s/tls", dir);
+  return 0 == stat(sub_dir, &file_stat) && S_ISDIR(file_stat.st_mode);
+}
+
+/**
+ * Get (building it if needed) the view for an ordered list of directories.
+ *
+ * @param dirs the directories, in search order
+ * @param count how many there are
+ * @param kind CPATH_KIND_EXEC or CPATH_KIND_LIB
+ * @param base the directory to keep views in
+ *
+ * @return the path of the view, or NULL if the directories can't be
+ *         flattened (the reason is in the verbose output)
+ */
+static char *cpath_view_get(char **dirs, unsigned int count, int kind, const char *base) {
+  unsigned long long hash = CPATH_INDEX_FNV_SEED;
+  unsigned int pos, idx, links = 0;
+  char *view, tmp_view[PATH_MAX], target[PATH_MAX];
+  struct stat file_stat;
+  cpath_index_t *index;
+  int view_fd;
+  hash = cpath_index_fnv(hash, &kind, sizeof(kind));
+  for(pos = 0; pos < count; pos++) {
+    if('/' != *dirs[pos]) {
+      verbose(1, ("# Can't flatten \"%s\", it's not an absolute path\n", dirs[pos]));
+      return NULL;
+    }
+    if(0 != stat(dirs[pos], &file_stat)) {
+      verbose(1, ("# Can't flatten \"%s\": %s\n", dirs[pos], strerror(errno)));
+      return NULL;
+    }
+    hash = cpath_index_fnv(hash, dirs[pos], strlen(dirs[pos]) + 1);
+    hash = cpath_index_fnv(hash, &file_stat.st_dev, sizeof(file_stat.st_dev));
+    hash = cpath_index_fnv(hash, &file_stat.st_ino, sizeof(file_stat.st_ino));
+    hash = cpath_index_fnv(hash, &file_stat.st_mtim, sizeof(file_stat.st_mtim));
+  }
+  view = (char *)fatal_malloc(PATH_MAX);
+  snprintf(view, PATH_MAX, "%s/%0*llx", base, CPATH_VIEW_NAME_LEN, hash);
+  if(0 == lstat(view, &file_stat) && S_ISDIR(file_stat.st_mode)) {
+    verbose(2, ("# Using existing view \"%s\"\n", view));
+    return view;
+  }
+  index = cpath_index_build(dirs, count, kind);
+  for(pos = 0; pos < count; pos++) {
+    if(NULL == index->scans[pos]) {
+      verbose(1, ("# Can't flatten \"%s\", unable to read it\n", dirs[pos]));
+      free(view);
+      return NULL;
+    }
+    if(CPATH_KIND_LIB == kind && cpath_view_has_hwcaps(dirs[pos])) {
+      verbose(1, ("# Can't flatten \"%s\", it has hardware capability subdirectories\n", dirs[pos]));
+      free(view);
+      return NULL;
+    }
+  }
+  snprintf(tmp_view, sizeof(tmp_view), "%s/.%0*llx.%d", base, CPATH_VIEW_NAME_LEN, hash, (int)getpid());
+  if(0 != mkdir(tmp_view, 0755) ||
+     0 > (view_fd = open(tmp_view, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+    verbose(1, ("# Unable to create view \"%s\": %s\n", tmp_view, strerror(errno)));
+    free(view);
+    return NULL;
+  }
+  /* Walk in search order, the first symlink made for a name wins */
+  for(pos = 0; pos < count; pos++) {
+    for(idx = 0; idx < index->scans[pos]->matches; idx++) {
+      const char *name = index->scans[pos]->names[idx];
+      snprintf(target, sizeof(target), "%s/%s", dirs[pos], name);
+      /* the loader skips a library it can't open and keeps looking, so a
+         broken one must not hide a later one */
+      if(CPATH_KIND_LIB == kind && (0 != stat(target, &file_stat) || ! S_ISREG(file_stat.st_mode)))
+        continue;
+      if(CPATH_KIND_LIB == kind && cpath_elf_uses_origin(target)) {
+        verbose(1, ("# Can't flatten \"%s\", \"%s\" finds libraries relative to itself ($ORIGIN)\n",
+                    dirs[pos], name));
+        close(view_fd);
+        cpath_view_remove(tmp_view);
+        free(view);
+        return NULL;
+      }
+      if(0 == symlinkat(target, view_fd, name)) {
+        links++;
+      } else if(EEXIST != errno) {
+        verbose(1, ("# Unable to create view \"%s\": %s\n", tmp_view, strerror(errno)));
+        close(view_fd);
+        cpath_view_remove(tmp_view);
+        free(view);
+        return NULL;
+      }
+    }
+  }
+  close(view_fd);
+  if(0 != rename(tmp_view, view)) {
+    /* someone else built the same view first, theirs is as good as ours */
+    cpath_view_remove(tmp_view);
+    if(0 != lstat(view, &file_stat) || ! S_ISDIR(file_stat.st_mode)) {
+      verbose(1, ("# Unable to create view \"%s\": %s\n", view, strerror(errno)));
+      free(view);
+      return NULL;
+    }
+  }
+  verbose(2, ("# Built view \"%s\" with %u links from %u directories\n", view, links, count));
+  return view;
+}
+
+#endif /* _CPATH_VIEW_LOADED_SEMAPHORE */
@@ -82,6 +82,11 @@ static args_array_t *opt_name_ends;
 static args_array_t *opt_value_match;
 static args_array_t *opt_value_starts;
 static args_array_t *opt_value_ends;
+static size_t opt_budget = 0;
+static char  *opt_budget_rules = NULL;
+static int    opt_env_size = 0;
+static args_array_t *opt_keep;
+static args_array_t *opt_keep_prefix;
 
 /**
  * Print the start of a comment if needed
@@ -310,6 +315,21 @@ void init_prog_light(char **argv) {
 static uid_t uid;
 static gid_t gid;
 
+#define CPATH_BUDGET_NOTE ""
+#include "cpath-budget.c"
+#include "cpath-allow.c"
+
+/**
+ * The environment's size, when --budget or --env-size asked for it
+ */
+static cpath_budget_t *env_budget = NULL;
+
+/**
+ * With --keep or --keep-prefix, the variables to keep, and the unsets held
+ * back to be printed as one statement
+ */
+static cpath_allow_t *keep_allow = NULL;
+static args_array_t *unset_pending = NULL;
 
 /**
  * Prints out a (hopefully) useful help menssage
@@ -336,6 +356,16 @@ static void usage() {
          "  -S st = Unset any env variable whose value starts with the string 'st'.\n"
          "  -E st = Unset any env variable whose value ends with the string 'st'.\n"
          "\n"
+         "Clean-room (allowlist) Criteria:\n"
+         "  --keep=NAMES\n"
+         "        = Keep the comma separated variables NAMES, and unset every variable\n"
+         "          not kept by this or --keep-prefix. The other criteria still apply\n"
+         "          to the variables kept. All the unsets are printed as one statement,\n"
+         "          except for exported bash functions, which get an \"unset -f\".\n"
+         "  --keep-prefix=PREFIXES\n"
+         "        = Keep variables whose names start with any of the comma separated\n"
+         "          PREFIXES, as with --keep.\n"
+         "\n"
          "Output Formatting:\n"
 #ifdef DEBUG_ON
          "  -D    = Toggle on/off debugging output if avaiable (default: off)\n"
@@ -352,8 +382,25 @@ static void usage() {
          "  -q    = Decrease verbosity by 1. Can be used multiple times.\n"
          "  -v    = Increase verbosity by 1. Can be used multiple times.\n"
          "\n"
+         "Environment Size:\n"
+         "  --env-size\n"
+         "        = Toggle on/off reporting how many bytes the environment costs every\n"
+         "          exec once the variables are unset, and the largest variables\n"
+         "          (default: off).\n"
+         "  --budget=BYTES\n"
+         "        = Also print what it takes to bring the environment under BYTES (K\n"
+         "          and M suffixes allowed), using --budget-rules.\n"
+         "  --budget-rules=RULES\n"
+         "        = Comma separated rules, tried in order: \"unset:PATTERN\" unsets\n"
+         "          matching variables, \"trim:PATTERN\" drops trailing elements of\n"
+         "          matching path variables. Largest variables go first. PATTERN is\n"
+         "          NAME, PREFIX* or *SUFFIX. Exported bash functions (BASH_FUNC_*)\n"
+         "          are removed with \"unset -f\", or left alone with csh (-c).\n"
+         "          Default:\n"
+         "          %s\n"
+         "\n"
          "Help:\n"
-         "  -h or -? = Print this help message\n"
+         "  -h or -? = Print this help message. Also --help.\n"
          "--------------------------------------------------------------------------------\n"
          "Example usage in bash:\n"
          "\n"
@@ -369,6 +416,7 @@ static void usage() {
          "\n"
          "================================================================================\n"
          , get_progname()
+         , CPATH_BUDGET_DEFAULT_RULES
          , '`'
          , get_progname()
          , get_progname()
@@ -412,6 +460,60 @@ static char *cpath_getval(int *idx, char **current_arg, int argc, char *args[])
   return next_arg;
 }
 
+/**
+ * Get the value of a long argument, either from "--name=value" or from the
+ * next argv.
+ *
+ * @param idx the index of the current argument, advanced if the next argv is
+ *        used
+ * @param name the long argument name, without the "--"
+ * @param value what followed the '=', or NULL if there was no '='
+ */
+static char *cpath_long_getval(int *idx, const char *name, char *value, int argc, char *args[]) {
+  if(NULL != value)
+    return str_clone(value);
+  *(idx) += 1;
+  if(*(idx) >= argc)
+    fatal("ERROR: No argument provided for --%s!\n", name);
+  return str_clone(args[*idx]);
+}
+
+/**
+ * Parse one long argument (--name or --name=value).
+ *
+ * @param idx the index of the current argument, advanced if the option's value
+ *        is the next argv
+ * @param this_arg the argument without the leading "--"
+ */
+static void cpath_parse_long_arg(int *idx, char *this_arg, int argc, char *args[]) {
+  char *name = str_clone(this_arg);
+  char *value = strchr(name, '=');
+  if(NULL != value) {
+    *value = '\0';
+    value++;
+  }
+  debug(3, ("cpath_parse_long_arg(\"%s\", \"%s\")\n", name, value ? value : ""));
+  if(eq(name, "help")) {
+    usage();
+    exit(0);
+  } else if(eq(name, "env-size")) {
+    toggle(opt_env_size);
+  } else if(eq(name, "budget")) {
+    opt_budget = cpath_budget_parse_size(cpath_long_getval(idx, name, value, argc, args));
+  } else if(eq(name, "budget-rules")) {
+    opt_budget_rules = cpath_long_getval(idx, name, value, argc, args);
+    cpath_budget_check_rules(opt_budget_rules);
+  } else if(eq(name, "keep") || eq(name, "keep-prefix")) {
+    char *names = cpath_long_getval(idx, name, value, argc, args), *keep_name;
+    for(keep_name = strtok(names, ","); keep_name; keep_name = strtok(NULL, ","))
+      cpath_add_other_arg(keep_name, eq(name, "keep") ? opt_keep : opt_keep_prefix);
+  } else {
+    usage();
+    fatal("Unknown parameter --%s\n", name);
+  }
+  free(name);
+}
+
 static args_array_t * cpath_new_args_array_t(void) {
   args_array_t *args_array = NULL;
   args_array = (args_array_t *)fatal_malloc(sizeof(args_array));
@@ -433,6 +535,8 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
   opt_value_match = cpath_new_args_array_t();
   opt_value_starts = cpath_new_args_array_t();
   opt_value_ends = cpath_new_args_array_t();
+  opt_keep = cpath_new_args_array_t();
+  opt_keep_prefix = cpath_new_args_array_t();
   for(
       i = 1; /* start at 1, not 0, since args[0] is the string with which
                 this programs was called */
@@ -451,9 +555,8 @@ static args_array_t *cpath_parseargs(int argc, char *args[]) {
       if('-' == *this_arg) { /* if the argument was a "long" agument as *
                                 specified by using --argname, handle it *
                                 differently */
-        /* Not implemented yet */
-        usage();
-        fatal("Long args are not implemented yet.\n");
+        cpath_parse_long_arg(&i, this_arg + 1, argc, args);
+        continue;
       }
       while(*this_arg) {
         switch(*this_arg) {
@@ -553,7 +656,30 @@ void set_env(const char *env_name, const char *env_value) {
     break;
   }
 }
+/**
+ * Print the unsetting of a variable. Exported bash functions are removed
+ * with "unset -f" on their own, since "export NAME=" and "unset NAME" don't
+ * (and the former fails a whole statement), and left alone with csh.
+ */
 int unset_env(const char *env_name) {
+  char *func = cpath_shell_bash_func(env_name);
+  if(func && CPATH_SHELL_CSH == opt_target_shell) {
+    verbose(0,("Not unsetting %s, csh can't remove exported functions\n",env_name));
+    free(func);
+    return 1;
+  }
+  if(env_budget)
+    cpath_budget_set(env_budget, env_name, NULL);
+  if(func && CPATH_SHELL_BASH == opt_target_shell) {
+    printf("unset -f %s\n",func);
+    free(func);
+    return 1;
+  }
+  free(func);
+  if(unset_pending) {
+    cpath_add_other_arg((char *)env_name, unset_pending);
+    return 1;
+  }
   switch(opt_target_shell) {
   case CPATH_SHELL_NONE:
     printf("%s=\n",env_name);
@@ -577,6 +703,36 @@ int unset_env(const char *env_name) {
   return 1;
 }
 
+/**
+ * Print the unsets held back in allowlist mode, as one statement.
+ */
+void unset_pending_flush(void) {
+  unsigned int i;
+  if(! unset_pending || 0 == unset_pending->length)
+    return;
+  switch(opt_target_shell) {
+  case CPATH_SHELL_NONE:
+    for(i=0; i<unset_pending->length; i++)
+      printf("%s=\n",unset_pending->args[i]);
+    return;
+  case CPATH_SHELL_BASH:
+    printf(opt_export ? "export" : "unset");
+    break;
+  case CPATH_SHELL_CSH:
+    printf("unsetenv");
+    break;
+  default:
+    usage();
+    fatal("Unknown target shell '%d'\n",opt_target_shell);
+    exit(EXIT_FAILURE);
+    break;
+  }
+  for(i=0; i<unset_pending->length; i++)
+    printf(CPATH_SHELL_BASH == opt_target_shell && opt_export ? " %s=" : " %s",unset_pending->args[i]);
+  printf(CPATH_SHELL_CSH == opt_target_shell ? ";\n" : "\n");
+  unset_pending->length = 0;
+}
+
 int unset_value_if(const char *env_name, const char *env_value) {
   unsigned int i;
   debug(3,(" - Checking env_name=\"%s\", env_value=\"%s\"\n",env_name,env_value));
@@ -690,6 +846,17 @@ int main(int argc, char *argv[], char *envp[] ) {
     exit(EXIT_FAILURE);
     break;
   }
+  if(opt_keep->length || opt_keep_prefix->length) {
+    keep_allow = cpath_allow_new(opt_keep->length + opt_keep_prefix->length);
+    for(i=0; i<opt_keep->length; i++)
+      cpath_allow_add(keep_allow, opt_keep->args[i], 0);
+    for(i=0; i<opt_keep_prefix->length; i++)
+      cpath_allow_add(keep_allow, opt_keep_prefix->args[i], 1);
+    unset_pending = cpath_new_args_array_t();
+  }
+  /* Take stock before envp is chopped up below */
+  if(opt_budget || opt_env_size)
+    env_budget = cpath_budget_new(envp, ':', CPATH_SHELL_CSH != opt_target_shell);
   for(i=0; i<env_array->length; i++)
     unset_env(env_array->args[i]);
   while(*envp) {
@@ -709,6 +876,11 @@ int main(int argc, char *argv[], char *envp[] ) {
     while('=' != *tmp_ptr) tmp_ptr++;
     /* Terminate env_name */
     *tmp_ptr = '\0';
+    if(keep_allow && ! cpath_allow_has(keep_allow, env_name)) {
+      verbose(1,("'%s' is not kept\n",env_name));
+      unset_env(env_name);
+      continue;
+    }
     if(check_name) {
       if(unset_name_if(env_name))
         continue;
@@ -721,5 +893,23 @@ int main(int argc, char *argv[], char *envp[] ) {
       set_env(env_name,tmp_ptr+1);
     }
   }
+  unset_pending_flush();
+  if(opt_budget) {
+    if(! opt_budget_rules)
+      opt_budget_rules = CPATH_BUDGET_DEFAULT_RULES;
+    cpath_budget_fit(env_budget, opt_budget, opt_budget_rules);
+    for(i=0; i<env_budget->count; i++) {
+      cpath_budget_var_t *var = &env_budget->vars[i];
+      if(! var->fitted)
+        continue;
+      if(var->value)
+        set_env(var->name, var->value);
+      else
+        unset_env(var->name);
+    }
+  }
+  unset_pending_flush();
+  if(opt_env_size)
+    cpath_budget_report(env_budget);
   return 0;
 }